@@ -0,0 +1,180 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "ib.h"
+#include "ah_cache.h"
+
+#define GRH_SGID            8       /* source GID in an IB or RoCE v1 GRH */
+#define GRH_IPV4            20      /* IPv4 header of RoCE v2 */
+#define GRH_IPV4_SADDR      12      /* source address in the IPv4 header */
+
+/* FNV-1a over the GID and the LID */
+static uint32_t __hash(uint16_t lid, const union ibv_gid *gid) {
+    uint32_t h = 2166136261u;
+    int i = 0;
+
+    for (i = 0; i < (int)sizeof(gid->raw); i++)
+        h = (h ^ gid->raw[i]) * 16777619u;
+    h = (h ^ (lid & 0xff)) * 16777619u;
+    h = (h ^ (lid >> 8)) * 16777619u;
+    return h;
+}
+
+/* the slot of the key, or the free slot it would go into */
+static struct AhCacheEntry *__find(struct AhCacheEntry *slots, uint32_t mask,
+                                   uint16_t lid, const union ibv_gid *gid) {
+    uint32_t i = __hash(lid, gid) & mask;
+
+    while (slots[i].ah != NULL &&
+           (slots[i].lid != lid ||
+            memcmp(slots[i].gid.raw, gid->raw, sizeof(gid->raw)) != 0))
+        i = (i + 1) & mask;
+
+    return &slots[i];
+}
+
+static int __grow(struct AhCache *cache) {
+    struct AhCacheEntry *slots = NULL, *e = NULL;
+    uint32_t mask = cache->mask * 2 + 1, i = 0;
+
+    slots = (struct AhCacheEntry *)calloc(mask + 1,
+                                          sizeof(struct AhCacheEntry));
+    check(slots != NULL, "Failed to grow the ah cache to %"PRIu32" slots",
+          mask + 1);
+
+    for (i = 0; i <= cache->mask; i++) {
+        if (cache->slots[i].ah == NULL)
+            continue;
+        e = __find(slots, mask, cache->slots[i].lid, &cache->slots[i].gid);
+        *e = cache->slots[i];
+    }
+
+    free(cache->slots);
+    cache->slots = slots;
+    cache->mask  = mask;
+    return 0;
+error:
+    return -1;
+}
+
+static struct ibv_ah *__create_ah(struct AhCache *cache, uint16_t lid,
+                                  const union ibv_gid *gid) {
+    struct ibv_ah_attr ah_attr;
+
+    memset(&ah_attr, 0, sizeof(struct ibv_ah_attr));
+    if (cache->global) {
+        ah_attr.is_global = 1;
+        memcpy(ah_attr.grh.dgid.raw, gid->raw, sizeof(union ibv_gid));
+        ah_attr.grh.sgid_index = cache->gid_index;
+        ah_attr.grh.hop_limit = 255;
+    } else {
+        ah_attr.dlid = lid;
+    }
+    ah_attr.sl = IB_SL;
+    ah_attr.port_num = cache->port;
+
+    return ibv_create_ah(cache->pd, &ah_attr);
+}
+
+struct AhCache *ah_cache_create(struct ibv_pd *pd, uint8_t port,
+                                int gid_index, bool global) {
+    struct AhCache *cache = NULL;
+
+    cache = (struct AhCache *)calloc(1, sizeof(struct AhCache));
+    check(cache != NULL, "Failed to allocate ah cache");
+
+    cache->slots = (struct AhCacheEntry *)calloc(AH_CACHE_MIN_SLOTS,
+                                                 sizeof(struct AhCacheEntry));
+    check(cache->slots != NULL, "Failed to allocate ah cache slots");
+
+    cache->pd        = pd;
+    cache->port      = port;
+    cache->gid_index = gid_index;
+    cache->global    = global;
+    cache->mask      = AH_CACHE_MIN_SLOTS - 1;
+    pthread_mutex_init(&cache->lock, NULL);
+
+    return cache;
+
+error:
+    if (cache != NULL)
+        free(cache);
+    return NULL;
+}
+
+void ah_cache_destroy(struct AhCache *cache) {
+    uint32_t i = 0;
+
+    if (cache == NULL)
+        return;
+
+    for (i = 0; i <= cache->mask; i++)
+        if (cache->slots[i].ah != NULL)
+            ibv_destroy_ah(cache->slots[i].ah);
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->slots);
+    free(cache);
+}
+
+struct ibv_ah *ah_cache_get(struct AhCache *cache, uint16_t lid,
+                            const union ibv_gid *gid) {
+    struct AhCacheEntry *e = NULL;
+    struct ibv_ah *ah = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    e = __find(cache->slots, cache->mask, lid, gid);
+    if (e->ah != NULL) {
+        cache->stats.hits++;
+        ah = e->ah;
+        goto out;
+    }
+
+    /* probing needs a free slot to stop at, should growing have failed */
+    cache->stats.misses++;
+    if (cache->stats.num_entries >= cache->mask) {
+        cache->stats.failures++;
+        goto out;
+    }
+    ah = __create_ah(cache, lid, gid);
+    if (ah == NULL) {
+        cache->stats.failures++;
+        goto out;
+    }
+    e->lid = lid;
+    e->gid = *gid;
+    e->ah  = ah;
+    cache->stats.num_entries++;
+
+    /* keep probe runs short; a failed grow leaves the table as it was */
+    if (cache->stats.num_entries * 2 > cache->mask + 1)
+        __grow(cache);
+
+out:
+    pthread_mutex_unlock(&cache->lock);
+    return ah;
+}
+
+void ah_cache_src(struct AhCache *cache, const struct ibv_wc *wc,
+                  const uint8_t *grh, uint16_t *lid, union ibv_gid *gid) {
+    *lid = wc->slid;
+    memset(gid, 0, sizeof(union ibv_gid));
+    if (cache->global == false || (wc->wc_flags & IBV_WC_GRH) == 0)
+        return;
+
+    /* the version nibble tells the two apart */
+    if (grh[0] >> 4 == 6) {
+        memcpy(gid->raw, grh + GRH_SGID, sizeof(gid->raw));
+    } else if (grh[GRH_IPV4] >> 4 == 4) {
+        gid->raw[10] = 0xff;
+        gid->raw[11] = 0xff;
+        memcpy(gid->raw + 12, grh + GRH_IPV4 + GRH_IPV4_SADDR, 4);
+    }
+}
+
+void ah_cache_stats(struct AhCache *cache, struct AhCacheStats *stats) {
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,68 @@
+#ifndef __AH_CACHE_H__
+#define __AH_CACHE_H__
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <infiniband/verbs.h>
+
+/*
+ * Address handle cache
+ *
+ * A UD send names its destination with an address handle, and creating one
+ * is a call into the provider, often the kernel. ah_cache_get() returns the
+ * AH of a remote port, keyed by its LID and GID, creating it on a miss; all
+ * QPs talking to the same port share it. The entries sit in an open
+ * addressing hash table with linear probing, which doubles once it is half
+ * full, so a hit is a hash and a probe or two.
+ *
+ * AHs stay until ah_cache_destroy(): a send which names one may still be
+ * outstanding, and the peers of a run do not come and go. All functions are
+ * thread-safe.
+ */
+#define AH_CACHE_MIN_SLOTS      64
+
+struct AhCacheEntry {
+    union ibv_gid   gid;
+    uint16_t        lid;
+    struct ibv_ah   *ah;        /* NULL for a free slot */
+};
+
+struct AhCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t failures;          /* ibv_create_ah() refused */
+    uint64_t num_entries;
+};
+
+struct AhCache {
+    struct ibv_pd           *pd;
+    uint8_t                 port;
+    int                     gid_index;
+    bool                    global;         /* GRH routed, RoCE */
+
+    pthread_mutex_t         lock;
+    struct AhCacheEntry     *slots;
+    uint32_t                mask;           /* slots - 1, a power of two */
+    struct AhCacheStats     stats;
+};
+
+struct AhCache *ah_cache_create(struct ibv_pd *pd, uint8_t port,
+                                int gid_index, bool global);
+void ah_cache_destroy(struct AhCache *cache);
+
+/* the AH of the port at lid and gid, NULL if it could not be created */
+struct ibv_ah *ah_cache_get(struct AhCache *cache, uint16_t lid,
+                            const union ibv_gid *gid);
+
+/*
+ * The port a UD receive came from, the key of the AH to answer it with:
+ * wc->slid, and for a GRH routed cache the source GID of the GRH the
+ * receive starts with. RoCE v2 over IPv4 leaves an IPv4 header in the last
+ * 20 bytes of the GRH instead, whose source address maps to ::ffff:a.b.c.d.
+ */
+void ah_cache_src(struct AhCache *cache, const struct ibv_wc *wc,
+                  const uint8_t *grh, uint16_t *lid, union ibv_gid *gid);
+void ah_cache_stats(struct AhCache *cache, struct AhCacheStats *stats);
+
+#endif /* __AH_CACHE_H__ */
@@ -0,0 +1,187 @@
+#!/usr/bin/env python3
+"""
+Regression check between two benchmark matrices
+
+Reads the summary.json of a baseline and of a candidate run of
+run_matrix.py, matches their points by parameters, and for every point
+compares the repetitions of each side with a two-sided Mann-Whitney U test.
+
+A point regresses when a gated metric got worse by more than its threshold
+and the difference is significant (p < --alpha):
+
+    mops        throughput, higher is better    --mops-threshold, 5%
+    lat_p99_ns  p99 round trip, lower is better --p99-threshold, 10%
+
+More gates can be added with --gate METRIC:THRESHOLD_PCT:higher|lower, for
+any metric in summary.json (e.g. server.empty_poll_pct:20:lower).
+
+Exit status: 0 no regression, 1 regression, 2 bad input. Points present on
+one side only are listed but don't fail the check.
+"""
+import argparse
+import functools
+import json
+import math
+import sys
+
+
+def ranks(values):
+    """average ranks, 1-based, ties share the mean of their positions"""
+    order = sorted(range(len(values)), key=lambda i: values[i])
+    r = [0.0] * len(values)
+    i = 0
+    while i < len(order):
+        j = i
+        while j + 1 < len(order) and values[order[j + 1]] == values[order[i]]:
+            j += 1
+        for k in range(i, j + 1):
+            r[order[k]] = (i + j) / 2.0 + 1
+        i = j + 1
+    return r
+
+
+@functools.lru_cache(maxsize=None)
+def _u_count(n1, n2, u):
+    """arrangements of n1 + n2 distinct values whose U statistic is u"""
+    if u < 0:
+        return 0
+    if n1 == 0 or n2 == 0:
+        return 1 if u == 0 else 0
+    # the largest value comes from sample 1 (beats all n2) or from sample 2
+    return _u_count(n1 - 1, n2, u - n2) + _u_count(n1, n2 - 1, u)
+
+
+def exact_u_cdf(u, n1, n2):
+    """P(U <= u) without ties"""
+    total = math.comb(n1 + n2, n1)
+    return sum(_u_count(n1, n2, k) for k in range(int(u) + 1)) / total
+
+
+def mann_whitney(x, y):
+    """two-sided p-value of the Mann-Whitney U test"""
+    n1, n2 = len(x), len(y)
+    r = ranks(list(x) + list(y))
+    u1 = sum(r[:n1]) - n1 * (n1 + 1) / 2.0
+    u = min(u1, n1 * n2 - u1)
+
+    if len(set(x) | set(y)) == n1 + n2 and n1 + n2 <= 40:
+        return min(1.0, 2 * exact_u_cdf(u, n1, n2))
+
+    # normal approximation with tie and continuity correction
+    n = n1 + n2
+    ties = {}
+    for v in list(x) + list(y):
+        ties[v] = ties.get(v, 0) + 1
+    tie_term = sum(t ** 3 - t for t in ties.values()) / (n * (n - 1))
+    sigma = math.sqrt(n1 * n2 / 12.0 * ((n + 1) - tie_term))
+    if sigma == 0:
+        return 1.0
+    z = (abs(u1 - n1 * n2 / 2.0) - 0.5) / sigma
+    return min(1.0, math.erfc(max(z, 0) / math.sqrt(2)))
+
+
+def min_p(n1, n2):
+    """smallest two-sided p the test can reach with these sample sizes"""
+    return min(1.0, 2.0 / math.comb(n1 + n2, n1))
+
+
+def load(path):
+    try:
+        with open(path) as f:
+            summary = json.load(f)
+    except (OSError, ValueError) as e:
+        print("%s: %s" % (path, e), file=sys.stderr)
+        sys.exit(2)
+    # summaries from before the server mode and transport axes ran to
+    # completion over RC
+    for p in summary["points"]:
+        p["params"].setdefault("pipeline", 0)
+        p["params"].setdefault("steal", 0)
+        p["params"].setdefault("coalesce", 0)
+        p["params"].setdefault("ud", 0)
+    return {json.dumps(p["params"], sort_keys=True): p
+            for p in summary["points"]}
+
+
+def parse_gate(s):
+    try:
+        metric, threshold, better = s.rsplit(":", 2)
+        assert better in ("higher", "lower")
+        return metric, float(threshold), better
+    except (ValueError, AssertionError):
+        raise argparse.ArgumentTypeError(
+            "gate must be METRIC:THRESHOLD_PCT:higher|lower")
+
+
+def main():
+    p = argparse.ArgumentParser(
+        description="flag regressions between two run_matrix.py summaries")
+    p.add_argument("baseline", help="summary.json of the reference run")
+    p.add_argument("candidate", help="summary.json of the run under test")
+    p.add_argument("--alpha", type=float, default=0.05,
+                   help="significance level (default 0.05)")
+    p.add_argument("--mops-threshold", type=float, default=5.0,
+                   help="throughput drop in %% that fails (default 5)")
+    p.add_argument("--p99-threshold", type=float, default=10.0,
+                   help="p99 increase in %% that fails (default 10)")
+    p.add_argument("--gate", type=parse_gate, action="append", default=[],
+                   help="extra METRIC:THRESHOLD_PCT:higher|lower")
+    args = p.parse_args()
+
+    gates = [("mops", args.mops_threshold, "higher"),
+             ("lat_p99_ns", args.p99_threshold, "lower")] + args.gate
+
+    base, cand = load(args.baseline), load(args.candidate)
+    regressions = 0
+    underpowered = False
+
+    print("%-32s %-20s %12s %12s %8s %8s  %s" % (
+        "point", "metric", "baseline", "candidate", "change", "p", "verdict"))
+
+    # matrix order: by parameter values, not by name
+    for key in sorted(base.keys() & cand.keys(),
+                      key=lambda k: list(base[k]["params"].values())):
+        name = base[key]["name"]
+        for metric, threshold, better in gates:
+            b = base[key]["metrics"].get(metric, {}).get("samples", [])
+            c = cand[key]["metrics"].get(metric, {}).get("samples", [])
+            if len(b) < 2 or len(c) < 2:
+                print("%-32s %-20s %12s %12s %8s %8s  %s" % (
+                    name, metric, "", "", "", "", "too few samples"))
+                continue
+
+            b_mean, c_mean = sum(b) / len(b), sum(c) / len(c)
+            change = 100.0 * (c_mean - b_mean) / b_mean if b_mean else 0.0
+            worse = -change if better == "higher" else change
+            pval = mann_whitney(b, c)
+
+            if min_p(len(b), len(c)) >= args.alpha:
+                underpowered = True
+            if pval >= args.alpha:
+                verdict = "same"
+            elif worse > threshold:
+                verdict = "REGRESSION"
+                regressions += 1
+            elif worse < 0:
+                verdict = "better"
+            else:
+                verdict = "worse, within %g%%" % threshold
+
+            print("%-32s %-20s %12.4g %12.4g %+7.1f%% %8.4f  %s" % (
+                name, metric, b_mean, c_mean, change, pval, verdict))
+
+    for key in sorted(base.keys() ^ cand.keys()):
+        side = base if key in base else cand
+        print("%-32s only in %s" % (side[key]["name"],
+              "baseline" if side is base else "candidate"))
+
+    if underpowered:
+        print("\nwarning: too few repetitions to ever reach p < %g, "
+              "run more with --repetitions" % args.alpha)
+
+    print("\n%d regression(s)" % regressions)
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,474 @@
+#!/usr/bin/env python3
+"""
+Benchmark matrix runner for rdma-tutorial
+
+Runs a server/client pair on one host (Soft-RoCE loopback, see
+setup_rxe.sh, or a real NIC looped through a switch) for every point of a
+parameter matrix, repeats each point, and summarizes every metric the
+client and server report with --output as mean, standard deviation and a
+95% confidence interval (Student's t).
+
+The first --discard repetitions of every point are warm-up runs: they pay
+for cold page tables, cold caches and a cold NIC, and are run but left out
+of the statistics.
+
+The matrix is a JSON object; every list is an axis, scalars apply to every
+point, and command-line options override the file:
+
+    {
+        "msg_size":         [64, 4096, 65536],
+        "num_concurr_msgs": [1, 16],
+        "threads":          [1, 2],
+        "peers":            [0, 8],
+        "signal_every":     [1, 16],
+        "inline":           [0, 64],
+        "pipeline":         [0, 2],
+        "steal":            [0, 1],
+        "coalesce":         [0, 8],
+        "ud":               [0, 1],
+        "handler":          "spin:1000",
+        "skew":             1.0,
+        "coalesce_us":      2,
+        "ops":              200000,
+        "warmup":           20000,
+        "repetitions":      5,
+        "discard":          1
+    }
+
+Output, under --out:
+    <point>/rep<N>/{server,client}.{json,log}   raw results of every run,
+                                                point as
+                                                s64_c16_t1_p0_sig1_inl0_pipe0_st0_co0_ud0
+    summary.json                                samples and statistics per point
+    summary.csv                                 one row per point, mean and CI
+
+"pipeline" is the number of handler workers per server thread, 0 runs
+the handler on the polling thread; "steal" 1 lets server threads steal
+requests from each other; "coalesce" packs up to that many responses into
+one send, holding a partial batch up to "coalesce_us". With more than one
+value of any of them, the output ends with every such point next to its
+run-to-completion twin, the change of throughput and of p99 latency.
+"ud" 1 runs both sides over UD QPs instead of RC; with both values, the
+output ends with every UD point next to its RC twin, including the memory
+the queues took on the client (queue_rss_bytes, the server's prefixed) and
+the AHs the server made. "peers" is the number of client QPs, all from one
+client process, 0 for one per server thread. The "threads" UD QPs of the
+server answer all of them; an RC QP has one peer, so the RC twin runs a
+server thread per peer.
+"handler" is the server's --handler, "skew" the clients' --skew.
+
+compare.py checks one summary.json against another for regressions.
+"""
+import argparse
+import csv
+import itertools
+import json
+import math
+import os
+import socket
+import subprocess
+import sys
+import time
+
+SUMMARY_VERSION = 1
+
+# axes in the order they appear in point names, with their binary option
+AXES = [
+    ("msg_size",         "s",   None),
+    ("num_concurr_msgs", "c",   None),
+    ("threads",          "t",   "--threads"),
+    ("peers",            "p",   "--peers"),
+    ("signal_every",     "sig", "--signal-every"),
+    ("inline",           "inl", "--inline"),
+    ("pipeline",         "pipe", "--pipeline"),
+    ("steal",            "st",  "--steal"),
+    ("coalesce",         "co",  "--coalesce"),
+    ("ud",               "ud",  "--ud"),
+]
+
+# axes which are a flag, given when the value is nonzero
+FLAGS = {"steal", "ud"}
+
+# axes common_args() sets per role
+ROLE_AXES = {"threads", "peers"}
+
+# server modes compared against running each request to completion
+RTC_AXES = ("pipeline", "steal", "coalesce")
+
+DEFAULTS = {
+    "msg_size":         [64],
+    "num_concurr_msgs": [1],
+    "threads":          [1],
+    "peers":            [0],
+    "signal_every":     [1],
+    "inline":           [0],
+    "pipeline":         [0],
+    "steal":            [0],
+    "coalesce":         [0],
+    "ud":               [0],
+    "ops":              200000,
+    "warmup":           20000,
+    "repetitions":      5,
+    "discard":          1,
+    "workload":         None,
+    "handler":          None,
+    "skew":             None,
+    "coalesce_us":      None,
+}
+
+# two-sided 95% quantiles of Student's t, by degrees of freedom
+T_95 = [0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+        2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093,
+        2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045,
+        2.042]
+
+
+def t_95(df):
+    return T_95[df] if df < len(T_95) else 1.960
+
+
+def summarize(samples):
+    n = len(samples)
+    if n == 0:
+        return {"n": 0}
+    mean = sum(samples) / n
+    stddev = math.sqrt(sum((x - mean) ** 2 for x in samples) / (n - 1)) \
+        if n > 1 else 0.0
+    ci95 = t_95(n - 1) * stddev / math.sqrt(n) if n > 1 else 0.0
+    return {"n": n, "mean": mean, "stddev": stddev, "ci95": ci95,
+            "ci95_pct": 100.0 * ci95 / mean if mean else 0.0,
+            "min": min(samples), "max": max(samples), "samples": samples}
+
+
+def axis(value):
+    return value if isinstance(value, list) else [value]
+
+
+def listening(port):
+    """True once some socket listens on port, read from /proc/net/tcp*"""
+    for path in ("/proc/net/tcp", "/proc/net/tcp6"):
+        try:
+            with open(path) as f:
+                next(f)
+                for line in f:
+                    local, state = line.split()[1], line.split()[3]
+                    if state == "0A" and int(local.split(":")[1], 16) == port:
+                        return True
+        except OSError:
+            pass
+    return False
+
+
+def detect_gid_index(dev, ib_port):
+    """RoCE v2 GID of an IPv4 address, the usual choice for rxe"""
+    base = "/sys/class/infiniband/%s/ports/%d" % (dev, ib_port)
+    for idx in range(256):
+        try:
+            with open("%s/gids/%d" % (base, idx)) as f:
+                gid = f.read().strip()
+            with open("%s/gid_attrs/types/%d" % (base, idx)) as f:
+                gid_type = f.read().strip()
+        except OSError:
+            continue
+        if gid.startswith("0000:0000:0000:0000:0000:ffff:") and \
+                "v2" in gid_type:
+            return idx
+    sys.exit("no RoCE v2 IPv4 GID on %s port %d" % (dev, ib_port))
+
+
+def role_args(point, server):
+    """a client thread per peer; only a UD server QP serves more than one"""
+    peers = point["peers"] or point["threads"]
+    if server and point["ud"]:
+        return ["--threads", str(point["threads"]), "--peers", str(peers)]
+    return ["--threads", str(peers)]
+
+
+def common_args(args, point, matrix, server):
+    cmd = [args.binary, "-i", "0",
+           "--ops", str(matrix["ops"]), "--warmup", str(matrix["warmup"]),
+           "--ib-port", str(args.ib_port), "--gid-idx", str(args.gid_idx)]
+    if args.dev:
+        cmd += ["--ib-dev", args.dev]
+    if matrix.get("workload"):
+        cmd += ["--workload", matrix["workload"]]
+    if matrix.get("handler"):
+        cmd += ["--handler", matrix["handler"]]
+    if matrix.get("skew"):
+        cmd += ["--skew", str(matrix["skew"])]
+    if matrix.get("coalesce_us"):
+        cmd += ["--coalesce-us", str(matrix["coalesce_us"])]
+    cmd += role_args(point, server)
+    for name, _, opt in AXES:
+        if name in ROLE_AXES:
+            continue
+        if name in FLAGS:
+            cmd += [opt] if point[name] else []
+        elif opt is not None:
+            cmd += [opt, str(point[name])]
+    return cmd
+
+
+def run_once(args, point, matrix, run_dir, port):
+    os.makedirs(run_dir, exist_ok=True)
+    size, concurr = str(point["msg_size"]), str(point["num_concurr_msgs"])
+    server = subprocess.Popen(
+        common_args(args, point, matrix, True) +
+        ["-o", "server.json", size, concurr, str(port)],
+        cwd=run_dir, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+
+    deadline = time.time() + 10
+    while not listening(port):
+        if server.poll() is not None or time.time() > deadline:
+            server.kill()
+            return None, "server did not start: %s" % \
+                server.stderr.read().decode(errors="replace").strip()
+        time.sleep(0.01)
+
+    client = subprocess.Popen(
+        common_args(args, point, matrix, False) +
+        ["-o", "client.json", args.server, size, concurr, str(port)],
+        cwd=run_dir, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+
+    try:
+        client_rc = client.wait(timeout=args.timeout)
+        server_rc = server.wait(timeout=10)
+    except subprocess.TimeoutExpired:
+        client.kill()
+        server.kill()
+        return None, "timed out after %ds" % args.timeout
+
+    if client_rc != 0 or server_rc != 0:
+        return None, "exit codes client %d server %d: %s" % (
+            client_rc, server_rc,
+            client.stderr.read().decode(errors="replace").strip())
+
+    results = {}
+    for role in ("client", "server"):
+        with open(os.path.join(run_dir, role + ".json")) as f:
+            results[role] = json.load(f)
+    return results, None
+
+
+def collect_metrics(results):
+    """numeric metrics, client ones as-is and server ones prefixed"""
+    metrics = {}
+    for role, prefix in (("client", ""), ("server", "server.")):
+        for key, value in results[role]["metrics"].items():
+            if isinstance(value, (int, float)) and not isinstance(value, bool):
+                metrics[prefix + key] = value
+        queues = results[role].get("queues", {})
+        if queues.get("rss_bytes", -1) >= 0:
+            metrics[prefix + "queue_rss_bytes"] = queues["rss_bytes"]
+        if "num_ahs" in queues:
+            metrics[prefix + "num_ahs"] = queues["num_ahs"]
+        # threads left out of the metrics for lack of a measured window
+        metrics[prefix + "unmeasured_threads"] = \
+            results[role].get("run", {}).get("unmeasured_threads", 0)
+    return metrics
+
+
+def point_name(point):
+    return "_".join("%s%s" % (label, point[name]) for name, label, _ in AXES)
+
+
+def compare_to_rtc(summary, axis_name, title):
+    """every point with axis_name set against its run-to-completion twin"""
+    def twin(pt):
+        return json.dumps(dict(pt["params"], **{axis_name: None}),
+                          sort_keys=True)
+
+    rtc = {twin(pt): pt for pt in summary["points"]
+           if pt["params"][axis_name] == 0 and "mops" in pt["metrics"]
+           and not any(pt["params"][a] for a in RTC_AXES)}
+    rows = [(rtc[twin(pt)], pt) for pt in summary["points"]
+            if pt["params"][axis_name] != 0 and "mops" in pt["metrics"]
+            and twin(pt) in rtc]
+    if not rows:
+        return
+
+    print("\n%-32s %8s %12s %12s %12s %12s" % (
+        title, axis_name, "Mops/s", "p99 ns", "vs rtc", "p99 vs rtc"))
+    for base, pt in rows:
+        b, m = base["metrics"], pt["metrics"]
+        print("%-32s %8d %12.3f %12.0f %+11.1f%% %+12.0f" % (
+            pt["name"], pt["params"][axis_name], m["mops"]["mean"],
+            m["lat_p99_ns"]["mean"],
+            100.0 * (m["mops"]["mean"] - b["mops"]["mean"]) /
+            b["mops"]["mean"] if b["mops"]["mean"] else 0.0,
+            m["lat_p99_ns"]["mean"] - b["lat_p99_ns"]["mean"]))
+
+
+def compare_transports(summary):
+    """every UD point against its RC twin, rate, queue memory and AHs"""
+    def twin(pt):
+        return json.dumps(dict(pt["params"], ud=None), sort_keys=True)
+
+    def kb(m):
+        return m["queue_rss_bytes"]["mean"] / 1024 \
+            if "queue_rss_bytes" in m else float("nan")
+
+    rc = {twin(pt): pt for pt in summary["points"]
+          if pt["params"]["ud"] == 0 and "mops" in pt["metrics"]}
+    rows = [(rc[twin(pt)], pt) for pt in summary["points"]
+            if pt["params"]["ud"] != 0 and "mops" in pt["metrics"]
+            and twin(pt) in rc]
+    if not rows:
+        return
+
+    print("\n%-38s %6s %6s %12s %12s %12s %12s %12s %6s" % (
+        "ud point", "qps", "peers", "Mops/s", "p99 ns", "vs rc", "queue KB",
+        "rc queue KB", "AHs"))
+    for base, pt in rows:
+        b, m = base["metrics"], pt["metrics"]
+        print("%-38s %6d %6d %12.3f %12.0f %+11.1f%% %12.0f %12.0f %6.0f" % (
+            pt["name"], pt["params"]["threads"],
+            pt["params"]["peers"] or pt["params"]["threads"],
+            m["mops"]["mean"], m["lat_p99_ns"]["mean"],
+            100.0 * (m["mops"]["mean"] - b["mops"]["mean"]) /
+            b["mops"]["mean"] if b["mops"]["mean"] else 0.0,
+            kb(m), kb(b), m.get("server.num_ahs", {}).get("mean",
+                                                          float("nan"))))
+
+
+def load_matrix(args):
+    matrix = dict(DEFAULTS)
+    if args.matrix:
+        with open(args.matrix) as f:
+            matrix.update(json.load(f))
+    for key in DEFAULTS:
+        value = getattr(args, key, None)
+        if value is not None:
+            matrix[key] = value
+    return matrix
+
+
+def int_list(s):
+    return [int(x) for x in s.split(",")]
+
+
+def main():
+    p = argparse.ArgumentParser(
+        description="run an rdma-tutorial benchmark matrix with repetitions")
+    p.add_argument("--matrix", help="matrix description, JSON")
+    p.add_argument("--out", default="bench_results", help="output directory")
+    p.add_argument("--binary", default=os.path.join(
+        os.path.dirname(os.path.abspath(__file__)), "..", "rdma-tutorial"))
+    p.add_argument("--server", default="127.0.0.1",
+                   help="address the client connects to (default 127.0.0.1)")
+    p.add_argument("--dev", help="IB device, e.g. rxe0")
+    p.add_argument("--ib-port", type=int, default=1)
+    p.add_argument("--gid-idx", default="auto",
+                   help="GID index, 'auto' picks the RoCE v2 IPv4 GID")
+    p.add_argument("--port", type=int, default=20000,
+                   help="first TCP port, every run uses the next one")
+    p.add_argument("--timeout", type=int, default=300,
+                   help="seconds before a run is killed")
+    p.add_argument("--msg-size", dest="msg_size", type=int_list)
+    p.add_argument("--concurrency", dest="num_concurr_msgs", type=int_list)
+    p.add_argument("--threads", type=int_list)
+    p.add_argument("--peers", type=int_list,
+                   help="client QPs, 0 for one per server thread")
+    p.add_argument("--signal-every", dest="signal_every", type=int_list)
+    p.add_argument("--inline", type=int_list)
+    p.add_argument("--pipeline", type=int_list)
+    p.add_argument("--steal", type=int_list)
+    p.add_argument("--coalesce", type=int_list)
+    p.add_argument("--ud", type=int_list)
+    p.add_argument("--workload")
+    p.add_argument("--handler")
+    p.add_argument("--skew", type=float)
+    p.add_argument("--coalesce-us", type=int)
+    p.add_argument("--ops", type=int)
+    p.add_argument("--warmup", type=int)
+    p.add_argument("--repetitions", "-r", type=int)
+    p.add_argument("--discard", type=int,
+                   help="leading warm-up repetitions left out of the stats")
+    args = p.parse_args()
+
+    matrix = load_matrix(args)
+    if args.gid_idx == "auto":
+        args.gid_idx = detect_gid_index(args.dev, args.ib_port) \
+            if args.dev else 3
+    if not os.access(args.binary, os.X_OK):
+        sys.exit("%s not found, run make first" % args.binary)
+    if matrix["discard"] >= matrix["repetitions"]:
+        sys.exit("discard must be below repetitions")
+
+    names = [name for name, _, _ in AXES]
+    points = [dict(zip(names, values)) for values in
+              itertools.product(*(axis(matrix[n]) for n in names))]
+
+    summary = {"version": SUMMARY_VERSION, "host": socket.gethostname(),
+               "matrix": matrix, "points": []}
+    port = args.port
+
+    for idx, point in enumerate(points):
+        name = point_name(point)
+        samples, failures = {}, []
+        for rep in range(matrix["repetitions"]):
+            run_dir = os.path.join(args.out, name, "rep%d" % rep)
+            results, err = run_once(args, point, matrix, run_dir, port)
+            port += 1
+            if results is None:
+                failures.append({"rep": rep, "error": err})
+                print("[%d/%d] %s rep %d: FAILED, %s" %
+                      (idx + 1, len(points), name, rep, err))
+                continue
+            if "environment" not in summary:
+                summary["environment"] = results["client"]["environment"]
+                summary["device"] = results["client"]["device"]
+            metrics = collect_metrics(results)
+            print("[%d/%d] %s rep %d: %.3f Mops/s, p99 %d ns%s" %
+                  (idx + 1, len(points), name, rep, metrics["mops"],
+                   metrics["lat_p99_ns"],
+                   " (warm-up)" if rep < matrix["discard"] else ""))
+            if rep < matrix["discard"]:
+                continue
+            for key, value in metrics.items():
+                samples.setdefault(key, []).append(value)
+
+        summary["points"].append({
+            "name": name, "params": point, "failures": failures,
+            "metrics": {k: summarize(v) for k, v in sorted(samples.items())}})
+
+    os.makedirs(args.out, exist_ok=True)
+    with open(os.path.join(args.out, "summary.json"), "w") as f:
+        json.dump(summary, f, indent=4)
+
+    columns = ["mops", "gbps", "lat_p50_ns", "lat_p99_ns", "lat_p999_ns",
+               "cpu_ns_per_msg", "empty_poll_cycle_pct"]
+    with open(os.path.join(args.out, "summary.csv"), "w", newline="") as f:
+        w = csv.writer(f)
+        w.writerow(names + ["n", "failures"] + [c + suffix for c in columns
+                   for suffix in ("", "_stddev", "_ci95")])
+        for pt in summary["points"]:
+            m = pt["metrics"]
+            row = [pt["params"][n] for n in names]
+            row += [m["mops"]["n"] if "mops" in m else 0, len(pt["failures"])]
+            for c in columns:
+                s = m.get(c, {})
+                row += ["%.6g" % s[k] if k in s else ""
+                        for k in ("mean", "stddev", "ci95")]
+            w.writerow(row)
+
+    print("\n%-32s %16s %18s" % ("point", "Mops/s (95% CI)", "p99 ns (95% CI)"))
+    for pt in summary["points"]:
+        m = pt["metrics"]
+        if "mops" not in m:
+            print("%-32s %16s" % (pt["name"], "failed"))
+            continue
+        print("%-32s %8.3f ±%6.3f %10.0f ±%6.0f" % (
+            pt["name"], m["mops"]["mean"], m["mops"]["ci95"],
+            m["lat_p99_ns"]["mean"], m["lat_p99_ns"]["ci95"]))
+
+    compare_to_rtc(summary, "pipeline", "pipelined point")
+    compare_to_rtc(summary, "steal", "work-stealing point")
+    compare_to_rtc(summary, "coalesce", "coalescing point")
+    compare_transports(summary)
+
+    return 1 if any(pt["failures"] for pt in summary["points"]) else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Soft-RoCE loopback for bench/run_matrix.py
+#
+# Loads rdma_rxe and binds an rxe device to a network interface, so that the
+# server and the client of a run can share one host without a RoCE NIC.
+#
+#   sudo bench/setup_rxe.sh [netdev] [rxe_name]
+#
+# netdev defaults to the interface of the default route, rxe_name to rxe0.
+# Afterwards run the matrix with --dev rxe0; the RoCE v2 IPv4 GID is picked
+# automatically, and the client may connect to 127.0.0.1.
+#
+set -e
+
+NETDEV=${1:-$(ip -o route get 1.1.1.1 2>/dev/null | sed -n 's/.* dev \([^ ]*\).*/\1/p')}
+RXE=${2:-rxe0}
+
+[ -n "$NETDEV" ] || { echo "no netdev given and no default route" >&2; exit 1; }
+
+modprobe rdma_rxe
+
+if [ ! -e "/sys/class/infiniband/$RXE" ]; then
+    rdma link add "$RXE" type rxe netdev "$NETDEV"
+fi
+
+echo "$RXE on $NETDEV:"
+rdma link show "$RXE/1"
+
+# GIDs appear once the netdev has an address
+for gid in /sys/class/infiniband/"$RXE"/ports/1/gids/*; do
+    idx=${gid##*/}
+    val=$(cat "$gid" 2>/dev/null) || continue
+    type=$(cat /sys/class/infiniband/"$RXE"/ports/1/gid_attrs/types/"$idx" 2>/dev/null) || continue
+    [ "$val" = "0000:0000:0000:0000:0000:0000:0000:0000" ] && continue
+    echo "  gid[$idx] $val $type"
+done
@@ -2,51 +2,172 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <math.h>
 
 #include "debug.h"
 #include "config.h"
 #include "setup_ib.h"
 #include "ib.h"
+#include "stats.h"
+#include "results.h"
+#include "msg_trace.h"
+#include "tsc.h"
 #include "client.h"
+#include "workload.h"
+#include "rndv.h"
+#include "rpc.h"
+#include "probes.h"
+
+static inline uint64_t __now_us() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Calls waiting for their send, in the order their slots were freed. A
+ * replayed trace holds a call back until it is due; the poll loop sends it
+ * then, so completions are never held up waiting for it.
+ */
+struct CallQueue {
+    int               *slots;
+    struct WorkloadOp *ops;
+    int               head;
+    int               num;
+    int               size;
+};
+
+/* draw the next call of slot */
+static inline void __queue_call(struct CallQueue *q, struct WorkloadGen *gen,
+                                int slot) {
+    int tail = (q->head + q->num++) % q->size;
+
+    q->slots[tail] = slot;
+    workload_next(gen, &q->ops[tail]);
+}
+
+/* trace records come in order, so only the first call can hold up others */
+static inline bool __call_due(struct CallQueue *q, uint64_t start_us) {
+    return q->num > 0 && (q->ops[q->head].due_us == 0 ||
+                          __now_us() - start_us >= q->ops[q->head].due_us);
+}
+
+/* requests thread_id keeps in flight, Zipf-skewed over the threads */
+static int __thread_concurrency(long thread_id) {
+    int n = config_info.num_concurr_msgs;
+
+    if (config_info.skew > 0)
+        n = (int)(n / pow(thread_id + 1, config_info.skew) + 0.5);
+
+    return n > 0 ? n : 1;
+}
+
+/* payload of a call of size bytes, the header takes the first of them */
+static inline uint32_t __rpc_payload(uint32_t size) {
+    return size > sizeof(struct RpcHdr) ? size - sizeof(struct RpcHdr) : 0;
+}
 
 static void *client_thread_func (void *arg) {
     int             ret                 = 0, i = 0, n = 0;
     long            thread_id           = (long) arg;
     int             num_concurr_msgs    = config_info.num_concurr_msgs;
-    int             msg_size            = config_info.msg_size;
+    int             num_active          = __thread_concurrency(thread_id);
+    int             slot_size           = ib_res.buf_slot_size;
     int             num_wc              = 20;
     bool            start_sending       = false;
     bool            stop                = false;
     pthread_t       self;
     cpu_set_t       cpuset;
-    struct ibv_qp  *qp          = ib_res.qp;
-    struct ibv_cq  *cq          = ib_res.cq;
+    struct ibv_qp  *qp          = ib_res.qp[thread_id];
+    struct ibv_cq  *cq          = ib_res.cq[thread_id];
+    struct ThreadStats *stats  = &thread_stats[thread_id];
     struct ibv_wc  *wc          = NULL;
-    uint32_t        lkey        = ib_res.mr->lkey;
-    char           *buf_ptr     = ib_res.ib_buf;
-    int             buf_offset  = 0;
-    size_t          buf_size    = ib_res.ib_buf_size;
+    char           *thread_buf  = ib_thread_buf(thread_id);
+    char           *buf_ptr     = thread_buf;
+    char           *send_buf    = thread_buf;
+    int             send_slot   = 0;
+    int             echo_slot   = 0;
+    uint64_t       *send_tsc    = NULL;
+    uint64_t       *send_ids    = NULL;
+    uint32_t        send_size   = 0;
+    uint64_t        poll_tsc    = 0;
+    uint64_t        lat_ns      = 0;
+    uint64_t        now_tsc     = 0;
+    uint64_t        send_seq    = 0;
+    bool            ready       = false;
+    struct RndvConn rc;
+    struct RndvMsg  msg;
+    struct RndvMsg  frame;
+    uint32_t        frame_off   = 0;
+    int             num_frames  = 0;
+    struct RpcConn  rpc;
+    struct RpcResult res;
+    struct MsgTrace *trace      = msg_trace_thread(thread_id);
+    struct WorkloadGen gen;
+    struct CallQueue calls      = {NULL, NULL, 0, 0, 0};
+    uint64_t        start_us    = 0;
     struct timeval  start, end;
     long            ops_count   = 0;
+    uint64_t        start_ops   = 0;
+    uint64_t        start_bytes = 0;
     double          duration    = 0.0;
     double          throughput  = 0.0;
+    double          bandwidth   = 0.0;
 
     /* set thread affinity */
     CPU_ZERO(&cpuset);
-    CPU_SET((int)thread_id, &cpuset);
+    CPU_SET((int)(thread_id % sysconf(_SC_NPROCESSORS_ONLN)), &cpuset);
     self = pthread_self();
     ret  = pthread_setaffinity_np(self, sizeof(cpu_set_t), &cpuset);
     check(ret == 0, "thread[%ld]: failed to set thread affinity", thread_id);
 
+    memset(&rc, 0, sizeof(struct RndvConn));
+    memset(&rpc, 0, sizeof(struct RpcConn));
+    workload_gen_init(&gen, (uint64_t)(thread_id + 1) * 0x9E3779B97F4A7C15ULL);
+
+    /*
+     * the first rndv_eager_recvs() slots receive echoes, the rest are sent
+     * from; with a rendezvous threshold the rndv layer owns the receives.
+     * Every request is an RPC call which names its send slot in the header,
+     * and the response names it back, so a response frees the slot of its
+     * own call even when rendezvous responses overtake eager ones. The
+     * header counts toward the message size.
+     */
+    if (config_info.rndv_threshold == 0)
+        send_buf = thread_buf + rndv_eager_recvs() * slot_size;
+
     /* pre-post recvs */
     wc = (struct ibv_wc *)calloc(num_wc, sizeof(struct ibv_wc));
     check(wc != NULL, "thread[%ld]: failed to allocate wc", thread_id);
 
-    for (i = 0; i < num_concurr_msgs; i++) {
-        ret = post_recv(msg_size, lkey, (uint64_t)buf_ptr, qp, buf_ptr);
-        check(ret == 0, "thread[%ld]: failed to post recv", thread_id);
-        buf_offset = (buf_offset + msg_size) % buf_size;
-        buf_ptr = ib_res.ib_buf + buf_offset;
+    send_tsc = (uint64_t *)calloc(num_concurr_msgs, sizeof(uint64_t));
+    send_ids = (uint64_t *)calloc(num_concurr_msgs, sizeof(uint64_t));
+    check(send_tsc != NULL && send_ids != NULL,
+          "thread[%ld]: failed to allocate send_tsc", thread_id);
+
+    calls.size  = num_concurr_msgs;
+    calls.slots = (int *)calloc(calls.size, sizeof(int));
+    calls.ops   = (struct WorkloadOp *)calloc(calls.size,
+                                              sizeof(struct WorkloadOp));
+    check(calls.slots != NULL && calls.ops != NULL,
+          "thread[%ld]: failed to allocate the call queue", thread_id);
+
+    ret = rndv_init(&rc, qp, num_concurr_msgs, thread_buf, slot_size,
+                    config_info.rndv_threshold);
+    ready = true;
+    ret = ib_workers_ready(ret == 0);
+    check(ret == 0, "thread[%ld]: failed to post recvs", thread_id);
+
+    ret = rpc_init(&rpc, &rc, num_concurr_msgs, NULL, 0);
+    check(ret == 0, "thread[%ld]: failed to init rpc", thread_id);
+
+    /* a UD server QP learns who we are from our first message */
+    if (config_info.ud) {
+        ret = rndv_send_ctl(&rc, thread_buf, 0, MSG_CTL_START);
+        check(ret == 0, "thread[%ld]: failed to greet the server", thread_id);
     }
 
     /* wait for start signal */
@@ -62,40 +183,61 @@ static void *client_thread_func (void *arg) {
                       thread_id, wc[i].status,
                       ibv_wc_status_str(wc[i].status));
             }
-            if (wc[i].opcode == IBV_WC_RECV) {
+            if (rndv_complete(&rc, &wc[i], &msg) == 1) {
                 /* post a receive */
-                post_recv(msg_size, lkey, (uint64_t)buf_ptr, qp, buf_ptr);
-                buf_offset = (buf_offset + msg_size) % buf_size;
-                buf_ptr = ib_res.ib_buf + buf_offset;
+                rndv_release(&rc, &msg);
 
-                if (ntohl(wc[i].imm_data) == MSG_CTL_START) {
+                if (MSG_IMM_TYPE(msg.imm) == MSG_CTL_START) {
+                    start_sending = true;
+                    break;
+                }
+                /* the server's other peers may finish before we greet it */
+                if (MSG_IMM_TYPE(msg.imm) == MSG_CTL_STOP) {
                     start_sending = true;
+                    stop = true;
                     break;
                 }
             }
         }
     }
-    log("thread[%ld]: ready to send", thread_id);
-
-    /* pre-post sends */
-    buf_ptr = ib_res.ib_buf;
-    for (i = 0; i < num_concurr_msgs; i++) {
-        ret = post_send(msg_size, lkey, 0, MSG_REGULAR, qp, buf_ptr);
-        check(ret == 0, "thread[%ld]: failed to post send", thread_id);
-        buf_offset = (buf_offset + msg_size) % buf_size;
-        buf_ptr = ib_res.ib_buf + buf_offset;
+    if (stop) {
+        log("thread[%ld]: stopped before it started", thread_id);
+        goto out;
+    }
+    log("thread[%ld]: ready to send, %d in flight", thread_id, num_active);
+
+    if (config_info.rndv_threshold == RNDV_AUTO) {
+        ret = rndv_calibrate(&rc, cq, send_buf);
+        check(ret == 0, "thread[%ld]: failed to calibrate rndv", thread_id);
+        log("thread[%ld]: rndv threshold = %d", thread_id, rc.threshold);
     }
+    start_us = __now_us();
 
+    /* the first calls of every slot go out from the poll loop */
+    for (send_slot = 0; send_slot < num_active; send_slot++)
+        __queue_call(&calls, &gen, send_slot);
 
     while (stop != true) {
         /* poll cq */
+        poll_tsc = rdtsc();
         n = ibv_poll_cq(cq, num_wc, wc);
+        poll_tsc = rdtsc() - poll_tsc;
+        PROBE(cq_poll, thread_id, n, poll_tsc, stats->outstanding);
+        stats_write_begin(stats);
+        stats_inc(stats, cq_polls);
+        stats_add(stats, poll_cycles, poll_tsc);
+        if (n == 0) {
+            stats_inc(stats, empty_polls);
+            stats_add(stats, empty_poll_cycles, poll_tsc);
+        }
+        stats_write_end(stats);
         if (n < 0) {
             check (0, "thread[%ld]: Failed to poll cq", thread_id);
         }
 
         for (i = 0; i < n; i++) {
             if (wc[i].status != IBV_WC_SUCCESS) {
+                stats_record_wc_error(stats, &wc[i]);
                 if (wc[i].opcode == IBV_WC_SEND) {
                     check(0, "thread[%ld]: send failed status: %d, %s",
                           thread_id, wc[i].status,
@@ -107,44 +249,150 @@ static void *client_thread_func (void *arg) {
                 }
             }
 
-            if (wc[i].opcode == IBV_WC_RECV) {
+            ret = rndv_complete(&rc, &wc[i], &msg);
+            check(ret >= 0, "thread[%ld]: failed to complete a message",
+                  thread_id);
+
+            if (ret == 1 && MSG_IMM_TYPE(msg.imm) == MSG_CTL_STOP) {
+                gettimeofday(&end, NULL);
+                results_mark_end(thread_id, stats);
+                PROBE(stop, thread_id, ops_count);
+                stop = true;
+                break;
+            }
+            if (ret != 1)
+                continue;
+
+            /* every response is an op, also those of a server's batch */
+            frame_off  = 0;
+            num_frames = 0;
+            while (rpc_next_response(&msg, &frame_off, &frame)) {
                 ops_count += 1;
-                log("ops_count = %ld", ops_count);
+                num_frames++;
+                stats_write_begin(stats);
+                stats_inc(stats, ops);
+                stats_add(stats, bytes, frame.len);
+                stats_write_end(stats);
 
-                if (ops_count == NUM_WARMING_UP_OPS)
+                if (ops_count == config_info.num_warmup_ops) {
                     gettimeofday(&start, NULL);
-
-                if (ntohl(wc[i].imm_data) == MSG_CTL_STOP) {
-                    gettimeofday(&end, NULL);
-                    stop = true;
-                    break;
+                    start_ops   = stats->ops;
+                    start_bytes = stats->bytes;
+                    results_mark_start(thread_id, stats);
+                    PROBE(warmup_done, thread_id, ops_count);
                 }
 
-                /* echo the message back */
-                char *msg_ptr = (char *)wc[i].wr_id;
-                ret = post_send(msg_size, lkey, 0, MSG_REGULAR, qp, msg_ptr);
-                check (ret == 0, "thread[%ld](file %s line %d): failed to post send",
-                       thread_id, __FILE__, __LINE__);
+                /* the response names the slot of its call */
+                echo_slot = rpc_complete(&rpc, &frame, &res);
+                check(echo_slot >= 0, "thread[%ld]: unexpected response",
+                      thread_id);
+                now_tsc = rdtsc();
+                lat_ns  = tsc_to_ns(now_tsc - send_tsc[echo_slot]);
+                stats_write_begin(stats);
+                stats_record_latency(stats, lat_ns);
+                stats_add(stats, outstanding, -1);
+                stats_write_end(stats);
+                msg_trace_record(trace, MSG_TRACE_REQUEST,
+                    ops_count <= config_info.num_warmup_ops ? MSG_TRACE_WARMUP : 0,
+                    thread_id, qp->qp_num, send_ids[echo_slot], frame.len,
+                    send_tsc[echo_slot], now_tsc);
+                PROBE(msg_echo, thread_id, echo_slot, frame.len, lat_ns);
 
-                /* post a new receive */
-                ret = post_recv(msg_size, lkey, wc[i].wr_id, qp, buf_ptr);
-                check (ret == 0, "thread[%ld](file %s line %d): failed to post recv",
-                       thread_id, __FILE__, __LINE__);
+                /* the freed slot sends the next request */
+                __queue_call(&calls, &gen, echo_slot);
+            }
+            if (MSG_IMM_TYPE(msg.imm) == MSG_RPC_BATCH) {
+                check(num_frames == (int)MSG_IMM_ARG(msg.imm),
+                      "thread[%ld]: batch of %d responses, %d expected",
+                      thread_id, num_frames, (int)MSG_IMM_ARG(msg.imm));
+                stats_write_begin(stats);
+                stats_inc(stats, batches);
+                stats_add(stats, coalesced, num_frames);
+                stats_write_end(stats);
             }
+
+            /* post a new receive */
+            ret = stats_post(stats, rndv_release(&rc, &msg));
+            check (ret == 0, "thread[%ld](file %s line %d): failed to post recv",
+                   thread_id, __FILE__, __LINE__);
+            PROBE(slot_recycled, thread_id, (uint64_t)msg.buf);
         } /* loop through all wc */
+
+        /* send the calls which are due */
+        while (stop == false && __call_due(&calls, start_us)) {
+            send_slot  = calls.slots[calls.head];
+            send_size  = calls.ops[calls.head].size;
+            calls.head = (calls.head + 1) % calls.size;
+            calls.num--;
+
+            send_ids[send_slot] = send_seq;
+            send_tsc[send_slot] = rdtsc();
+            PROBE(msg_send, thread_id, send_slot, send_size,
+                  send_tsc[send_slot]);
+            buf_ptr = send_buf + send_slot * slot_size;
+            send_seq++;
+            ret = stats_post(stats,
+                rpc_call(&rpc, send_slot, config_info.rpc_method, buf_ptr,
+                         __rpc_payload(send_size)));
+            check (ret == 0, "thread[%ld](file %s line %d): failed to post send",
+                   thread_id, __FILE__, __LINE__);
+            stats_write_begin(stats);
+            stats_inc(stats, outstanding);
+            stats_write_end(stats);
+        }
+
+        stats_write_begin(stats);
+        stats_set(stats, credit_waits, rc.credit_waits);
+        stats_set(stats, credit_msgs, rc.credit_msgs);
+        stats_write_end(stats);
     }
 
     /* dump statistics */
     duration = (double)((end.tv_sec - start.tv_sec) * 1000000 +
         (end.tv_usec - start.tv_usec));
-    throughput = (double)(ops_count) / duration;
+    throughput = (double)(stats->ops - start_ops) / duration;
+    bandwidth  = (double)(stats->bytes - start_bytes) * 8 / duration / 1000;
     log("thread[%ld]: throughput = %f (Mops/s)",  thread_id, throughput);
+    log("thread[%ld]: bandwidth = %f (Gb/s), avg msg size = %f (bytes)",
+        thread_id, bandwidth,
+        ops_count ? (double)stats->bytes / ops_count : 0.0);
+    if (rc.threshold != 0)
+        log("thread[%ld]: rndv threshold = %d, eager = %"PRIu64", rendezvous "
+            "= %"PRIu64", pool waits = %"PRIu64, thread_id, rc.threshold,
+            rc.eager_msgs, rc.rndv_msgs, rc.pool_waits);
+    if (rc.credit_batch != 0)
+        log("thread[%ld]: credit waits = %"PRIu64", credit msgs = %"PRIu64,
+            thread_id, rc.credit_waits, rc.credit_msgs);
+    log("thread[%ld]: rpc calls = %"PRIu64", errors = %"PRIu64, thread_id,
+        rpc.calls, rpc.errors);
+    if (stats->batches != 0)
+        log("thread[%ld]: batches = %"PRIu64", %.2f responses each",
+            thread_id, stats->batches,
+            (double)stats->coalesced / stats->batches);
 
-
+out:
+    rpc_destroy(&rpc);
+    rndv_destroy(&rc);
+    free(calls.slots);
+    free(calls.ops);
+    free(send_ids);
+    free(send_tsc);
     free(wc);
     pthread_exit((void *)0);
 
 error:
+    if (ready == false)
+        ib_workers_ready(false);
+    rpc_destroy(&rpc);
+    rndv_destroy(&rc);
+    if (calls.slots != NULL)
+        free(calls.slots);
+    if (calls.ops != NULL)
+        free(calls.ops);
+    if (send_ids != NULL)
+        free(send_ids);
+    if (send_tsc != NULL)
+        free(send_tsc);
     if (wc != NULL)
         free (wc);
     pthread_exit((void *)-1);
@@ -152,7 +400,7 @@ error:
 
 int run_client() {
     int             ret = 0;
-    long            num_threads = 1;
+    long            num_threads = config_info.num_threads;
     long            i = 0;
     pthread_t      *client_threads = NULL;
     pthread_attr_t  attr;
@@ -167,12 +415,25 @@ int run_client() {
     client_threads = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
     check(client_threads != NULL, "Failed to allocate client_threads.");
 
+    ret = stats_init(num_threads, config_info.shm_stats);
+    check(ret == 0, "Failed to init thread stats.");
+
+    ret = results_init(num_threads);
+    check(ret == 0, "Failed to init thread results.");
+
+    ret = msg_trace_init(num_threads, config_info.trace_prefix,
+                         config_info.trace_records);
+    check(ret == 0, "Failed to init message trace.");
+
     for (i = 0; i < num_threads; i++) {
         ret = pthread_create(&client_threads[i], &attr,
                               client_thread_func, (void *)i);
         check(ret == 0, "Failed to create client_thread[%ld]", i);
     }
 
+    ret = stats_reporter_start(config_info.stats_interval_ms);
+    check(ret == 0, "Failed to start stats reporter.");
+
     bool thread_ret_normally = true;
     for (i = 0; i < num_threads; i++) {
         ret = pthread_join(client_threads[i], &status);
@@ -183,14 +444,28 @@ int run_client() {
         }
     }
 
+    stats_reporter_stop();
+
     if (thread_ret_normally == false)
         goto error;
 
+    if (config_info.results_path != NULL) {
+        ret = results_write(config_info.results_path);
+        check(ret == 0, "Failed to write results.");
+    }
+
+    msg_trace_destroy();
+    results_destroy();
+    stats_destroy();
     pthread_attr_destroy(&attr);
     free(client_threads);
     return 0;
 
 error:
+    stats_reporter_stop();
+    msg_trace_destroy();
+    results_destroy();
+    stats_destroy();
     if (client_threads != NULL)
         free(client_threads);
 
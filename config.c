@@ -2,6 +2,7 @@
 
 #include "debug.h"
 #include "config.h"
+#include "workload.h"
 
 struct ConfigInfo config_info;
 
@@ -16,10 +17,58 @@ void print_config_info() {
 
     log("msg_size           = %d", config_info.msg_size);
     log("num_concurr_msgs   = %d", config_info.num_concurr_msgs);
+    log("num_threads        = %d", config_info.num_threads);
+    if (config_info.is_server)
+        log("num_peers          = %d", config_info.num_peers);
+    log("num_warmup_ops     = %ld", config_info.num_warmup_ops);
+    log("tot_num_ops        = %ld", config_info.tot_num_ops);
+    log("signal_interval    = %d", config_info.signal_interval);
+    log("inline_size        = %d", config_info.inline_size);
+    log("num_sge            = %d", config_info.num_sge);
     log("sock_port          = %s", config_info.sock_port);
+    log("stats_interval_ms  = %d", config_info.stats_interval_ms);
+    log("shm_stats          = %s", config_info.shm_stats ? "true" : "false");
+    if (config_info.results_path != NULL)
+        log("results_path       = %s", config_info.results_path);
+    log("perf_counters      = %s", config_info.perf_counters ? "true" : "false");
+    if (config_info.trace_prefix != NULL)
+        log("trace_prefix       = %s, %ld records",
+            config_info.trace_prefix, config_info.trace_records);
+    if (config_info.rndv_threshold == -1) {
+        log("rndv_threshold     = auto, pool %d", config_info.rndv_pool);
+    } else if (config_info.rndv_threshold > 0) {
+        log("rndv_threshold     = %d, pool %d", config_info.rndv_threshold,
+            config_info.rndv_pool);
+    }
+    log("credits            = %s", config_info.credits ? "true" : "false");
+    log("transport          = %s", config_info.ud ? "ud" : "rc");
+    if (config_info.is_server == false) {
+        log("rpc_method         = %s", config_info.rpc_name);
+        if (config_info.skew > 0)
+            log("skew               = %f", config_info.skew);
+    } else if (config_info.pipeline > 0) {
+        log("server_mode        = pipelined, %d workers per thread",
+            config_info.pipeline);
+    } else if (config_info.steal) {
+        log("server_mode        = work stealing");
+    } else {
+        log("server_mode        = run to completion");
+    }
+    if (config_info.is_server && config_info.coalesce > 1)
+        log("coalesce           = %d responses, %d us",
+            config_info.coalesce, config_info.coalesce_us);
+    print_workload_info();
 
     if (config_info.is_server == false)
         log("server_name        = %s", config_info.server_name);
 
+    log("ib_devname         = %s", config_info.ib_devname ?
+        config_info.ib_devname : "(first)");
+    log("ib_port            = %d", config_info.ib_port);
+    log("gid_index          = %d", config_info.gid_index);
+    log("fork_init          = %s", config_info.fork_init ? "true" : "false");
+    log("reg_chunk_mb       = %d", config_info.reg_chunk_mb);
+    log("reg_threads        = %d", config_info.reg_threads);
+
     log(LOG_SUB_HEADER, "End of Configuraion");
 }
@@ -9,9 +9,43 @@ struct ConfigInfo {
 
     int  msg_size;           /* the size of each echo message */
     int  num_concurr_msgs;   /* the number of messages can be sent concurrently */
+    int  num_threads;        /* worker threads, one QP and CQ each */
+    int  num_peers;          /* client QPs the server serves, --peers */
+    long num_warmup_ops;     /* ops per thread before measuring starts */
+    long tot_num_ops;        /* ops per thread, server stops after them */
+    int  signal_interval;    /* signal one data send in every N */
+    int  inline_size;        /* requested max_inline_data, 0 disables */
+    int  num_sge;            /* max_send_sge and max_recv_sge of the QPs */
 
     char *sock_port;         /* socket port number */
     char *server_name;       /* server name */
+
+    char *ib_devname;        /* IB device, NULL for the first one */
+    int  ib_port;            /* IB port number */
+    int  gid_index;          /* GID index, RoCE only */
+    bool fork_init;          /* call ibv_fork_init() */
+    int  reg_chunk_mb;       /* register larger pools in chunks, 0 never */
+    int  reg_threads;        /* threads registering chunks, 0 for auto */
+
+    char *workload_spec;     /* message-size distribution, NULL for fixed */
+    int  stats_interval_ms;  /* period of the stats reporter, 0 disables */
+    bool shm_stats;          /* publish stats in /dev/shm for rdma-stat */
+    char *results_path;      /* JSON or CSV results, by extension */
+    bool perf_counters;      /* hardware counters over the measured window */
+    char *trace_prefix;      /* per-message trace files, NULL disables */
+    long trace_records;      /* trace ring size per thread, in records */
+    int  rndv_threshold;     /* eager/rendezvous cutoff, 0 off, -1 auto */
+    int  rndv_pool;          /* rendezvous receive buffers per thread */
+    bool credits;            /* credit-based flow control of receives */
+    bool ud;                 /* UD QPs instead of RC, implies credits */
+    char *rpc_name;          /* RPC method the client calls */
+    int  rpc_method;         /* its id in the handler table */
+    char *handler_spec;      /* the server's "serve" handler, NULL for noop */
+    int  pipeline;           /* handler workers per server thread, 0 none */
+    bool steal;              /* server threads steal each other's requests */
+    double skew;             /* client concurrency of thread i, nc/(i+1)^skew */
+    int  coalesce;           /* server responses per send, 0 or 1 off */
+    int  coalesce_us;        /* longest hold of a partial batch */
 }__attribute__((aligned(64)));
 
 extern struct ConfigInfo config_info;
@@ -5,6 +5,7 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #include <net/if.h>
+#include <dirent.h>
 #include "ib.h"
 
 void print_gid(union ibv_gid gid) {
@@ -18,30 +19,36 @@ void print_gid(union ibv_gid gid) {
 
 static int __ibdev_2_netdev(const char *ib_dev_name,
                              char *net_dev_name, const int net_dev_name_len) {
-    char command[256] = {'\0'};
-    FILE *fp = NULL;
-
-    snprintf(command, sizeof(command),
-             "ls /sys/class/infiniband/%s/device/net", ib_dev_name);
-
-    fp = popen(command, "r");
-    if (fp == NULL) {
-        fprintf(stderr, "Failed to list sysfs path %s: %s\n", command,
+    char path[256] = {'\0'};
+    DIR *dir = NULL;
+    struct dirent *ent = NULL;
+
+    // the net device is the only entry of this directory, read it
+    // directly instead of forking a shell to list it
+    snprintf(path, sizeof(path), "/sys/class/infiniband/%s/device/net",
+             ib_dev_name);
+
+    dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "Failed to open sysfs path %s: %s\n", path,
                 strerror(errno));
         return -1;
     }
 
-    if (fgets(net_dev_name, net_dev_name_len, fp) == NULL) {
-        fprintf(stderr, "Failed to get net device name from '%s' for %s: %s\n",
-                command, ib_dev_name, strerror(errno));
-        fclose(fp);
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] != '.')
+            break;
+    }
+
+    if (ent == NULL) {
+        fprintf(stderr, "No net device under %s for %s\n", path, ib_dev_name);
+        closedir(dir);
         return -1;
     }
 
-    // remove the trailing newline character
-    net_dev_name[strlen(net_dev_name) - 1] = '\0';
+    snprintf(net_dev_name, net_dev_name_len, "%s", ent->d_name);
 
-    fclose(fp);
+    closedir(dir);
     return 0;
 }
 
@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <dlfcn.h>
+
+#include "debug.h"
+#include "tsc.h"
+#include "handler.h"
+
+struct Handler handler;
+
+static const char *handler_names[] = {
+    [HANDLER_NOOP]     = "noop",
+    [HANDLER_SPIN]     = "spin",
+    [HANDLER_EXP]      = "exp",
+    [HANDLER_CHECKSUM] = "checksum",
+    [HANDLER_CUSTOM]   = "custom",
+};
+
+/* per worker thread, so exp draws never contend */
+static __thread uint64_t handler_rng;
+
+static inline void __spin_ns(uint64_t ns) {
+    uint64_t start = rdtsc();
+
+    while (tsc_to_ns(rdtsc() - start) < ns)
+        ;
+}
+
+/* xorshift64*, as in workload.c */
+static inline double __rand_unit() {
+    if (handler_rng == 0)
+        handler_rng = rdtsc() | 1;
+    handler_rng ^= handler_rng >> 12;
+    handler_rng ^= handler_rng << 25;
+    handler_rng ^= handler_rng >> 27;
+    return (double)((handler_rng * 0x2545F4914F6CDD1DULL) >> 11) *
+        (1.0 / 9007199254740992.0);
+}
+
+static int __handle_noop(struct RpcCall *call, void *arg) {
+    call->resp     = call->req;
+    call->resp_len = call->req_len;
+    return 0;
+}
+
+static int __handle_spin(struct RpcCall *call, void *arg) {
+    __spin_ns(handler.service_ns);
+    return __handle_noop(call, arg);
+}
+
+static int __handle_exp(struct RpcCall *call, void *arg) {
+    /* log1p() rather than log(), which debug.h takes over */
+    __spin_ns((uint64_t)(-log1p(-__rand_unit()) * handler.service_ns));
+    return __handle_noop(call, arg);
+}
+
+static int __handle_checksum(struct RpcCall *call, void *arg) {
+    uint64_t sum = 0, word = 0;
+    uint32_t i = 0;
+
+    for (i = 0; i + sizeof(uint64_t) <= call->req_len; i += sizeof(uint64_t)) {
+        memcpy(&word, call->req + i, sizeof(uint64_t));
+        sum += word;
+    }
+    for (; i < call->req_len; i++)
+        sum += (uint8_t)call->req[i];
+
+    if (call->resp_max < sizeof(uint64_t))
+        return -1;
+    memcpy(call->resp, &sum, sizeof(uint64_t));
+    call->resp_len = sizeof(uint64_t);
+    return 0;
+}
+
+static int __load_custom(char *spec) {
+    char *symbol = strrchr(spec, ':');
+    const char *name = HANDLER_SYMBOL;
+    int (*fn)(struct RpcCall *call, void *arg) = NULL;
+
+    if (symbol != NULL) {
+        *symbol = '\0';
+        name    = symbol + 1;
+    }
+
+    handler.dl = dlopen(spec, RTLD_NOW | RTLD_LOCAL);
+    check(handler.dl != NULL, "Failed to load handler: %s", dlerror());
+
+    *(void **)&fn = dlsym(handler.dl, name);
+    check(fn != NULL, "No handler %s in %s", name, spec);
+
+    handler.type = HANDLER_CUSTOM;
+    return rpc_register(RPC_SERVE, "serve", fn, NULL);
+error:
+    return -1;
+}
+
+int handler_init(const char *spec) {
+    int ret = 0;
+    char *arg = NULL;
+    int (*fn)(struct RpcCall *call, void *arg) = __handle_noop;
+
+    memset(&handler, 0, sizeof(struct Handler));
+    if (spec == NULL)
+        spec = HANDLER_DEFAULT;
+
+    handler.path = strdup(spec);
+    check(handler.path != NULL, "Failed to copy handler spec");
+
+    if (strchr(spec, '/') != NULL || strstr(spec, ".so") != NULL) {
+        ret = __load_custom(handler.path);
+        check(ret == 0, "Failed to register handler '%s'", spec);
+        return 0;
+    }
+
+    arg = strchr(handler.path, ':');
+    if (arg != NULL)
+        *arg++ = '\0';
+
+    if (strcmp(handler.path, "noop") == 0) {
+        check(arg == NULL, "Usage: noop");
+        handler.type = HANDLER_NOOP;
+    } else if (strcmp(handler.path, "spin") == 0 ||
+               strcmp(handler.path, "exp") == 0) {
+        check(arg != NULL && atoll(arg) > 0, "Usage: %s:NS", handler.path);
+        handler.type       = handler.path[0] == 's' ? HANDLER_SPIN :
+                                                      HANDLER_EXP;
+        handler.service_ns = (uint64_t)atoll(arg);
+        fn = handler.type == HANDLER_SPIN ? __handle_spin : __handle_exp;
+    } else if (strcmp(handler.path, "checksum") == 0) {
+        check(arg == NULL, "Usage: checksum");
+        handler.type = HANDLER_CHECKSUM;
+        fn           = __handle_checksum;
+    } else {
+        check(0, "Unknown handler '%s'", spec);
+    }
+
+    free(handler.path);
+    handler.path = NULL;
+
+    ret = rpc_register(RPC_SERVE, "serve", fn, NULL);
+    check(ret == 0, "Failed to register handler '%s'", spec);
+    return 0;
+error:
+    handler_destroy();
+    return -1;
+}
+
+void handler_destroy() {
+    if (handler.dl != NULL)
+        dlclose(handler.dl);
+    if (handler.path != NULL)
+        free(handler.path);
+
+    handler.dl   = NULL;
+    handler.path = NULL;
+}
+
+void print_handler_info() {
+    log("handler            = %s", handler_names[handler.type]);
+    if (handler.type == HANDLER_SPIN || handler.type == HANDLER_EXP)
+        log("service_ns         = %"PRIu64, handler.service_ns);
+    if (handler.type == HANDLER_CUSTOM)
+        log("handler_path       = %s", handler.path);
+}
@@ -0,0 +1,55 @@
+#ifndef __HANDLER_H__
+#define __HANDLER_H__
+
+#include <inttypes.h>
+
+#include "rpc.h"
+
+/*
+ * Server handlers
+ *
+ * The server registers one of these as the RPC_SERVE method, "serve", which
+ * is what clients call by default, so the same transport can be measured
+ * under different server loads. --handler takes
+ *
+ *   noop           answer in place at once, the plain echo
+ *   spin:NS        busy-spin NS nanoseconds, then echo
+ *   exp:NS         busy-spin an exponentially distributed time of mean NS
+ *   checksum       read every payload byte, answer with their 64-bit sum
+ *   PATH[:SYMBOL]  a handler from a shared object, SYMBOL defaults to
+ *                  HANDLER_SYMBOL
+ *
+ * A shared object handler is an
+ *
+ *   int rpc_handler(struct RpcCall *call, void *arg)
+ *
+ * as in rpc.h, called with a NULL arg. Handlers run on all server threads
+ * at once, or on their pipeline workers (pipeline.h), and keep any state
+ * per thread. The spinning handlers never yield the CPU, like a worker
+ * which is busy computing.
+ */
+#define HANDLER_SYMBOL      "rpc_handler"
+#define HANDLER_DEFAULT     "noop"
+
+enum HandlerType {
+    HANDLER_NOOP = 0,
+    HANDLER_SPIN,
+    HANDLER_EXP,
+    HANDLER_CHECKSUM,
+    HANDLER_CUSTOM,
+};
+
+struct Handler {
+    enum HandlerType type;
+    uint64_t         service_ns;    /* spin time, or its mean */
+    char             *path;         /* of a custom one */
+    void             *dl;           /* its dlopen() handle */
+};
+
+extern struct Handler handler;
+
+int  handler_init(const char *spec);
+void handler_destroy();
+void print_handler_info();
+
+#endif /* __HANDLER_H__ */
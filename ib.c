@@ -3,9 +3,9 @@
 
 #include "ib.h"
 #include "debug.h"
+#include "config.h"
 #include "setup_ib.h"
-
-struct IBRes ib_res;
+#include "probes.h"
 
 static int __modify_qp_to_init(struct ibv_qp *qp) {
     struct ibv_qp_attr qp_attr;
@@ -14,7 +14,7 @@ static int __modify_qp_to_init(struct ibv_qp *qp) {
 
     qp_attr.qp_state = IBV_QPS_INIT;
     qp_attr.pkey_index = 0;
-    qp_attr.port_num = IB_PORT;
+    qp_attr.port_num = config_info.ib_port;
     qp_attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
         IBV_ACCESS_REMOTE_ATOMIC | IBV_ACCESS_REMOTE_WRITE;
 
@@ -22,6 +22,35 @@ static int __modify_qp_to_init(struct ibv_qp *qp) {
                          IBV_QP_PORT | IBV_QP_ACCESS_FLAGS);
 }
 
+/* a UD QP has no remote end: the destination comes with every send */
+static int __modify_ud_qp_to_rts(struct ibv_qp *qp) {
+    struct ibv_qp_attr qp_attr;
+
+    memset(&qp_attr, 0, sizeof(struct ibv_qp_attr));
+    qp_attr.qp_state = IBV_QPS_INIT;
+    qp_attr.pkey_index = 0;
+    qp_attr.port_num = config_info.ib_port;
+    qp_attr.qkey = IB_UD_QKEY;
+    check(ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX |
+                        IBV_QP_PORT | IBV_QP_QKEY) == 0,
+          "Failed to modify ud qp to INIT.");
+
+    memset(&qp_attr, 0, sizeof(struct ibv_qp_attr));
+    qp_attr.qp_state = IBV_QPS_RTR;
+    check(ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE) == 0,
+          "Failed to modify ud qp to RTR.");
+
+    memset(&qp_attr, 0, sizeof(struct ibv_qp_attr));
+    qp_attr.qp_state = IBV_QPS_RTS;
+    qp_attr.sq_psn = 0;
+    check(ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE | IBV_QP_SQ_PSN) == 0,
+          "Failed to modify ud qp to RTS.");
+
+    return 0;
+error:
+    return -1;
+}
+
 static int __modify_qp_to_rtr(struct ibv_qp *qp, uint8_t link_layer,
                               struct QPInfo *remote_qp_info) {
     struct ibv_qp_attr qp_attr;
@@ -32,7 +61,9 @@ static int __modify_qp_to_rtr(struct ibv_qp *qp, uint8_t link_layer,
     qp_attr.path_mtu = ib_res.port_attr.active_mtu;
     qp_attr.dest_qp_num = remote_qp_info->qp_num;
     qp_attr.rq_psn = 0;
-    qp_attr.max_dest_rd_atomic = 1;
+    /* responder resources, for the peer's rendezvous reads */
+    qp_attr.max_dest_rd_atomic = ib_res.dev_attr.max_qp_rd_atom < IB_MAX_RD_ATOMIC ?
+        ib_res.dev_attr.max_qp_rd_atom : IB_MAX_RD_ATOMIC;
     qp_attr.min_rnr_timer = 12;
 
     if (link_layer == IBV_LINK_LAYER_ETHERNET) {
@@ -40,7 +71,7 @@ static int __modify_qp_to_rtr(struct ibv_qp *qp, uint8_t link_layer,
         memcpy(qp_attr.ah_attr.grh.dgid.raw, remote_qp_info->gid.raw,
                sizeof(union ibv_gid));
         qp_attr.ah_attr.grh.flow_label = 0;
-        qp_attr.ah_attr.grh.sgid_index = IB_GID_INDEX;
+        qp_attr.ah_attr.grh.sgid_index = config_info.gid_index;
         qp_attr.ah_attr.grh.hop_limit = 255;
         qp_attr.ah_attr.grh.traffic_class = 0;
     } else {
@@ -50,7 +81,7 @@ static int __modify_qp_to_rtr(struct ibv_qp *qp, uint8_t link_layer,
 
     qp_attr.ah_attr.sl = IB_SL;
     qp_attr.ah_attr.src_path_bits = 0;
-    qp_attr.ah_attr.port_num = IB_PORT;
+    qp_attr.ah_attr.port_num = config_info.ib_port;
 
     return ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE | IBV_QP_AV |
                          IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
@@ -65,9 +96,15 @@ static int __modify_qp_to_rts(struct ibv_qp *qp) {
     qp_attr.qp_state = IBV_QPS_RTS;
     qp_attr.timeout = 14;
     qp_attr.retry_cnt = 7;
-    qp_attr.rnr_retry = 7;
+    /*
+     * With credits a sender never finds the peer's receive queue empty, so
+     * an RNR NAK would be a protocol bug: fail it at once, where rnr_errors
+     * counts it, instead of retrying it forever.
+     */
+    qp_attr.rnr_retry = config_info.credits ? 0 : 7;
     qp_attr.sq_psn = 0;
-    qp_attr.max_rd_atomic = 1;
+    qp_attr.max_rd_atomic = ib_res.dev_attr.max_qp_init_rd_atom < IB_MAX_RD_ATOMIC ?
+        ib_res.dev_attr.max_qp_init_rd_atom : IB_MAX_RD_ATOMIC;
 
     return ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE | IBV_QP_TIMEOUT |
                          IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY |
@@ -75,6 +112,9 @@ static int __modify_qp_to_rts(struct ibv_qp *qp) {
 }
 
 int modify_qp_to_rts(struct ibv_qp *qp, struct QPInfo *remote_qp_info) {
+    if (qp->qp_type == IBV_QPT_UD)
+        return __modify_ud_qp_to_rts(qp);
+
     /* change QP state to INIT */
     check(__modify_qp_to_init(qp) == 0, "Failed to modify qp to INIT.");
 
@@ -90,6 +130,14 @@ error:
     return -1;
 }
 
+/* address a send of a UD QP to dest */
+static inline void __set_ud_dest(struct ibv_send_wr *wr,
+                                 const struct UdDest *dest) {
+    wr->wr.ud.ah          = dest->ah;
+    wr->wr.ud.remote_qpn  = dest->qp_num;
+    wr->wr.ud.remote_qkey = IB_UD_QKEY;
+}
+
 /*
  * struct ibv_send_wr {
  *      uint64_t                wr_id;
@@ -235,7 +283,14 @@ error:
  */
 
 int post_send(uint32_t req_size, uint32_t lkey, uint64_t wr_id,
-              uint32_t imm_data, struct ibv_qp *qp, char *buf) {
+              uint32_t imm_data, int send_flags, struct ibv_qp *qp, char *buf) {
+    return post_send_to(req_size, lkey, wr_id, imm_data, send_flags, qp,
+                        (const struct UdDest *)qp->qp_context, buf);
+}
+
+int post_send_to(uint32_t req_size, uint32_t lkey, uint64_t wr_id,
+                 uint32_t imm_data, int send_flags, struct ibv_qp *qp,
+                 const struct UdDest *dest, char *buf) {
     int ret = 0;
     struct ibv_send_wr *bad_send_wr;
 
@@ -300,10 +355,13 @@ int post_send(uint32_t req_size, uint32_t lkey, uint64_t wr_id,
         .sg_list    = &list,
         .num_sge    = 1,
         .opcode     = IBV_WR_SEND_WITH_IMM,
-        .send_flags = IBV_SEND_SIGNALED,
+        .send_flags = send_flags,
         .imm_data   = htonl (imm_data)
     };
 
+    if (qp->qp_type == IBV_QPT_UD)
+        __set_ud_dest(&send_wr, dest);
+
     /*
      * ibv_post_send() posts a linked list of Work Requests (WRs) to the Send
      * Queue of a Queue Pair (QP). ibv_post_send() go over all of the entries
@@ -331,6 +389,8 @@ int post_send(uint32_t req_size, uint32_t lkey, uint64_t wr_id,
      */
 
     ret = ibv_post_send(qp, &send_wr, &bad_send_wr);
+    PROBE(post_send, qp->qp_num, wr_id, req_size, send_wr.opcode, send_flags,
+          ret);
     return ret;
 }
 
@@ -401,5 +461,150 @@ int post_recv(uint32_t req_size, uint32_t lkey, uint64_t wr_id,
      *
      */
     ret = ibv_post_recv(qp, &recv_wr, &bad_recv_wr);
+    PROBE(post_recv, qp->qp_num, wr_id, req_size, ret);
+    return ret;
+}
+
+static inline uint32_t __sgl_size(struct ibv_sge *sgl, int num_sge) {
+    int i = 0;
+    uint32_t size = 0;
+
+    for (i = 0; i < num_sge; i++)
+        size += sgl[i].length;
+    return size;
+}
+
+/*
+ * The NIC gathers the entries of sgl, in order, into one message; inline
+ * sends are copied from all of them as well. The entries may belong to
+ * different MRs.
+ */
+int post_send_sgl(struct ibv_sge *sgl, int num_sge, uint64_t wr_id,
+                  uint32_t imm_data, int send_flags, struct ibv_qp *qp) {
+    int ret = 0;
+    struct ibv_send_wr *bad_send_wr;
+
+    struct ibv_send_wr send_wr = {
+        .wr_id      = wr_id,
+        .sg_list    = sgl,
+        .num_sge    = num_sge,
+        .opcode     = IBV_WR_SEND_WITH_IMM,
+        .send_flags = send_flags,
+        .imm_data   = htonl (imm_data)
+    };
+
+    if (qp->qp_type == IBV_QPT_UD)
+        __set_ud_dest(&send_wr, (const struct UdDest *)qp->qp_context);
+
+    ret = ibv_post_send(qp, &send_wr, &bad_send_wr);
+    PROBE(post_send, qp->qp_num, wr_id, __sgl_size(sgl, num_sge),
+          send_wr.opcode, send_flags, ret);
+    return ret;
+}
+
+/*
+ * An incoming message fills the entries of sgl in order, each up to its
+ * length, so a fixed-size header lands in its own buffer.
+ */
+int post_recv_sgl(struct ibv_sge *sgl, int num_sge, uint64_t wr_id,
+                  struct ibv_qp *qp) {
+    int ret = 0;
+    struct ibv_recv_wr *bad_recv_wr;
+
+    struct ibv_recv_wr recv_wr = {
+        .wr_id   = wr_id,
+        .next    = NULL,
+        .sg_list = sgl,
+        .num_sge = num_sge
+    };
+
+    ret = ibv_post_recv(qp, &recv_wr, &bad_recv_wr);
+    PROBE(post_recv, qp->qp_num, wr_id, __sgl_size(sgl, num_sge), ret);
+    return ret;
+}
+
+/*
+ * Pull req_size bytes at remote_addr of the peer into buf. Always signaled:
+ * the completion is the only sign that the data has arrived.
+ */
+int post_read(uint32_t req_size, uint32_t lkey, uint64_t wr_id,
+              uint64_t remote_addr, uint32_t rkey, struct ibv_qp *qp,
+              char *buf) {
+    int ret = 0;
+    struct ibv_send_wr *bad_send_wr;
+
+    struct ibv_sge list = {
+        .addr   = (uintptr_t)buf,
+        .length = req_size,
+        .lkey   = lkey
+    };
+
+    struct ibv_send_wr send_wr = {
+        .wr_id      = wr_id,
+        .sg_list    = &list,
+        .num_sge    = 1,
+        .opcode     = IBV_WR_RDMA_READ,
+        .send_flags = IBV_SEND_SIGNALED,
+        .wr.rdma    = {
+            .remote_addr = remote_addr,
+            .rkey        = rkey,
+        },
+    };
+
+    ret = ibv_post_send(qp, &send_wr, &bad_send_wr);
+    PROBE(post_send, qp->qp_num, wr_id, req_size, send_wr.opcode,
+          send_wr.send_flags, ret);
     return ret;
 }
+
+static int __post_write(enum ibv_wr_opcode opcode, uint32_t req_size,
+                        uint32_t lkey, uint64_t wr_id, uint32_t imm_data,
+                        int send_flags, uint64_t remote_addr, uint32_t rkey,
+                        struct ibv_qp *qp, char *buf) {
+    int ret = 0;
+    struct ibv_send_wr *bad_send_wr;
+
+    struct ibv_sge list = {
+        .addr   = (uintptr_t)buf,
+        .length = req_size,
+        .lkey   = lkey
+    };
+
+    struct ibv_send_wr send_wr = {
+        .wr_id      = wr_id,
+        .sg_list    = &list,
+        .num_sge    = 1,
+        .opcode     = opcode,
+        .send_flags = send_flags,
+        .imm_data   = htonl (imm_data),
+        .wr.rdma    = {
+            .remote_addr = remote_addr,
+            .rkey        = rkey,
+        },
+    };
+
+    ret = ibv_post_send(qp, &send_wr, &bad_send_wr);
+    PROBE(post_send, qp->qp_num, wr_id, req_size, send_wr.opcode, send_flags,
+          ret);
+    return ret;
+}
+
+/* Place req_size bytes of buf at remote_addr of the peer, silently. */
+int post_write(uint32_t req_size, uint32_t lkey, uint64_t wr_id,
+               int send_flags, uint64_t remote_addr, uint32_t rkey,
+               struct ibv_qp *qp, char *buf) {
+    return __post_write(IBV_WR_RDMA_WRITE, req_size, lkey, wr_id, 0,
+                        send_flags, remote_addr, rkey, qp, buf);
+}
+
+/*
+ * As post_write(), then consume a receive of the peer, which completes with
+ * imm_data once the data, and everything written before it on this QP, is
+ * in place.
+ */
+int post_write_imm(uint32_t req_size, uint32_t lkey, uint64_t wr_id,
+                   uint32_t imm_data, int send_flags, uint64_t remote_addr,
+                   uint32_t rkey, struct ibv_qp *qp, char *buf) {
+    return __post_write(IBV_WR_RDMA_WRITE_WITH_IMM, req_size, lkey, wr_id,
+                        imm_data, send_flags, remote_addr, rkey, qp, buf);
+}
@@ -42,6 +42,11 @@
 #define IB_WR_ID_STOP       0xE000000000000000
 #define NUM_WARMING_UP_OPS  500000
 #define TOT_NUM_OPS         10000000
+#define REG_CHUNK_MB        1024
+#define IB_MAX_RD_ATOMIC    16      /* RDMA READs in flight per QP */
+#define IB_MAX_SGE          1       /* default of --sge */
+#define IB_GRH_SIZE         40      /* in front of every UD receive */
+#define IB_UD_QKEY          0x11111111
 
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 static inline uint64_t htonll (uint64_t x) {return bswap_64(x); }
@@ -59,19 +64,68 @@ struct QPInfo {
     union ibv_gid gid;
 }__attribute__ ((packed));
 
+/*
+ * The peer of a UD QP. A client QP has one, in its qp_context: post_send()
+ * addresses every send of the QP to it, so the layers above need not know
+ * the transport. A server QP answers many, see post_send_to().
+ */
+struct UdDest {
+    struct ibv_ah *ah;
+    uint32_t      qp_num;
+};
+
 enum MsgType {
     MSG_CTL_START = 0,
     MSG_CTL_STOP,
     MSG_REGULAR,
+    MSG_RPC,            /* an RpcHdr and its payload */
+    MSG_RPC_BATCH,      /* MSG_RPC responses back to back, count in arg */
+    MSG_RNDV_REQ,       /* a RndvDesc in place of the payload */
+    MSG_RNDV_FIN,       /* the peer is done reading a pool buffer */
+    MSG_XFER_END,       /* last chunk of a transfer on one lane */
+    MSG_CREDIT,         /* returns receive credits, nothing else */
 };
 
+/* imm_data carries the MsgType in its low byte, an argument above it */
+#define MSG_IMM(type, arg)  ((uint32_t)(arg) << 8 | (uint32_t)(type))
+#define MSG_IMM_TYPE(imm)   ((imm) & 0xff)
+#define MSG_IMM_ARG(imm)    ((imm) >> 8)
+
+/* RC: connect to the remote QP; UD: only the state, see struct UdDest */
 int modify_qp_to_rts(struct ibv_qp *qp, struct QPInfo *remote_qp_info);
 
 int post_send(uint32_t req_size, uint32_t lkey, uint64_t wr_id,
-              uint32_t imm_data, struct ibv_qp *qp, char *buf);
+              uint32_t imm_data, int send_flags, struct ibv_qp *qp, char *buf);
+
+/* post_send() to dest, which is NULL for RC and the qp's own peer */
+int post_send_to(uint32_t req_size, uint32_t lkey, uint64_t wr_id,
+                 uint32_t imm_data, int send_flags, struct ibv_qp *qp,
+                 const struct UdDest *dest, char *buf);
 
 int post_recv(uint32_t req_size, uint32_t lkey, uint64_t wr_id,
               struct ibv_qp *qp, char *buf);
 
+/*
+ * Gather/scatter variants: header and payload may sit in separate
+ * registered buffers instead of being copied into one. num_sge must not
+ * exceed the QP's max_send_sge/max_recv_sge, see --sge.
+ */
+int post_send_sgl(struct ibv_sge *sgl, int num_sge, uint64_t wr_id,
+                  uint32_t imm_data, int send_flags, struct ibv_qp *qp);
+
+int post_recv_sgl(struct ibv_sge *sgl, int num_sge, uint64_t wr_id,
+                  struct ibv_qp *qp);
+
+int post_read(uint32_t req_size, uint32_t lkey, uint64_t wr_id,
+              uint64_t remote_addr, uint32_t rkey, struct ibv_qp *qp,
+              char *buf);
+
+int post_write(uint32_t req_size, uint32_t lkey, uint64_t wr_id,
+               int send_flags, uint64_t remote_addr, uint32_t rkey,
+               struct ibv_qp *qp, char *buf);
+
+int post_write_imm(uint32_t req_size, uint32_t lkey, uint64_t wr_id,
+                   uint32_t imm_data, int send_flags, uint64_t remote_addr,
+                   uint32_t rkey, struct ibv_qp *qp, char *buf);
 
 #endif /* __IB_H__ */
@@ -1,8 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <getopt.h>
 
 #include "debug.h"
 #include "config.h"
+#include "workload.h"
+#include "tsc.h"
+#include "msg_trace.h"
+#include "rndv.h"
+#include "rpc.h"
+#include "handler.h"
+#include "ib.h"
 #include "setup_ib.h"
 #include "client.h"
 #include "server.h"
@@ -18,45 +26,337 @@ static int init_env() {
 
     check(log_fp != NULL, "Failed to open log file");
 
+    check(tsc_init() == 0, "Failed to calibrate TSC");
+
     log(LOG_HEADER, "IB Echo Server");
     print_config_info();
+    if (config_info.is_server)
+        print_handler_info();
 
     return 0;
 error:
     return -1;
 }
 
+static void usage(const char *prog) {
+    printf("Server: %s [options] msg_size num_concurr_msgs sock_port\n", prog);
+    printf("Client: %s [options] server_name msg_size num_concurr_msgs sock_port\n", prog);
+    printf("Options:\n");
+    printf("  -w, --workload=SPEC   message-size distribution: fixed, uniform:MIN:MAX,\n"
+           "                        zipf:MIN:MAX:S, bimodal:SMALL:LARGE:P, cdf:FILE,\n"
+           "                        trace:FILE (give the same spec to both sides;\n"
+           "                        every slot holds the largest size, so mixes\n"
+           "                        of small and large sizes want --rndv)\n");
+    printf("  -i, --stats-interval=MS\n"
+           "                        report per-thread counters every MS ms,\n"
+           "                        0 disables (default 1000)\n");
+    printf("  -S, --shm-stats       publish live stats in /dev/shm for rdma-stat\n");
+    printf("  -d, --ib-dev=NAME     IB device (default: the first one)\n");
+    printf("  -P, --ib-port=N       IB port (default %d)\n", IB_PORT);
+    printf("  -g, --gid-idx=N       GID index for RoCE (default %d)\n", IB_GID_INDEX);
+    printf("  -F, --no-fork-init    skip ibv_fork_init(), faster startup\n");
+    printf("  -c, --reg-chunk-mb=MB register buffer pools larger than MB in\n"
+           "                        chunks of MB, in parallel (default %d,\n"
+           "                        0 registers one MR)\n", REG_CHUNK_MB);
+    printf("  -j, --reg-threads=N   threads registering chunks, on the NIC's\n"
+           "                        NUMA node (default: its CPUs, up to 16)\n");
+    printf("  -o, --output=FILE     write results as JSON, or CSV if FILE ends\n"
+           "                        in .csv (rows are appended)\n");
+    printf("  -t, --threads=N       worker threads, one QP each (default 1)\n");
+    printf("  -e, --peers=N         client QPs the server accepts, from any\n"
+           "                        number of clients (default: one per server\n"
+           "                        thread; more only with --ud)\n");
+    printf("  -n, --ops=N           ops per thread, server side (default %d)\n",
+           TOT_NUM_OPS);
+    printf("  -W, --warmup=N        warm-up ops per thread (default %d)\n",
+           NUM_WARMING_UP_OPS);
+    printf("  -s, --signal-every=N  request a completion for one data send in N\n"
+           "                        (default 1)\n");
+    printf("  -I, --inline=BYTES    send messages up to BYTES inline (default 0)\n");
+    printf("  -G, --sge=N           scatter/gather entries per work request\n"
+           "                        (default %d, up to the device's max_sge)\n",
+           IB_MAX_SGE);
+    printf("  -p, --perf-counters   count cycles, instructions, LLC and branch\n"
+           "                        misses per message in the measured window\n");
+    printf("  -T, --trace=PREFIX    record every message to PREFIX.<role>.<thread>,\n"
+           "                        decode with rdma-trace\n");
+    printf("  -R, --trace-records=N trace ring size per thread (default %d)\n",
+           MSG_TRACE_RECORDS);
+    printf("  -r, --rndv=BYTES|auto send messages above BYTES as a descriptor\n"
+           "                        the peer reads the payload with, receives\n"
+           "                        are only BYTES; auto measures the cutoff up\n"
+           "                        to %d (same on both sides, default off)\n",
+           RNDV_EAGER_MAX);
+    printf("  -b, --rndv-pool=N     buffers per thread rendezvous payloads are\n"
+           "                        read into (default %d)\n", RNDV_POOL_BUFS);
+    printf("  -C, --credits         never send into an empty receive queue: peers\n"
+           "                        return freed receives as credits, and an RNR\n"
+           "                        NAK fails instead of being retried (same on\n"
+           "                        both sides)\n");
+    printf("  -u, --ud              unreliable datagram QPs instead of reliable\n"
+           "                        connections: messages up to the path MTU,\n"
+           "                        implies --credits, no --rndv (same on both\n"
+           "                        sides)\n");
+    printf("  -m, --method=NAME     RPC method the client calls: serve runs the\n"
+           "                        server's handler, null answers with an empty\n"
+           "                        response, echo with the request (default\n"
+           "                        serve)\n");
+    printf("  -H, --handler=SPEC    server work per call: noop, spin:NS, exp:NS\n"
+           "                        (mean), checksum or PATH.so[:SYMBOL]\n"
+           "                        (default %s)\n", HANDLER_DEFAULT);
+    printf("  -D, --pipeline=N      server threads only poll and post, N worker\n"
+           "                        threads each run the handlers (default 0,\n"
+           "                        run to completion)\n");
+    printf("  -k, --steal           server threads queue requests and steal\n"
+           "                        from each other's queues when idle\n");
+    printf("  -z, --skew=S          client thread i keeps num_concurr_msgs /\n"
+           "                        (i+1)^S requests in flight, Zipf over\n"
+           "                        connections (default 0, all equal)\n");
+    printf("  -B, --coalesce=N      server packs up to N small responses of a\n"
+           "                        connection into one send (default 0, off)\n");
+    printf("  -U, --coalesce-us=US  hold a partial batch up to US us for more\n"
+           "                        responses (default 0, send it at the end\n"
+           "                        of each poll)\n");
+}
+
 static void destroy_env() {
-    log(LOG_HEADER, "Run Finished");
+    workload_destroy();
+    handler_destroy();
 
-    if (log_fp != NULL)
+    if (log_fp != NULL) {
+        log(LOG_HEADER, "Run Finished");
         fclose(log_fp);
+    }
 }
 
 int main(int argc, char *argv[]) {
-    int ret = 0;
+    int ret = 0, opt = 0;
+    char **args = NULL;
+
+    static struct option long_options[] = {
+        {"workload",       required_argument, NULL, 'w'},
+        {"stats-interval", required_argument, NULL, 'i'},
+        {"shm-stats",      no_argument,       NULL, 'S'},
+        {"ib-dev",         required_argument, NULL, 'd'},
+        {"ib-port",        required_argument, NULL, 'P'},
+        {"gid-idx",        required_argument, NULL, 'g'},
+        {"no-fork-init",   no_argument,       NULL, 'F'},
+        {"reg-chunk-mb",   required_argument, NULL, 'c'},
+        {"reg-threads",    required_argument, NULL, 'j'},
+        {"output",         required_argument, NULL, 'o'},
+        {"threads",        required_argument, NULL, 't'},
+        {"peers",          required_argument, NULL, 'e'},
+        {"ops",            required_argument, NULL, 'n'},
+        {"warmup",         required_argument, NULL, 'W'},
+        {"signal-every",   required_argument, NULL, 's'},
+        {"inline",         required_argument, NULL, 'I'},
+        {"sge",            required_argument, NULL, 'G'},
+        {"perf-counters",  no_argument,       NULL, 'p'},
+        {"trace",          required_argument, NULL, 'T'},
+        {"trace-records",  required_argument, NULL, 'R'},
+        {"rndv",           required_argument, NULL, 'r'},
+        {"rndv-pool",      required_argument, NULL, 'b'},
+        {"credits",        no_argument,       NULL, 'C'},
+        {"ud",             no_argument,       NULL, 'u'},
+        {"method",         required_argument, NULL, 'm'},
+        {"handler",        required_argument, NULL, 'H'},
+        {"pipeline",       required_argument, NULL, 'D'},
+        {"steal",          no_argument,       NULL, 'k'},
+        {"skew",           required_argument, NULL, 'z'},
+        {"coalesce",       required_argument, NULL, 'B'},
+        {"coalesce-us",    required_argument, NULL, 'U'},
+        {"help",           no_argument,       NULL, 'h'},
+        {NULL,             0,                 NULL,  0 }
+    };
+
+    config_info.stats_interval_ms = 1000;
+    config_info.ib_port           = IB_PORT;
+    config_info.gid_index         = IB_GID_INDEX;
+    config_info.fork_init         = true;
+    config_info.reg_chunk_mb      = REG_CHUNK_MB;
+    config_info.num_threads       = 1;
+    config_info.num_warmup_ops    = NUM_WARMING_UP_OPS;
+    config_info.tot_num_ops       = TOT_NUM_OPS;
+    config_info.signal_interval   = 1;
+    config_info.inline_size       = 0;
+    config_info.num_sge           = IB_MAX_SGE;
+    config_info.trace_records     = MSG_TRACE_RECORDS;
+    config_info.rndv_pool         = RNDV_POOL_BUFS;
+    config_info.rpc_name          = "serve";
 
-    if (argc == 5) {
+    while ((opt = getopt_long(argc, argv, "w:i:Sd:P:g:Fc:j:o:t:e:n:W:s:I:G:pT:R:r:b:Cum:H:D:kz:B:U:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'w':
+            config_info.workload_spec = optarg;
+            break;
+        case 'i':
+            config_info.stats_interval_ms = atoi(optarg);
+            break;
+        case 'S':
+            config_info.shm_stats = true;
+            break;
+        case 'd':
+            config_info.ib_devname = optarg;
+            break;
+        case 'P':
+            config_info.ib_port = atoi(optarg);
+            break;
+        case 'g':
+            config_info.gid_index = atoi(optarg);
+            break;
+        case 'F':
+            config_info.fork_init = false;
+            break;
+        case 'c':
+            config_info.reg_chunk_mb = atoi(optarg);
+            break;
+        case 'j':
+            config_info.reg_threads = atoi(optarg);
+            break;
+        case 'o':
+            config_info.results_path = optarg;
+            break;
+        case 't':
+            config_info.num_threads = atoi(optarg);
+            break;
+        case 'e':
+            config_info.num_peers = atoi(optarg);
+            break;
+        case 'n':
+            config_info.tot_num_ops = atol(optarg);
+            break;
+        case 'W':
+            config_info.num_warmup_ops = atol(optarg);
+            break;
+        case 's':
+            config_info.signal_interval = atoi(optarg);
+            break;
+        case 'I':
+            config_info.inline_size = atoi(optarg);
+            break;
+        case 'G':
+            config_info.num_sge = atoi(optarg);
+            break;
+        case 'p':
+            config_info.perf_counters = true;
+            break;
+        case 'T':
+            config_info.trace_prefix = optarg;
+            break;
+        case 'R':
+            config_info.trace_records = atol(optarg);
+            break;
+        case 'r':
+            if (strcmp(optarg, "auto") == 0)
+                config_info.rndv_threshold = RNDV_AUTO;
+            else
+                config_info.rndv_threshold = atoi(optarg);
+            break;
+        case 'b':
+            config_info.rndv_pool = atoi(optarg);
+            break;
+        case 'C':
+            config_info.credits = true;
+            break;
+        case 'u':
+            /* a send into an empty receive queue is dropped, not retried */
+            config_info.ud = true;
+            config_info.credits = true;
+            break;
+        case 'm':
+            config_info.rpc_name = optarg;
+            break;
+        case 'H':
+            config_info.handler_spec = optarg;
+            break;
+        case 'D':
+            config_info.pipeline = atoi(optarg);
+            break;
+        case 'k':
+            config_info.steal = true;
+            break;
+        case 'z':
+            config_info.skew = atof(optarg);
+            break;
+        case 'B':
+            config_info.coalesce = atoi(optarg);
+            break;
+        case 'U':
+            config_info.coalesce_us = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 0;
+        }
+    }
+
+    args = &argv[optind];
+    if (argc - optind == 4) {
         config_info.is_server        = false;
-        config_info.server_name      = argv[1];
-        config_info.msg_size         = atoi(argv[2]);
-        config_info.num_concurr_msgs = atoi(argv[3]);
-        config_info.sock_port        = argv[4];
-    } else if (argc == 4) {
+        config_info.server_name      = args[0];
+        config_info.msg_size         = atoi(args[1]);
+        config_info.num_concurr_msgs = atoi(args[2]);
+        config_info.sock_port        = args[3];
+    } else if (argc - optind == 3) {
         config_info.is_server        = true;
-        config_info.msg_size         = atoi (argv[1]);
-        config_info.num_concurr_msgs = atoi (argv[2]);
-        config_info.sock_port        = argv[3];
+        config_info.msg_size         = atoi (args[0]);
+        config_info.num_concurr_msgs = atoi (args[1]);
+        config_info.sock_port        = args[2];
     } else {
-        printf("Server: %s msg_size num_concurr_msgs sock_port\n", argv[0]);
-        printf("Client: %s server_name msg_size num_concurr_msgs sock_port\n", argv[0]);
+        usage(argv[0]);
         return 0;
     }
 
+    check(config_info.num_threads > 0, "threads must be positive");
+    if (config_info.num_peers == 0)
+        config_info.num_peers = config_info.num_threads;
+    check(config_info.num_peers > 0, "peers must be positive");
+    /* an RC QP has one peer, a UD QP answers any number of them */
+    check(config_info.ud || config_info.num_peers == config_info.num_threads,
+          "peers other than threads need ud");
+    check(config_info.num_peers >= config_info.num_threads,
+          "every server thread needs a peer");
+    check(config_info.pipeline >= 0, "pipeline must not be negative");
+    check(config_info.pipeline == 0 || config_info.steal == false,
+          "pipeline and steal are exclusive");
+    check(config_info.skew >= 0, "skew must not be negative");
+    check(config_info.coalesce >= 0 && config_info.coalesce_us >= 0,
+          "coalesce and coalesce-us must not be negative");
+    check(config_info.signal_interval > 0, "signal-every must be positive");
+    check(config_info.inline_size >= 0, "inline must not be negative");
+    check(config_info.num_sge > 0, "sge must be positive");
+    check(config_info.trace_records > 0, "trace-records must be positive");
+    check(config_info.rndv_threshold >= RNDV_AUTO && config_info.rndv_pool > 0,
+          "rndv must be auto or a size, rndv-pool positive");
+    check(config_info.ud == false || config_info.rndv_threshold == 0,
+          "ud has no RDMA READ for rndv");
+    check(config_info.credits == false ||
+          config_info.num_concurr_msgs <= RNDV_CREDIT_MAX_MSGS,
+          "credits leave room for %d concurrent messages", RNDV_CREDIT_MAX_MSGS);
+    check(config_info.num_concurr_msgs <= (int)RPC_SLOT_MASK + 1,
+          "RPC slots leave room for %d concurrent messages", RPC_SLOT_MASK + 1);
+    check(config_info.reg_chunk_mb >= 0 && config_info.reg_threads >= 0,
+          "reg-chunk-mb and reg-threads must not be negative");
+    check(config_info.num_warmup_ops > 0 &&
+          config_info.num_warmup_ops < config_info.tot_num_ops,
+          "warmup must be positive and below ops");
+
+    ret = rpc_init_methods();
+    check(ret == 0, "Failed to register RPC methods");
+    /* the client only needs the name of the server's handler */
+    ret = handler_init(config_info.is_server ? config_info.handler_spec : NULL);
+    check(ret == 0, "Failed to init handler");
+    config_info.rpc_method = rpc_method_id(config_info.rpc_name);
+    check(config_info.rpc_method >= 0, "Unknown RPC method %s",
+          config_info.rpc_name);
+
+    ret = workload_init(config_info.workload_spec, config_info.msg_size);
+    check(ret == 0, "Failed to init workload");
+
     ret = init_env();
     check(ret == 0, "Failed to init env");
 
-    ret = setup_ib(NULL);
+    ret = setup_ib(config_info.ib_devname);
     check(ret == 0, "Failed to setup IB");
 
     if (config_info.is_server) {
@@ -0,0 +1,440 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/mman.h>
+
+#include "debug.h"
+#include "mr_cache.h"
+
+struct MrCacheEntry {
+    uintptr_t           start;      /* registered [start, end), page aligned */
+    uintptr_t           end;
+    uintptr_t           max_end;    /* largest end in this subtree */
+    uint32_t            prio;
+    struct MrCacheEntry *left;
+    struct MrCacheEntry *right;
+
+    struct MrCacheEntry *lru_prev;  /* while unreferenced */
+    struct MrCacheEntry *lru_next;
+    struct MrCacheEntry *victim;    /* invalidation batch, zombie list */
+
+    struct ibv_mr       *mr;
+    int                 refcnt;
+};
+
+static struct MrCache  *live_caches = NULL;
+static pthread_mutex_t  live_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uintptr_t __page_mask() {
+    static uintptr_t mask = 0;
+
+    if (mask == 0)
+        mask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+    return mask;
+}
+
+/* treap */
+
+static inline uintptr_t __max_end(struct MrCacheEntry *n) {
+    return n != NULL ? n->max_end : 0;
+}
+
+static inline void __update(struct MrCacheEntry *n) {
+    n->max_end = n->end;
+    if (__max_end(n->left) > n->max_end)
+        n->max_end = __max_end(n->left);
+    if (__max_end(n->right) > n->max_end)
+        n->max_end = __max_end(n->right);
+}
+
+static inline int __cmp(struct MrCacheEntry *a, struct MrCacheEntry *b) {
+    if (a->start != b->start)
+        return a->start < b->start ? -1 : 1;
+    if (a->end != b->end)
+        return a->end < b->end ? -1 : 1;
+    return a == b ? 0 : (a < b ? -1 : 1);
+}
+
+static struct MrCacheEntry *__rotate_right(struct MrCacheEntry *n) {
+    struct MrCacheEntry *l = n->left;
+
+    n->left = l->right;
+    l->right = n;
+    __update(n);
+    __update(l);
+    return l;
+}
+
+static struct MrCacheEntry *__rotate_left(struct MrCacheEntry *n) {
+    struct MrCacheEntry *r = n->right;
+
+    n->right = r->left;
+    r->left = n;
+    __update(n);
+    __update(r);
+    return r;
+}
+
+static struct MrCacheEntry *__insert(struct MrCacheEntry *root,
+                                     struct MrCacheEntry *e) {
+    if (root == NULL) {
+        e->left = e->right = NULL;
+        __update(e);
+        return e;
+    }
+
+    if (__cmp(e, root) < 0) {
+        root->left = __insert(root->left, e);
+        if (root->left->prio > root->prio)
+            return __rotate_right(root);
+    } else {
+        root->right = __insert(root->right, e);
+        if (root->right->prio > root->prio)
+            return __rotate_left(root);
+    }
+
+    __update(root);
+    return root;
+}
+
+static struct MrCacheEntry *__merge(struct MrCacheEntry *l,
+                                    struct MrCacheEntry *r) {
+    if (l == NULL)
+        return r;
+    if (r == NULL)
+        return l;
+
+    if (l->prio > r->prio) {
+        l->right = __merge(l->right, r);
+        __update(l);
+        return l;
+    }
+    r->left = __merge(l, r->left);
+    __update(r);
+    return r;
+}
+
+static struct MrCacheEntry *__remove(struct MrCacheEntry *root,
+                                     struct MrCacheEntry *e) {
+    int c = 0;
+
+    if (root == NULL)
+        return NULL;
+
+    c = __cmp(e, root);
+    if (c == 0)
+        return __merge(root->left, root->right);
+
+    if (c < 0)
+        root->left = __remove(root->left, e);
+    else
+        root->right = __remove(root->right, e);
+
+    __update(root);
+    return root;
+}
+
+/* some entry with start <= s and e <= end */
+static struct MrCacheEntry *__find_covering(struct MrCacheEntry *n,
+                                            uintptr_t s, uintptr_t e) {
+    struct MrCacheEntry *found = NULL;
+
+    while (n != NULL && n->max_end >= e) {
+        if (n->left != NULL && n->left->max_end >= e) {
+            found = __find_covering(n->left, s, e);
+            if (found != NULL)
+                return found;
+        }
+        if (n->start > s)
+            return NULL;
+        if (n->end >= e)
+            return n;
+        n = n->right;
+    }
+
+    return NULL;
+}
+
+/* the entry registered for exactly [s, e) */
+static struct MrCacheEntry *__find_exact(struct MrCacheEntry *n,
+                                         uintptr_t s, uintptr_t e) {
+    while (n != NULL) {
+        if (s == n->start && e == n->end)
+            return n;
+        if (s < n->start || (s == n->start && e < n->end))
+            n = n->left;
+        else
+            n = n->right;
+    }
+
+    return NULL;
+}
+
+/* chain every entry overlapping [s, e) through victim */
+static void __collect_overlapping(struct MrCacheEntry *n, uintptr_t s,
+                                  uintptr_t e, struct MrCacheEntry **list) {
+    if (n == NULL || n->max_end <= s)
+        return;
+
+    __collect_overlapping(n->left, s, e, list);
+    if (n->start < e) {
+        if (n->end > s) {
+            n->victim = *list;
+            *list = n;
+        }
+        __collect_overlapping(n->right, s, e, list);
+    }
+}
+
+/* LRU of unreferenced entries */
+
+static void __lru_remove(struct MrCache *cache, struct MrCacheEntry *e) {
+    if (e->lru_prev != NULL)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        cache->lru_head = e->lru_next;
+
+    if (e->lru_next != NULL)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        cache->lru_tail = e->lru_prev;
+
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void __lru_append(struct MrCache *cache, struct MrCacheEntry *e) {
+    e->lru_prev = cache->lru_tail;
+    e->lru_next = NULL;
+
+    if (cache->lru_tail != NULL)
+        cache->lru_tail->lru_next = e;
+    else
+        cache->lru_head = e;
+    cache->lru_tail = e;
+}
+
+static void __release(struct MrCache *cache, struct MrCacheEntry *e) {
+    cache->stats.pinned_bytes -= e->end - e->start;
+    cache->stats.num_entries--;
+    ibv_dereg_mr(e->mr);
+    free(e);
+}
+
+/* drop an entry from the tree, now or on its last put if still in use */
+static void __drop(struct MrCache *cache, struct MrCacheEntry *e) {
+    cache->root = __remove(cache->root, e);
+
+    if (e->refcnt > 0) {
+        /* freed on its last put */
+        e->victim = cache->zombies;
+        cache->zombies = e;
+        return;
+    }
+
+    __lru_remove(cache, e);
+    __release(cache, e);
+}
+
+static bool __make_room(struct MrCache *cache, size_t len) {
+    if (cache->max_pinned == 0)
+        return true;
+
+    while (cache->stats.pinned_bytes + len > cache->max_pinned &&
+           cache->lru_head != NULL) {
+        cache->stats.evictions++;
+        __drop(cache, cache->lru_head);
+    }
+
+    return cache->stats.pinned_bytes + len <= cache->max_pinned;
+}
+
+struct MrCache *mr_cache_create(struct ibv_pd *pd, int access,
+                                size_t max_pinned) {
+    struct MrCache *cache = NULL;
+
+    cache = (struct MrCache *)calloc(1, sizeof(struct MrCache));
+    check(cache != NULL, "Failed to allocate mr cache");
+
+    cache->pd         = pd;
+    cache->access     = access;
+    cache->max_pinned = max_pinned;
+    cache->seed       = (uint32_t)(uintptr_t)cache | 1;
+    pthread_mutex_init(&cache->lock, NULL);
+
+    pthread_mutex_lock(&live_lock);
+    cache->next = live_caches;
+    live_caches = cache;
+    pthread_mutex_unlock(&live_lock);
+
+    return cache;
+
+error:
+    return NULL;
+}
+
+void mr_cache_destroy(struct MrCache *cache) {
+    struct MrCache **p = NULL;
+    struct MrCacheEntry *e = NULL;
+
+    if (cache == NULL)
+        return;
+
+    pthread_mutex_lock(&live_lock);
+    for (p = &live_caches; *p != NULL; p = &(*p)->next) {
+        if (*p == cache) {
+            *p = cache->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&live_lock);
+
+    pthread_mutex_lock(&cache->lock);
+    while (cache->root != NULL) {
+        e = cache->root;
+        cache->root = __remove(cache->root, e);
+        __release(cache, e);
+    }
+
+    /* references still held past destroy are dropped with it */
+    while (cache->zombies != NULL) {
+        e = cache->zombies;
+        cache->zombies = e->victim;
+        __release(cache, e);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+struct ibv_mr *mr_cache_get(struct MrCache *cache, const void *addr,
+                            size_t len) {
+    uintptr_t s = (uintptr_t)addr, e = s + (len ? len : 1);
+    struct MrCacheEntry *entry = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+
+    entry = __find_covering(cache->root, s, e);
+    if (entry != NULL) {
+        cache->stats.hits++;
+        if (entry->refcnt++ == 0)
+            __lru_remove(cache, entry);
+        pthread_mutex_unlock(&cache->lock);
+        return entry->mr;
+    }
+
+    /* whole pages, neighbouring buffers on them hit later */
+    cache->stats.misses++;
+    s &= ~__page_mask();
+    e  = (e + __page_mask()) & ~__page_mask();
+
+    if (__make_room(cache, e - s) == false) {
+        errno = ENOMEM;
+        goto error;
+    }
+
+    entry = (struct MrCacheEntry *)calloc(1, sizeof(struct MrCacheEntry));
+    if (entry == NULL)
+        goto error;
+
+    entry->mr = ibv_reg_mr(cache->pd, (void *)s, e - s, cache->access);
+    if (entry->mr == NULL) {
+        free(entry);
+        goto error;
+    }
+
+    /* xorshift */
+    cache->seed ^= cache->seed << 13;
+    cache->seed ^= cache->seed >> 17;
+    cache->seed ^= cache->seed << 5;
+
+    entry->start  = s;
+    entry->end    = e;
+    entry->prio   = cache->seed;
+    entry->refcnt = 1;
+    cache->root   = __insert(cache->root, entry);
+    cache->stats.pinned_bytes += e - s;
+    cache->stats.num_entries++;
+
+    pthread_mutex_unlock(&cache->lock);
+    return entry->mr;
+
+error:
+    cache->stats.failures++;
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+void mr_cache_put(struct MrCache *cache, struct ibv_mr *mr) {
+    uintptr_t s = (uintptr_t)mr->addr;
+    struct MrCacheEntry *entry = NULL, **z = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+
+    entry = __find_exact(cache->root, s, s + mr->length);
+    if (entry != NULL && entry->mr == mr) {
+        if (--entry->refcnt == 0)
+            __lru_append(cache, entry);
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+
+    for (z = &cache->zombies; *z != NULL; z = &(*z)->victim) {
+        entry = *z;
+        if (entry->mr != mr)
+            continue;
+        if (--entry->refcnt == 0) {
+            *z = entry->victim;
+            __release(cache, entry);
+        }
+        break;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void mr_cache_invalidate(struct MrCache *cache, const void *addr, size_t len) {
+    uintptr_t s = (uintptr_t)addr, e = s + len;
+    struct MrCacheEntry *list = NULL, *entry = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+
+    __collect_overlapping(cache->root, s, e, &list);
+    while (list != NULL) {
+        entry = list;
+        list = entry->victim;
+        cache->stats.invalidations++;
+        __drop(cache, entry);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void mr_cache_stats(struct MrCache *cache, struct MrCacheStats *stats) {
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static void __invalidate_all(const void *addr, size_t len) {
+    struct MrCache *cache = NULL;
+
+    pthread_mutex_lock(&live_lock);
+    for (cache = live_caches; cache != NULL; cache = cache->next)
+        mr_cache_invalidate(cache, addr, len);
+    pthread_mutex_unlock(&live_lock);
+}
+
+int mr_cache_munmap(void *addr, size_t len) {
+    __invalidate_all(addr, len);
+    return munmap(addr, len);
+}
+
+void mr_cache_free(void *ptr) {
+    if (ptr == NULL)
+        return;
+
+    __invalidate_all(ptr, malloc_usable_size(ptr));
+    free(ptr);
+}
@@ -0,0 +1,72 @@
+#ifndef __MR_CACHE_H__
+#define __MR_CACHE_H__
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <infiniband/verbs.h>
+
+/*
+ * Memory registration cache
+ *
+ * For sending from memory outside ib_buf without an ibv_reg_mr() per
+ * message. mr_cache_get() returns an MR covering [addr, addr + len),
+ * registering the pages around it on a miss, and holds a reference until
+ * mr_cache_put(). Registrations are kept in an interval tree (a treap
+ * ordered by start, each node knowing the largest end below it), so that a
+ * hit is a walk down the tree. Unreferenced registrations sit on an LRU
+ * list and are deregistered, oldest first, to keep the pinned bytes under
+ * the budget.
+ *
+ * A cached MR pins pages the application may give back to the system. It
+ * must call mr_cache_invalidate(), or use mr_cache_munmap() and
+ * mr_cache_free() in place of munmap() and free(), before memory that may
+ * be cached is released; later allocations at the same address would be
+ * served stale pages otherwise. The hooks cover every live cache.
+ *
+ * All functions are thread-safe.
+ */
+struct MrCacheEntry;
+
+struct MrCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+    uint64_t failures;          /* registrations refused or over budget */
+    uint64_t pinned_bytes;
+    uint64_t num_entries;
+};
+
+struct MrCache {
+    struct ibv_pd           *pd;
+    int                     access;
+    size_t                  max_pinned;     /* bytes, 0 for no limit */
+
+    pthread_mutex_t         lock;
+    struct MrCacheEntry     *root;          /* interval tree */
+    struct MrCacheEntry     *lru_head;      /* least recently released */
+    struct MrCacheEntry     *lru_tail;
+    struct MrCacheEntry     *zombies;       /* invalidated while in use */
+    uint32_t                seed;           /* treap priorities */
+    struct MrCacheStats     stats;
+
+    struct MrCache          *next;          /* live caches, for the hooks */
+};
+
+struct MrCache *mr_cache_create(struct ibv_pd *pd, int access,
+                                size_t max_pinned);
+void mr_cache_destroy(struct MrCache *cache);
+
+struct ibv_mr *mr_cache_get(struct MrCache *cache, const void *addr,
+                            size_t len);
+void mr_cache_put(struct MrCache *cache, struct ibv_mr *mr);
+
+void mr_cache_invalidate(struct MrCache *cache, const void *addr, size_t len);
+void mr_cache_stats(struct MrCache *cache, struct MrCacheStats *stats);
+
+/* invalidate the range in every cache, then release it */
+int  mr_cache_munmap(void *addr, size_t len);
+void mr_cache_free(void *ptr);
+
+#endif /* __MR_CACHE_H__ */
@@ -0,0 +1,197 @@
+/*
+ * rdma-mrcache-bench: registration cache against a registration per message
+ *
+ * Registers a working set of heap buffers the way an application sending
+ * from arbitrary memory would: once with ibv_reg_mr()/ibv_dereg_mr() around
+ * every message, then through mr_cache_get()/mr_cache_put(), cold and then
+ * hot. With a pinned-bytes budget below the working set the cache evicts,
+ * which shows what a miss costs on top of the registration itself.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <infiniband/verbs.h>
+
+#include "debug.h"
+#include "tsc.h"
+#include "mr_cache.h"
+
+FILE *log_fp = NULL;
+
+#define MR_ACCESS (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | \
+                   IBV_ACCESS_REMOTE_WRITE)
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-d ib_dev] [-s msg_size] [-b buffers] [-n ops] "
+           "[-B budget_mb]\n", prog);
+    printf("  defaults: first device, 4096 bytes, 64 buffers, 100000 ops, "
+           "no budget\n");
+}
+
+static struct ibv_context *__open_device(const char *name) {
+    int i = 0, num = 0;
+    struct ibv_device **list = NULL;
+    struct ibv_context *ctx = NULL;
+
+    list = ibv_get_device_list(&num);
+    check(list != NULL && num > 0, "No IB devices found");
+
+    for (i = 0; i < num; i++)
+        if (name == NULL || !strcmp(ibv_get_device_name(list[i]), name))
+            break;
+    check(i < num, "IB device %s not found", name);
+
+    ctx = ibv_open_device(list[i]);
+    check(ctx != NULL, "Failed to open %s", ibv_get_device_name(list[i]));
+
+error:
+    if (list != NULL)
+        ibv_free_device_list(list);
+    return ctx;
+}
+
+static void __report(const char *mode, long ops, uint64_t cycles,
+                     double base_ns) {
+    double ns = (double)tsc_to_ns(cycles) / ops;
+
+    printf("%-22s %10ld %12.1f %10.1fx\n", mode, ops, ns,
+           base_ns > 0 ? base_ns / ns : 1.0);
+}
+
+static int __run_cache(struct MrCache *cache, char **bufs, int num_bufs,
+                       int size, long ops, uint64_t *cycles) {
+    long i = 0;
+    uint64_t start = 0;
+    struct ibv_mr *mr = NULL;
+
+    start = rdtsc();
+    for (i = 0; i < ops; i++) {
+        mr = mr_cache_get(cache, bufs[i % num_bufs], size);
+        check(mr != NULL, "Failed to get an mr for buffer %ld", i % num_bufs);
+        mr_cache_put(cache, mr);
+    }
+    *cycles = rdtsc() - start;
+
+    return 0;
+error:
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    int opt = 0, size = 4096, num_bufs = 64, i = 0;
+    long ops = 100000, budget_mb = 0, reg_ops = 0;
+    char *dev = NULL;
+    char **bufs = NULL;
+    uint64_t start = 0, cycles = 0;
+    double reg_ns = 0.0;
+    struct ibv_context *ctx = NULL;
+    struct ibv_pd *pd = NULL;
+    struct ibv_mr *mr = NULL;
+    struct MrCache *cache = NULL;
+    struct MrCacheStats stats;
+
+    log_fp = stdout;
+
+    while ((opt = getopt(argc, argv, "d:s:b:n:B:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            dev = optarg;
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'b':
+            num_bufs = atoi(optarg);
+            break;
+        case 'n':
+            ops = atol(optarg);
+            break;
+        case 'B':
+            budget_mb = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 0;
+        }
+    }
+    check(size > 0 && num_bufs > 0 && ops > 0 && budget_mb >= 0,
+          "sizes and counts must be positive");
+
+    check(tsc_init() == 0, "Failed to calibrate TSC");
+
+    ctx = __open_device(dev);
+    check(ctx != NULL, "Failed to open device");
+    pd = ibv_alloc_pd(ctx);
+    check(pd != NULL, "Failed to allocate pd");
+
+    /* separate allocations, as an application would hand them over */
+    bufs = (char **)calloc(num_bufs, sizeof(char *));
+    check(bufs != NULL, "Failed to allocate buffers");
+    for (i = 0; i < num_bufs; i++) {
+        bufs[i] = (char *)malloc(size);
+        check(bufs[i] != NULL, "Failed to allocate buffer %d", i);
+        memset(bufs[i], 0, size);
+    }
+
+    printf("%s: %d buffers of %d bytes, %ld ops, budget %ld MB\n\n",
+           ibv_get_device_name(ctx->device), num_bufs, size, ops, budget_mb);
+    printf("%-22s %10s %12s %11s\n", "mode", "ops", "ns/op", "speedup");
+
+    /* registration is slow, a tenth of the ops is plenty */
+    reg_ops = ops / 10 > 0 ? ops / 10 : 1;
+    start = rdtsc();
+    for (i = 0; i < reg_ops; i++) {
+        mr = ibv_reg_mr(pd, bufs[i % num_bufs], size, MR_ACCESS);
+        check(mr != NULL, "Failed to register buffer %d", i % num_bufs);
+        ibv_dereg_mr(mr);
+    }
+    cycles = rdtsc() - start;
+    reg_ns = (double)tsc_to_ns(cycles) / reg_ops;
+    __report("reg_mr per message", reg_ops, cycles, 0.0);
+
+    cache = mr_cache_create(pd, MR_ACCESS, (size_t)budget_mb << 20);
+    check(cache != NULL, "Failed to create mr cache");
+
+    check(__run_cache(cache, bufs, num_bufs, size, ops, &cycles) == 0,
+          "Cold cache run failed");
+    __report("cache, cold", ops, cycles, reg_ns);
+
+    check(__run_cache(cache, bufs, num_bufs, size, ops, &cycles) == 0,
+          "Hot cache run failed");
+    __report("cache, hot", ops, cycles, reg_ns);
+
+    mr_cache_stats(cache, &stats);
+    printf("\nhits %"PRIu64", misses %"PRIu64" (%.2f%% hit), evictions %"PRIu64
+           ", pinned %"PRIu64" bytes in %"PRIu64" mr(s)\n", stats.hits,
+           stats.misses, 100.0 * stats.hits / (stats.hits + stats.misses),
+           stats.evictions, stats.pinned_bytes, stats.num_entries);
+
+    /* give the buffers back through the invalidation hook */
+    for (i = 0; i < num_bufs; i++)
+        mr_cache_free(bufs[i]);
+    free(bufs);
+    bufs = NULL;
+
+    mr_cache_stats(cache, &stats);
+    printf("after free: %"PRIu64" invalidations, %"PRIu64" mr(s) left\n",
+           stats.invalidations, stats.num_entries);
+
+    mr_cache_destroy(cache);
+    ibv_dealloc_pd(pd);
+    ibv_close_device(ctx);
+    return 0;
+
+error:
+    if (bufs != NULL) {
+        for (i = 0; i < num_bufs; i++)
+            free(bufs[i]);
+        free(bufs);
+    }
+    mr_cache_destroy(cache);
+    if (pd != NULL)
+        ibv_dealloc_pd(pd);
+    if (ctx != NULL)
+        ibv_close_device(ctx);
+    return -1;
+}
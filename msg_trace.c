@@ -0,0 +1,175 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "config.h"
+#include "tsc.h"
+#include "msg_trace.h"
+
+struct MsgTrace *msg_traces = NULL;
+static int num_msg_traces = 0;
+
+static int __trace_open(struct MsgTrace *t, const char *prefix, int thread_id,
+                        uint64_t capacity) {
+    char path[256];
+    size_t size = 0;
+    struct timespec now;
+
+    snprintf(path, sizeof(path), "%s.%s.%d", prefix,
+             config_info.is_server ? "server" : "client", thread_id);
+    size = sizeof(struct MsgTraceHeader) +
+        capacity * sizeof(struct MsgTraceRecord);
+
+    t->fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    check(t->fd >= 0, "Failed to create trace file %s", path);
+
+    /* allocate the blocks now, a hole would fault in the data path */
+    check(posix_fallocate(t->fd, 0, size) == 0,
+          "Failed to allocate %zu bytes for %s", size, path);
+
+    t->hdr = (struct MsgTraceHeader *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, t->fd, 0);
+    check(t->hdr != MAP_FAILED, "Failed to map trace file %s", path);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    t->records  = (struct MsgTraceRecord *)(t->hdr + 1);
+    t->mask     = capacity - 1;
+    t->head     = 0;
+    t->map_size = size;
+
+    t->hdr->version          = MSG_TRACE_VERSION;
+    t->hdr->header_size      = sizeof(struct MsgTraceHeader);
+    t->hdr->record_size      = sizeof(struct MsgTraceRecord);
+    t->hdr->capacity         = capacity;
+    t->hdr->head             = 0;
+    t->hdr->ns_per_cycle     = tsc_ns_per_cycle;
+    t->hdr->pid              = getpid();
+    t->hdr->thread_id        = thread_id;
+    t->hdr->is_server        = config_info.is_server;
+    t->hdr->num_concurr_msgs = config_info.num_concurr_msgs;
+    t->hdr->start_time_ns    = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    __atomic_store_n(&t->hdr->magic, MSG_TRACE_MAGIC, __ATOMIC_RELEASE);
+
+    log("trace file[%d]     = %s, %"PRIu64" records", thread_id, path,
+        capacity);
+    return 0;
+
+error:
+    t->hdr = NULL;
+    return -1;
+}
+
+static void __trace_close(struct MsgTrace *t) {
+    uint64_t used = t->head < t->mask + 1 ? t->head : t->mask + 1;
+
+    if (t->hdr != NULL)
+        munmap(t->hdr, t->map_size);
+
+    /* drop the part of the ring that was never written */
+    if (t->fd >= 0) {
+        if (ftruncate(t->fd, sizeof(struct MsgTraceHeader) +
+                      used * sizeof(struct MsgTraceRecord)) != 0)
+            log("Failed to truncate trace file: %s", strerror(errno));
+        close(t->fd);
+    }
+
+    t->hdr = NULL;
+    t->fd  = -1;
+}
+
+int msg_trace_init(int num_threads, const char *prefix, uint64_t capacity) {
+    int i = 0;
+    uint64_t ring = 1;
+
+    if (prefix == NULL)
+        return 0;
+
+    check(capacity > 0, "trace records must be positive");
+    while (ring < capacity)
+        ring <<= 1;
+
+    msg_traces = (struct MsgTrace *)memalign(CACHE_LINE_SIZE,
+        num_threads * sizeof(struct MsgTrace));
+    check(msg_traces != NULL, "Failed to allocate traces");
+
+    memset(msg_traces, 0, num_threads * sizeof(struct MsgTrace));
+    for (i = 0; i < num_threads; i++)
+        msg_traces[i].fd = -1;
+    num_msg_traces = num_threads;
+
+    for (i = 0; i < num_threads; i++)
+        check(__trace_open(&msg_traces[i], prefix, i, ring) == 0,
+              "Failed to open trace for thread %d", i);
+
+    return 0;
+error:
+    msg_trace_destroy();
+    return -1;
+}
+
+void msg_trace_destroy() {
+    int i = 0;
+
+    if (msg_traces == NULL)
+        return;
+
+    for (i = 0; i < num_msg_traces; i++)
+        __trace_close(&msg_traces[i]);
+
+    free(msg_traces);
+    msg_traces = NULL;
+    num_msg_traces = 0;
+}
+
+struct MsgTraceHeader *msg_trace_map(const char *path, size_t *size) {
+    int fd = -1;
+    struct stat st;
+    struct MsgTraceHeader *hdr = MAP_FAILED;
+    uint64_t count = 0;
+
+    fd = open(path, O_RDONLY);
+    check(fd >= 0, "Failed to open trace file %s", path);
+
+    check(fstat(fd, &st) == 0, "Failed to stat trace file %s", path);
+    check(st.st_size >= (off_t)sizeof(struct MsgTraceHeader),
+          "%s is too small for a trace file", path);
+
+    hdr = (struct MsgTraceHeader *)mmap(NULL, st.st_size, PROT_READ,
+                                        MAP_SHARED, fd, 0);
+    check(hdr != MAP_FAILED, "Failed to map trace file %s", path);
+    close(fd);
+    fd = -1;
+
+    check(hdr->magic == MSG_TRACE_MAGIC, "%s is not a trace file", path);
+    check(hdr->version == MSG_TRACE_VERSION,
+          "%s has version %u, expected %u", path, hdr->version,
+          MSG_TRACE_VERSION);
+
+    count = hdr->head < hdr->capacity ? hdr->head : hdr->capacity;
+    check(hdr->record_size >= sizeof(struct MsgTraceRecord) &&
+          hdr->header_size + count * hdr->record_size <= (uint64_t)st.st_size,
+          "%s has an inconsistent layout", path);
+
+    *size = st.st_size;
+    return hdr;
+
+error:
+    if (fd >= 0)
+        close(fd);
+    if (hdr != MAP_FAILED)
+        munmap(hdr, st.st_size);
+    return NULL;
+}
+
+void msg_trace_unmap(struct MsgTraceHeader *hdr, size_t size) {
+    if (hdr != NULL)
+        munmap(hdr, size);
+}
@@ -0,0 +1,112 @@
+#ifndef __MSG_TRACE_H__
+#define __MSG_TRACE_H__
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "stats.h"
+
+/*
+ * Per-message event trace
+ *
+ * With --trace=PREFIX every worker appends one fixed-size record per
+ * message to its own file, PREFIX.<client|server>.<thread>. The file is
+ * preallocated, mapped and prefaulted before the workers start, so that
+ * recording a message is a few stores into the mapping: no syscall, no
+ * page fault, no lock. The file is a ring; once full, the oldest records
+ * are overwritten and head keeps counting.
+ *
+ * Layout: one MsgTraceHeader, followed by capacity MsgTraceRecords.
+ * rdma-trace decodes the files into CSV or per-interval percentiles.
+ *
+ *   client, MSG_TRACE_REQUEST: post_tsc is the request being posted,
+ *       comp_tsc its echo being polled; wr_id is the request's sequence
+ *       number, which the client also posts it with.
+ *   server, MSG_TRACE_ECHO: comp_tsc is the request being polled,
+ *       post_tsc its echo being posted; wr_id is the receive's wr_id.
+ */
+#define MSG_TRACE_MAGIC     0x43525444  /* "DTRC" */
+#define MSG_TRACE_VERSION   1
+#define MSG_TRACE_RECORDS   (1 << 20)   /* default ring size, per thread */
+
+enum MsgTraceOp {
+    MSG_TRACE_REQUEST = 1,
+    MSG_TRACE_ECHO,
+};
+
+enum MsgTraceFlags {
+    MSG_TRACE_WARMUP = 1 << 0,  /* before the warm-up mark */
+};
+
+struct MsgTraceHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint64_t capacity;          /* records, a power of two */
+    uint64_t head;              /* records written, wraps over capacity */
+    double   ns_per_cycle;      /* TSC calibration of the writer */
+    int32_t  pid;
+    int32_t  thread_id;
+    int32_t  is_server;
+    int32_t  num_concurr_msgs;
+    uint64_t start_time_ns;     /* CLOCK_REALTIME */
+}__attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct MsgTraceRecord {
+    uint64_t post_tsc;
+    uint64_t comp_tsc;
+    uint64_t wr_id;
+    uint32_t qp_num;
+    uint32_t size;
+    uint16_t thread_id;
+    uint8_t  op;                /* enum MsgTraceOp */
+    uint8_t  flags;             /* enum MsgTraceFlags */
+    uint32_t reserved;
+};
+
+struct MsgTrace {
+    struct MsgTraceHeader *hdr;
+    struct MsgTraceRecord *records;
+    uint64_t mask;
+    uint64_t head;
+    size_t   map_size;
+    int      fd;
+}__attribute__((aligned(CACHE_LINE_SIZE)));
+
+extern struct MsgTrace *msg_traces;
+
+int  msg_trace_init(int num_threads, const char *prefix, uint64_t capacity);
+void msg_trace_destroy();
+
+struct MsgTraceHeader *msg_trace_map(const char *path, size_t *size);
+void msg_trace_unmap(struct MsgTraceHeader *hdr, size_t size);
+
+static inline struct MsgTrace *msg_trace_thread(int thread_id) {
+    return msg_traces != NULL ? &msg_traces[thread_id] : NULL;
+}
+
+static inline void msg_trace_record(struct MsgTrace *t, int op, int flags,
+                                    int thread_id, uint32_t qp_num,
+                                    uint64_t wr_id, uint32_t size,
+                                    uint64_t post_tsc, uint64_t comp_tsc) {
+    struct MsgTraceRecord *rec = NULL;
+
+    if (t == NULL)
+        return;
+
+    rec = &t->records[t->head & t->mask];
+    rec->post_tsc  = post_tsc;
+    rec->comp_tsc  = comp_tsc;
+    rec->wr_id     = wr_id;
+    rec->qp_num    = qp_num;
+    rec->size      = size;
+    rec->thread_id = (uint16_t)thread_id;
+    rec->op        = (uint8_t)op;
+    rec->flags     = (uint8_t)flags;
+
+    /* a live reader sees whole records up to head */
+    __atomic_store_n(&t->hdr->head, ++t->head, __ATOMIC_RELEASE);
+}
+
+#endif /* __MSG_TRACE_H__ */
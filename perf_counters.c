@@ -0,0 +1,123 @@
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "debug.h"
+#include "perf_counters.h"
+
+const char *perf_counter_names[PERF_NUM_COUNTERS] = {
+    "cycles",
+    "instructions",
+    "llc_misses",
+    "branch_misses",
+};
+
+static const uint64_t perf_counter_configs[PERF_NUM_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+struct PerfReadFormat {
+    uint64_t value;
+    uint64_t time_enabled;
+    uint64_t time_running;
+};
+
+static int __perf_event_open(uint64_t config, bool exclude_kernel) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(struct perf_event_attr));
+    attr.size           = sizeof(struct perf_event_attr);
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.config         = config;
+    attr.disabled       = 1;
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_hv     = 1;
+    attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                          PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    /* this thread, any CPU */
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void perf_counters_init(struct PerfCounters *pc) {
+    int i = 0;
+
+    for (i = 0; i < PERF_NUM_COUNTERS; i++) {
+        pc->fd[i]    = -1;
+        pc->value[i] = 0;
+    }
+    pc->valid = 0;
+    pc->exclude_kernel = 0;
+}
+
+static int __open_all(struct PerfCounters *pc) {
+    int i = 0, num_open = 0;
+
+    for (i = 0; i < PERF_NUM_COUNTERS; i++) {
+        pc->fd[i] = __perf_event_open(perf_counter_configs[i],
+                                      pc->exclude_kernel);
+        if (pc->fd[i] >= 0)
+            num_open++;
+    }
+
+    return num_open;
+}
+
+/* open and enable the counters for the calling thread */
+int perf_counters_start(struct PerfCounters *pc) {
+    int i = 0, num_open = 0;
+
+    perf_counters_init(pc);
+
+    num_open = __open_all(pc);
+    if (num_open == 0 && (errno == EACCES || errno == EPERM)) {
+        /* perf_event_paranoid >= 2 allows user space only */
+        pc->exclude_kernel = 1;
+        num_open = __open_all(pc);
+    }
+    check(num_open > 0, "No hardware counter available");
+
+    for (i = 0; i < PERF_NUM_COUNTERS; i++) {
+        if (pc->fd[i] < 0)
+            continue;
+        ioctl(pc->fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    return 0;
+error:
+    errno = 0;
+    return -1;
+}
+
+/* disable, read and close the counters */
+void perf_counters_stop(struct PerfCounters *pc) {
+    int i = 0;
+    struct PerfReadFormat rf;
+
+    for (i = 0; i < PERF_NUM_COUNTERS; i++)
+        if (pc->fd[i] >= 0)
+            ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+
+    for (i = 0; i < PERF_NUM_COUNTERS; i++) {
+        if (pc->fd[i] < 0)
+            continue;
+
+        if (read(pc->fd[i], &rf, sizeof(rf)) == sizeof(rf) &&
+            rf.time_running > 0) {
+            /* scale up when the counter was multiplexed */
+            pc->value[i] = rf.time_running < rf.time_enabled ?
+                (uint64_t)((double)rf.value * rf.time_enabled /
+                           rf.time_running) : rf.value;
+            pc->valid |= 1u << i;
+        }
+
+        close(pc->fd[i]);
+        pc->fd[i] = -1;
+    }
+}
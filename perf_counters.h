@@ -0,0 +1,36 @@
+#ifndef __PERF_COUNTERS_H__
+#define __PERF_COUNTERS_H__
+
+#include <inttypes.h>
+
+/*
+ * Hardware performance counters of one worker thread
+ *
+ * The counters follow the calling thread on any CPU. They are opened and
+ * enabled at the warm-up mark and disabled at STOP, so they cover the
+ * measured window only, and cost no syscall in between. Counters the CPU
+ * or the hypervisor doesn't expose are simply left out; counts are scaled
+ * when the kernel had to multiplex them.
+ */
+enum PerfCounterId {
+    PERF_CYCLES = 0,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_NUM_COUNTERS,
+};
+
+struct PerfCounters {
+    int         fd[PERF_NUM_COUNTERS];
+    uint64_t    value[PERF_NUM_COUNTERS];   /* counts of the window */
+    uint32_t    valid;                      /* bit i: value[i] was read */
+    int         exclude_kernel;             /* user space only */
+};
+
+extern const char *perf_counter_names[PERF_NUM_COUNTERS];
+
+void perf_counters_init(struct PerfCounters *pc);
+int  perf_counters_start(struct PerfCounters *pc);
+void perf_counters_stop(struct PerfCounters *pc);
+
+#endif /* __PERF_COUNTERS_H__ */
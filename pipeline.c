@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <malloc.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "pipeline.h"
+
+static void *__worker(void *arg) {
+    struct PipeWorker *w = (struct PipeWorker *)arg;
+    struct PipeJob job;
+    cpu_set_t cpuset;
+
+    CPU_ZERO(&cpuset);
+    CPU_SET(w->cpu, &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset))
+        log("pipeline worker: failed to set affinity to cpu %d", w->cpu);
+
+    while (__atomic_load_n(&w->stop, __ATOMIC_RELAXED) == false) {
+        if (spsc_pop(&w->in, &job) == false)
+            continue;
+
+        job.ret = rpc_handle(job.rpc, &job.msg, &job.resp);
+        w->jobs++;
+
+        /* the poller drains the out ring whenever it is stuck */
+        while (spsc_push(&w->out, &job) == false)
+            if (__atomic_load_n(&w->stop, __ATOMIC_RELAXED))
+                return NULL;
+    }
+
+    return NULL;
+}
+
+int pipeline_init(struct Pipeline *p, int num_workers, int first_cpu) {
+    int i = 0, ret = 0;
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    struct PipeWorker *w = NULL;
+
+    memset(p, 0, sizeof(struct Pipeline));
+    check(num_workers > 0, "Pipeline of %d workers", num_workers);
+
+    p->workers = (struct PipeWorker *)memalign(64, num_workers *
+                                               sizeof(struct PipeWorker));
+    check(p->workers != NULL, "Failed to allocate pipeline workers");
+    memset(p->workers, 0, num_workers * sizeof(struct PipeWorker));
+    p->num_workers = num_workers;
+
+    for (i = 0; i < num_workers; i++) {
+        w      = &p->workers[i];
+        w->cpu = (int)((first_cpu + i) % num_cpus);
+
+        ret = spsc_init(&w->in, PIPE_RING_SIZE, sizeof(struct PipeJob));
+        check(ret == 0, "Failed to init worker %d's ring", i);
+        ret = spsc_init(&w->out, PIPE_RING_SIZE, sizeof(struct PipeJob));
+        check(ret == 0, "Failed to init worker %d's ring", i);
+
+        ret = pthread_create(&w->thread, NULL, __worker, w);
+        check(ret == 0, "Failed to start pipeline worker %d", i);
+        w->started = true;
+    }
+
+    return 0;
+error:
+    pipeline_destroy(p);
+    return -1;
+}
+
+void pipeline_destroy(struct Pipeline *p) {
+    int i = 0;
+
+    if (p->workers == NULL)
+        return;
+
+    for (i = 0; i < p->num_workers; i++)
+        __atomic_store_n(&p->workers[i].stop, true, __ATOMIC_RELAXED);
+    for (i = 0; i < p->num_workers; i++) {
+        if (p->workers[i].started)
+            pthread_join(p->workers[i].thread, NULL);
+        spsc_destroy(&p->workers[i].in);
+        spsc_destroy(&p->workers[i].out);
+    }
+
+    free(p->workers);
+    memset(p, 0, sizeof(struct Pipeline));
+}
+
+bool pipeline_submit(struct Pipeline *p, struct PipeJob *job) {
+    int i = 0, k = 0;
+
+    for (i = 0; i < p->num_workers; i++) {
+        k = (p->next + i) % p->num_workers;
+        if (spsc_push(&p->workers[k].in, job)) {
+            p->next = (k + 1) % p->num_workers;
+            p->in_flight++;
+            return true;
+        }
+    }
+
+    p->full_waits++;
+    return false;
+}
+
+bool pipeline_poll(struct Pipeline *p, struct PipeJob *job) {
+    int i = 0, k = 0;
+
+    if (p->in_flight == 0)
+        return false;
+
+    for (i = 0; i < p->num_workers; i++) {
+        k = (p->next_out + i) % p->num_workers;
+        if (spsc_pop(&p->workers[k].out, job)) {
+            p->next_out = (k + 1) % p->num_workers;
+            p->in_flight--;
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,64 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "spsc.h"
+#include "rndv.h"
+#include "rpc.h"
+
+/*
+ * Dispatcher/worker pipeline
+ *
+ * With --pipeline=N a server thread only polls its CQ: it hands every
+ * delivered message to one of N handler workers over an SPSC ring, takes
+ * the built responses back over a second ring per worker, and posts them
+ * and the receives itself. The QP, its CQ and the rndv state stay with the
+ * polling thread, so the workers never touch verbs; they run rpc_handle()
+ * and nothing else. Messages go to the workers round robin, skipping the
+ * ones whose ring is full.
+ *
+ * Without it the polling thread runs every handler itself, to completion.
+ */
+#define PIPE_RING_SIZE      256     /* jobs per ring, a power of two */
+
+/* a message on its way through the pipeline, and in run to completion */
+struct PipeJob {
+    struct RpcConn  *rpc;           /* of the peer which sent msg */
+    struct RndvMsg  msg;
+    struct RpcResp  resp;
+    uint64_t        recv_tsc;
+    bool            warmup;
+    int             ret;            /* of rpc_handle() */
+};
+
+struct PipeWorker {
+    struct SpscRing in;             /* jobs to handle */
+    struct SpscRing out;            /* jobs with their response */
+    pthread_t       thread;
+    bool            started;
+    bool            stop;
+    int             cpu;
+    uint64_t        jobs;           /* handled */
+}__attribute__((aligned(64)));
+
+struct Pipeline {
+    struct PipeWorker   *workers;
+    int                 num_workers;
+    int                 next;           /* round robin */
+    int                 next_out;
+    uint64_t            in_flight;
+    uint64_t            full_waits;     /* every ring was full */
+};
+
+int  pipeline_init(struct Pipeline *p, int num_workers, int first_cpu);
+void pipeline_destroy(struct Pipeline *p);
+
+/* hand a job to a worker, false while all of their rings are full */
+bool pipeline_submit(struct Pipeline *p, struct PipeJob *job);
+/* a handled job, false if none is back yet */
+bool pipeline_poll(struct Pipeline *p, struct PipeJob *job);
+
+#endif /* __PIPELINE_H__ */
@@ -0,0 +1,34 @@
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+/*
+ * USDT probes
+ *
+ * PROBE(name, args...) marks an application-level event for bpftrace,
+ * perf or SystemTap under the provider "rdma_tutorial". A probe compiles
+ * to a single NOP and a note in .note.stapsdt describing where its
+ * arguments live; nothing else runs until a tracer attaches. Arguments
+ * should be values the code already has at hand.
+ *
+ * Without <sys/sdt.h> (systemtap-sdt-dev / systemtap-sdt-devel), or with
+ * make USDT=0, the probes compile to nothing.
+ *
+ *   readelf -n rdma-tutorial     # list the probes
+ *   see tracing/usdt_*.bt
+ */
+#if !defined(NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_USDT 1
+#endif
+#endif
+
+#ifdef HAVE_USDT
+#define PROBE(name, ...) STAP_PROBEV(rdma_tutorial, name, ##__VA_ARGS__)
+#else
+/* arguments stay "used", the call is optimized away */
+static inline void __probe_nop(int unused, ...) {}
+#define PROBE(name, ...) __probe_nop(0, ##__VA_ARGS__)
+#endif
+
+#endif /* __PROBES_H__ */
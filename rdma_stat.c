@@ -0,0 +1,213 @@
+/*
+ * rdma-stat: live view of a running rdma-tutorial
+ *
+ * Attaches read-only to the /dev/shm segment published with --shm-stats and
+ * prints per-thread rates, latency percentiles and queue occupancy every
+ * interval. The workers are never stopped or signalled; a snapshot is
+ * retried while a worker is in the middle of updating its counters.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <time.h>
+#include <malloc.h>
+
+#include "debug.h"
+#include "stats.h"
+#include "shm_stats.h"
+
+FILE *log_fp = NULL;
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-i interval_ms] [-n count] [pid]\n", prog);
+    printf("  without pid, attach to the only running rdma-tutorial\n");
+}
+
+/* return the pid of the only stats segment in /dev/shm, list them otherwise */
+static pid_t __find_segment() {
+    DIR *dir = NULL;
+    struct dirent *ent = NULL;
+    pid_t pid = 0;
+    int found = 0;
+    size_t prefix_len = strlen(SHM_STATS_PREFIX);
+
+    dir = opendir("/dev/shm");
+    check(dir != NULL, "Failed to open /dev/shm");
+
+    while ((ent = readdir(dir)) != NULL) {
+        if (strncmp(ent->d_name, SHM_STATS_PREFIX, prefix_len) != 0)
+            continue;
+
+        pid = (pid_t)atoi(ent->d_name + prefix_len);
+        if (found++ > 0)
+            printf("%s/dev/shm/%s\n", found == 2 ? "multiple segments, "
+                   "pick a pid:\n" : "", ent->d_name);
+    }
+    closedir(dir);
+
+    check(found > 0, "No rdma-tutorial stats segment in /dev/shm, "
+          "run it with --shm-stats");
+    return found == 1 ? pid : -1;
+
+error:
+    return -1;
+}
+
+static double __now_sec() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/*
+ * Rates are taken over the time since a thread's last snapshot which
+ * worked, taken[i], so a busy interval does not double the next one; a
+ * thread without any yet only gets its baseline.
+ */
+static void __print_interval(struct ShmStatsHeader *hdr,
+                             struct ThreadStats *prev,
+                             struct ThreadStats *cur, double *taken) {
+    int i = 0, j = 0;
+    uint64_t polls = 0;
+    double now = 0, interval = 0;
+    struct ThreadStats *delta = NULL;
+
+    delta = (struct ThreadStats *)memalign(CACHE_LINE_SIZE,
+                                           sizeof(struct ThreadStats));
+    if (delta == NULL)
+        return;
+
+    printf("%-6s %10s %10s %7s %6s %10s %10s %10s %6s %6s %6s\n",
+           "thread", "Mops/s", "Gb/s", "empty%", "queue",
+           "p50(ns)", "p99(ns)", "p99.9(ns)", "fail", "rnr", "retry");
+
+    for (i = 0; i < hdr->num_threads; i++) {
+        if (stats_snapshot(shm_stats_thread(hdr, i), &cur[i]) != 0) {
+            printf("%-6d %10s\n", i, "busy");
+            continue;
+        }
+
+        now = __now_sec();
+        if (taken[i] == 0) {
+            printf("%-6d %10s\n", i, "-");
+            prev[i]  = cur[i];
+            taken[i] = now;
+            continue;
+        }
+        interval = now - taken[i];
+
+        for (j = 0; j < STATS_LAT_BUCKETS; j++)
+            delta->lat_hist[j] = cur[i].lat_hist[j] - prev[i].lat_hist[j];
+
+        polls = cur[i].cq_polls - prev[i].cq_polls;
+        printf("%-6d %10.3f %10.3f %7.1f %6"PRIu64" %10"PRIu64" %10"PRIu64
+               " %10"PRIu64" %6"PRIu64" %6"PRIu64" %6"PRIu64"\n", i,
+               (double)(cur[i].ops - prev[i].ops) / interval / 1e6,
+               (double)(cur[i].bytes - prev[i].bytes) * 8 / interval / 1e9,
+               polls ? 100.0 * (cur[i].empty_polls - prev[i].empty_polls) /
+               polls : 0.0,
+               cur[i].outstanding,
+               stats_lat_percentile(delta->lat_hist, 50),
+               stats_lat_percentile(delta->lat_hist, 99),
+               stats_lat_percentile(delta->lat_hist, 99.9),
+               cur[i].post_failures, cur[i].rnr_errors, cur[i].retry_errors);
+
+        prev[i]  = cur[i];
+        taken[i] = now;
+    }
+    printf("\n");
+
+    free(delta);
+}
+
+int main(int argc, char *argv[]) {
+    int opt = 0, interval_ms = 1000, count = -1, i = 0;
+    pid_t pid = 0;
+    size_t size = 0;
+    struct ShmStatsHeader *hdr = NULL;
+    struct ThreadStats *prev = NULL, *cur = NULL;
+    double *taken = NULL;
+    struct timespec delay;
+
+    log_fp = stdout;
+
+    while ((opt = getopt(argc, argv, "i:n:h")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval_ms = atoi(optarg);
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 0;
+        }
+    }
+
+    if (optind < argc)
+        pid = (pid_t)atoi(argv[optind]);
+    else
+        pid = __find_segment();
+    check(pid > 0, "No process to attach to");
+    check(interval_ms > 0, "interval must be positive");
+
+    hdr = shm_stats_attach(pid, &size);
+    check(hdr != NULL, "Failed to attach to pid %d", (int)pid);
+
+    printf("rdma-tutorial pid %d: %s, %d thread(s), msg_size %d, "
+           "num_concurr_msgs %d\n\n", (int)pid,
+           hdr->is_server ? "server" : "client", hdr->num_threads,
+           hdr->msg_size, hdr->num_concurr_msgs);
+
+    prev = (struct ThreadStats *)memalign(CACHE_LINE_SIZE,
+        hdr->num_threads * sizeof(struct ThreadStats));
+    cur = (struct ThreadStats *)memalign(CACHE_LINE_SIZE,
+        hdr->num_threads * sizeof(struct ThreadStats));
+    taken = (double *)calloc(hdr->num_threads, sizeof(double));
+    check(prev != NULL && cur != NULL && taken != NULL,
+          "Failed to allocate snapshots");
+
+    memset(prev, 0, hdr->num_threads * sizeof(struct ThreadStats));
+    for (i = 0; i < hdr->num_threads; i++)
+        if (stats_snapshot(shm_stats_thread(hdr, i), &prev[i]) == 0)
+            taken[i] = __now_sec();
+
+    delay.tv_sec  = interval_ms / 1000;
+    delay.tv_nsec = (long)(interval_ms % 1000) * 1000000;
+
+    while (count != 0) {
+        nanosleep(&delay, NULL);
+
+        if (__atomic_load_n(&hdr->state, __ATOMIC_ACQUIRE) != SHM_STATS_RUNNING ||
+            kill(pid, 0) != 0) {
+            printf("pid %d finished\n", (int)pid);
+            break;
+        }
+
+        __print_interval(hdr, prev, cur, taken);
+        if (count > 0)
+            count--;
+    }
+
+    free(prev);
+    free(cur);
+    free(taken);
+    shm_stats_detach(hdr, size);
+    return 0;
+
+error:
+    if (prev != NULL)
+        free(prev);
+    if (cur != NULL)
+        free(cur);
+    if (taken != NULL)
+        free(taken);
+    shm_stats_detach(hdr, size);
+    return -1;
+}
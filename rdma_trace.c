@@ -0,0 +1,257 @@
+/*
+ * rdma-trace: decode the per-message trace files of rdma-tutorial
+ *
+ * Reads the files written with --trace=PREFIX and prints every record as
+ * CSV, oldest first, or with -i the latency percentiles of every interval,
+ * per operation: round trips for client requests, service times for
+ * server echoes. Files of several threads, or of client and server on one
+ * host, can be given together; times are relative to the earliest record.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <getopt.h>
+
+#include "debug.h"
+#include "msg_trace.h"
+
+FILE *log_fp = NULL;
+
+struct Sample {
+    uint64_t time_ns;       /* of the earlier timestamp, from the first record */
+    uint64_t lat_ns;
+    int      op;
+};
+
+struct TraceFile {
+    const char *path;
+    struct MsgTraceHeader *hdr;
+    size_t size;
+    uint64_t first;         /* index of the oldest record */
+    uint64_t count;
+};
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-i interval_ms] [-w] file...\n", prog);
+    printf("  print the records as CSV, or with -i per-interval latency\n"
+           "  percentiles; -w keeps the warm-up messages\n");
+}
+
+static const char *__op_name(int op) {
+    switch (op) {
+    case MSG_TRACE_REQUEST:
+        return "request";
+    case MSG_TRACE_ECHO:
+        return "echo";
+    default:
+        return "unknown";
+    }
+}
+
+static inline struct MsgTraceRecord *__record(struct TraceFile *f,
+                                              uint64_t i) {
+    uint64_t idx = (f->first + i) & (f->hdr->capacity - 1);
+
+    return (struct MsgTraceRecord *)((char *)f->hdr + f->hdr->header_size +
+                                     idx * f->hdr->record_size);
+}
+
+static inline uint64_t __start_tsc(struct MsgTraceRecord *rec) {
+    return rec->post_tsc < rec->comp_tsc ? rec->post_tsc : rec->comp_tsc;
+}
+
+static inline uint64_t __lat_cycles(struct MsgTraceRecord *rec) {
+    return rec->post_tsc < rec->comp_tsc ? rec->comp_tsc - rec->post_tsc :
+        rec->post_tsc - rec->comp_tsc;
+}
+
+static int __cmp_time(const void *a, const void *b) {
+    const struct Sample *x = a, *y = b;
+
+    if (x->op != y->op)
+        return x->op - y->op;
+    return x->time_ns < y->time_ns ? -1 : x->time_ns > y->time_ns;
+}
+
+static int __cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* nearest rank of a sorted array */
+static uint64_t __percentile(uint64_t *v, size_t n, double pct) {
+    size_t rank = (size_t)(pct / 100.0 * n + 0.999999);
+
+    return v[rank == 0 ? 0 : rank - 1];
+}
+
+static void __print_csv(struct TraceFile *files, int num_files, uint64_t t0,
+                        bool warmup) {
+    int i = 0;
+    uint64_t j = 0;
+    struct MsgTraceRecord *rec = NULL;
+    double ns_per_cycle = 0.0;
+
+    printf("pid,role,thread,qp_num,op,warmup,wr_id,size,post_tsc,comp_tsc,"
+           "time_ns,latency_ns\n");
+
+    for (i = 0; i < num_files; i++) {
+        ns_per_cycle = files[i].hdr->ns_per_cycle;
+        for (j = 0; j < files[i].count; j++) {
+            rec = __record(&files[i], j);
+            if (!warmup && (rec->flags & MSG_TRACE_WARMUP))
+                continue;
+
+            printf("%d,%s,%u,%u,%s,%d,%"PRIu64",%u,%"PRIu64",%"PRIu64
+                   ",%.0f,%.0f\n", files[i].hdr->pid,
+                   files[i].hdr->is_server ? "server" : "client",
+                   rec->thread_id, rec->qp_num, __op_name(rec->op),
+                   rec->flags & MSG_TRACE_WARMUP ? 1 : 0, rec->wr_id,
+                   rec->size, rec->post_tsc, rec->comp_tsc,
+                   (__start_tsc(rec) - t0) * ns_per_cycle,
+                   __lat_cycles(rec) * ns_per_cycle);
+        }
+    }
+}
+
+static int __print_intervals(struct TraceFile *files, int num_files,
+                             uint64_t t0, bool warmup, int interval_ms) {
+    int i = 0;
+    uint64_t j = 0, total = 0, n = 0, k = 0, end = 0;
+    uint64_t interval_ns = (uint64_t)interval_ms * 1000000;
+    struct MsgTraceRecord *rec = NULL;
+    struct Sample *samples = NULL;
+    uint64_t *lat = NULL;
+
+    for (i = 0; i < num_files; i++)
+        total += files[i].count;
+
+    samples = (struct Sample *)malloc((total + 1) * sizeof(struct Sample));
+    lat = (uint64_t *)malloc((total + 1) * sizeof(uint64_t));
+    check(samples != NULL && lat != NULL, "Failed to allocate %"PRIu64
+          " samples", total);
+
+    for (i = 0; i < num_files; i++) {
+        for (j = 0; j < files[i].count; j++) {
+            rec = __record(&files[i], j);
+            if (!warmup && (rec->flags & MSG_TRACE_WARMUP))
+                continue;
+
+            samples[n].time_ns = (uint64_t)((__start_tsc(rec) - t0) *
+                                            files[i].hdr->ns_per_cycle);
+            samples[n].lat_ns  = (uint64_t)(__lat_cycles(rec) *
+                                            files[i].hdr->ns_per_cycle);
+            samples[n].op      = rec->op;
+            n++;
+        }
+    }
+    qsort(samples, n, sizeof(struct Sample), __cmp_time);
+
+    printf("%-8s %10s %10s %10s %10s %10s %10s %10s\n", "op", "start(ms)",
+           "msgs", "Mops/s", "p50(ns)", "p99(ns)", "p99.9(ns)", "max(ns)");
+
+    for (j = 0; j < n; j = end) {
+        /* one interval of one op */
+        k = samples[j].time_ns / interval_ns;
+        for (end = j; end < n && samples[end].op == samples[j].op &&
+             samples[end].time_ns / interval_ns == k; end++)
+            lat[end - j] = samples[end].lat_ns;
+        qsort(lat, end - j, sizeof(uint64_t), __cmp_u64);
+
+        printf("%-8s %10"PRIu64" %10"PRIu64" %10.3f %10"PRIu64" %10"PRIu64
+               " %10"PRIu64" %10"PRIu64"\n", __op_name(samples[j].op),
+               k * interval_ms, end - j,
+               (double)(end - j) / (interval_ns / 1000.0),
+               __percentile(lat, end - j, 50.0),
+               __percentile(lat, end - j, 99.0),
+               __percentile(lat, end - j, 99.9), lat[end - j - 1]);
+    }
+
+    free(samples);
+    free(lat);
+    return 0;
+
+error:
+    if (samples != NULL)
+        free(samples);
+    if (lat != NULL)
+        free(lat);
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    int opt = 0, interval_ms = 0, num_files = 0, i = 0, ret = 0;
+    bool warmup = false;
+    uint64_t t0 = UINT64_MAX, j = 0, tsc = 0;
+    struct TraceFile *files = NULL;
+
+    log_fp = stdout;
+
+    while ((opt = getopt(argc, argv, "i:wh")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval_ms = atoi(optarg);
+            break;
+        case 'w':
+            warmup = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 0;
+        }
+    }
+
+    num_files = argc - optind;
+    if (num_files == 0) {
+        usage(argv[0]);
+        return 0;
+    }
+    check(interval_ms >= 0, "interval must not be negative");
+
+    files = (struct TraceFile *)calloc(num_files, sizeof(struct TraceFile));
+    check(files != NULL, "Failed to allocate files");
+
+    for (i = 0; i < num_files; i++) {
+        files[i].path = argv[optind + i];
+        files[i].hdr  = msg_trace_map(files[i].path, &files[i].size);
+        check(files[i].hdr != NULL, "Failed to read %s", files[i].path);
+
+        /* once the ring wrapped, the oldest record sits at head */
+        if (files[i].hdr->head > files[i].hdr->capacity) {
+            files[i].count = files[i].hdr->capacity;
+            files[i].first = files[i].hdr->head;
+            fprintf(stderr, "%s: ring wrapped, first %"PRIu64" of %"PRIu64
+                    " records lost\n", files[i].path,
+                    files[i].hdr->head - files[i].hdr->capacity,
+                    files[i].hdr->head);
+        } else {
+            files[i].count = files[i].hdr->head;
+            files[i].first = 0;
+        }
+
+        for (j = 0; j < files[i].count; j++) {
+            tsc = __start_tsc(__record(&files[i], j));
+            if (tsc < t0)
+                t0 = tsc;
+        }
+    }
+
+    if (interval_ms > 0)
+        ret = __print_intervals(files, num_files, t0, warmup, interval_ms);
+    else
+        __print_csv(files, num_files, t0, warmup);
+
+    for (i = 0; i < num_files; i++)
+        msg_trace_unmap(files[i].hdr, files[i].size);
+    free(files);
+    return ret;
+
+error:
+    if (files != NULL) {
+        for (i = 0; i < num_files; i++)
+            msg_trace_unmap(files[i].hdr, files[i].size);
+        free(files);
+    }
+    return -1;
+}
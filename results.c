@@ -0,0 +1,735 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <malloc.h>
+#include <sys/utsname.h>
+#include <sys/resource.h>
+
+#include "debug.h"
+#include "ib.h"
+#include "config.h"
+#include "workload.h"
+#include "handler.h"
+#include "setup_ib.h"
+#include "tsc.h"
+#include "results.h"
+
+#define MAX_RESULT_FIELDS 256
+
+struct ThreadResult *thread_results = NULL;
+int num_thread_results = 0;
+
+enum FieldType {
+    FIELD_INT = 0,
+    FIELD_DBL,
+    FIELD_STR,
+    FIELD_BOOL,
+};
+
+struct ResultField {
+    const char     *section;
+    const char     *key;
+    enum FieldType  type;
+    int64_t         i;
+    double          d;
+    char            s[128];
+};
+
+static struct ResultField fields[MAX_RESULT_FIELDS];
+static int num_fields = 0;
+
+/*
+ * CPU cost of the measured window, summed over threads. wall_cycles is the
+ * TSC span of the window, which busy-polling workers spend entirely on CPU.
+ */
+struct CpuCost {
+    uint64_t cpu_ns;        /* thread CPU time */
+    uint64_t wall_cycles;
+    uint64_t utime_us;
+    uint64_t stime_us;
+    uint64_t minflt;
+    uint64_t majflt;
+    uint64_t nvcsw;
+    uint64_t nivcsw;
+};
+
+static uint64_t __clock_ns(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t __monotonic_ns() {
+    return __clock_ns(CLOCK_MONOTONIC);
+}
+
+static uint64_t __timeval_us(struct timeval *tv) {
+    return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+int results_init(int num_threads) {
+    int i = 0;
+
+    thread_results = (struct ThreadResult *)memalign(CACHE_LINE_SIZE,
+        num_threads * sizeof(struct ThreadResult));
+    check(thread_results != NULL, "Failed to allocate thread results");
+
+    memset(thread_results, 0, num_threads * sizeof(struct ThreadResult));
+    num_thread_results = num_threads;
+
+    for (i = 0; i < num_threads; i++)
+        perf_counters_init(&thread_results[i].perf);
+
+    return 0;
+error:
+    return -1;
+}
+
+void results_destroy() {
+    if (thread_results != NULL)
+        free(thread_results);
+
+    thread_results = NULL;
+    num_thread_results = 0;
+}
+
+/*
+ * called by the owner of stats, no need to go through the seqlock. The
+ * counters are started last and stopped first, so that they don't count
+ * the marks themselves.
+ */
+void results_mark_start(int thread_id, struct ThreadStats *stats) {
+    struct ThreadResult *res = &thread_results[thread_id];
+
+    res->start        = *stats;
+    res->start_ns     = __monotonic_ns();
+    res->start_cpu_ns = __clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    getrusage(RUSAGE_THREAD, &res->start_ru);
+    res->start_tsc    = rdtsc();
+
+    if (config_info.perf_counters && perf_counters_start(&res->perf) != 0)
+        log("thread[%d]: hardware counters unavailable", thread_id);
+}
+
+void results_mark_end(int thread_id, struct ThreadStats *stats) {
+    int i = 0;
+    uint64_t ops = 0;
+    struct ThreadResult *res = &thread_results[thread_id];
+
+    if (config_info.perf_counters)
+        perf_counters_stop(&res->perf);
+
+    res->end_tsc    = rdtsc();
+    res->end        = *stats;
+    res->end_ns     = __monotonic_ns();
+    res->end_cpu_ns = __clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    getrusage(RUSAGE_THREAD, &res->end_ru);
+
+    ops = res->end.ops - res->start.ops;
+    for (i = 0; i < PERF_NUM_COUNTERS; i++)
+        if ((res->perf.valid & (1u << i)) && ops > 0)
+            log("thread[%d]: %s = %.1f per msg%s", thread_id,
+                perf_counter_names[i], (double)res->perf.value[i] / ops,
+                res->perf.exclude_kernel ? " (user space only)" : "");
+}
+
+static struct ResultField *__add_field(const char *section, const char *key,
+                                       enum FieldType type) {
+    struct ResultField *f = NULL;
+
+    if (num_fields == MAX_RESULT_FIELDS)
+        return NULL;
+
+    f = &fields[num_fields++];
+    memset(f, 0, sizeof(struct ResultField));
+    f->section = section;
+    f->key     = key;
+    f->type    = type;
+    return f;
+}
+
+static void __add_int(const char *section, const char *key, int64_t v) {
+    struct ResultField *f = __add_field(section, key, FIELD_INT);
+
+    if (f != NULL)
+        f->i = v;
+}
+
+static void __add_dbl(const char *section, const char *key, double v) {
+    struct ResultField *f = __add_field(section, key, FIELD_DBL);
+
+    if (f != NULL)
+        f->d = v;
+}
+
+static void __add_bool(const char *section, const char *key, bool v) {
+    struct ResultField *f = __add_field(section, key, FIELD_BOOL);
+
+    if (f != NULL)
+        f->i = v;
+}
+
+static void __add_str(const char *section, const char *key, const char *v) {
+    struct ResultField *f = __add_field(section, key, FIELD_STR);
+
+    if (f != NULL)
+        snprintf(f->s, sizeof(f->s), "%s", v ? v : "");
+}
+
+static void __cpu_model(char *buf, size_t len) {
+    FILE *fp = NULL;
+    char line[256];
+    char *p = NULL;
+
+    snprintf(buf, len, "unknown");
+
+    fp = fopen("/proc/cpuinfo", "r");
+    if (fp == NULL)
+        return;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "model name", 10) != 0)
+            continue;
+
+        p = strchr(line, ':');
+        if (p == NULL)
+            break;
+        for (p++; *p == ' ' || *p == '\t'; p++)
+            ;
+        p[strcspn(p, "\n")] = '\0';
+        snprintf(buf, len, "%s", p);
+        break;
+    }
+
+    fclose(fp);
+}
+
+static void __add_run_info(int num_unmeasured) {
+    char hostname[64] = {'\0'};
+    char timestamp[32] = {'\0'};
+    time_t now = time(NULL);
+    struct tm tm;
+
+    gethostname(hostname, sizeof(hostname) - 1);
+    gmtime_r(&now, &tm);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+    __add_int("run", "version", RESULTS_VERSION);
+    __add_str("run", "timestamp", timestamp);
+    __add_str("run", "hostname", hostname);
+    __add_str("run", "role", config_info.is_server ? "server" : "client");
+    __add_int("run", "unmeasured_threads", num_unmeasured);
+}
+
+static void __add_config() {
+    __add_bool("config", "is_server", config_info.is_server);
+    __add_int("config", "msg_size", config_info.msg_size);
+    __add_int("config", "num_concurr_msgs", config_info.num_concurr_msgs);
+    __add_str("config", "sock_port", config_info.sock_port);
+    __add_str("config", "server_name", config_info.server_name);
+    __add_str("config", "workload",
+              config_info.workload_spec ? config_info.workload_spec : "fixed");
+    __add_int("config", "workload_min_size", workload.min_size);
+    __add_int("config", "workload_max_size", workload.max_size);
+    __add_int("config", "num_threads", num_thread_results);
+    __add_int("config", "num_warmup_ops", config_info.num_warmup_ops);
+    __add_int("config", "tot_num_ops", config_info.tot_num_ops);
+    __add_int("config", "signal_interval", config_info.signal_interval);
+    __add_int("config", "inline_size", config_info.inline_size);
+    __add_int("config", "num_sge", config_info.num_sge);
+    __add_int("config", "stats_interval_ms", config_info.stats_interval_ms);
+    __add_bool("config", "shm_stats", config_info.shm_stats);
+    __add_bool("config", "perf_counters", config_info.perf_counters);
+    __add_bool("config", "fork_init", config_info.fork_init);
+    __add_int("config", "reg_chunk_mb", config_info.reg_chunk_mb);
+    __add_int("config", "reg_threads", config_info.reg_threads);
+    __add_int("config", "rndv_threshold", config_info.rndv_threshold);
+    __add_int("config", "rndv_pool", config_info.rndv_pool);
+    __add_bool("config", "credits", config_info.credits);
+    __add_str("config", "transport", config_info.ud ? "ud" : "rc");
+    if (config_info.is_server == false) {
+        __add_str("config", "rpc_method", config_info.rpc_name);
+        __add_dbl("config", "skew", config_info.skew);
+    } else {
+        __add_str("config", "handler", config_info.handler_spec ?
+                  config_info.handler_spec : HANDLER_DEFAULT);
+        __add_int("config", "service_ns", handler.service_ns);
+        __add_int("config", "pipeline", config_info.pipeline);
+        __add_bool("config", "steal", config_info.steal);
+        __add_int("config", "coalesce", config_info.coalesce);
+        __add_int("config", "coalesce_us", config_info.coalesce_us);
+    }
+}
+
+/* setup_ib() phases in ms; reg_mr overlaps the ones after it */
+static void __add_setup() {
+    int i = 0;
+
+    for (i = 0; i < SETUP_NUM_PHASES; i++)
+        __add_dbl("setup_ms", setup_phase_names[i], ib_res.setup_ns[i] / 1e6);
+    __add_dbl("setup_ms", "total", ib_res.setup_total_ns / 1e6);
+
+    __add_dbl("registration", "gbps", setup_reg_gbps());
+    __add_int("registration", "bytes", ib_res.ib_buf_size);
+    __add_int("registration", "num_mrs", ib_res.num_mrs);
+    __add_int("registration", "chunk_size", ib_res.mr_chunk_size);
+    __add_int("registration", "threads", ib_res.num_reg_threads);
+    __add_int("registration", "nic_numa_node", ib_res.nic_numa_node);
+}
+
+/* what the queues cost, RC against UD; -1 if RSS could not be read */
+static void __add_queues() {
+    struct AhCacheStats ah_stats;
+
+    __add_int("queues", "num_qps", ib_res.num_qps);
+    __add_int("queues", "peers", config_info.is_server ?
+              config_info.num_peers : ib_res.num_qps);
+    __add_int("queues", "rss_bytes", ib_res.queue_rss);
+    if (ib_res.ud_mtu == 0)
+        return;
+
+    ah_cache_stats(ib_res.ah_cache, &ah_stats);
+    __add_int("queues", "ud_mtu", ib_res.ud_mtu);
+    __add_int("queues", "num_ahs", ah_stats.num_entries);
+    __add_int("queues", "ah_hits", ah_stats.hits);
+}
+
+static void __add_device() {
+    const char *link_layer = "unspecified";
+
+    if (ib_res.port_attr.link_layer == IBV_LINK_LAYER_INFINIBAND)
+        link_layer = "infiniband";
+    else if (ib_res.port_attr.link_layer == IBV_LINK_LAYER_ETHERNET)
+        link_layer = "ethernet";
+
+    __add_str("device", "name", ib_res.ctx ?
+              ibv_get_device_name(ib_res.ctx->device) : "");
+    __add_int("device", "ib_port", config_info.ib_port);
+    __add_int("device", "gid_index", config_info.gid_index);
+    __add_str("device", "link_layer", link_layer);
+    __add_int("device", "active_mtu", 128 << ib_res.port_attr.active_mtu);
+    __add_int("device", "max_inline_data", ib_res.qp_cap.max_inline_data);
+    __add_int("device", "max_send_wr", ib_res.qp_cap.max_send_wr);
+    __add_int("device", "max_recv_wr", ib_res.qp_cap.max_recv_wr);
+    __add_int("device", "max_send_sge", ib_res.qp_cap.max_send_sge);
+    __add_int("device", "max_recv_sge", ib_res.qp_cap.max_recv_sge);
+    __add_int("device", "dev_max_sge", ib_res.dev_attr.max_sge);
+    __add_str("device", "signaling",
+              config_info.signal_interval == 1 ? "all" : "selective");
+}
+
+static void __add_environment() {
+    struct utsname uts;
+    char cpu_model[128];
+
+    memset(&uts, 0, sizeof(struct utsname));
+    uname(&uts);
+    __cpu_model(cpu_model, sizeof(cpu_model));
+
+    __add_str("environment", "kernel", uts.release);
+    __add_str("environment", "arch", uts.machine);
+    __add_str("environment", "cpu_model", cpu_model);
+    __add_int("environment", "num_cpus", sysconf(_SC_NPROCESSORS_ONLN));
+    __add_str("environment", "nic_fw_ver", ib_res.dev_attr.fw_ver);
+    __add_int("environment", "nic_vendor_id", ib_res.dev_attr.vendor_id);
+    __add_int("environment", "nic_vendor_part_id",
+              ib_res.dev_attr.vendor_part_id);
+}
+
+/*
+ * A thread which got too few ops to reach the warm-up mark, or never got to
+ * STOP, has no measured window; its start would be zero and the window the
+ * machine's uptime.
+ */
+static bool __measured(struct ThreadResult *res) {
+    return res->start_ns != 0 && res->end_ns >= res->start_ns;
+}
+
+/* the counters of the measured window, delta += end - start */
+static void __accumulate_delta(struct ThreadResult *res,
+                               struct ThreadStats *delta) {
+    int i = 0;
+
+    delta->ops           += res->end.ops - res->start.ops;
+    delta->bytes         += res->end.bytes - res->start.bytes;
+    delta->cq_polls      += res->end.cq_polls - res->start.cq_polls;
+    delta->empty_polls   += res->end.empty_polls - res->start.empty_polls;
+    delta->post_failures += res->end.post_failures - res->start.post_failures;
+    delta->rnr_errors    += res->end.rnr_errors - res->start.rnr_errors;
+    delta->retry_errors  += res->end.retry_errors - res->start.retry_errors;
+    delta->credit_waits  += res->end.credit_waits - res->start.credit_waits;
+    delta->credit_msgs   += res->end.credit_msgs - res->start.credit_msgs;
+    delta->steals        += res->end.steals - res->start.steals;
+    delta->stolen        += res->end.stolen - res->start.stolen;
+    delta->batches       += res->end.batches - res->start.batches;
+    delta->coalesced     += res->end.coalesced - res->start.coalesced;
+    delta->poll_cycles   += res->end.poll_cycles - res->start.poll_cycles;
+    delta->empty_poll_cycles += res->end.empty_poll_cycles -
+                                res->start.empty_poll_cycles;
+    delta->post_cycles   += res->end.post_cycles - res->start.post_cycles;
+
+    for (i = 0; i < STATS_LAT_BUCKETS; i++)
+        delta->lat_hist[i] += res->end.lat_hist[i] - res->start.lat_hist[i];
+}
+
+static void __add_metrics(const char *section, struct ThreadStats *delta,
+                          double duration_s) {
+    int i = 0;
+    uint64_t lat_max = 0;
+
+    /* upper bound of the highest non-empty bucket */
+    for (i = STATS_LAT_BUCKETS - 1; i >= 0; i--) {
+        if (delta->lat_hist[i] != 0) {
+            lat_max = stats_lat_bucket_lower(i < STATS_LAT_BUCKETS - 1 ?
+                                             i + 1 : i);
+            break;
+        }
+    }
+
+    __add_dbl(section, "duration_s", duration_s);
+    __add_int(section, "ops", delta->ops);
+    __add_int(section, "bytes", delta->bytes);
+    __add_dbl(section, "mops", duration_s > 0 ?
+              delta->ops / duration_s / 1e6 : 0.0);
+    __add_dbl(section, "gbps", duration_s > 0 ?
+              delta->bytes * 8 / duration_s / 1e9 : 0.0);
+    __add_dbl(section, "avg_msg_size", delta->ops ?
+              (double)delta->bytes / delta->ops : 0.0);
+    __add_int(section, "lat_p50_ns", stats_lat_percentile(delta->lat_hist, 50));
+    __add_int(section, "lat_p90_ns", stats_lat_percentile(delta->lat_hist, 90));
+    __add_int(section, "lat_p99_ns", stats_lat_percentile(delta->lat_hist, 99));
+    __add_int(section, "lat_p999_ns",
+              stats_lat_percentile(delta->lat_hist, 99.9));
+    __add_int(section, "lat_max_ns", lat_max);
+    __add_int(section, "cq_polls", delta->cq_polls);
+    __add_dbl(section, "empty_poll_pct", delta->cq_polls ?
+              100.0 * delta->empty_polls / delta->cq_polls : 0.0);
+    __add_int(section, "post_failures", delta->post_failures);
+    __add_int(section, "rnr_errors", delta->rnr_errors);
+    __add_int(section, "retry_errors", delta->retry_errors);
+    __add_int(section, "credit_waits", delta->credit_waits);
+    __add_int(section, "credit_msgs", delta->credit_msgs);
+    __add_int(section, "steals", delta->steals);
+    __add_int(section, "stolen", delta->stolen);
+    __add_int(section, "batches", delta->batches);
+    __add_dbl(section, "resp_per_batch", delta->batches ?
+              (double)delta->coalesced / delta->batches : 0.0);
+}
+
+static void __accumulate_cpu_cost(struct ThreadResult *res,
+                                  struct CpuCost *cost) {
+    cost->cpu_ns      += res->end_cpu_ns - res->start_cpu_ns;
+    cost->wall_cycles += res->end_tsc - res->start_tsc;
+    cost->utime_us    += __timeval_us(&res->end_ru.ru_utime) -
+                         __timeval_us(&res->start_ru.ru_utime);
+    cost->stime_us    += __timeval_us(&res->end_ru.ru_stime) -
+                         __timeval_us(&res->start_ru.ru_stime);
+    cost->minflt      += res->end_ru.ru_minflt - res->start_ru.ru_minflt;
+    cost->majflt      += res->end_ru.ru_majflt - res->start_ru.ru_majflt;
+    cost->nvcsw       += res->end_ru.ru_nvcsw - res->start_ru.ru_nvcsw;
+    cost->nivcsw      += res->end_ru.ru_nivcsw - res->start_ru.ru_nivcsw;
+}
+
+static double __pct(uint64_t part, uint64_t whole) {
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+/*
+ * app cycles are whatever the window spent outside ibv_poll_cq and
+ * ibv_post_*: completion handling, buffer management, bookkeeping
+ */
+static void __add_cpu_metrics(const char *section, struct ThreadStats *delta,
+                              struct CpuCost *cost, double duration_s) {
+    uint64_t ops = delta->ops;
+    uint64_t verbs_cycles = delta->poll_cycles + delta->post_cycles;
+    uint64_t app_cycles = cost->wall_cycles > verbs_cycles ?
+                          cost->wall_cycles - verbs_cycles : 0;
+
+    __add_dbl(section, "cpu_ns_per_msg", ops ? (double)cost->cpu_ns / ops : 0.0);
+    /* of one core, like top */
+    __add_dbl(section, "cpu_util_pct", duration_s > 0 ?
+              cost->cpu_ns / 1e7 / duration_s : 0.0);
+    __add_dbl(section, "user_s", cost->utime_us / 1e6);
+    __add_dbl(section, "sys_s", cost->stime_us / 1e6);
+    __add_int(section, "minor_faults", cost->minflt);
+    __add_int(section, "major_faults", cost->majflt);
+    __add_int(section, "vol_ctx_switches", cost->nvcsw);
+    __add_int(section, "invol_ctx_switches", cost->nivcsw);
+
+    __add_dbl(section, "poll_cycles_per_msg",
+              ops ? (double)delta->poll_cycles / ops : 0.0);
+    __add_dbl(section, "post_cycles_per_msg",
+              ops ? (double)delta->post_cycles / ops : 0.0);
+    __add_dbl(section, "app_cycles_per_msg", ops ? (double)app_cycles / ops : 0.0);
+    __add_dbl(section, "poll_cycle_pct", __pct(delta->poll_cycles,
+                                               cost->wall_cycles));
+    __add_dbl(section, "post_cycle_pct", __pct(delta->post_cycles,
+                                               cost->wall_cycles));
+    __add_dbl(section, "app_cycle_pct", __pct(app_cycles, cost->wall_cycles));
+    __add_dbl(section, "empty_poll_cycle_pct", __pct(delta->empty_poll_cycles,
+                                                     cost->wall_cycles));
+}
+
+static const char *perf_metric_keys[PERF_NUM_COUNTERS] = {
+    "cycles_per_msg",
+    "instructions_per_msg",
+    "llc_misses_per_msg",
+    "branch_misses_per_msg",
+};
+
+/* per-message counts, -1 for a counter that couldn't be read */
+static void __add_perf_metrics(const char *section, struct PerfCounters *perf,
+                               uint64_t ops) {
+    int i = 0;
+    uint32_t ipc_mask = (1u << PERF_CYCLES) | (1u << PERF_INSTRUCTIONS);
+
+    if (config_info.perf_counters == false)
+        return;
+
+    for (i = 0; i < PERF_NUM_COUNTERS; i++)
+        __add_dbl(section, perf_metric_keys[i],
+                  (perf->valid & (1u << i)) && ops ?
+                  (double)perf->value[i] / ops : -1.0);
+
+    __add_dbl(section, "ipc", (perf->valid & ipc_mask) == ipc_mask &&
+              perf->value[PERF_CYCLES] ? (double)perf->value[PERF_INSTRUCTIONS] /
+              perf->value[PERF_CYCLES] : -1.0);
+    __add_bool(section, "perf_user_only", perf->exclude_kernel);
+}
+
+/* sum of the counters every thread could read */
+static void __accumulate_perf(struct ThreadResult *res,
+                              struct PerfCounters *total) {
+    int i = 0;
+
+    total->valid &= res->perf.valid;
+    total->exclude_kernel |= res->perf.exclude_kernel;
+    for (i = 0; i < PERF_NUM_COUNTERS; i++)
+        total->value[i] += res->perf.value[i];
+}
+
+static void __write_json_string(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(fp, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(fp, "\\u%04x", *s);
+        else
+            fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+static void __write_json_value(FILE *fp, struct ResultField *f) {
+    switch (f->type) {
+    case FIELD_INT:  fprintf(fp, "%"PRId64, f->i); break;
+    case FIELD_DBL:  fprintf(fp, "%.6f", f->d); break;
+    case FIELD_BOOL: fprintf(fp, "%s", f->i ? "true" : "false"); break;
+    case FIELD_STR:  __write_json_string(fp, f->s); break;
+    }
+}
+
+/* fields[from, to) as one JSON object per section */
+static void __write_json_sections(FILE *fp, int from, int to,
+                                  const char *indent) {
+    int i = 0;
+
+    for (i = from; i < to; i++) {
+        if (i == from || strcmp(fields[i].section, fields[i - 1].section)) {
+            if (i != from)
+                fprintf(fp, "\n%s},\n", indent);
+            fprintf(fp, "%s\"%s\": {\n", indent, fields[i].section);
+        } else {
+            fprintf(fp, ",\n");
+        }
+
+        fprintf(fp, "%s    \"%s\": ", indent, fields[i].key);
+        __write_json_value(fp, &fields[i]);
+    }
+
+    if (to > from)
+        fprintf(fp, "\n%s}", indent);
+}
+
+static int __write_json(const char *path, struct ThreadStats *delta) {
+    int i = 0, num_run_fields = 0;
+    FILE *fp = NULL;
+    struct CpuCost cost;
+    struct ThreadResult *res = NULL;
+
+    fp = fopen(path, "w");
+    check(fp != NULL, "Failed to open %s", path);
+
+    fprintf(fp, "{\n");
+    __write_json_sections(fp, 0, num_fields, "    ");
+
+    /* per-thread breakdown, reusing the field table past the run fields */
+    num_run_fields = num_fields;
+    fprintf(fp, ",\n    \"threads\": [\n");
+    for (i = 0; i < num_thread_results; i++) {
+        res = &thread_results[i];
+        fprintf(fp, "        {\n            \"thread_id\": %d,\n"
+                "            \"measured\": %s", i,
+                __measured(res) ? "true" : "false");
+
+        if (__measured(res)) {
+            memset(delta, 0, sizeof(struct ThreadStats));
+            __accumulate_delta(res, delta);
+            __add_metrics("metrics", delta,
+                          (res->end_ns - res->start_ns) / 1e9);
+            memset(&cost, 0, sizeof(struct CpuCost));
+            __accumulate_cpu_cost(res, &cost);
+            __add_cpu_metrics("metrics", delta, &cost,
+                              (res->end_ns - res->start_ns) / 1e9);
+            __add_perf_metrics("metrics", &res->perf, delta->ops);
+
+            fprintf(fp, ",\n");
+            __write_json_sections(fp, num_run_fields, num_fields,
+                                  "            ");
+            num_fields = num_run_fields;
+        }
+        fprintf(fp, "\n        }%s\n", i == num_thread_results - 1 ? "" : ",");
+    }
+    fprintf(fp, "    ]\n}\n");
+
+    fclose(fp);
+    return 0;
+error:
+    return -1;
+}
+
+static void __write_csv_value(FILE *fp, struct ResultField *f) {
+    const char *p = NULL;
+
+    if (f->type != FIELD_STR) {
+        __write_json_value(fp, f);
+        return;
+    }
+
+    fputc('"', fp);
+    for (p = f->s; *p != '\0'; p++) {
+        if (*p == '"')
+            fputc('"', fp);
+        fputc(*p, fp);
+    }
+    fputc('"', fp);
+}
+
+/*
+ * The columns depend on the role and on options (--perf-counters, --ud), so
+ * a row is only appended to a file whose header matches the one of this
+ * run; anything else would land in the wrong columns.
+ */
+static int __write_csv(const char *path) {
+    int i = 0;
+    FILE *fp = NULL, *hdr_fp = NULL;
+    char *header = NULL, *line = NULL;
+    size_t header_len = 0, line_len = 0;
+
+    hdr_fp = open_memstream(&header, &header_len);
+    check(hdr_fp != NULL, "Failed to build the CSV header");
+    for (i = 0; i < num_fields; i++)
+        fprintf(hdr_fp, "%s%s.%s", i ? "," : "", fields[i].section,
+                fields[i].key);
+    fclose(hdr_fp);
+
+    fp = fopen(path, "a+");
+    check(fp != NULL, "Failed to open %s", path);
+
+    if (getline(&line, &line_len, fp) > 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+        check(strcmp(line, header) == 0, "%s holds the columns of another "
+              "kind of run (role, --perf-counters, --ud or version), write "
+              "to a new file", path);
+    }
+    fseek(fp, 0, SEEK_END);
+    if (ftell(fp) == 0)
+        fprintf(fp, "%s\n", header);
+
+    for (i = 0; i < num_fields; i++) {
+        if (i)
+            fputc(',', fp);
+        __write_csv_value(fp, &fields[i]);
+    }
+    fprintf(fp, "\n");
+
+    fclose(fp);
+    free(header);
+    free(line);
+    return 0;
+error:
+    if (fp != NULL)
+        fclose(fp);
+    free(header);
+    free(line);
+    return -1;
+}
+
+int results_write(const char *path) {
+    int i = 0, ret = 0, num_unmeasured = 0;
+    size_t len = 0;
+    uint64_t duration_ns = 0;
+    enum ResultsFormat format = RESULTS_JSON;
+    struct ThreadStats *delta = NULL;
+    struct PerfCounters perf;
+    struct CpuCost cost;
+
+    len = strlen(path);
+    if (len > 4 && strcmp(path + len - 4, ".csv") == 0)
+        format = RESULTS_CSV;
+
+    delta = (struct ThreadStats *)memalign(CACHE_LINE_SIZE,
+                                           sizeof(struct ThreadStats));
+    check(delta != NULL, "Failed to allocate results delta");
+    memset(delta, 0, sizeof(struct ThreadStats));
+    perf_counters_init(&perf);
+    perf.valid = ~0u;
+    memset(&cost, 0, sizeof(struct CpuCost));
+
+    for (i = 0; i < num_thread_results; i++) {
+        if (__measured(&thread_results[i]) == false) {
+            num_unmeasured++;
+            continue;
+        }
+        __accumulate_delta(&thread_results[i], delta);
+        __accumulate_perf(&thread_results[i], &perf);
+        __accumulate_cpu_cost(&thread_results[i], &cost);
+        if (thread_results[i].end_ns - thread_results[i].start_ns > duration_ns)
+            duration_ns = thread_results[i].end_ns - thread_results[i].start_ns;
+    }
+
+    if (num_unmeasured > 0)
+        log("results: %d of %d thread(s) never got through warm-up to STOP, "
+            "left out of the metrics", num_unmeasured, num_thread_results);
+
+    num_fields = 0;
+    __add_run_info(num_unmeasured);
+    __add_config();
+    __add_device();
+    __add_setup();
+    __add_queues();
+    __add_environment();
+    __add_metrics("metrics", delta, duration_ns / 1e9);
+    __add_cpu_metrics("metrics", delta, &cost, duration_ns / 1e9);
+    __add_perf_metrics("metrics", &perf, delta->ops);
+
+    if (format == RESULTS_CSV)
+        ret = __write_csv(path);
+    else
+        ret = __write_json(path, delta);
+    check(ret == 0, "Failed to write results to %s", path);
+
+    log("results            = %s", path);
+    free(delta);
+    return 0;
+
+error:
+    if (delta != NULL)
+        free(delta);
+    return -1;
+}
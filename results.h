@@ -0,0 +1,67 @@
+#ifndef __RESULTS_H__
+#define __RESULTS_H__
+
+#include <inttypes.h>
+#include <sys/resource.h>
+
+#include "stats.h"
+#include "perf_counters.h"
+
+/*
+ * Machine-readable results
+ *
+ * Every worker snapshots its ThreadStats at the warm-up mark and when it
+ * stops; results_write() turns the two snapshots into metrics for the
+ * measured window and emits them, together with the full configuration,
+ * device and environment, as JSON or CSV.
+ *
+ * Threads which never reached the warm-up mark, e.g. because they got too
+ * few ops, have no window; they are left out of the metrics and counted in
+ * run.unmeasured_threads.
+ *
+ * JSON holds one run with a per-thread breakdown. CSV holds one row per
+ * run with dotted column names (config.msg_size, metrics.mops, ...); when
+ * the file already exists the row is appended without a header, so that
+ * repeated runs accumulate in one file. The columns depend on the role and
+ * on some options, so a file whose header differs is refused rather than
+ * appended to.
+ *
+ * The marks also take the thread's CPU time, getrusage() and TSC, so that
+ * CPU cost per message can be compared across polling modes, and the TSC
+ * cycles counted around ibv_poll_cq and ibv_post_* split the window into
+ * polling, posting and application work. With --perf-counters the marks
+ * also bracket the hardware counters of the worker.
+ */
+#define RESULTS_VERSION 2
+
+enum ResultsFormat {
+    RESULTS_JSON = 0,
+    RESULTS_CSV,
+};
+
+struct ThreadResult {
+    uint64_t            start_ns;   /* CLOCK_MONOTONIC at the warm-up mark */
+    uint64_t            end_ns;     /* CLOCK_MONOTONIC at STOP */
+    uint64_t            start_tsc;
+    uint64_t            end_tsc;
+    uint64_t            start_cpu_ns;   /* CLOCK_THREAD_CPUTIME_ID */
+    uint64_t            end_cpu_ns;
+    struct rusage       start_ru;       /* RUSAGE_THREAD */
+    struct rusage       end_ru;
+    struct ThreadStats  start;
+    struct ThreadStats  end;
+    struct PerfCounters perf;       /* measured window, --perf-counters */
+}__attribute__((aligned(CACHE_LINE_SIZE)));
+
+extern struct ThreadResult *thread_results;
+extern int num_thread_results;
+
+int  results_init(int num_threads);
+void results_destroy();
+
+void results_mark_start(int thread_id, struct ThreadStats *stats);
+void results_mark_end(int thread_id, struct ThreadStats *stats);
+
+int  results_write(const char *path);
+
+#endif /* __RESULTS_H__ */
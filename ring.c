@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "debug.h"
+#include "ib.h"
+#include "ring.h"
+
+static inline uint32_t __rec_size(uint32_t len) {
+    return (sizeof(struct RingHdr) + len + 1 + RING_ALIGN - 1) &
+        ~(uint32_t)(RING_ALIGN - 1);
+}
+
+/* retire send queue entries: a signaled write retires the ones before it */
+static int __reap(struct RingChan *c) {
+    int i = 0, n = 0;
+    struct ibv_wc wc[8];
+
+    n = ibv_poll_cq(c->cq, 8, wc);
+    check(n >= 0, "Failed to poll cq");
+    for (i = 0; i < n; i++) {
+        check(wc[i].status == IBV_WC_SUCCESS, "ring write failed: %d, %s",
+              wc[i].status, ibv_wc_status_str(wc[i].status));
+        c->sq_used -= RING_SIGNAL;
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+static int __write(struct RingChan *c, char *src, uint64_t remote_addr,
+                   uint32_t len) {
+    int flags = 0;
+
+    while (c->sq_used >= c->sq_depth)
+        check(__reap(c) == 0, "Failed to retire ring writes");
+
+    if (++c->num_posts % RING_SIGNAL == 0)
+        flags = IBV_SEND_SIGNALED;
+    check(post_write(len, c->mr->lkey, 0, flags, remote_addr, c->rkey, c->qp,
+                     src) == 0, "Failed to post ring write");
+    c->sq_used++;
+
+    return 0;
+error:
+    return -1;
+}
+
+int ring_init(struct RingChan *c, struct ibv_pd *pd, struct ibv_qp *qp,
+              struct ibv_cq *cq, int sq_depth, uint32_t size) {
+    memset(c, 0, sizeof(struct RingChan));
+    check(size >= 1024 && size % (4 * RING_ALIGN) == 0, "Ring size %"PRIu32
+          " must be a multiple of %d, at least 1024", size, 4 * RING_ALIGN);
+    check(sq_depth >= RING_SIGNAL, "Send queue of %d is below %d", sq_depth,
+          RING_SIGNAL);
+
+    c->qp       = qp;
+    c->cq       = cq;
+    c->size     = size;
+    c->sq_depth = sq_depth;
+
+    /* a cache line for each head word */
+    c->region_size = 2 * (size_t)size + 128;
+    c->region = (char *)memalign(4096, c->region_size);
+    check(c->region != NULL, "Failed to allocate the ring");
+    memset(c->region, 0, c->region_size);
+
+    c->mr = ibv_reg_mr(pd, c->region, c->region_size,
+                       IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    check(c->mr != NULL, "Failed to register the ring");
+
+    c->rx       = c->region;
+    c->tx       = c->region + size;
+    c->tx_head  = (volatile uint64_t *)(c->tx + size);
+    c->head_out = (volatile uint64_t *)(c->tx + size + 64);
+
+    return 0;
+error:
+    ring_destroy(c);
+    return -1;
+}
+
+void ring_destroy(struct RingChan *c) {
+    if (c->mr != NULL)
+        ibv_dereg_mr(c->mr);
+    if (c->region != NULL)
+        free(c->region);
+
+    memset(c, 0, sizeof(struct RingChan));
+}
+
+void ring_local(struct RingChan *c, struct RingRemote *local) {
+    local->ring_addr = htonll((uintptr_t)c->rx);
+    local->head_addr = htonll((uintptr_t)c->tx_head);
+    local->rkey      = htonl(c->mr->rkey);
+    local->size      = htonl(c->size);
+}
+
+int ring_connect(struct RingChan *c, const struct RingRemote *peer) {
+    check(ntohl(peer->size) == c->size, "Peer ring is %"PRIu32" bytes, ours "
+          "%"PRIu32, ntohl(peer->size), c->size);
+
+    c->remote_ring = ntohll(peer->ring_addr);
+    c->remote_head = ntohll(peer->head_addr);
+    c->rkey        = ntohl(peer->rkey);
+
+    return 0;
+error:
+    return -1;
+}
+
+char *ring_alloc(struct RingChan *c, uint32_t len) {
+    uint32_t rec = __rec_size(len), to_end = c->size - c->tx_off;
+    uint64_t need = rec > to_end ? (uint64_t)to_end + rec : rec;
+    struct RingHdr *hdr = NULL;
+
+    if (c->size - (c->tx_written - *c->tx_head) < need) {
+        c->full_waits++;
+        return NULL;
+    }
+
+    if (rec > to_end) {
+        hdr       = (struct RingHdr *)(c->tx + c->tx_off);
+        hdr->size = to_end;
+        hdr->len  = RING_WRAP;
+        check(__write(c, (char *)hdr, c->remote_ring + c->tx_off,
+                      sizeof(struct RingHdr)) == 0, "Failed to wrap the ring");
+        c->tx_written += to_end;
+        c->tx_off      = 0;
+    }
+
+    c->tx_size = rec;
+    return c->tx + c->tx_off + sizeof(struct RingHdr);
+error:
+    return NULL;
+}
+
+int ring_commit(struct RingChan *c, uint32_t len) {
+    char *rec = c->tx + c->tx_off;
+    struct RingHdr *hdr = (struct RingHdr *)rec;
+
+    check(c->tx_size == __rec_size(len), "Commit of %"PRIu32" bytes does "
+          "not match the allocation", len);
+
+    hdr->size = c->tx_size;
+    hdr->len  = len;
+    rec[c->tx_size - 1] = RING_VALID;
+    check(__write(c, rec, c->remote_ring + c->tx_off, c->tx_size) == 0,
+          "Failed to write a record");
+
+    c->tx_written += c->tx_size;
+    c->tx_off     += c->tx_size;
+    if (c->tx_off == c->size)
+        c->tx_off = 0;
+    c->tx_size = 0;
+    c->msgs_sent++;
+
+    return 0;
+error:
+    return -1;
+}
+
+int ring_send(struct RingChan *c, const char *buf, uint32_t len) {
+    char *payload = NULL;
+    uint64_t waits = c->full_waits;
+
+    check(len <= ring_max_msg(c), "%"PRIu32" bytes exceed the ring's %"PRIu32,
+          len, ring_max_msg(c));
+    /* spin while the ring is full, a NULL without a wait is an error */
+    while ((payload = ring_alloc(c, len)) == NULL) {
+        check(c->full_waits != waits, "Failed to allocate a record");
+        waits = c->full_waits;
+    }
+
+    memcpy(payload, buf, len);
+    return ring_commit(c, len);
+error:
+    return -1;
+}
+
+int ring_poll(struct RingChan *c, struct RingMsg *msg) {
+    uint64_t word = 0;
+    struct RingHdr hdr;
+
+    for (;;) {
+        /* records are RING_ALIGN aligned: the header arrives in one piece */
+        word = *(volatile uint64_t *)(c->rx + c->rx_off);
+        memcpy(&hdr, &word, sizeof(hdr));
+        if (hdr.size == 0)
+            return 0;
+        check(hdr.size <= c->size - c->rx_off && hdr.size % RING_ALIGN == 0,
+              "Bad ring record of %"PRIu32" bytes at %"PRIu32, hdr.size,
+              c->rx_off);
+
+        if (hdr.len != RING_WRAP)
+            break;
+
+        *(volatile uint64_t *)(c->rx + c->rx_off) = 0;
+        c->rx_freed += hdr.size;
+        c->rx_off    = 0;
+    }
+
+    if (((volatile char *)c->rx)[c->rx_off + hdr.size - 1] != RING_VALID)
+        return 0;
+    /* payload reads must not be hoisted above the marker */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (c->rx_size == 0)
+        c->msgs_recvd++;
+    c->rx_size = hdr.size;
+    msg->buf   = c->rx + c->rx_off + sizeof(struct RingHdr);
+    msg->len   = hdr.len;
+    return 1;
+error:
+    return -1;
+}
+
+int ring_release(struct RingChan *c) {
+    check(c->rx_size != 0, "No ring record to release");
+
+    memset(c->rx + c->rx_off, 0, c->rx_size);
+    c->rx_freed += c->rx_size;
+    c->rx_off   += c->rx_size;
+    if (c->rx_off == c->size)
+        c->rx_off = 0;
+    c->rx_size = 0;
+
+    if (c->rx_freed - c->rx_acked >= c->size / RING_ACK_DIV) {
+        *c->head_out = c->rx_freed;
+        check(__write(c, (char *)c->head_out, c->remote_head,
+                      sizeof(uint64_t)) == 0, "Failed to write back the head");
+        c->rx_acked = c->rx_freed;
+        c->head_writes++;
+    }
+
+    return 0;
+error:
+    return -1;
+}
@@ -0,0 +1,123 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <infiniband/verbs.h>
+
+/*
+ * One-sided ring channel
+ *
+ * Messages are RDMA-written as records into a ring in the receiver's
+ * memory; the receiver finds them by polling memory, so no receive is
+ * posted and no completion is generated on its side. A record is
+ *
+ *   | RingHdr | payload | pad | RING_VALID |
+ *
+ * rounded to RING_ALIGN bytes. The receiver sees a nonzero header, then
+ * waits for the last byte of the record, which the NIC places last. A
+ * record which does not fit before the end of the ring is preceded by a
+ * header-only wrap record covering the rest.
+ *
+ * The receiver zeroes records as it releases them, so the ring reads as
+ * empty again, and writes the number of bytes released back into the
+ * sender's memory once at least a quarter of the ring has been freed. The
+ * sender builds records in a local mirror of the ring and writes them from
+ * there; a record is never larger than a quarter of the ring, so lazy
+ * write-back can not starve it.
+ *
+ * Each side of a RingChan sends and receives: ring_init() sets up both
+ * directions on one RC QP, both peers use the same size. The channel
+ * owns the CQ of its QP, which only ever holds its own write completions.
+ */
+#define RING_SIZE       (1 << 20)   /* default ring bytes */
+#define RING_ALIGN      16
+#define RING_VALID      0x5A
+#define RING_WRAP       0xFFFFFFFF  /* RingHdr.len of a wrap record */
+#define RING_SIGNAL     16          /* one write in N is signaled */
+#define RING_ACK_DIV    4           /* write back after size / N freed */
+
+struct RingHdr {
+    uint32_t size;      /* record bytes, never 0 */
+    uint32_t len;       /* payload bytes, or RING_WRAP */
+};
+
+/* what the peer needs to write to us, sent over the socket, network order */
+struct RingRemote {
+    uint64_t ring_addr;
+    uint64_t head_addr;
+    uint32_t rkey;
+    uint32_t size;
+}__attribute__((packed));
+
+struct RingMsg {
+    char     *buf;
+    uint32_t len;
+};
+
+struct RingChan {
+    struct ibv_qp       *qp;
+    struct ibv_cq       *cq;
+    uint32_t            size;
+
+    /* ring, mirror and both head words in one MR */
+    char                *region;
+    size_t              region_size;
+    struct ibv_mr       *mr;
+
+    /* receiving */
+    char                *rx;
+    uint32_t            rx_off;         /* record being polled or held */
+    uint32_t            rx_size;        /* of the held record, 0 if none */
+    uint64_t            rx_freed;       /* bytes released in all */
+    uint64_t            rx_acked;       /* rx_freed last written back */
+    volatile uint64_t   *head_out;      /* source of the write-back */
+
+    /* sending */
+    char                *tx;            /* mirror of the peer's ring */
+    uint32_t            tx_off;
+    uint32_t            tx_size;        /* of the allocated record */
+    uint64_t            tx_written;     /* bytes written in all */
+    volatile uint64_t   *tx_head;       /* the peer's rx_freed */
+    uint64_t            remote_ring;
+    uint64_t            remote_head;
+    uint32_t            rkey;
+
+    int                 sq_depth;
+    int                 sq_used;
+    uint64_t            num_posts;
+
+    uint64_t            msgs_sent;
+    uint64_t            msgs_recvd;
+    uint64_t            head_writes;
+    uint64_t            full_waits;     /* ring_alloc() found no room */
+};
+
+static inline uint32_t ring_max_msg(struct RingChan *c) {
+    return c->size / 4 - sizeof(struct RingHdr) - RING_ALIGN;
+}
+
+int  ring_init(struct RingChan *c, struct ibv_pd *pd, struct ibv_qp *qp,
+               struct ibv_cq *cq, int sq_depth, uint32_t size);
+void ring_destroy(struct RingChan *c);
+
+void ring_local(struct RingChan *c, struct RingRemote *local);
+int  ring_connect(struct RingChan *c, const struct RingRemote *peer);
+
+/*
+ * Room for a len byte payload in the mirror, NULL while the peer has not
+ * freed enough. Fill it in and ring_commit() it before the next alloc.
+ */
+char *ring_alloc(struct RingChan *c, uint32_t len);
+int   ring_commit(struct RingChan *c, uint32_t len);
+int   ring_send(struct RingChan *c, const char *buf, uint32_t len);
+
+/*
+ * The next message, in ring order: 1 with msg filled in, 0 if none has
+ * arrived yet. A message stays valid until ring_release(), and the next
+ * one is only returned after that.
+ */
+int  ring_poll(struct RingChan *c, struct RingMsg *msg);
+int  ring_release(struct RingChan *c);
+
+#endif /* __RING_H__ */
@@ -0,0 +1,629 @@
+/*
+ * rdma-ring: the one-sided ring channel against send/recv
+ *
+ * For every message size, measures ping-pong latency and one-way message
+ * rate over a ring channel (ring.h) on one QP and over two-sided
+ * SEND_WITH_IMM with pre-posted receives on another. The client drives,
+ * the server follows the same script from the parameters the client sent.
+ * Rate runs end with an answer from the server, so they count delivered
+ * messages; send/recv rate is paced by credits the server returns.
+ *
+ *   server: rdma-ring [options] sock_port
+ *   client: rdma-ring [options] server_name sock_port
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <malloc.h>
+#include <infiniband/verbs.h>
+
+#include "debug.h"
+#include "ib.h"
+#include "config.h"
+#include "setup_ib.h"
+#include "sock.h"
+#include "tsc.h"
+#include "ring.h"
+
+FILE *log_fp = NULL;
+struct IBRes ib_res;
+
+#define RING_BENCH_ITERS        100000
+#define RING_BENCH_DEPTH        64
+#define RING_BENCH_MAX_SIZES    16
+#define RING_BENCH_WARMUP       1000
+#define RING_BENCH_SQ           (2 * RING_SIGNAL)
+
+/* the run's script, sent by the client, network order */
+struct RingHello {
+    uint32_t iters;
+    uint32_t depth;
+    uint32_t ring_size;
+    uint32_t num_sizes;
+    uint32_t sizes[RING_BENCH_MAX_SIZES];
+}__attribute__((packed));
+
+/* SEND_WITH_IMM into depth pre-posted receives */
+struct SrChan {
+    struct ibv_qp   *qp;
+    struct ibv_cq   *send_cq;
+    struct ibv_cq   *recv_cq;
+    char            *buf;           /* depth receive slots, one send slot */
+    size_t          slot_size;
+    int             depth;
+    struct ibv_mr   *mr;
+    int             sq_used;
+    uint64_t        num_posts;
+};
+
+struct Bench {
+    struct ibv_cq   *cq[3];         /* ring, send/recv sends and receives */
+    struct ibv_qp   *qp[2];         /* ring, send/recv */
+    struct RingChan ring;
+    struct SrChan   sr;
+    uint32_t        iters;
+    uint32_t        ring_size;
+    uint32_t        num_sizes;
+    uint32_t        sizes[RING_BENCH_MAX_SIZES];
+    uint64_t        *samples;
+};
+
+struct Result {
+    double lat_us;
+    double p99_us;
+    double mops;
+};
+
+static void usage(const char *prog) {
+    printf("Server: %s [options] sock_port\n", prog);
+    printf("Client: %s [options] server_name sock_port\n", prog);
+    printf("Options:\n");
+    printf("  -d ib_dev     IB device (default: the first one)\n");
+    printf("  -P ib_port    IB port (default %d)\n", IB_PORT);
+    printf("  -g gid_idx    GID index for RoCE (default %d)\n", IB_GID_INDEX);
+    printf("  -r bytes      ring size (default %d)\n", RING_SIZE);
+    printf("  -q depth      send/recv receives posted (default %d)\n",
+           RING_BENCH_DEPTH);
+    printf("  -s size,...   message sizes (default 8,64,256,1024,4096)\n");
+    printf("  -n iters      messages per size and test (default %d)\n",
+           RING_BENCH_ITERS);
+}
+
+static int __parse_sizes(char *arg, uint32_t *sizes) {
+    int n = 0;
+    char *tok = NULL;
+
+    for (tok = strtok(arg, ","); tok != NULL && n < RING_BENCH_MAX_SIZES;
+         tok = strtok(NULL, ","))
+        sizes[n++] = (uint32_t)atol(tok);
+    return n;
+}
+
+static int __open(const char *name) {
+    int i = 0, num = 0;
+    struct ibv_device **list = NULL;
+
+    list = ibv_get_device_list(&num);
+    check(list != NULL && num > 0, "No IB devices found");
+    for (i = 0; i < num; i++)
+        if (name == NULL || !strcmp(ibv_get_device_name(list[i]), name))
+            break;
+    check(i < num, "IB device %s not found", name);
+
+    ib_res.ctx = ibv_open_device(list[i]);
+    check(ib_res.ctx != NULL, "Failed to open %s",
+          ibv_get_device_name(list[i]));
+    ibv_free_device_list(list);
+    list = NULL;
+
+    ib_res.pd = ibv_alloc_pd(ib_res.ctx);
+    check(ib_res.pd != NULL, "Failed to allocate pd");
+    check(ibv_query_port(ib_res.ctx, config_info.ib_port,
+                         &ib_res.port_attr) == 0, "Failed to query port");
+    check(ibv_query_device(ib_res.ctx, &ib_res.dev_attr) == 0,
+          "Failed to query device");
+    if (ib_res.port_attr.link_layer == IBV_LINK_LAYER_ETHERNET)
+        check(ibv_query_gid(ib_res.ctx, config_info.ib_port,
+                            config_info.gid_index, &ib_res.local_gid) == 0,
+              "Failed to query GID");
+
+    return 0;
+error:
+    if (list != NULL)
+        ibv_free_device_list(list);
+    return -1;
+}
+
+static int __create_qps(struct Bench *b, int depth) {
+    int i = 0;
+    struct ibv_qp_init_attr attr = {
+        .cap = {
+            .max_send_wr  = RING_BENCH_SQ,
+            .max_recv_wr  = depth,
+            .max_send_sge = 1,
+            .max_recv_sge = 1,
+        },
+        .qp_type = IBV_QPT_RC,
+    };
+
+    for (i = 0; i < 3; i++) {
+        b->cq[i] = ibv_create_cq(ib_res.ctx, RING_BENCH_SQ + depth, NULL,
+                                 NULL, 0);
+        check(b->cq[i] != NULL, "Failed to create cq[%d]", i);
+    }
+
+    /* send/recv reaps sends without running into receives */
+    for (i = 0; i < 2; i++) {
+        attr.send_cq = b->cq[i];
+        attr.recv_cq = b->cq[2 * i];
+        b->qp[i] = ibv_create_qp(ib_res.pd, &attr);
+        check(b->qp[i] != NULL, "Failed to create qp[%d]", i);
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+/* the client speaks first */
+static int __swap(int sockfd, bool is_server, void *local, void *remote,
+                  size_t size) {
+    int n = 0;
+
+    if (is_server == false) {
+        n = sock_write(sockfd, local, size);
+        check(n == (int)size, "Failed to write to the peer");
+    }
+    n = sock_read(sockfd, remote, size);
+    check(n == (int)size, "Failed to read from the peer");
+    if (is_server) {
+        n = sock_write(sockfd, local, size);
+        check(n == (int)size, "Failed to write to the peer");
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+static int __sync(int sockfd, bool is_server) {
+    char local[sizeof(SOCK_SYNC_MSG)] = SOCK_SYNC_MSG;
+    char remote[sizeof(SOCK_SYNC_MSG)];
+
+    return __swap(sockfd, is_server, local, remote, sizeof(local));
+}
+
+static int __connect(struct Bench *b, int sockfd, bool is_server) {
+    int i = 0;
+    struct QPInfo local, remote;
+    struct RingRemote ring_local_info, ring_peer;
+
+    for (i = 0; i < 2; i++) {
+        local.lid    = ib_res.port_attr.lid;
+        local.qp_num = b->qp[i]->qp_num;
+        local.gid    = ib_res.local_gid;
+        check(__swap(sockfd, is_server, &local, &remote, sizeof(local)) == 0,
+              "Failed to exchange qp_info");
+        check(modify_qp_to_rts(b->qp[i], &remote) == 0,
+              "Failed to connect qp[%d]", i);
+    }
+
+    ring_local(&b->ring, &ring_local_info);
+    check(__swap(sockfd, is_server, &ring_local_info, &ring_peer,
+                 sizeof(ring_peer)) == 0, "Failed to exchange rings");
+    return ring_connect(&b->ring, &ring_peer);
+error:
+    return -1;
+}
+
+static inline char *__sr_slot(struct SrChan *s, int i) {
+    return s->buf + (size_t)i * s->slot_size;
+}
+
+static int __sr_init(struct SrChan *s, struct ibv_qp *qp,
+                     struct ibv_cq *send_cq, struct ibv_cq *recv_cq, int depth,
+                     uint32_t max_size) {
+    int i = 0;
+
+    s->qp        = qp;
+    s->send_cq   = send_cq;
+    s->recv_cq   = recv_cq;
+    s->depth     = depth;
+    s->slot_size = ((size_t)max_size + 63) & ~(size_t)63;
+    if (s->slot_size == 0)
+        s->slot_size = 64;
+
+    s->buf = (char *)memalign(4096, s->slot_size * (depth + 1));
+    check(s->buf != NULL, "Failed to allocate send/recv buffers");
+    memset(s->buf, 0, s->slot_size * (depth + 1));
+    s->mr = ibv_reg_mr(ib_res.pd, s->buf, s->slot_size * (depth + 1),
+                       IBV_ACCESS_LOCAL_WRITE);
+    check(s->mr != NULL, "Failed to register send/recv buffers");
+
+    for (i = 0; i < depth; i++)
+        check(post_recv(s->slot_size, s->mr->lkey, i, qp, __sr_slot(s, i))
+              == 0, "Failed to post recv");
+
+    return 0;
+error:
+    return -1;
+}
+
+/* retire send queue entries: a signaled send retires the ones before it */
+static int __sr_reap(struct SrChan *s) {
+    int n = 0;
+    struct ibv_wc wc;
+
+    while (s->sq_used >= RING_BENCH_SQ) {
+        n = ibv_poll_cq(s->send_cq, 1, &wc);
+        check(n >= 0, "Failed to poll cq");
+        if (n == 0)
+            continue;
+        check(wc.status == IBV_WC_SUCCESS, "send failed status: %d, %s",
+              wc.status, ibv_wc_status_str(wc.status));
+        s->sq_used -= RING_SIGNAL;
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+/* one send in RING_SIGNAL is signaled, as on the ring */
+static int __sr_send(struct SrChan *s, uint32_t len, uint32_t imm) {
+    int flags = 0;
+
+    check(__sr_reap(s) == 0, "Failed to retire sends");
+    if (++s->num_posts % RING_SIGNAL == 0)
+        flags = IBV_SEND_SIGNALED;
+    check(post_send(len, s->mr->lkey, 0, imm, flags, s->qp,
+                    __sr_slot(s, s->depth)) == 0, "Failed to post send");
+    s->sq_used++;
+
+    return 0;
+error:
+    return -1;
+}
+
+/* the next receive, reposted at once: returns its imm, its slot in *slot */
+static int __sr_recv(struct SrChan *s, uint32_t *imm, int *slot) {
+    int n = 0;
+    struct ibv_wc wc;
+
+    for (;;) {
+        n = ibv_poll_cq(s->recv_cq, 1, &wc);
+        check(n >= 0, "Failed to poll cq");
+        if (n == 0)
+            continue;
+        check(wc.status == IBV_WC_SUCCESS, "wc failed status: %d, %s",
+              wc.status, ibv_wc_status_str(wc.status));
+
+        *imm  = ntohl(wc.imm_data);
+        *slot = (int)wc.wr_id;
+        check(post_recv(s->slot_size, s->mr->lkey, wc.wr_id, s->qp,
+                        __sr_slot(s, *slot)) == 0, "Failed to post recv");
+        return 0;
+    }
+error:
+    return -1;
+}
+
+static int __ring_wait(struct RingChan *c, struct RingMsg *msg) {
+    int ret = 0;
+
+    while ((ret = ring_poll(c, msg)) == 0)
+        ;
+    return ret == 1 ? 0 : -1;
+}
+
+static int __cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void __latency(struct Bench *b, struct Result *r) {
+    uint32_t i = 0;
+    uint64_t sum = 0;
+
+    for (i = 0; i < b->iters; i++)
+        sum += b->samples[i];
+    qsort(b->samples, b->iters, sizeof(uint64_t), __cmp_u64);
+
+    r->lat_us = tsc_to_ns(sum) / 1e3 / b->iters;
+    r->p99_us = tsc_to_ns(b->samples[(uint64_t)b->iters * 99 / 100]) / 1e3;
+}
+
+/*
+ * Client side of the four tests at one size. Latency runs warm up first;
+ * rate runs are timed from the first send to the server's answer.
+ */
+static int __client_size(struct Bench *b, uint32_t size, struct Result *ring,
+                         struct Result *sr) {
+    long i = 0;
+    int slot = 0;
+    uint32_t imm = 0, credited = 0, sent = 0;
+    uint64_t start = 0;
+    char *msg_buf = __sr_slot(&b->sr, b->sr.depth);
+    struct RingMsg msg;
+
+    for (i = -RING_BENCH_WARMUP; i < (long)b->iters; i++) {
+        start = rdtsc();
+        check(ring_send(&b->ring, msg_buf, size) == 0, "Failed to send");
+        check(__ring_wait(&b->ring, &msg) == 0 && msg.len == size,
+              "Bad ring echo");
+        check(ring_release(&b->ring) == 0, "Failed to release");
+        if (i >= 0)
+            b->samples[i] = rdtsc() - start;
+    }
+    __latency(b, ring);
+
+    start = rdtsc();
+    for (i = 0; i < (long)b->iters; i++)
+        check(ring_send(&b->ring, msg_buf, size) == 0, "Failed to send");
+    check(__ring_wait(&b->ring, &msg) == 0 && msg.len == 0, "Bad ring answer");
+    check(ring_release(&b->ring) == 0, "Failed to release");
+    ring->mops = b->iters / (double)tsc_to_ns(rdtsc() - start) * 1e3;
+
+    for (i = -RING_BENCH_WARMUP; i < (long)b->iters; i++) {
+        start = rdtsc();
+        check(__sr_send(&b->sr, size, MSG_REGULAR) == 0, "Failed to send");
+        check(__sr_recv(&b->sr, &imm, &slot) == 0, "Failed to receive");
+        if (i >= 0)
+            b->samples[i] = rdtsc() - start;
+    }
+    __latency(b, sr);
+
+    /* the server has depth receives, it returns credits for depth / 2 */
+    start = rdtsc();
+    while (credited < b->iters) {
+        while (sent < b->iters && sent - credited < (uint32_t)b->sr.depth) {
+            check(__sr_send(&b->sr, size, MSG_REGULAR) == 0,
+                  "Failed to send");
+            sent++;
+        }
+        check(__sr_recv(&b->sr, &imm, &slot) == 0, "Failed to receive");
+        credited = MSG_IMM_ARG(imm);
+    }
+    sr->mops = b->iters / (double)tsc_to_ns(rdtsc() - start) * 1e3;
+
+    return 0;
+error:
+    return -1;
+}
+
+static int __server_size(struct Bench *b, uint32_t size) {
+    long i = 0;
+    int slot = 0;
+    uint32_t imm = 0, credit_every = b->sr.depth / 2 ? b->sr.depth / 2 : 1;
+    struct RingMsg msg;
+
+    for (i = -RING_BENCH_WARMUP; i < (long)b->iters; i++) {
+        check(__ring_wait(&b->ring, &msg) == 0 && msg.len == size,
+              "Bad ring message");
+        check(ring_send(&b->ring, msg.buf, msg.len) == 0, "Failed to echo");
+        check(ring_release(&b->ring) == 0, "Failed to release");
+    }
+
+    for (i = 0; i < (long)b->iters; i++) {
+        check(__ring_wait(&b->ring, &msg) == 0 && msg.len == size,
+              "Bad ring message");
+        check(ring_release(&b->ring) == 0, "Failed to release");
+    }
+    check(ring_send(&b->ring, "", 0) == 0, "Failed to answer");
+
+    for (i = -RING_BENCH_WARMUP; i < (long)b->iters; i++) {
+        check(__sr_recv(&b->sr, &imm, &slot) == 0, "Failed to receive");
+        memcpy(__sr_slot(&b->sr, b->sr.depth), __sr_slot(&b->sr, slot), size);
+        check(__sr_send(&b->sr, size, MSG_REGULAR) == 0, "Failed to echo");
+    }
+
+    for (i = 1; i <= (long)b->iters; i++) {
+        check(__sr_recv(&b->sr, &imm, &slot) == 0, "Failed to receive");
+        if (i % credit_every == 0 || i == (long)b->iters) {
+            check(__sr_send(&b->sr, 0, MSG_IMM(MSG_REGULAR, i)) == 0,
+                  "Failed to return credits");
+        }
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+static int __run(struct Bench *b, int sockfd, bool is_server, int depth) {
+    uint32_t i = 0, max_size = 0;
+    struct RingHello local, remote;
+    struct Result ring, sr;
+
+    memset(&local, 0, sizeof(local));
+    local.iters     = htonl(b->iters);
+    local.depth     = htonl((uint32_t)depth);
+    local.ring_size = htonl(b->ring_size);
+    local.num_sizes = htonl(b->num_sizes);
+    for (i = 0; i < b->num_sizes; i++)
+        local.sizes[i] = htonl(b->sizes[i]);
+    check(__swap(sockfd, is_server, &local, &remote, sizeof(local)) == 0,
+          "Failed to exchange the script");
+
+    /* the server follows the client's script */
+    if (is_server) {
+        b->iters     = ntohl(remote.iters);
+        depth        = (int)ntohl(remote.depth);
+        b->ring_size = ntohl(remote.ring_size);
+        b->num_sizes = ntohl(remote.num_sizes);
+        check(b->num_sizes <= RING_BENCH_MAX_SIZES, "Bad script");
+        for (i = 0; i < b->num_sizes; i++)
+            b->sizes[i] = ntohl(remote.sizes[i]);
+    }
+    for (i = 0; i < b->num_sizes; i++)
+        if (b->sizes[i] > max_size)
+            max_size = b->sizes[i];
+
+    check(__create_qps(b, depth) == 0, "Failed to create qps");
+    check(ring_init(&b->ring, ib_res.pd, b->qp[0], b->cq[0], RING_BENCH_SQ,
+                    b->ring_size) == 0, "Failed to init the ring");
+    check(max_size <= ring_max_msg(&b->ring), "%"PRIu32" bytes exceed the "
+          "ring's %"PRIu32, max_size, ring_max_msg(&b->ring));
+    check(__sr_init(&b->sr, b->qp[1], b->cq[1], b->cq[2], depth, max_size)
+          == 0,
+          "Failed to set up send/recv");
+    b->samples = (uint64_t *)calloc(b->iters, sizeof(uint64_t));
+    check(b->samples != NULL, "Failed to allocate samples");
+
+    check(__connect(b, sockfd, is_server) == 0, "Failed to connect");
+    check(__sync(sockfd, is_server) == 0, "Failed to sync");
+
+    if (is_server == false) {
+        printf("%s port %d: %"PRIu32" byte ring, %d receives, %"PRIu32
+               " messages per test\n\n",
+               ibv_get_device_name(ib_res.ctx->device), config_info.ib_port,
+               b->ring_size, depth, b->iters);
+        printf("%8s | %9s %9s %8s | %9s %9s %8s\n", "", "ring", "", "",
+               "send/recv", "", "");
+        printf("%8s | %9s %9s %8s | %9s %9s %8s\n", "size", "lat(us)",
+               "p99(us)", "Mmsg/s", "lat(us)", "p99(us)", "Mmsg/s");
+    }
+
+    for (i = 0; i < b->num_sizes; i++) {
+        if (is_server) {
+            check(__server_size(b, b->sizes[i]) == 0, "Size %"PRIu32
+                  " failed", b->sizes[i]);
+            continue;
+        }
+
+        check(__client_size(b, b->sizes[i], &ring, &sr) == 0,
+              "Size %"PRIu32" failed", b->sizes[i]);
+        printf("%8"PRIu32" | %9.2f %9.2f %8.3f | %9.2f %9.2f %8.3f\n",
+               b->sizes[i], ring.lat_us, ring.p99_us, ring.mops, sr.lat_us,
+               sr.p99_us, sr.mops);
+    }
+
+    if (is_server == false)
+        printf("\nring: %"PRIu64" head write-backs, full %"PRIu64" times\n",
+               b->ring.head_writes, b->ring.full_waits);
+
+    /* nobody tears down QPs with the peer's last message in flight */
+    return __sync(sockfd, is_server);
+error:
+    return -1;
+}
+
+static void __destroy(struct Bench *b) {
+    int i = 0;
+
+    ring_destroy(&b->ring);
+    if (b->sr.mr != NULL)
+        ibv_dereg_mr(b->sr.mr);
+    if (b->sr.buf != NULL)
+        free(b->sr.buf);
+    if (b->samples != NULL)
+        free(b->samples);
+    for (i = 0; i < 2; i++)
+        if (b->qp[i] != NULL)
+            ibv_destroy_qp(b->qp[i]);
+    for (i = 0; i < 3; i++)
+        if (b->cq[i] != NULL)
+            ibv_destroy_cq(b->cq[i]);
+    if (ib_res.pd != NULL)
+        ibv_dealloc_pd(ib_res.pd);
+    if (ib_res.ctx != NULL)
+        ibv_close_device(ib_res.ctx);
+}
+
+int main(int argc, char *argv[]) {
+    int ret = 0, opt = 0, depth = RING_BENCH_DEPTH;
+    int sockfd = 0, listen_fd = 0;
+    char *dev = NULL;
+    struct Bench b;
+
+    log_fp = stdout;
+    memset(&b, 0, sizeof(b));
+    b.iters     = RING_BENCH_ITERS;
+    b.ring_size = RING_SIZE;
+    b.num_sizes = 5;
+    b.sizes[0]  = 8;
+    b.sizes[1]  = 64;
+    b.sizes[2]  = 256;
+    b.sizes[3]  = 1024;
+    b.sizes[4]  = 4096;
+    config_info.ib_port   = IB_PORT;
+    config_info.gid_index = IB_GID_INDEX;
+
+    while ((opt = getopt(argc, argv, "d:P:g:r:q:s:n:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            dev = optarg;
+            break;
+        case 'P':
+            config_info.ib_port = atoi(optarg);
+            break;
+        case 'g':
+            config_info.gid_index = atoi(optarg);
+            break;
+        case 'r':
+            b.ring_size = (uint32_t)atol(optarg);
+            break;
+        case 'q':
+            depth = atoi(optarg);
+            break;
+        case 's':
+            b.num_sizes = __parse_sizes(optarg, b.sizes);
+            break;
+        case 'n':
+            b.iters = (uint32_t)atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 0;
+        }
+    }
+
+    if (argc - optind == 2) {
+        config_info.is_server   = false;
+        config_info.server_name = argv[optind];
+        config_info.sock_port   = argv[optind + 1];
+    } else if (argc - optind == 1) {
+        config_info.is_server   = true;
+        config_info.sock_port   = argv[optind];
+    } else {
+        usage(argv[0]);
+        return 0;
+    }
+
+    check(depth > 1 && b.iters > 0 && b.num_sizes > 0,
+          "depth must be above 1, iters and sizes positive");
+
+    check(tsc_init() == 0, "Failed to calibrate TSC");
+    check(__open(dev) == 0, "Failed to open device");
+
+    if (config_info.is_server) {
+        listen_fd = sock_create_bind(config_info.sock_port);
+        check(listen_fd > 0, "Failed to create server socket");
+        listen(listen_fd, 5);
+        sockfd = accept(listen_fd, NULL, NULL);
+    } else {
+        sockfd = sock_create_connect(config_info.server_name,
+                                     config_info.sock_port);
+    }
+    check(sockfd > 0, "Failed to connect to the peer");
+
+    ret = __run(&b, sockfd, config_info.is_server, depth);
+    check(ret == 0, "Failed to run");
+
+    close(sockfd);
+    if (listen_fd > 0)
+        close(listen_fd);
+    __destroy(&b);
+    return 0;
+error:
+    if (sockfd > 0)
+        close(sockfd);
+    if (listen_fd > 0)
+        close(listen_fd);
+    __destroy(&b);
+    return -1;
+}
@@ -0,0 +1,461 @@
+#include <stdlib.h>
+#include <malloc.h>
+
+#include "debug.h"
+#include "ib.h"
+#include "tsc.h"
+#include "workload.h"
+#include "rndv.h"
+
+#define RNDV_BUF_READING    0x1     /* RDMA READ in flight */
+#define RNDV_BUF_APP        0x2     /* delivered, not released yet */
+#define RNDV_BUF_LENT       0x4     /* sent on, the peer is reading it */
+
+#define RNDV_CALIB_MIN      64
+#define RNDV_CALIB_WARMUP   10
+
+static inline char *__pool_buf(struct RndvConn *c, int idx) {
+    return c->pool + (size_t)idx * c->pool_buf_size;
+}
+
+/* start reads of waiting descriptors while the pool has buffers */
+static int __start_reads(struct RndvConn *c) {
+    int ret = 0, idx = 0;
+    struct RndvDesc *d = NULL;
+
+    while (c->num_pending > 0 && c->num_free > 0) {
+        d   = &c->pending[c->pending_head];
+        idx = c->free_bufs[--c->num_free];
+
+        c->bufs[idx].len    = ntohl(d->len);
+        c->bufs[idx].imm    = ntohl(d->imm);
+        c->bufs[idx].cookie = ntohl(d->cookie);
+        c->bufs[idx].state  = RNDV_BUF_READING;
+
+        ret = post_read(c->bufs[idx].len, c->mr->lkey, idx, ntohll(d->addr),
+                        ntohl(d->rkey), c->qp, __pool_buf(c, idx));
+        check(ret == 0, "Failed to post rendezvous read of %"PRIu32" bytes",
+              c->bufs[idx].len);
+
+        c->pending_head = (c->pending_head + 1) % c->num_recvs;
+        c->num_pending--;
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+/* buf is sent on: a pool buffer stays out until the peer's FIN */
+static int __lend(struct RndvConn *c, const char *buf) {
+    int idx = -1;
+
+    if (rndv_owns(c, buf) && buf >= c->pool) {
+        idx = (buf - c->pool) / c->pool_buf_size;
+        c->bufs[idx].state |= RNDV_BUF_LENT;
+    }
+
+    return idx;
+}
+
+/* buf is the message, the receive starts recv_offset in front of it */
+static int __repost(struct RndvConn *c, char *buf) {
+    int ret = 0;
+
+    buf -= c->recv_offset;
+    ret = post_recv(c->recv_size, rndv_lkey(c, buf), (uint64_t)buf, c->qp,
+                    buf);
+    if (ret == 0 && c->credit_batch != 0)
+        c->credits_freed++;
+
+    return ret;
+}
+
+/* post queued sends while there are credits, return freed receives */
+int __rndv_credit_flush(struct RndvConn *c) {
+    int ret = 0;
+    struct RndvSend *s = NULL;
+
+    while (c->num_queued > 0 && c->credits > RNDV_CREDIT_RESERVE) {
+        s = &c->queue[c->queue_head];
+        ret = __rndv_post(c, s->buf, s->len, s->wr_id, s->imm, s->mode,
+                          s->send_flags);
+        check(ret == 0, "Failed to post a queued send");
+
+        c->queue_head = (c->queue_head + 1) % c->queue_size;
+        c->num_queued--;
+        if (s->repost) {
+            ret = __repost(c, s->buf);
+            check(ret == 0, "Failed to post recv");
+        }
+    }
+
+    if (c->credits_freed >= c->credit_batch && c->credits > 0) {
+        ret = post_send_to(0, rndv_lkey(c, c->recvs), 0,
+                           rndv_credit_imm(c, MSG_IMM(MSG_CREDIT, 0)),
+                           data_send_flags(0, &c->num_sends), c->qp, c->dest,
+                           c->recvs);
+        check(ret == 0, "Failed to return credits");
+        c->credit_msgs++;
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+static int __buf_done(struct RndvConn *c, int idx, int state) {
+    check(idx >= 0 && idx < c->num_pool && (c->bufs[idx].state & state),
+          "Bad rendezvous buffer %d", idx);
+
+    c->bufs[idx].state &= ~state;
+    if (c->bufs[idx].state != 0)
+        return 0;
+
+    c->free_bufs[c->num_free++] = idx;
+    return __start_reads(c);
+
+error:
+    return -1;
+}
+
+int rndv_init(struct RndvConn *c, struct ibv_qp *qp, int num_msgs,
+              char *recv_buf, uint32_t recv_size, int threshold) {
+    int i = 0, ret = 0;
+    size_t recvs_size = 0, pool_size = 0;
+    char *buf = NULL;
+
+    memset(c, 0, sizeof(struct RndvConn));
+    c->qp          = qp;
+    c->dest        = (const struct UdDest *)qp->qp_context;
+    c->num_recvs   = num_msgs;
+    c->recv_size   = recv_size;
+    c->recv_offset = ib_recv_offset();
+    if (config_info.credits)
+        c->num_recvs += RNDV_CREDIT_RECVS;
+
+    if (threshold != 0) {
+        /* receives hold the largest eager message, or a descriptor */
+        if (threshold == RNDV_AUTO)
+            threshold = RNDV_EAGER_MAX < workload.max_size ?
+                RNDV_EAGER_MAX : workload.max_size;
+        if (threshold > workload.max_size)
+            threshold = workload.max_size;
+        if (threshold < (int)sizeof(struct RndvDesc))
+            threshold = sizeof(struct RndvDesc);
+        c->threshold = threshold;
+        c->recv_size = ((uint32_t)threshold + 63) & ~(uint32_t)63;
+
+        /* FINs take a receive too, and so do the control messages */
+        c->num_pool      = rndv_pool_bufs();
+        c->num_recvs    += c->num_pool + 1;
+        c->pool_buf_size = ((size_t)workload.max_size + 63) & ~(size_t)63;
+        c->num_ctl       = ib_res.qp_cap.max_send_wr;
+
+        recvs_size = ((size_t)c->num_recvs * c->recv_size + 4095) &
+            ~(size_t)4095;
+        pool_size  = (size_t)c->num_pool * c->pool_buf_size;
+        c->region_size = recvs_size + pool_size +
+            c->num_ctl * sizeof(struct RndvDesc);
+
+        c->region = (char *)memalign(4096, c->region_size);
+        c->bufs      = (struct RndvBuf *)calloc(c->num_pool,
+                                                sizeof(struct RndvBuf));
+        c->free_bufs = (int *)calloc(c->num_pool, sizeof(int));
+        c->pending   = (struct RndvDesc *)calloc(c->num_recvs,
+                                                 sizeof(struct RndvDesc));
+        check(c->region != NULL && c->bufs != NULL && c->free_bufs != NULL &&
+              c->pending != NULL, "Failed to allocate rendezvous buffers");
+
+        c->mr = ibv_reg_mr(ib_res.pd, c->region, c->region_size,
+                           IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+        check(c->mr != NULL, "Failed to register rendezvous buffers");
+
+        recv_buf = c->region;
+        c->pool  = c->region + recvs_size;
+        c->ctl   = (struct RndvDesc *)(c->pool + pool_size);
+        for (i = 0; i < c->num_pool; i++)
+            c->free_bufs[c->num_free++] = c->num_pool - 1 - i;
+    }
+
+    if (config_info.credits) {
+        /* the peer posts as many receives */
+        c->credits      = c->num_recvs;
+        c->credit_batch = c->num_recvs / 2 > 2 ? c->num_recvs / 2 : 2;
+        c->queue_size   = c->num_recvs + c->num_pool + 2;
+        c->queue = (struct RndvSend *)calloc(c->queue_size,
+                                             sizeof(struct RndvSend));
+        check(c->queue != NULL, "Failed to allocate the credit queue");
+    }
+
+    c->recvs = recv_buf;
+    for (i = 0; i < c->num_recvs; i++) {
+        buf = recv_buf + (size_t)i * c->recv_size;
+        ret = post_recv(c->recv_size, rndv_lkey(c, buf), (uint64_t)buf, qp,
+                        buf);
+        check(ret == 0, "Failed to post recv");
+    }
+
+    return 0;
+error:
+    rndv_destroy(c);
+    return -1;
+}
+
+void rndv_destroy(struct RndvConn *c) {
+    if (c->mr != NULL)
+        ibv_dereg_mr(c->mr);
+    if (c->region != NULL)
+        free(c->region);
+    if (c->bufs != NULL)
+        free(c->bufs);
+    if (c->free_bufs != NULL)
+        free(c->free_bufs);
+    if (c->pending != NULL)
+        free(c->pending);
+    if (c->queue != NULL)
+        free(c->queue);
+
+    memset(c, 0, sizeof(struct RndvConn));
+}
+
+int __rndv_send_desc(struct RndvConn *c, char *buf, uint32_t len,
+                     uint64_t wr_id, uint32_t imm) {
+    int idx = __lend(c, buf);
+    bool own = rndv_owns(c, buf);
+    struct RndvDesc *d = &c->ctl[c->ctl_head];
+
+    /*
+     * The ring has a descriptor for every send queue entry: once a post
+     * succeeds, the WQE which sent this slot last has been retired.
+     */
+    c->ctl_head = (c->ctl_head + 1) % c->num_ctl;
+
+    d->addr   = htonll((uintptr_t)buf);
+    d->rkey   = htonl(own ? c->mr->rkey : ib_rkey(buf));
+    d->len    = htonl(len);
+    d->imm    = htonl(imm);
+    d->cookie = htonl((uint32_t)(idx + 1));
+
+    return post_send(sizeof(struct RndvDesc), c->mr->lkey, wr_id,
+                     rndv_credit_imm(c, MSG_IMM(MSG_RNDV_REQ, 0)),
+                     data_send_flags(sizeof(struct RndvDesc), &c->num_sends),
+                     c->qp, (char *)d);
+}
+
+int __rndv_complete(struct RndvConn *c, struct ibv_wc *wc,
+                    struct RndvMsg *msg) {
+    int ret = 0, idx = 0, tail = 0;
+    uint32_t imm = 0;
+    char *buf = NULL;
+
+    if (wc->opcode == IBV_WC_RDMA_READ) {
+        idx = (int)wc->wr_id;
+        c->bufs[idx].state = RNDV_BUF_APP;
+
+        /* the peer may reuse its pool buffer now */
+        if (c->bufs[idx].cookie != 0) {
+            ret = __rndv_submit(c, c->region, 0, 0,
+                                MSG_IMM(MSG_RNDV_FIN, c->bufs[idx].cookie),
+                                RNDV_EAGER, 0);
+            check(ret == 0, "Failed to post rendezvous fin");
+        }
+
+        msg->buf        = __pool_buf(c, idx);
+        msg->len        = c->bufs[idx].len;
+        msg->imm        = c->bufs[idx].imm;
+        msg->rendezvous = true;
+        return 1;
+    }
+
+    imm = ntohl(wc->imm_data);
+    buf = (char *)wc->wr_id + c->recv_offset;
+
+    /* with credits, every receive comes this way */
+    if (c->credit_batch != 0) {
+        c->credits += RNDV_IMM_CREDITS(imm);
+        imm = RNDV_IMM_MSG(imm);
+
+        if (MSG_IMM_TYPE(imm) < MSG_RNDV_REQ ||
+            (c->threshold == 0 && MSG_IMM_TYPE(imm) != MSG_CREDIT)) {
+            msg->buf        = buf;
+            msg->len        = wc->byte_len - c->recv_offset;
+            msg->imm        = imm;
+            msg->rendezvous = false;
+
+            ret = __rndv_credit_flush(c);
+            check(ret == 0, "Failed to spend credits");
+            return 1;
+        }
+    }
+
+    if (MSG_IMM_TYPE(imm) == MSG_RNDV_REQ) {
+        check(wc->byte_len - c->recv_offset == sizeof(struct RndvDesc) &&
+              c->num_pending < c->num_recvs, "Bad rendezvous descriptor");
+
+        tail = (c->pending_head + c->num_pending) % c->num_recvs;
+        memcpy(&c->pending[tail], buf, sizeof(struct RndvDesc));
+        if (c->num_free == 0)
+            c->pool_waits++;
+        c->num_pending++;
+    } else if (MSG_IMM_TYPE(imm) == MSG_RNDV_FIN) {
+        ret = __buf_done(c, (int)MSG_IMM_ARG(imm) - 1, RNDV_BUF_LENT);
+        check(ret == 0, "Failed to release a lent buffer");
+    }
+
+    ret = __repost(c, buf);
+    check(ret == 0, "Failed to post recv");
+
+    ret = __start_reads(c);
+    check(ret == 0, "Failed to start rendezvous reads");
+
+    if (c->credit_batch != 0) {
+        ret = __rndv_credit_flush(c);
+        check(ret == 0, "Failed to spend credits");
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+int __rndv_queue(struct RndvConn *c, char *buf, uint32_t len,
+                 uint64_t wr_id, uint32_t imm, enum RndvMode mode,
+                 int send_flags) {
+    struct RndvSend *s = NULL;
+
+    check(c->num_queued < c->queue_size, "%d sends wait for credits",
+          c->num_queued);
+
+    s = &c->queue[(c->queue_head + c->num_queued) % c->queue_size];
+    s->buf        = buf;
+    s->len        = len;
+    s->imm        = imm;
+    s->wr_id      = wr_id;
+    s->mode       = mode;
+    s->send_flags = send_flags;
+    s->repost     = false;
+    if (mode == RNDV_RENDEZVOUS)
+        __lend(c, buf);
+
+    c->num_queued++;
+    c->credit_waits++;
+    return 0;
+error:
+    return -1;
+}
+
+/*
+ * An eager message is released: repost its receive, unless a queued send
+ * still has to send from it, as the server's echo does.
+ */
+int __rndv_credit_release(struct RndvConn *c, char *buf) {
+    int i = 0, ret = 0;
+    struct RndvSend *s = NULL, *last = NULL;
+
+    for (i = 0; i < c->num_queued; i++) {
+        s = &c->queue[(c->queue_head + i) % c->queue_size];
+        if (s->buf == buf)
+            last = s;
+    }
+    if (last != NULL) {
+        last->repost = true;
+        return 0;
+    }
+
+    ret = __repost(c, buf);
+    check(ret == 0, "Failed to post recv");
+
+    return __rndv_credit_flush(c);
+error:
+    return -1;
+}
+
+int __rndv_release(struct RndvConn *c, struct RndvMsg *msg) {
+    return __buf_done(c, (msg->buf - c->pool) / c->pool_buf_size,
+                      RNDV_BUF_APP);
+}
+
+/* mean round trip of one size and protocol, in ns, or 0 on error */
+static uint64_t __calib_rtt(struct RndvConn *c, struct ibv_cq *cq, char *buf,
+                            uint32_t size, enum RndvMode mode) {
+    int i = 0, j = 0, n = 0, ret = 0;
+    bool done = false;
+    uint64_t start = 0, cycles = 0;
+    struct ibv_wc wc[8];
+    struct RndvMsg msg;
+
+    for (i = 0; i < RNDV_CALIB_WARMUP + RNDV_CALIB_ROUNDS; i++) {
+        start = rdtsc();
+        ret = rndv_send(c, buf, size, 0, MSG_IMM(MSG_REGULAR, 0), mode);
+        check(ret == 0, "Failed to post calibration message");
+
+        for (done = false; done == false; ) {
+            n = ibv_poll_cq(cq, 8, wc);
+            check(n >= 0, "Failed to poll cq");
+
+            for (j = 0; j < n; j++) {
+                check(wc[j].status == IBV_WC_SUCCESS, "wc failed status: %d, %s",
+                      wc[j].status, ibv_wc_status_str(wc[j].status));
+
+                ret = rndv_complete(c, &wc[j], &msg);
+                check(ret >= 0, "Failed to complete calibration message");
+                if (ret == 0)
+                    continue;
+
+                check(MSG_IMM_TYPE(msg.imm) != MSG_CTL_STOP,
+                      "Server stopped during calibration");
+                ret = rndv_release(c, &msg);
+                check(ret == 0, "Failed to release calibration message");
+                done = true;
+            }
+        }
+
+        if (i >= RNDV_CALIB_WARMUP)
+            cycles += rdtsc() - start;
+    }
+
+    return tsc_to_ns(cycles) / RNDV_CALIB_ROUNDS;
+error:
+    return 0;
+}
+
+/*
+ * Ping-pong both protocols at doubling sizes, one message at a time, and
+ * keep the largest size at which eager was still as fast. The server
+ * echoes a message the way it came, so the calibration needs no help from
+ * it, though it counts the round trips as warm-up ops. buf is a registered
+ * send buffer of the caller.
+ */
+int rndv_calibrate(struct RndvConn *c, struct ibv_cq *cq, char *buf) {
+    uint32_t size = 0, max_size = c->recv_size;
+    uint64_t eager_ns = 0, rndv_ns = 0;
+    int threshold = RNDV_CALIB_MIN;
+
+    if (c->threshold == 0)
+        return 0;
+
+    if (max_size > c->pool_buf_size)
+        max_size = c->pool_buf_size;
+
+    for (size = RNDV_CALIB_MIN; size <= max_size; size *= 2) {
+        eager_ns = __calib_rtt(c, cq, buf, size, RNDV_EAGER);
+        rndv_ns  = __calib_rtt(c, cq, buf, size, RNDV_RENDEZVOUS);
+        check(eager_ns > 0 && rndv_ns > 0, "Failed to calibrate at %"PRIu32
+              " bytes", size);
+
+        log("rndv calibration: %8"PRIu32" bytes, eager %6"PRIu64" ns, "
+            "rendezvous %6"PRIu64" ns", size, eager_ns, rndv_ns);
+        if (rndv_ns < eager_ns)
+            break;
+        threshold = size;
+    }
+    /* eager won up to the receive size */
+    if (size > max_size)
+        threshold = max_size;
+
+    c->threshold = threshold;
+    return 0;
+error:
+    return -1;
+}
@@ -0,0 +1,305 @@
+#ifndef __RNDV_H__
+#define __RNDV_H__
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include <infiniband/verbs.h>
+
+#include "ib.h"
+#include "config.h"
+#include "setup_ib.h"
+
+/*
+ * Eager/rendezvous messaging
+ *
+ * Pre-posting a receive of the largest message in every slot wastes memory
+ * when most messages are small. With a rendezvous threshold, receives are
+ * only large enough for the threshold. A message up to it is sent eagerly
+ * (inline when it fits); a larger one sends a RndvDesc naming the
+ * registered buffer it sits in, and the receiver pulls the payload with RDMA
+ * READ into one of a few pool buffers. Descriptors which find the pool empty
+ * wait for a buffer to be released.
+ *
+ * The sender must leave a rendezvous buffer alone until the peer answers.
+ * Pool buffers are sent on by the layer itself (the server echoes from
+ * them), so for those the reader returns a MSG_RNDV_FIN.
+ *
+ * --rndv=BYTES sets the threshold, --rndv=auto measures the cutoff at
+ * connection time with rndv_calibrate(). Both sides need the same setting,
+ * which sizes the receives. Without it every call is a plain send or
+ * receive on the caller's buffers.
+ *
+ * A RndvConn belongs to one peer of a QP and is used by the QP's worker
+ * thread only. A UD server QP keeps one per client QP it answers, each with
+ * the peer's address in dest; their receives all go to the QP's one receive
+ * queue, so a message may land in a buffer another peer's RndvConn posted.
+ * Receives are the same size, and the one the message took is reposted and
+ * counted as a credit by the RndvConn of its sender.
+ */
+#define RNDV_AUTO           -1
+#define RNDV_EAGER_MAX      16384   /* eager receive size with --rndv=auto */
+#define RNDV_POOL_BUFS      16      /* default of --rndv-pool, per thread */
+#define RNDV_CALIB_ROUNDS   100     /* round trips per size and protocol */
+
+/*
+ * Credits
+ *
+ * With --credits every message which takes a receive of the peer spends a
+ * credit, and the peer's receives are its credits to start with. The top
+ * byte of every immediate returns the receives reposted since the last one
+ * went out. Once half of them are waiting, a MSG_CREDIT returns them
+ * without waiting for a message to ride on. Sends without credit queue
+ * in the layer, in order, until credits come back.
+ *
+ * The last credit is kept for MSG_CREDIT: if a sender is stuck, the peer
+ * holds all of its receives but one and can always return them. A MSG_CREDIT
+ * only sends once at least two receives are waiting, so credit messages can
+ * not answer each other forever. Both sides post a receive more for the
+ * reserve and one for control messages; the immediate of a message is left
+ * 16 bits of argument.
+ */
+#define RNDV_CREDIT_RECVS       2       /* extra receives with credits */
+#define RNDV_CREDIT_RESERVE     1       /* credits only MSG_CREDIT may use */
+#define RNDV_CREDIT_MAX         255     /* returned by one immediate */
+#define RNDV_CREDIT_MAX_MSGS    65535   /* MSG_IMM argument with credits */
+#define RNDV_IMM_CREDITS(imm)   ((imm) >> 24)
+#define RNDV_IMM_MSG(imm)       ((imm) & 0xffffff)
+
+/* how rndv_send() moves the message */
+enum RndvMode {
+    RNDV_ANY = 0,       /* by the threshold */
+    RNDV_EAGER,
+    RNDV_RENDEZVOUS,
+};
+
+/* a send waiting for a credit */
+struct RndvSend {
+    char            *buf;
+    uint32_t        len;
+    uint32_t        imm;
+    uint64_t        wr_id;
+    enum RndvMode   mode;
+    int             send_flags;
+    bool            repost;     /* buf is a receive, repost it once sent */
+};
+
+/* sent with MSG_RNDV_REQ in place of the payload, network order */
+struct RndvDesc {
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t len;
+    uint32_t imm;       /* of the message */
+    uint32_t cookie;    /* pool buffer + 1 to return in a FIN, or 0 */
+}__attribute__((packed));
+
+struct RndvBuf {
+    uint32_t len;
+    uint32_t imm;
+    uint32_t cookie;    /* of the peer's buffer */
+    int      state;     /* RNDV_BUF_* */
+};
+
+struct RndvMsg {
+    char     *buf;
+    uint32_t len;
+    uint32_t imm;       /* host order */
+    bool     rendezvous;
+};
+
+struct RndvConn {
+    struct ibv_qp   *qp;
+    const struct UdDest *dest;      /* UD: the peer, NULL for RC */
+    int             threshold;      /* largest eager message, 0 when off */
+    char            *recvs;         /* first receive buffer */
+    uint32_t        recv_size;
+    uint32_t        recv_offset;    /* of a message in its receive, the GRH */
+    int             num_recvs;
+    uint64_t        num_sends;      /* for data_send_flags() */
+
+    /* with a threshold: receives, pool and descriptors in one MR */
+    char            *region;
+    size_t          region_size;
+    struct ibv_mr   *mr;
+    char            *pool;
+    size_t          pool_buf_size;
+    int             num_pool;
+    struct RndvBuf  *bufs;
+    int             *free_bufs;     /* stack of pool buffers */
+    int             num_free;
+    struct RndvDesc *ctl;           /* descriptors being sent */
+    int             num_ctl;
+    int             ctl_head;
+    struct RndvDesc *pending;       /* waiting for a pool buffer */
+    int             pending_head;
+    int             num_pending;
+
+    /* with credits */
+    int             credit_batch;   /* MSG_CREDIT at this many, 0 when off */
+    int             credits;        /* receives of the peer we may take */
+    int             credits_freed;  /* reposted, not returned yet */
+    struct RndvSend *queue;         /* sends waiting for credits */
+    int             queue_size;
+    int             queue_head;
+    int             num_queued;
+
+    uint64_t        eager_msgs;     /* sent */
+    uint64_t        rndv_msgs;      /* sent */
+    uint64_t        pool_waits;     /* descriptors which found no buffer */
+    uint64_t        credit_waits;   /* sends which found no credit */
+    uint64_t        credit_msgs;    /* MSG_CREDIT sent */
+};
+
+/* pool buffers of a thread, bounded by the messages it can have in flight */
+static inline int rndv_pool_bufs() {
+    return config_info.rndv_pool < config_info.num_concurr_msgs ?
+        config_info.rndv_pool : config_info.num_concurr_msgs;
+}
+
+/* receives of a thread without a rendezvous threshold, in ib_buf slots */
+static inline int rndv_eager_recvs() {
+    return config_info.num_concurr_msgs +
+        (config_info.credits ? RNDV_CREDIT_RECVS : 0);
+}
+
+/* the largest message a receive of the peer takes */
+static inline uint32_t rndv_recv_room(struct RndvConn *c) {
+    uint32_t room = c->recv_size - c->recv_offset;
+
+    return ib_res.ud_mtu != 0 && room > ib_res.ud_mtu ? ib_res.ud_mtu : room;
+}
+
+static inline bool rndv_owns(struct RndvConn *c, const char *buf) {
+    return buf >= c->region && buf < c->region + c->region_size;
+}
+
+static inline uint32_t rndv_lkey(struct RndvConn *c, const char *buf) {
+    return c->mr != NULL && rndv_owns(c, buf) ? c->mr->lkey : ib_lkey(buf);
+}
+
+int  rndv_init(struct RndvConn *c, struct ibv_qp *qp, int num_msgs,
+               char *recv_buf, uint32_t recv_size, int threshold);
+void rndv_destroy(struct RndvConn *c);
+
+int  __rndv_send_desc(struct RndvConn *c, char *buf, uint32_t len,
+                      uint64_t wr_id, uint32_t imm);
+int  __rndv_queue(struct RndvConn *c, char *buf, uint32_t len,
+                  uint64_t wr_id, uint32_t imm, enum RndvMode mode,
+                  int send_flags);
+int  __rndv_complete(struct RndvConn *c, struct ibv_wc *wc,
+                     struct RndvMsg *msg);
+int  __rndv_release(struct RndvConn *c, struct RndvMsg *msg);
+int  __rndv_credit_release(struct RndvConn *c, char *buf);
+int  __rndv_credit_flush(struct RndvConn *c);
+
+int  rndv_calibrate(struct RndvConn *c, struct ibv_cq *cq, char *buf);
+
+/* spend a credit on a message, returning freed receives in its immediate */
+static inline uint32_t rndv_credit_imm(struct RndvConn *c, uint32_t imm) {
+    int n = 0;
+
+    if (c->credit_batch == 0)
+        return imm;
+
+    n = c->credits_freed < RNDV_CREDIT_MAX ?
+        c->credits_freed : RNDV_CREDIT_MAX;
+    c->credits_freed -= n;
+    c->credits--;
+    return imm | (uint32_t)n << 24;
+}
+
+/* mode is RNDV_EAGER or RNDV_RENDEZVOUS, send_flags 0 for data_send_flags() */
+static inline int __rndv_post(struct RndvConn *c, char *buf, uint32_t len,
+                              uint64_t wr_id, uint32_t imm,
+                              enum RndvMode mode, int send_flags) {
+    if (mode == RNDV_RENDEZVOUS)
+        return __rndv_send_desc(c, buf, len, wr_id, imm);
+
+    return post_send_to(len, rndv_lkey(c, buf), wr_id,
+                        rndv_credit_imm(c, imm), send_flags ? send_flags :
+                        data_send_flags(len, &c->num_sends), c->qp, c->dest,
+                        buf);
+}
+
+/* post now, or queue behind earlier sends until there is a credit */
+static inline int __rndv_submit(struct RndvConn *c, char *buf, uint32_t len,
+                                uint64_t wr_id, uint32_t imm,
+                                enum RndvMode mode, int send_flags) {
+    if (c->credit_batch != 0 &&
+        (c->num_queued > 0 || c->credits <= RNDV_CREDIT_RESERVE))
+        return __rndv_queue(c, buf, len, wr_id, imm, mode, send_flags);
+
+    return __rndv_post(c, buf, len, wr_id, imm, mode, send_flags);
+}
+
+/* buf must be registered, in ib_buf or the layer's own region */
+static inline int rndv_send(struct RndvConn *c, char *buf, uint32_t len,
+                            uint64_t wr_id, uint32_t imm, enum RndvMode mode) {
+    if (c->threshold == 0 || mode == RNDV_EAGER ||
+        (mode == RNDV_ANY && len <= (uint32_t)c->threshold)) {
+        c->eager_msgs++;
+        return __rndv_submit(c, buf, len, wr_id, imm, RNDV_EAGER, 0);
+    }
+
+    c->rndv_msgs++;
+    return __rndv_submit(c, buf, len, wr_id, imm, RNDV_RENDEZVOUS, 0);
+}
+
+/* an empty, signaled control message of type, e.g. MSG_CTL_STOP */
+static inline int rndv_send_ctl(struct RndvConn *c, char *buf, uint64_t wr_id,
+                                enum MsgType type) {
+    return __rndv_submit(c, buf, 0, wr_id, MSG_IMM(type, 0), RNDV_EAGER,
+                         IBV_SEND_SIGNALED);
+}
+
+/*
+ * Feed one completion through the layer. Returns 1 with msg filled in when
+ * a message arrived, 0 for completions the layer consumed, -1 on error.
+ */
+static inline int rndv_complete(struct RndvConn *c, struct ibv_wc *wc,
+                                struct RndvMsg *msg) {
+    uint32_t imm = 0;
+
+    if (wc->opcode == IBV_WC_RECV) {
+        imm = ntohl(wc->imm_data);
+        if (c->credit_batch == 0 &&
+            (c->threshold == 0 || MSG_IMM_TYPE(imm) < MSG_RNDV_REQ)) {
+            msg->buf        = (char *)wc->wr_id + c->recv_offset;
+            msg->len        = wc->byte_len - c->recv_offset;
+            msg->imm        = imm;
+            msg->rendezvous = false;
+            return 1;
+        }
+    } else if (wc->opcode != IBV_WC_RDMA_READ) {
+        return 0;
+    }
+
+    return __rndv_complete(c, wc, msg);
+}
+
+/*
+ * Feed a completion which arrives after the worker stopped taking messages:
+ * with credits, the ones it returns still count and queued sends still go
+ * out; nothing is delivered, read or reposted.
+ */
+static inline int rndv_discard(struct RndvConn *c, struct ibv_wc *wc) {
+    if (c->credit_batch == 0 || wc->opcode != IBV_WC_RECV)
+        return 0;
+
+    c->credits += RNDV_IMM_CREDITS(ntohl(wc->imm_data));
+    return __rndv_credit_flush(c);
+}
+
+/* hand a delivered message back: repost its receive or free its buffer */
+static inline int rndv_release(struct RndvConn *c, struct RndvMsg *msg) {
+    if (msg->rendezvous == true)
+        return __rndv_release(c, msg);
+    if (c->credit_batch != 0)
+        return __rndv_credit_release(c, msg->buf);
+
+    return post_recv(c->recv_size, rndv_lkey(c, msg->buf),
+                     (uint64_t)(msg->buf - c->recv_offset), c->qp,
+                     msg->buf - c->recv_offset);
+}
+
+#endif /* __RNDV_H__ */
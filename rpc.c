@@ -0,0 +1,336 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "rpc.h"
+
+struct RpcMethod rpc_methods[RPC_MAX_METHODS];
+
+static int __rpc_null(struct RpcCall *call, void *arg) {
+    call->resp_len = 0;
+    return 0;
+}
+
+static int __rpc_echo(struct RpcCall *call, void *arg) {
+    call->resp     = call->req;
+    call->resp_len = call->req_len;
+    return 0;
+}
+
+int rpc_register(uint16_t method, const char *name,
+                 int (*handler)(struct RpcCall *call, void *arg), void *arg) {
+    check(method < RPC_MAX_METHODS, "RPC method %d is above %d", method,
+          RPC_MAX_METHODS - 1);
+    check(rpc_methods[method].handler == NULL, "RPC method %d is taken by %s",
+          method, rpc_methods[method].name);
+    check(rpc_method_id(name) < 0, "RPC method %s is registered twice", name);
+
+    rpc_methods[method].name    = name;
+    rpc_methods[method].handler = handler;
+    rpc_methods[method].arg     = arg;
+    return 0;
+error:
+    return -1;
+}
+
+int rpc_init_methods() {
+    int ret = 0;
+
+    ret = rpc_register(RPC_NULL, "null", __rpc_null, NULL);
+    check(ret == 0, "Failed to register the null method");
+
+    ret = rpc_register(RPC_ECHO, "echo", __rpc_echo, NULL);
+    check(ret == 0, "Failed to register the echo method");
+
+    return 0;
+error:
+    return -1;
+}
+
+int rpc_method_id(const char *name) {
+    int i = 0;
+
+    for (i = 0; i < RPC_MAX_METHODS; i++)
+        if (rpc_methods[i].name != NULL &&
+            strcmp(rpc_methods[i].name, name) == 0)
+            return i;
+
+    return -1;
+}
+
+int rpc_init(struct RpcConn *c, struct RndvConn *rc, int num_slots,
+             char *resp_bufs, uint32_t resp_size) {
+    memset(c, 0, sizeof(struct RpcConn));
+    check(num_slots > 0 && num_slots <= (int)RPC_SLOT_MASK + 1,
+          "%d RPC slots, at most %d", num_slots, RPC_SLOT_MASK + 1);
+    check(resp_bufs == NULL || resp_size > sizeof(struct RpcHdr),
+          "RPC response slots of %"PRIu32" bytes", resp_size);
+
+    c->rc        = rc;
+    c->num_slots = num_slots;
+    c->resp_bufs = resp_bufs;
+    c->resp_size = resp_size;
+
+    c->pending = (struct RpcPending *)calloc(num_slots,
+                                             sizeof(struct RpcPending));
+    check(c->pending != NULL, "Failed to allocate pending calls");
+
+    return 0;
+error:
+    rpc_destroy(c);
+    return -1;
+}
+
+void rpc_destroy(struct RpcConn *c) {
+    if (c->pending != NULL)
+        free(c->pending);
+
+    memset(c, 0, sizeof(struct RpcConn));
+}
+
+int rpc_coalesce(struct RpcConn *c, char *bufs, uint32_t buf_size,
+                 int num_bufs, int max) {
+    /* a batch lands in one receive of the peer, sized like ours */
+    if (buf_size > rndv_recv_room(c->rc))
+        buf_size = rndv_recv_room(c->rc);
+
+    check(bufs != NULL && num_bufs > 0 && max > 1 &&
+          buf_size > sizeof(struct RpcHdr),
+          "Bad RPC batches: %d of %"PRIu32" bytes, %d responses", num_bufs,
+          buf_size, max);
+
+    c->batch_bufs     = bufs;
+    c->batch_size     = buf_size;
+    c->num_batch_bufs = num_bufs;
+    c->batch_max      = max;
+    c->batch_next     = 0;
+    c->batch_count    = 0;
+    c->batch_len      = 0;
+    return 0;
+error:
+    return -1;
+}
+
+int rpc_call(struct RpcConn *c, int slot, uint16_t method, char *buf,
+             uint32_t len) {
+    struct RpcHdr *hdr = (struct RpcHdr *)buf;
+    struct RpcPending *p = NULL;
+
+    check(slot >= 0 && slot < c->num_slots, "RPC slot %d of %d", slot,
+          c->num_slots);
+    p = &c->pending[slot];
+    check(p->busy == false, "RPC slot %d is busy", slot);
+
+    hdr->req_id = c->next_seq++ << RPC_SLOT_BITS | (uint32_t)slot;
+    hdr->method = method;
+    hdr->status = RPC_OK;
+    hdr->len    = len;
+
+    p->req_id = hdr->req_id;
+    p->busy   = true;
+    c->calls++;
+
+    return rndv_send(c->rc, buf, sizeof(struct RpcHdr) + len, hdr->req_id,
+                     MSG_IMM(MSG_RPC, 0), RNDV_ANY);
+error:
+    return -1;
+}
+
+int rpc_complete(struct RpcConn *c, struct RndvMsg *msg,
+                 struct RpcResult *res) {
+    struct RpcHdr *hdr = (struct RpcHdr *)msg->buf;
+    struct RpcPending *p = NULL;
+    int slot = 0;
+
+    check(MSG_IMM_TYPE(msg->imm) == MSG_RPC &&
+          msg->len >= sizeof(struct RpcHdr) &&
+          hdr->len == msg->len - sizeof(struct RpcHdr),
+          "Bad RPC response of %"PRIu32" bytes", msg->len);
+
+    slot = (int)(hdr->req_id & RPC_SLOT_MASK);
+    check(slot < c->num_slots, "RPC response for slot %d", slot);
+    p = &c->pending[slot];
+    check(p->busy && p->req_id == hdr->req_id,
+          "RPC response %#"PRIx32" matches no call", hdr->req_id);
+    p->busy = false;
+
+    if (hdr->status != RPC_OK)
+        c->errors++;
+
+    res->slot   = slot;
+    res->method = hdr->method;
+    res->status = hdr->status;
+    res->data   = msg->buf + sizeof(struct RpcHdr);
+    res->len    = hdr->len;
+    return slot;
+error:
+    return -1;
+}
+
+int rpc_handle(struct RpcConn *c, struct RndvMsg *msg, struct RpcResp *resp) {
+    struct RpcHdr *hdr = (struct RpcHdr *)msg->buf;
+    struct RpcMethod *m = NULL;
+    struct RpcCall call;
+    uint16_t status = RPC_OK;
+    char *slot_buf = NULL;
+    int slot = 0;
+
+    resp->mode   = msg->rendezvous ? RNDV_RENDEZVOUS : RNDV_EAGER;
+    resp->status = RPC_OK;
+    if (MSG_IMM_TYPE(msg->imm) != MSG_RPC) {
+        resp->buf = msg->buf;
+        resp->len = msg->len;
+        resp->imm = msg->imm;
+        return 0;
+    }
+
+    check(msg->len >= sizeof(struct RpcHdr) &&
+          hdr->len == msg->len - sizeof(struct RpcHdr),
+          "Bad RPC request of %"PRIu32" bytes", msg->len);
+    slot = (int)(hdr->req_id & RPC_SLOT_MASK);
+    check(slot < c->num_slots, "RPC request from slot %d", slot);
+    slot_buf = c->resp_bufs + (size_t)slot * c->resp_size +
+        sizeof(struct RpcHdr);
+
+    call.req_id   = hdr->req_id;
+    call.method   = hdr->method;
+    call.req      = msg->buf + sizeof(struct RpcHdr);
+    call.req_len  = hdr->len;
+    call.resp     = slot_buf;
+    call.resp_len = 0;
+    call.resp_max = c->resp_size - sizeof(struct RpcHdr);
+    /* without rendezvous a response must fit a receive of the peer */
+    if (c->rc->threshold == 0 &&
+        call.resp_max > rndv_recv_room(c->rc) - sizeof(struct RpcHdr))
+        call.resp_max = rndv_recv_room(c->rc) - sizeof(struct RpcHdr);
+
+    if (call.method < RPC_MAX_METHODS)
+        m = &rpc_methods[call.method];
+    if (m == NULL || m->handler == NULL)
+        status = RPC_NO_METHOD;
+    else if (m->handler(&call, m->arg) != 0)
+        status = RPC_FAILED;
+
+    if (status != RPC_OK) {
+        call.resp     = slot_buf;
+        call.resp_len = 0;
+    }
+    check((call.resp == slot_buf && call.resp_len <= call.resp_max) ||
+          (call.resp == call.req && call.resp_len <= call.req_len),
+          "RPC method %d answered outside its buffers", call.method);
+
+    /* an in-place answer goes back the way the request came */
+    if (call.resp != call.req)
+        resp->mode = RNDV_ANY;
+
+    hdr = (struct RpcHdr *)(call.resp - sizeof(struct RpcHdr));
+    hdr->req_id = call.req_id;
+    hdr->method = call.method;
+    hdr->status = status;
+    hdr->len    = call.resp_len;
+
+    resp->buf    = (char *)hdr;
+    resp->len    = sizeof(struct RpcHdr) + call.resp_len;
+    resp->imm    = MSG_IMM(MSG_RPC, 0);
+    resp->status = status;
+    return 0;
+error:
+    return -1;
+}
+
+/* an eager RPC response which fits a batch */
+static bool __rpc_batchable(struct RpcConn *c, struct RpcResp *resp) {
+    if (c->batch_max == 0 || MSG_IMM_TYPE(resp->imm) != MSG_RPC ||
+        resp->mode == RNDV_RENDEZVOUS || resp->len > c->batch_size)
+        return false;
+
+    return resp->mode == RNDV_EAGER || c->rc->threshold == 0 ||
+        resp->len <= (uint32_t)c->rc->threshold;
+}
+
+int rpc_respond(struct RpcConn *c, struct RpcResp *resp) {
+    char *batch = NULL;
+
+    if (MSG_IMM_TYPE(resp->imm) == MSG_RPC) {
+        c->calls++;
+        if (resp->status != RPC_OK)
+            c->errors++;
+    }
+
+    if (__rpc_batchable(c, resp) == false)
+        return rndv_send(c->rc, resp->buf, resp->len, 0, resp->imm,
+                         resp->mode);
+
+    if (c->batch_len + resp->len > c->batch_size && rpc_flush(c) != 0)
+        return -1;
+    if (c->batch_count == 0)
+        c->batch_tsc = rdtsc();
+
+    batch = c->batch_bufs + (size_t)c->batch_next * c->batch_size;
+    memcpy(batch + c->batch_len, resp->buf, resp->len);
+    c->batch_len += resp->len;
+    c->batch_count++;
+
+    if (c->batch_count == c->batch_max)
+        return rpc_flush(c);
+    return 0;
+}
+
+int rpc_dispatch(struct RpcConn *c, struct RndvMsg *msg) {
+    struct RpcResp resp;
+
+    if (rpc_handle(c, msg, &resp) != 0)
+        return -1;
+
+    return rpc_respond(c, &resp);
+}
+
+int rpc_flush(struct RpcConn *c) {
+    char *batch = NULL;
+    uint32_t imm = MSG_IMM(MSG_RPC, 0), len = c->batch_len;
+
+    if (c->batch_count == 0)
+        return 0;
+
+    batch = c->batch_bufs + (size_t)c->batch_next * c->batch_size;
+    if (c->batch_count > 1) {
+        imm = MSG_IMM(MSG_RPC_BATCH, c->batch_count);
+        c->batches++;
+        c->coalesced += c->batch_count;
+    }
+
+    c->batch_next  = (c->batch_next + 1) % c->num_batch_bufs;
+    c->batch_count = 0;
+    c->batch_len   = 0;
+    return rndv_send(c->rc, batch, len, 0, imm, RNDV_EAGER);
+}
+
+bool rpc_next_response(struct RndvMsg *msg, uint32_t *off,
+                       struct RndvMsg *frame) {
+    struct RpcHdr *hdr = NULL;
+    uint32_t left = msg->len - *off;
+
+    if (MSG_IMM_TYPE(msg->imm) != MSG_RPC_BATCH) {
+        if (*off != 0)
+            return false;
+        *frame = *msg;
+        *off   = msg->len;
+        return true;
+    }
+
+    if (*off >= msg->len)
+        return false;
+
+    /* a truncated frame takes the rest, for rpc_complete() to refuse */
+    hdr = (struct RpcHdr *)(msg->buf + *off);
+    frame->buf        = msg->buf + *off;
+    frame->len        = left;
+    frame->imm        = MSG_IMM(MSG_RPC, 0);
+    frame->rendezvous = msg->rendezvous;
+    if (left >= sizeof(struct RpcHdr) &&
+        hdr->len <= left - sizeof(struct RpcHdr))
+        frame->len = sizeof(struct RpcHdr) + hdr->len;
+
+    *off += frame->len;
+    return true;
+}
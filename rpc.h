@@ -0,0 +1,188 @@
+#ifndef __RPC_H__
+#define __RPC_H__
+
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include "rndv.h"
+#include "tsc.h"
+
+/*
+ * Request/response RPC
+ *
+ * A call is one MSG_RPC message: an RpcHdr followed by the payload, both
+ * counted in the message size. The client numbers its calls per slot, the
+ * low RPC_SLOT_BITS of req_id name the slot and are the wr_id of the send,
+ * so a response finds its call without a search; the rest of req_id tells a
+ * late response from the current call of the slot.
+ *
+ * The server looks the method up in the handler table and hands the
+ * request to the handler in its receive buffer. The handler answers in
+ * call->resp, which starts out as the server's response slot for the
+ * client's slot, or points it at the request to answer in place. Either way
+ * the header goes into the bytes in front of the payload and the response
+ * is sent from there, without a copy. A client reuses a slot only once its
+ * response is in, so the response slot is free again by then.
+ *
+ * Messages of other types are echoed back the way they came, which is what
+ * rndv_calibrate() expects. Handlers are registered before the worker
+ * threads start and are shared by all of them; an RpcConn belongs to one
+ * worker and its RndvConn.
+ *
+ * With rpc_coalesce() the server copies eager responses into a batch buffer
+ * instead of sending each on its own, and rpc_flush() sends the batch as one
+ * MSG_RPC_BATCH message: the responses back to back, each behind its
+ * RpcHdr, their count in the immediate. A batch of one goes out as a plain
+ * MSG_RPC. Responses which do not fit a batch, or go by rendezvous, are sent
+ * right away. The client takes a batch apart with rpc_next_response().
+ *
+ * A batch is at most the peer's receive size. The batch buffers are filled
+ * in turn and num_concurr_msgs of them are enough: the client has at most
+ * that many calls in flight, so before a buffer is filled again the batch
+ * sent from it has arrived, RC delivering in order.
+ */
+#define RPC_MAX_METHODS     16
+#define RPC_SLOT_BITS       16
+#define RPC_SLOT_MASK       ((1u << RPC_SLOT_BITS) - 1)
+
+/* built in, registered by rpc_init_methods() */
+#define RPC_NULL            0       /* empty response */
+#define RPC_ECHO            1       /* the request payload, in place */
+#define RPC_SERVE           2       /* the server's --handler, handler.h */
+
+enum RpcStatus {
+    RPC_OK = 0,
+    RPC_NO_METHOD,
+    RPC_FAILED,         /* the handler returned an error */
+};
+
+/* in front of every request and response, host order */
+struct RpcHdr {
+    uint32_t req_id;
+    uint16_t method;
+    uint16_t status;    /* enum RpcStatus, responses only */
+    uint32_t len;       /* payload bytes */
+}__attribute__((packed));
+
+struct RpcCall {
+    uint32_t req_id;
+    uint16_t method;
+    char     *req;      /* payload, valid during the handler only */
+    uint32_t req_len;
+    char     *resp;     /* the response slot, or set to req */
+    uint32_t resp_len;
+    uint32_t resp_max;  /* room in the response slot */
+};
+
+struct RpcMethod {
+    const char *name;
+    int  (*handler)(struct RpcCall *call, void *arg);  /* 0 or -1 */
+    void *arg;
+};
+
+/* a call of the client waiting for its response */
+struct RpcPending {
+    uint32_t req_id;
+    bool     busy;
+};
+
+struct RpcConn {
+    struct RndvConn     *rc;
+    int                 num_slots;
+
+    /* client */
+    struct RpcPending   *pending;
+    uint32_t            next_seq;
+
+    /* server: a response slot per client slot, registered */
+    char                *resp_bufs;
+    uint32_t            resp_size;
+
+    /* server, coalescing: responses waiting in a batch buffer */
+    char                *batch_bufs;
+    uint32_t            batch_size;
+    int                 num_batch_bufs;
+    int                 batch_max;      /* responses per batch, 0 when off */
+    int                 batch_next;     /* the buffer being filled */
+    int                 batch_count;
+    uint32_t            batch_len;
+    uint64_t            batch_tsc;      /* of its first response */
+
+    uint64_t            calls;          /* sent or served */
+    uint64_t            errors;         /* served with a status, or failed */
+    uint64_t            batches;        /* MSG_RPC_BATCH sent */
+    uint64_t            coalesced;      /* responses in them */
+};
+
+/* a response built by rpc_handle(), ready to send */
+struct RpcResp {
+    char          *buf;
+    uint32_t      len;
+    uint32_t      imm;
+    enum RndvMode mode;
+    uint16_t      status;
+};
+
+/* a response delivered by rpc_complete() */
+struct RpcResult {
+    int      slot;
+    uint16_t method;
+    uint16_t status;
+    char     *data;     /* payload, valid until the message is released */
+    uint32_t len;
+};
+
+extern struct RpcMethod rpc_methods[RPC_MAX_METHODS];
+
+int  rpc_register(uint16_t method, const char *name,
+                  int (*handler)(struct RpcCall *call, void *arg), void *arg);
+int  rpc_init_methods();
+int  rpc_method_id(const char *name);
+
+int  rpc_init(struct RpcConn *c, struct RndvConn *rc, int num_slots,
+              char *resp_bufs, uint32_t resp_size);
+void rpc_destroy(struct RpcConn *c);
+/* batch up to max responses in num_bufs registered buffers of buf_size */
+int  rpc_coalesce(struct RpcConn *c, char *bufs, uint32_t buf_size,
+                  int num_bufs, int max);
+
+/*
+ * Call method from slot with the len payload bytes at buf + sizeof(struct
+ * RpcHdr); buf is registered and left alone until the response is in.
+ */
+int  rpc_call(struct RpcConn *c, int slot, uint16_t method, char *buf,
+              uint32_t len);
+/* match a delivered MSG_RPC response to its call, -1 if it has none */
+int  rpc_complete(struct RpcConn *c, struct RndvMsg *msg,
+                  struct RpcResult *res);
+
+/*
+ * Serve a delivered message, the caller releases it afterwards.
+ * rpc_dispatch() is rpc_handle() and rpc_respond() in one go; apart, the
+ * handler can run on another thread than the one owning the RndvConn:
+ * rpc_handle() only touches the message and its response slot.
+ */
+int  rpc_handle(struct RpcConn *c, struct RndvMsg *msg, struct RpcResp *resp);
+int  rpc_respond(struct RpcConn *c, struct RpcResp *resp);
+int  rpc_dispatch(struct RpcConn *c, struct RndvMsg *msg);
+
+/* send the responses batched so far */
+int  rpc_flush(struct RpcConn *c);
+
+/* flush a batch whose first response has waited hold_tsc or longer */
+static inline int rpc_flush_after(struct RpcConn *c, uint64_t hold_tsc) {
+    if (c->batch_count == 0 || rdtsc() - c->batch_tsc < hold_tsc)
+        return 0;
+
+    return rpc_flush(c);
+}
+
+/*
+ * Step through the responses of a delivered message, from *off = 0: every
+ * response of a MSG_RPC_BATCH in turn as a MSG_RPC message of its own, any
+ * other message as it is. Returns false when there are no more.
+ */
+bool rpc_next_response(struct RndvMsg *msg, uint32_t *off,
+                       struct RndvMsg *frame);
+
+#endif /* __RPC_H__ */
@@ -2,64 +2,358 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include "debug.h"
 #include "ib.h"
+#include "stats.h"
+#include "results.h"
+#include "msg_trace.h"
+#include "tsc.h"
 #include "setup_ib.h"
+#include "ah_cache.h"
 #include "config.h"
 #include "server.h"
+#include "rndv.h"
+#include "rpc.h"
+#include "pipeline.h"
+#include "steal.h"
+#include "probes.h"
+
+/*
+ * A client QP we serve. An RC QP has one, bound from the start. A UD QP
+ * answers all the client QPs connected to it: each one's first message, its
+ * MSG_CTL_START, binds it to a free peer, whose replies are addressed to
+ * the port and QP it came from. Every peer has its own slots and rndv and
+ * rpc state, its receives all go to the QP's receive queue.
+ */
+struct ServerPeer {
+    struct RndvConn rc;
+    struct RpcConn  rpc;
+    struct UdDest   dest;
+    char            *buf;       /* its slots, the first for control messages */
+};
+
+/* what a UD receive is matched on, the sender's port and QP */
+struct PeerKey {
+    union ibv_gid   gid;
+    uint32_t        qp_num;
+    uint16_t        lid;
+};
+
+struct PeerTable {
+    struct ServerPeer   *peers;
+    struct PeerKey      *keys;      /* of the bound peers */
+    int                 num_peers;  /* connected to the QP */
+    int                 num_bound;
+    int                 num_stopped;    /* sent MSG_CTL_STOP */
+};
+
+/*
+ * The peer a completion belongs to. A UD receive is matched on its sender,
+ * binding the next free peer to one we have not heard from, which only
+ * takes the AH cache's lock once per peer. Every other completion goes to
+ * the QP's first peer: RC has no other, and the rndv layer does nothing
+ * with UD send completions.
+ */
+static struct ServerPeer *__peer_of(struct PeerTable *t, struct ibv_wc *wc) {
+    int i = 0;
+    struct PeerKey key;
+    struct ServerPeer *peer = NULL;
+
+    if (config_info.ud == false || wc->opcode != IBV_WC_RECV)
+        return &t->peers[0];
+
+    key.qp_num = wc->src_qp;
+    ah_cache_src(ib_res.ah_cache, wc, (const uint8_t *)wc->wr_id, &key.lid,
+                 &key.gid);
+    for (i = 0; i < t->num_bound; i++)
+        if (t->keys[i].qp_num == key.qp_num && t->keys[i].lid == key.lid &&
+            memcmp(&t->keys[i].gid, &key.gid, sizeof(key.gid)) == 0)
+            return &t->peers[i];
+
+    check(t->num_bound < t->num_peers, "Message from qp %"PRIu32", all %d "
+          "peers are bound", key.qp_num, t->num_peers);
+    peer = &t->peers[t->num_bound];
+    peer->dest.ah = ah_cache_get(ib_res.ah_cache, key.lid, &key.gid);
+    check(peer->dest.ah != NULL, "Failed to create ah for qp %"PRIu32,
+          key.qp_num);
+    peer->dest.qp_num = key.qp_num;
+    peer->rc.dest     = &peer->dest;
+    t->keys[t->num_bound++] = key;
+
+    return peer;
+error:
+    return NULL;
+}
+
+/* signal the bound peers to stop, after any echo still waiting for credits */
+static int __stop_peers(struct PeerTable *t) {
+    int ret = 0;
+    struct ServerPeer *peer = NULL;
+
+    for (; t->num_stopped < t->num_bound; t->num_stopped++) {
+        peer = &t->peers[t->num_stopped];
+        ret = rndv_send_ctl(&peer->rc, peer->buf, IB_WR_ID_STOP,
+                            MSG_CTL_STOP);
+        check(ret == 0, "Failed to signal peer %d to stop", t->num_stopped);
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+/*
+ * The counters of all peers, added up in rc and rpc for the stats and the
+ * log; the settings the log looks at are the first peer's.
+ */
+static void __sum_peers(struct PeerTable *t, struct RndvConn *rc,
+                        struct RpcConn *rpc) {
+    int i = 0;
+    struct ServerPeer *peer = NULL;
+
+    memset(rc, 0, sizeof(struct RndvConn));
+    memset(rpc, 0, sizeof(struct RpcConn));
+    rc->threshold    = t->peers[0].rc.threshold;
+    rc->credit_batch = t->peers[0].rc.credit_batch;
+    for (i = 0; i < t->num_peers; i++) {
+        peer = &t->peers[i];
+        rc->num_recvs     += peer->rc.num_recvs;
+        rc->eager_msgs    += peer->rc.eager_msgs;
+        rc->rndv_msgs     += peer->rc.rndv_msgs;
+        rc->pool_waits    += peer->rc.pool_waits;
+        rc->credit_waits  += peer->rc.credit_waits;
+        rc->credit_msgs   += peer->rc.credit_msgs;
+        rpc->calls        += peer->rpc.calls;
+        rpc->errors       += peer->rpc.errors;
+        rpc->batches      += peer->rpc.batches;
+        rpc->coalesced    += peer->rpc.coalesced;
+    }
+}
+
+static void __destroy_peers(struct PeerTable *t) {
+    int i = 0;
+
+    for (i = 0; t->peers != NULL && i < t->num_peers; i++) {
+        rpc_destroy(&t->peers[i].rpc);
+        rndv_destroy(&t->peers[i].rc);
+    }
+    if (t->peers != NULL)
+        free(t->peers);
+    if (t->keys != NULL)
+        free(t->keys);
+    memset(t, 0, sizeof(struct PeerTable));
+}
+
+/* send the response of a handled message and post its receive again */
+static int __respond(struct PipeJob *job, long thread_id, uint32_t qp_num) {
+    int ret = 0;
+    uint64_t echo_tsc = rdtsc(), service_ns = 0;
+    struct ThreadStats *stats = &thread_stats[thread_id];
+
+    check(job->ret == 0, "thread[%ld]: failed to handle a message", thread_id);
+    ret = stats_post(stats, rpc_respond(job->rpc, &job->resp));
+    check (ret == 0, "thread[%ld](file %s line %d): failed to post send",
+           thread_id, __FILE__, __LINE__);
+
+    /* post a new receive */
+    ret = stats_post(stats, rndv_release(job->rpc->rc, &job->msg));
+    check (ret == 0, "thread[%ld](file %s line %d): failed to post recv",
+           thread_id, __FILE__, __LINE__);
+    PROBE(slot_recycled, thread_id, (uint64_t)job->msg.buf);
+    msg_trace_record(msg_trace_thread(thread_id), MSG_TRACE_ECHO,
+        job->warmup ? MSG_TRACE_WARMUP : 0, thread_id, qp_num,
+        (uint64_t)job->msg.buf, job->msg.len, echo_tsc, job->recv_tsc);
+
+    service_ns = tsc_to_ns(rdtsc() - job->recv_tsc);
+    stats_write_begin(stats);
+    if (job->msg.rendezvous == false)
+        stats_inc(stats, outstanding);
+    stats_record_latency(stats, service_ns);
+    stats_write_end(stats);
+    PROBE(msg_echoed, thread_id, (uint64_t)job->msg.buf, job->msg.len,
+          service_ns);
+
+    return 0;
+error:
+    return -1;
+}
+
+/* send back whatever the pipeline workers have finished */
+static int __drain(struct Pipeline *pipeline, long thread_id,
+                   uint32_t qp_num) {
+    struct PipeJob job;
+
+    while (pipeline_poll(pipeline, &job))
+        check(__respond(&job, thread_id, qp_num) == 0,
+              "thread[%ld]: failed to respond", thread_id);
+
+    return 0;
+error:
+    return -1;
+}
+
+/*
+ * Run all jobs of our own, oldest first, or a stolen one when idle, after
+ * sending back what thieves have handled for us. A thief stuck on a full
+ * ring to its victim keeps answering its own returns meanwhile, so two
+ * thieves of each other never wait on one another.
+ */
+static int __steal_work(long thread_id, uint32_t qp_num, bool idle) {
+    struct PipeJob job, done;
+    int victim = 0;
+
+    while (steal_returned(thread_id, &job))
+        check(__respond(&job, thread_id, qp_num) == 0,
+              "thread[%ld]: failed to respond", thread_id);
+
+    while (steal_pop(thread_id, &job)) {
+        job.ret = rpc_handle(job.rpc, &job.msg, &job.resp);
+        check(__respond(&job, thread_id, qp_num) == 0,
+              "thread[%ld]: failed to respond", thread_id);
+        idle = false;
+    }
+
+    if (idle == false || steal_take(thread_id, &job, &victim) == false)
+        return 0;
+
+    job.ret = rpc_handle(job.rpc, &job.msg, &job.resp);
+    while (steal_return(thread_id, victim, &job) == false)
+        while (steal_returned(thread_id, &done))
+            check(__respond(&done, thread_id, qp_num) == 0,
+                  "thread[%ld]: failed to respond", thread_id);
+
+    return 0;
+error:
+    return -1;
+}
 
 void *server_thread(void *arg) {
-    int             ret                 = 0, i = 0, n = 0;
+    int             ret                 = 0, i = 0, n = 0, p = 0;
     long            thread_id           = (long)arg;
     int             num_concurr_msgs    = config_info.num_concurr_msgs;
-    int             msg_size            = config_info.msg_size;
+    int             slot_size           = ib_res.buf_slot_size;
     int             num_wc              = 20;
+    int             num_stops           = 0;
     bool            stop                = false;
+    bool            ready               = false;
     pthread_t       self;
     cpu_set_t       cpuset;
-    struct ibv_qp  *qp         = ib_res.qp;
-    struct ibv_cq  *cq         = ib_res.cq;
+    struct ibv_qp  *qp         = ib_res.qp[thread_id];
+    struct ibv_cq  *cq         = ib_res.cq[thread_id];
+    struct ThreadStats *stats  = &thread_stats[thread_id];
     struct ibv_wc  *wc         = NULL;
-    uint32_t        lkey       = ib_res.mr->lkey;
-    char           *buf_ptr    = ib_res.ib_buf;
-    int             buf_offset = 0;
-    size_t          buf_size   = ib_res.ib_buf_size;
+    char           *resp_bufs  = NULL;
+    uint64_t        poll_tsc   = 0;
     struct timeval  start, end;
     long            ops_count  = 0;
+    uint64_t        start_ops  = 0;
+    uint64_t        recv_tsc   = 0;
+    uint64_t        hold_tsc   = 0;
+    struct PeerTable table;
+    struct ServerPeer *peer    = NULL;
+    struct RndvConn rc;
+    struct RndvMsg  msg;
+    struct RpcConn  rpc;
+    struct Pipeline pipeline;
+    struct PipeJob  job;
     double          duration   = 0.0;
     double          throughput = 0.0;
 
+    memset(&table, 0, sizeof(struct PeerTable));
+    memset(&pipeline, 0, sizeof(struct Pipeline));
+
     /* set thread affinity */
     CPU_ZERO(&cpuset);
-    CPU_SET((int)thread_id, &cpuset);
+    CPU_SET((int)(thread_id % sysconf(_SC_NPROCESSORS_ONLN)), &cpuset);
     self = pthread_self();
     ret = pthread_setaffinity_np(self, sizeof(cpu_set_t), &cpuset);
     check(ret == 0, "thread[%ld]: failed to set thread affinity", thread_id);
 
     /* pre-post recvs */
     wc = (struct ibv_wc *)calloc(num_wc, sizeof(struct ibv_wc));
-    check(wc != NULL, "thread[%ld]: failed to allocate wc", thread_id);
+    table.num_peers = ib_res.qp_peers[thread_id];
+    table.peers = (struct ServerPeer *)calloc(table.num_peers,
+                                              sizeof(struct ServerPeer));
+    table.keys  = (struct PeerKey *)calloc(table.num_peers,
+                                           sizeof(struct PeerKey));
+    check(wc != NULL && table.peers != NULL && table.keys != NULL,
+          "thread[%ld]: failed to allocate wc", thread_id);
 
-    for (i = 0; i < num_concurr_msgs; i++) {
-        ret = post_recv(msg_size, lkey, (uint64_t)buf_ptr, qp, buf_ptr);
-        check (ret == 0, "thread[%ld]: failed to post recv", thread_id);
-        buf_offset = (buf_offset + msg_size) % buf_size;
-        buf_ptr = ib_res.ib_buf + buf_offset;
+    for (p = 0; p < table.num_peers && ret == 0; p++) {
+        table.peers[p].buf = ib_peer_buf(thread_id, p);
+        ret = rndv_init(&table.peers[p].rc, qp, num_concurr_msgs,
+                        table.peers[p].buf, slot_size,
+                        config_info.rndv_threshold);
     }
+    ready = true;
+    ret = ib_workers_ready(ret == 0);
+    check(ret == 0, "thread[%ld]: failed to post recvs", thread_id);
+
+    for (p = 0; p < table.num_peers; p++) {
+        peer = &table.peers[p];
+
+        /* the response slots follow the receives, or the control slot */
+        resp_bufs = peer->buf + slot_size;
+        if (config_info.rndv_threshold == 0)
+            resp_bufs = peer->buf + rndv_eager_recvs() * slot_size;
+        ret = rpc_init(&peer->rpc, &peer->rc, num_concurr_msgs, resp_bufs,
+                       slot_size);
+        check(ret == 0, "thread[%ld]: failed to init rpc", thread_id);
 
-    /* signal the client to start */
-    ret = post_send(0, lkey, 0, MSG_CTL_START, qp, buf_ptr);
-    check(ret == 0, "thread[%ld]: failed to signal the client to start", thread_id);
+        /* the batch buffers follow the response slots */
+        if (config_info.coalesce > 1) {
+            ret = rpc_coalesce(&peer->rpc,
+                               resp_bufs + num_concurr_msgs * slot_size,
+                               slot_size, num_concurr_msgs,
+                               config_info.coalesce);
+            check(ret == 0, "thread[%ld]: failed to set up coalescing",
+                  thread_id);
+        }
+    }
+    hold_tsc = tsc_from_ns((uint64_t)config_info.coalesce_us * 1000);
+
+    /* the workers take the cpus after those of the server threads */
+    if (config_info.pipeline > 0) {
+        ret = pipeline_init(&pipeline, config_info.pipeline,
+                            (int)(config_info.num_threads +
+                                  thread_id * config_info.pipeline));
+        check(ret == 0, "thread[%ld]: failed to start the pipeline",
+              thread_id);
+    }
+    __sum_peers(&table, &rc, &rpc);
+    stats_set(stats, outstanding, rc.num_recvs);
+
+    /* signal the client to start; a UD client greets us first */
+    if (config_info.ud == false) {
+        table.num_bound = 1;
+        ret = rndv_send_ctl(&table.peers[0].rc, table.peers[0].buf, 0,
+                            MSG_CTL_START);
+        check(ret == 0, "thread[%ld]: failed to signal the client to start",
+              thread_id);
+    }
 
     while (stop != true) {
         /* poll cq */
+        poll_tsc = rdtsc();
         n = ibv_poll_cq(cq, num_wc, wc);
+        poll_tsc = rdtsc() - poll_tsc;
+        PROBE(cq_poll, thread_id, n, poll_tsc, stats->outstanding);
+        stats_write_begin(stats);
+        stats_inc(stats, cq_polls);
+        stats_add(stats, poll_cycles, poll_tsc);
+        if (n == 0) {
+            stats_inc(stats, empty_polls);
+            stats_add(stats, empty_poll_cycles, poll_tsc);
+        }
+        stats_write_end(stats);
         if (n < 0)
             check(0, "thread[%ld]: Failed to poll cq", thread_id);
 
         for (i = 0; i < n; i++) {
             if (wc[i].status != IBV_WC_SUCCESS) {
+                stats_record_wc_error(stats, &wc[i]);
                 if (wc[i].opcode == IBV_WC_SEND) {
                     check(0, "thread[%ld]: send failed status: %d, %s",
                           thread_id, wc[i].status,
@@ -71,46 +365,156 @@ void *server_thread(void *arg) {
                 }
             }
 
-            if (wc[i].opcode == IBV_WC_RECV) {
+            peer = __peer_of(&table, &wc[i]);
+            check(peer != NULL, "thread[%ld]: failed to find the peer of a "
+                  "message", thread_id);
+
+            /*
+             * the rest of the batch after the last op may still return
+             * credits, which the STOP and queued responses wait for
+             */
+            if (stop) {
+                ret = rndv_discard(&peer->rc, &wc[i]);
+                check(ret == 0, "thread[%ld]: failed to return credits",
+                      thread_id);
+                continue;
+            }
+
+            ret = rndv_complete(&peer->rc, &wc[i], &msg);
+            check(ret >= 0, "thread[%ld]: failed to complete a message",
+                  thread_id);
+
+            /* a UD client QP's greeting, answered with its START */
+            if (ret == 1 && MSG_IMM_TYPE(msg.imm) == MSG_CTL_START) {
+                ret = rndv_release(&peer->rc, &msg);
+                check(ret == 0, "thread[%ld]: failed to post recv",
+                      thread_id);
+                ret = rndv_send_ctl(&peer->rc, peer->buf, 0, MSG_CTL_START);
+                check(ret == 0, "thread[%ld]: failed to signal a client to "
+                      "start", thread_id);
+                continue;
+            }
+
+            if (ret == 1) {
+                recv_tsc = rdtsc();
                 ops_count += 1;
-                log("ops_count = %ld", ops_count);
+                stats_write_begin(stats);
+                stats_inc(stats, ops);
+                stats_add(stats, bytes, msg.len);
+                if (msg.rendezvous == false)
+                    stats_add(stats, outstanding, -1);
+                stats_write_end(stats);
+                PROBE(msg_recv, thread_id, (uint64_t)msg.buf, msg.len, recv_tsc);
 
-                if (ops_count == NUM_WARMING_UP_OPS)
+                if (ops_count == config_info.num_warmup_ops) {
                     gettimeofday (&start, NULL);
+                    start_ops = stats->ops;
+                    results_mark_start(thread_id, stats);
+                    PROBE(warmup_done, thread_id, ops_count);
+                }
 
-                if (ops_count == TOT_NUM_OPS) {
+                if (ops_count == config_info.tot_num_ops) {
                     gettimeofday (&end, NULL);
+                    results_mark_end(thread_id, stats);
+                    PROBE(stop, thread_id, ops_count);
                     stop = true;
-                    break;
+                    continue;
                 }
 
-                /* echo the message back */
-                char *msg_ptr = (char *)wc[i].wr_id;
-                ret = post_send(msg_size, lkey, 0, MSG_REGULAR, qp, msg_ptr);
-                check (ret == 0, "thread[%ld](file %s line %d): failed to post send",
-                       thread_id, __FILE__, __LINE__);
-
-                /* post a new receive */
-                ret = post_recv(msg_size, lkey, wc[i].wr_id, qp, msg_ptr);
-                check (ret == 0, "thread[%ld](file %s line %d): failed to post recv",
-                       thread_id, __FILE__, __LINE__);
+                /*
+                 * run the handler of the call and send its response; other
+                 * messages are echoed back the way they came, which lets
+                 * the client calibrate the rendezvous threshold
+                 */
+                job.rpc      = &peer->rpc;
+                job.msg      = msg;
+                job.recv_tsc = recv_tsc;
+                job.warmup   = ops_count <= config_info.num_warmup_ops;
+                if (config_info.pipeline > 0) {
+                    while (pipeline_submit(&pipeline, &job) == false) {
+                        ret = __drain(&pipeline, thread_id, qp->qp_num);
+                        check(ret == 0, "thread[%ld]: failed to drain the "
+                              "pipeline", thread_id);
+                    }
+                } else if (config_info.steal == false ||
+                           steal_push(thread_id, &job) == false) {
+                    job.ret = rpc_handle(job.rpc, &job.msg, &job.resp);
+                    ret = __respond(&job, thread_id, qp->qp_num);
+                    check(ret == 0, "thread[%ld]: failed to respond",
+                          thread_id);
+                }
             }
         }
+        if (config_info.pipeline > 0) {
+            ret = __drain(&pipeline, thread_id, qp->qp_num);
+            check(ret == 0, "thread[%ld]: failed to drain the pipeline",
+                  thread_id);
+        }
+        if (config_info.steal) {
+            ret = __steal_work(thread_id, qp->qp_num, n == 0);
+            check(ret == 0, "thread[%ld]: failed to run queued jobs",
+                  thread_id);
+        }
+        for (p = 0; config_info.coalesce > 1 && p < table.num_bound; p++) {
+            ret = rpc_flush_after(&table.peers[p].rpc, hold_tsc);
+            check(ret == 0, "thread[%ld]: failed to send a batch", thread_id);
+        }
+
+        stats_write_begin(stats);
+        if (config_info.steal) {
+            stats_set(stats, steals, steal_queues[thread_id].steals);
+            stats_set(stats, stolen, steal_queues[thread_id].stolen);
+        }
+        /* adding up the peers is only worth it when something happened */
+        if (n > 0) {
+            __sum_peers(&table, &rc, &rpc);
+            stats_set(stats, batches, rpc.batches);
+            stats_set(stats, coalesced, rpc.coalesced);
+            stats_set(stats, credit_waits, rc.credit_waits);
+            stats_set(stats, credit_msgs, rc.credit_msgs);
+        }
+        stats_write_end(stats);
     }
 
-    /* signal the client to stop */
-    ret = post_send(0, lkey, IB_WR_ID_STOP, MSG_CTL_STOP, qp, ib_res.ib_buf);
-    check(ret == 0, "thread[%ld]: failed to signal the client to stop", thread_id);
+    /* answer what the workers still hold before the clients are stopped */
+    while (pipeline.in_flight > 0) {
+        ret = __drain(&pipeline, thread_id, qp->qp_num);
+        check(ret == 0, "thread[%ld]: failed to drain the pipeline",
+              thread_id);
+    }
 
-    stop = false;
-    while (stop != true) {
+    /* and what is left in our deque or with thieves */
+    while (config_info.steal && steal_queues[thread_id].in_flight > 0) {
+        ret = __steal_work(thread_id, qp->qp_num, false);
+        check(ret == 0, "thread[%ld]: failed to run queued jobs", thread_id);
+    }
+
+    /* and what is held for a batch */
+    for (p = 0; p < table.num_bound; p++) {
+        ret = rpc_flush(&table.peers[p].rpc);
+        check(ret == 0, "thread[%ld]: failed to send a batch", thread_id);
+    }
+
+    /* signal the clients to stop, after any echo still waiting for credits */
+    ret = __stop_peers(&table);
+    check(ret == 0, "thread[%ld]: failed to signal the clients to stop",
+          thread_id);
+
+    /* a UD client QP which greets us only now is stopped right away */
+    while (num_stops < table.num_peers) {
         /* poll cq */
         n = ibv_poll_cq(cq, num_wc, wc);
+        stats_write_begin(stats);
+        stats_inc(stats, cq_polls);
+        if (n == 0)
+            stats_inc(stats, empty_polls);
+        stats_write_end(stats);
         if (n < 0)
             check(0, "thread[%ld]: Failed to poll cq", thread_id);
 
         for (i = 0; i < n; i++) {
             if (wc[i].status != IBV_WC_SUCCESS) {
+                stats_record_wc_error(stats, &wc[i]);
                 if (wc[i].opcode == IBV_WC_SEND) {
                     check(0, "thread[%ld]: send failed status: %d, %s",
                           thread_id, wc[i].status,
@@ -123,24 +527,70 @@ void *server_thread(void *arg) {
             }
 
             if (wc[i].opcode == IBV_WC_SEND) {
-                if (wc[i].wr_id == IB_WR_ID_STOP) {
-                    stop = true;
-                    break;
-                }
+                if (wc[i].wr_id == IB_WR_ID_STOP)
+                    num_stops++;
+                continue;
             }
+
+            peer = __peer_of(&table, &wc[i]);
+            check(peer != NULL, "thread[%ld]: failed to find the peer of a "
+                  "message", thread_id);
+            ret = rndv_discard(&peer->rc, &wc[i]);
+            check(ret == 0, "thread[%ld]: failed to return credits", thread_id);
         }
+
+        ret = __stop_peers(&table);
+        check(ret == 0, "thread[%ld]: failed to signal the clients to stop",
+              thread_id);
     }
 
     /* dump statistics */
+    __sum_peers(&table, &rc, &rpc);
+    stats_write_begin(stats);
+    stats_set(stats, batches, rpc.batches);
+    stats_set(stats, coalesced, rpc.coalesced);
+    stats_set(stats, credit_waits, rc.credit_waits);
+    stats_set(stats, credit_msgs, rc.credit_msgs);
+    stats_write_end(stats);
     duration = (double)((end.tv_sec - start.tv_sec) * 1000000 +
         (end.tv_usec - start.tv_usec));
-    throughput = (double)(ops_count) / duration;
+    throughput = (double)(stats->ops - start_ops) / duration;
     log("thread[%ld]: throughput = %f (Mops/s)",  thread_id, throughput);
+    if (table.num_peers > 1)
+        log("thread[%ld]: served %d peers", thread_id, table.num_peers);
+    if (rpc.batches != 0)
+        log("thread[%ld]: batches = %"PRIu64", %.2f responses each",
+            thread_id, rpc.batches, (double)rpc.coalesced / rpc.batches);
+    if (rc.threshold != 0)
+        log("thread[%ld]: rndv eager = %"PRIu64", rendezvous = %"PRIu64
+            ", pool waits = %"PRIu64, thread_id, rc.eager_msgs, rc.rndv_msgs,
+            rc.pool_waits);
+    if (rc.credit_batch != 0)
+        log("thread[%ld]: credit waits = %"PRIu64", credit msgs = %"PRIu64,
+            thread_id, rc.credit_waits, rc.credit_msgs);
+    log("thread[%ld]: rpc calls = %"PRIu64", errors = %"PRIu64, thread_id,
+        rpc.calls, rpc.errors);
+    for (i = 0; i < pipeline.num_workers; i++)
+        log("thread[%ld]: pipeline worker %d handled %"PRIu64, thread_id, i,
+            pipeline.workers[i].jobs);
+    if (pipeline.num_workers > 0)
+        log("thread[%ld]: pipeline full waits = %"PRIu64, thread_id,
+            pipeline.full_waits);
+    if (config_info.steal)
+        log("thread[%ld]: stole %"PRIu64" jobs, %"PRIu64" of ours were "
+            "stolen", thread_id, steal_queues[thread_id].steals,
+            steal_queues[thread_id].stolen);
 
+    pipeline_destroy(&pipeline);
+    __destroy_peers(&table);
     free(wc);
     pthread_exit((void *)0);
 
 error:
+    if (ready == false)
+        ib_workers_ready(false);
+    pipeline_destroy(&pipeline);
+    __destroy_peers(&table);
     if (wc != NULL)
         free(wc);
     pthread_exit((void *)-1);
@@ -148,7 +598,7 @@ error:
 
 int run_server() {
     int             ret = 0;
-    long            num_threads = 1;
+    long            num_threads = config_info.num_threads;
     long            i = 0;
     pthread_t      *threads = NULL;
     pthread_attr_t  attr;
@@ -160,11 +610,29 @@ int run_server() {
     threads = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
     check(threads != NULL, "Failed to allocate threads.");
 
+    ret = stats_init(num_threads, config_info.shm_stats);
+    check(ret == 0, "Failed to init thread stats.");
+
+    ret = results_init(num_threads);
+    check(ret == 0, "Failed to init thread results.");
+
+    ret = msg_trace_init(num_threads, config_info.trace_prefix,
+                         config_info.trace_records);
+    check(ret == 0, "Failed to init message trace.");
+
+    if (config_info.steal) {
+        ret = steal_init(num_threads);
+        check(ret == 0, "Failed to init work stealing.");
+    }
+
     for (i = 0; i < num_threads; i++) {
         ret = pthread_create(&threads[i], &attr, server_thread, (void *)i);
         check(ret == 0, "Failed to create server_thread[%ld]", i);
     }
 
+    ret = stats_reporter_start(config_info.stats_interval_ms);
+    check(ret == 0, "Failed to start stats reporter.");
+
     bool thread_ret_normally = true;
     for (i = 0; i < num_threads; i++) {
         ret = pthread_join(threads[i], &status);
@@ -175,15 +643,31 @@ int run_server() {
         }
     }
 
+    stats_reporter_stop();
+
     if (thread_ret_normally == false)
         goto error;
 
+    if (config_info.results_path != NULL) {
+        ret = results_write(config_info.results_path);
+        check(ret == 0, "Failed to write results.");
+    }
+
+    steal_destroy();
+    msg_trace_destroy();
+    results_destroy();
+    stats_destroy();
     pthread_attr_destroy(&attr);
     free(threads);
 
     return 0;
 
 error:
+    stats_reporter_stop();
+    steal_destroy();
+    msg_trace_destroy();
+    results_destroy();
+    stats_destroy();
     pthread_attr_destroy(&attr);
     if (threads != NULL)
         free (threads);
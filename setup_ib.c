@@ -1,109 +1,264 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <infiniband/verbs.h>
 #include <unistd.h>
 #include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
 
 #include "sock.h"
 #include "ib.h"
 #include "debug.h"
 #include "config.h"
+#include "workload.h"
 #include "setup_ib.h"
+#include "rndv.h"
+#include "probes.h"
 
 struct IBRes ib_res;
 
+/* workers meet here before the sync with the peer, see ib_workers_ready() */
+static pthread_barrier_t workers_barrier;
+static bool workers_barrier_inited = false;
+static bool workers_ok = true;
+static int  workers_sync = 0;
+
+const char *setup_phase_names[SETUP_NUM_PHASES] = {
+    [SETUP_FORK_INIT]    = "fork_init",
+    [SETUP_OPEN_DEVICE]  = "open_device",
+    [SETUP_ALLOC_PD]     = "alloc_pd",
+    [SETUP_QUERY_PORT]   = "query_port",
+    [SETUP_ALLOC_BUF]    = "alloc_buf",
+    [SETUP_REG_MR]       = "reg_mr",
+    [SETUP_QUERY_DEVICE] = "query_device",
+    [SETUP_CREATE_CQ]    = "create_cq",
+    [SETUP_CREATE_QP]    = "create_qp",
+    [SETUP_CONNECT]      = "connect",
+    [SETUP_MR_WAIT]      = "mr_wait",
+};
+
+static uint64_t __monotonic_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* charge the time since start to phase, return now as the next start */
+static uint64_t __phase_done(enum SetupPhase phase, uint64_t start) {
+    uint64_t now = __monotonic_ns();
+
+    ib_res.setup_ns[phase] += now - start;
+    return now;
+}
+
+static void __log_setup_timing() {
+    int i = 0;
+
+    log(LOG_SUB_HEADER, "Setup Timing");
+    for (i = 0; i < SETUP_NUM_PHASES; i++)
+        log("%-18s = %.3f ms%s", setup_phase_names[i],
+            ib_res.setup_ns[i] / 1e6,
+            i == SETUP_REG_MR ? " (overlapped)" : "");
+    log("%-18s = %.3f ms", "total", ib_res.setup_total_ns / 1e6);
+    log("%-18s = %.3f GB/s, %zu bytes in %d mr(s) on %d thread(s), "
+        "NUMA node %d", "reg_throughput", setup_reg_gbps(),
+        ib_res.ib_buf_size, ib_res.num_mrs, ib_res.num_reg_threads,
+        ib_res.nic_numa_node);
+    log("%-18s = %ld KB for %d %s qp(s)", "queue_rss", ib_res.queue_rss >> 10,
+        ib_res.num_qps, config_info.ud ? "ud" : "rc");
+    log(LOG_SUB_HEADER, "End of Setup Timing");
+}
+
+/* raw bytes, QPInfo is packed */
+static void __log_gid(const char *name, const uint8_t *raw) {
+    log("%s GID: %02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d",
+        name, raw[0], raw[1], raw[2], raw[3], raw[4], raw[5], raw[6], raw[7],
+        raw[8], raw[9], raw[10], raw[11], raw[12], raw[13], raw[14], raw[15]);
+}
+
+static void __log_qp_info(struct QPInfo *local_qp_info,
+                          struct QPInfo *remote_qp_info) {
+    log("\tqp[%"PRIu32"] <-> qp[%"PRIu32"]",
+        local_qp_info->qp_num, remote_qp_info->qp_num);
+    log("local address: LID %#04x QPN %#06x", local_qp_info->lid,
+        local_qp_info->qp_num);
+    __log_gid("local", local_qp_info->gid.raw);
+    log("remote address: LID %#04x QPN %#06x", remote_qp_info->lid,
+        remote_qp_info->qp_num);
+    __log_gid("remote", remote_qp_info->gid.raw);
+}
+
+/*
+ * Resident pages of the process less those of ib_buf, which the
+ * registration faults in on its own thread while the queues are created.
+ * vec has a byte per page of ib_buf. -1 if either can not be read.
+ */
+static long __rss_pages(unsigned char *vec) {
+    FILE *fp = NULL;
+    long size = 0, rss = -1;
+    size_t i = 0, page = sysconf(_SC_PAGESIZE);
+
+    fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL)
+        return -1;
+    if (fscanf(fp, "%ld %ld", &size, &rss) != 2)
+        rss = -1;
+    fclose(fp);
+
+    if (rss < 0 || mincore(ib_res.ib_buf, ib_res.ib_buf_size, vec) != 0)
+        return -1;
+    for (i = 0; i < (ib_res.ib_buf_size + page - 1) / page; i++)
+        rss -= vec[i] & 1;
+
+    return rss;
+}
+
+/*
+ * UD client: address the sends of QP i to the remote QP. The AH belongs to
+ * the remote port, so the QPs of a peer share one. A server QP answers
+ * whoever sent the message, see server.c.
+ */
+static int __ud_connect(int i, struct QPInfo *remote_qp_info) {
+    union ibv_gid gid = remote_qp_info->gid;
+
+    ib_res.ud_dest[i].ah = ah_cache_get(ib_res.ah_cache, remote_qp_info->lid,
+                                        &gid);
+    check(ib_res.ud_dest[i].ah != NULL, "Failed to create ah for qp[%d]", i);
+    ib_res.ud_dest[i].qp_num = remote_qp_info->qp_num;
+
+    return 0;
+error:
+    return -1;
+}
+
+/*
+ * The client announces its number of QPs, every one of which the server
+ * pairs with one of its own; left is how many of --peers the server still
+ * takes. Returns the client's count, or -1.
+ */
+static int __exchange_num_qps(int peer_sockfd, int left) {
+    int n = 0;
+    uint32_t local = htonl((uint32_t)ib_res.num_qps), remote = 0;
+
+    if (config_info.is_server) {
+        n = sock_read(peer_sockfd, &remote, sizeof(remote));
+        check(n == sizeof(remote), "Failed to read the number of qps");
+        check(ntohl(remote) > 0 && ntohl(remote) <= (uint32_t)left,
+              "Client runs %"PRIu32" threads, %d of the peers are left",
+              ntohl(remote), left);
+        n = sock_write(peer_sockfd, &local, sizeof(local));
+        check(n == sizeof(local), "Failed to write the number of qps");
+    } else {
+        n = sock_write(peer_sockfd, &local, sizeof(local));
+        check(n == sizeof(local), "Failed to write the number of qps");
+        n = sock_read(peer_sockfd, &remote, sizeof(remote));
+        check(n == sizeof(remote), "Server refused %d threads",
+              ib_res.num_qps);
+        remote = local;
+    }
+
+    return (int)ntohl(remote);
+
+error:
+    return -1;
+}
+
+/*
+ * Accept clients until --peers of their QPs are in, from one connection or
+ * many. Client QPs go round robin over ours: with RC there is one for every
+ * QP of ours, which it is connected to; a UD QP answers all of its peers.
+ */
 int connect_qp_server() {
-    int ret = 0, n = 0;
+    int ret = 0, i = 0, j = 0, n = 0, peer = 0;
     int sockfd = 0;
     int peer_sockfd = 0;
     struct sockaddr_in peer_addr;
     socklen_t peer_addr_len = sizeof(struct sockaddr_in);
-    char sock_buf[64] = {'\0'};
     struct QPInfo local_qp_info, remote_qp_info;
 
+    ib_res.sync_sockfds = (int *)calloc(config_info.num_peers, sizeof(int));
+    ib_res.qp_peers     = (int *)calloc(ib_res.num_qps, sizeof(int));
+    check(ib_res.sync_sockfds != NULL && ib_res.qp_peers != NULL,
+          "Failed to allocate peers");
+
     sockfd = sock_create_bind(config_info.sock_port);
     check(sockfd > 0, "Failed to create server socket.");
 
-    listen(sockfd, 5);
+    listen(sockfd, SOMAXCONN);
 
-    peer_sockfd = accept(sockfd, (struct sockaddr *)&peer_addr,
-                         &peer_addr_len);
-    check(peer_sockfd > 0, "Failed to create peer_sockfd");
+    /* a UD QP has no remote end, it is ready once */
+    for (i = 0; config_info.ud && i < ib_res.num_qps; i++) {
+        ret = modify_qp_to_rts(ib_res.qp[i], NULL);
+        check(ret == 0, "Failed to modify qp to rts");
+    }
 
-    /* init local qp_info */
-    /*
-     * LID - The lid field in the struct ibv_port_attr represents the base Local
-     * Identifier (LID) of the port. This value is valid only if the port's
-     * state is either IBV_PORT_ARMED or IBV_PORT_ACTIVE. The LID is a unique
-     * identifier used in InfiniBand networks to route packets to the correct
-     * destination port.
-     *
-     * In InfiniBand networks, both Local Identifier (LID) and Global Identifier
-     * (GID) are used for addressing, but they serve different purposes and
-     * have different characteristics:
-     *
-     * LID is a shorter, locally unique identifier used within a single
-     * InfiniBand subnet for efficient routing.
-     *
-     * GID is a longer, globally unique identifier used for routing across
-     * multiple subnets, ensuring global uniqueness.
-     *
-     */
-    local_qp_info.lid  = ib_res.port_attr.lid;
-    local_qp_info.qp_num = ib_res.qp->qp_num;
-    local_qp_info.gid = ib_res.local_gid;
+    log(LOG_SUB_HEADER, "IB Config");
+    while (peer < config_info.num_peers) {
+        peer_sockfd = accept(sockfd, (struct sockaddr *)&peer_addr,
+                             &peer_addr_len);
+        check(peer_sockfd > 0, "Failed to create peer_sockfd");
+        ib_res.sync_sockfds[ib_res.num_sync_sockfds++] = peer_sockfd;
+
+        n = __exchange_num_qps(peer_sockfd, config_info.num_peers - peer);
+        check(n > 0, "Failed to agree on the number of qps");
 
-    /* get qp_info from client */
-    ret = sock_get_qp_info(peer_sockfd, &remote_qp_info);
-    check(ret == 0, "Failed to get qp_info from client");
+        for (j = 0; j < n; j++, peer++) {
+            i = peer % ib_res.num_qps;
 
-    /* send qp_info to client */
-    ret = sock_set_qp_info(peer_sockfd, &local_qp_info);
-    check(ret == 0, "Failed to send qp_info to client");
+            /* init local qp_info */
+            /*
+             * LID - The lid field in the struct ibv_port_attr represents the base Local
+             * Identifier (LID) of the port. This value is valid only if the port's
+             * state is either IBV_PORT_ARMED or IBV_PORT_ACTIVE. The LID is a unique
+             * identifier used in InfiniBand networks to route packets to the correct
+             * destination port.
+             *
+             * In InfiniBand networks, both Local Identifier (LID) and Global Identifier
+             * (GID) are used for addressing, but they serve different purposes and
+             * have different characteristics:
+             *
+             * LID is a shorter, locally unique identifier used within a single
+             * InfiniBand subnet for efficient routing.
+             *
+             * GID is a longer, globally unique identifier used for routing across
+             * multiple subnets, ensuring global uniqueness.
+             *
+             */
+            local_qp_info.lid    = ib_res.port_attr.lid;
+            local_qp_info.qp_num = ib_res.qp[i]->qp_num;
+            local_qp_info.gid    = ib_res.local_gid;
 
-    /* change send QP state to RTS (Ready To Send) */
-    ret = modify_qp_to_rts(ib_res.qp, &remote_qp_info);
-    check(ret == 0, "Failed to modify qp to rts");
+            /* get qp_info from client */
+            ret = sock_get_qp_info(peer_sockfd, &remote_qp_info);
+            check(ret == 0, "Failed to get qp_info from client");
 
-    log(LOG_SUB_HEADER, "IB Config");
-    log("\tqp[%"PRIu32"] <-> qp[%"PRIu32"]",
-        ib_res.qp->qp_num, remote_qp_info.qp_num);
-    log("local address: LID %#04x QPN %#06x", local_qp_info.lid, local_qp_info.qp_num);
-    log("GID: %02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d",
-        local_qp_info.gid.raw[0], local_qp_info.gid.raw[1],
-        local_qp_info.gid.raw[2], local_qp_info.gid.raw[3],
-        local_qp_info.gid.raw[4], local_qp_info.gid.raw[5],
-        local_qp_info.gid.raw[6], local_qp_info.gid.raw[7],
-        local_qp_info.gid.raw[8], local_qp_info.gid.raw[9],
-        local_qp_info.gid.raw[10], local_qp_info.gid.raw[11],
-        local_qp_info.gid.raw[12], local_qp_info.gid.raw[13],
-        local_qp_info.gid.raw[14], local_qp_info.gid.raw[15]);
-    log("remote address: LID %#04x QPN %#06x", remote_qp_info.lid, remote_qp_info.qp_num);
-    log("GID: %02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d",
-        remote_qp_info.gid.raw[0], remote_qp_info.gid.raw[1],
-        remote_qp_info.gid.raw[2], remote_qp_info.gid.raw[3],
-        remote_qp_info.gid.raw[4], remote_qp_info.gid.raw[5],
-        remote_qp_info.gid.raw[6], remote_qp_info.gid.raw[7],
-        remote_qp_info.gid.raw[8], remote_qp_info.gid.raw[9],
-        remote_qp_info.gid.raw[10], remote_qp_info.gid.raw[11],
-        remote_qp_info.gid.raw[12], remote_qp_info.gid.raw[13],
-        remote_qp_info.gid.raw[14], remote_qp_info.gid.raw[15]);
-    log(LOG_SUB_HEADER, "End of IB Config");
+            /* send qp_info to client */
+            ret = sock_set_qp_info(peer_sockfd, &local_qp_info);
+            check(ret == 0, "Failed to send qp_info to client");
 
-    /* sync with clients */
-    n = sock_read(peer_sockfd, sock_buf, sizeof(SOCK_SYNC_MSG));
-    check(n == sizeof(SOCK_SYNC_MSG), "Failed to receive sync from client");
+            /* change send QP state to RTS (Ready To Send) */
+            if (config_info.ud == false) {
+                ret = modify_qp_to_rts(ib_res.qp[i], &remote_qp_info);
+                check(ret == 0, "Failed to modify qp to rts");
+            }
+            ib_res.qp_peers[i]++;
 
-    n = sock_write(peer_sockfd, sock_buf, sizeof(SOCK_SYNC_MSG));
-    check(n == sizeof(SOCK_SYNC_MSG), "Failed to write sync to client");
+            __log_qp_info(&local_qp_info, &remote_qp_info);
+            PROBE(qp_connected, i, local_qp_info.qp_num, remote_qp_info.qp_num);
+        }
+    }
+    log(LOG_SUB_HEADER, "End of IB Config");
 
-    close(peer_sockfd);
+    /* the workers sync with the clients once their receives are posted */
     close(sockfd);
 
     return 0;
 
 error:
-    if (peer_sockfd > 0)
-        close (peer_sockfd);
+    /* the clients' sockets are closed by close_ib_connection() */
     if (sockfd > 0)
         close (sockfd);
 
@@ -111,65 +266,50 @@ error:
 }
 
 int connect_qp_client() {
-    int ret = 0, n = 0;
+    int ret = 0, i = 0;
     int peer_sockfd = 0;
-    char sock_buf[64] = {'\0'};
 
     struct QPInfo local_qp_info, remote_qp_info;
 
+    ib_res.sync_sockfds = (int *)calloc(1, sizeof(int));
+    check(ib_res.sync_sockfds != NULL, "Failed to allocate sync socket");
+
     peer_sockfd = sock_create_connect(config_info.server_name,
                                        config_info.sock_port);
     check(peer_sockfd > 0, "Failed to create peer_sockfd");
 
-    local_qp_info.lid = ib_res.port_attr.lid;
-    local_qp_info.qp_num = ib_res.qp->qp_num;
-    local_qp_info.gid = ib_res.local_gid;
+    ret = __exchange_num_qps(peer_sockfd, 0);
+    check(ret > 0, "Failed to agree on the number of qps");
 
-    /* send qp_info to server */
-    ret = sock_set_qp_info(peer_sockfd, &local_qp_info);
-    check(ret == 0, "Failed to send qp_info to server");
+    log(LOG_SUB_HEADER, "IB Config");
+    for (i = 0; i < ib_res.num_qps; i++) {
+        local_qp_info.lid    = ib_res.port_attr.lid;
+        local_qp_info.qp_num = ib_res.qp[i]->qp_num;
+        local_qp_info.gid    = ib_res.local_gid;
 
-    /* get qp_info from server */
-    ret = sock_get_qp_info(peer_sockfd, &remote_qp_info);
-    check(ret == 0, "Failed to get qp_info from server");
+        /* send qp_info to server */
+        ret = sock_set_qp_info(peer_sockfd, &local_qp_info);
+        check(ret == 0, "Failed to send qp_info to server");
 
-    /* change QP state to RTS */
-    ret = modify_qp_to_rts(ib_res.qp, &remote_qp_info);
-    check(ret == 0, "Failed to modify qp to rts");
+        /* get qp_info from server */
+        ret = sock_get_qp_info(peer_sockfd, &remote_qp_info);
+        check(ret == 0, "Failed to get qp_info from server");
 
-    log(LOG_SUB_HEADER, "IB Config");
-    log("\tqp[%"PRIu32"] <-> qp[%"PRIu32"]",
-        ib_res.qp->qp_num, remote_qp_info.qp_num);
-    log("local address: LID %#04x QPN %#06x", local_qp_info.lid, local_qp_info.qp_num);
-    log("GID: %02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d",
-        local_qp_info.gid.raw[0], local_qp_info.gid.raw[1],
-        local_qp_info.gid.raw[2], local_qp_info.gid.raw[3],
-        local_qp_info.gid.raw[4], local_qp_info.gid.raw[5],
-        local_qp_info.gid.raw[6], local_qp_info.gid.raw[7],
-        local_qp_info.gid.raw[8], local_qp_info.gid.raw[9],
-        local_qp_info.gid.raw[10], local_qp_info.gid.raw[11],
-        local_qp_info.gid.raw[12], local_qp_info.gid.raw[13],
-        local_qp_info.gid.raw[14], local_qp_info.gid.raw[15]);
-    log("remote address: LID %#04x QPN %#06x", remote_qp_info.lid, remote_qp_info.qp_num);
-    log("GID: %02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d:%02d",
-        remote_qp_info.gid.raw[0], remote_qp_info.gid.raw[1],
-        remote_qp_info.gid.raw[2], remote_qp_info.gid.raw[3],
-        remote_qp_info.gid.raw[4], remote_qp_info.gid.raw[5],
-        remote_qp_info.gid.raw[6], remote_qp_info.gid.raw[7],
-        remote_qp_info.gid.raw[8], remote_qp_info.gid.raw[9],
-        remote_qp_info.gid.raw[10], remote_qp_info.gid.raw[11],
-        remote_qp_info.gid.raw[12], remote_qp_info.gid.raw[13],
-        remote_qp_info.gid.raw[14], remote_qp_info.gid.raw[15]);
-    log(LOG_SUB_HEADER, "End of IB Config");
+        if (config_info.ud) {
+            ret = __ud_connect(i, &remote_qp_info);
+            check(ret == 0, "Failed to address qp[%d]", i);
+        }
 
-    /* sync with server */
-    n = sock_write(peer_sockfd, sock_buf, sizeof(SOCK_SYNC_MSG));
-    check(n == sizeof(SOCK_SYNC_MSG), "Failed to write sync to client");
+        /* change QP state to RTS */
+        ret = modify_qp_to_rts(ib_res.qp[i], &remote_qp_info);
+        check(ret == 0, "Failed to modify qp to rts");
 
-    n = sock_read(peer_sockfd, sock_buf, sizeof(SOCK_SYNC_MSG));
-    check(n == sizeof(SOCK_SYNC_MSG), "Failed to receive sync from client");
+        __log_qp_info(&local_qp_info, &remote_qp_info);
+    }
+    log(LOG_SUB_HEADER, "End of IB Config");
 
-    close(peer_sockfd);
+    /* the workers sync with the server once their receives are posted */
+    ib_res.sync_sockfds[ib_res.num_sync_sockfds++] = peer_sockfd;
     return 0;
 
 error:
@@ -179,8 +319,67 @@ error:
     return -1;
 }
 
+/* the server answers once every client has sent its sync */
+static int __sync_peers() {
+    int i = 0, n = 0;
+    char sock_buf[64] = {'\0'};
+
+    if (config_info.is_server) {
+        for (i = 0; i < ib_res.num_sync_sockfds; i++) {
+            n = sock_read(ib_res.sync_sockfds[i], sock_buf,
+                          sizeof(SOCK_SYNC_MSG));
+            check(n == sizeof(SOCK_SYNC_MSG),
+                  "Failed to receive sync from client %d", i);
+        }
+
+        for (i = 0; i < ib_res.num_sync_sockfds; i++) {
+            n = sock_write(ib_res.sync_sockfds[i], sock_buf,
+                           sizeof(SOCK_SYNC_MSG));
+            check(n == sizeof(SOCK_SYNC_MSG),
+                  "Failed to write sync to client %d", i);
+        }
+    } else {
+        n = sock_write(ib_res.sync_sockfds[0], sock_buf, sizeof(SOCK_SYNC_MSG));
+        check(n == sizeof(SOCK_SYNC_MSG), "Failed to write sync to server");
+
+        n = sock_read(ib_res.sync_sockfds[0], sock_buf, sizeof(SOCK_SYNC_MSG));
+        check(n == sizeof(SOCK_SYNC_MSG), "Failed to receive sync from server");
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+/* close the sockets to the clients, or the server */
+static void __close_sync_sockfds() {
+    int i = 0;
+
+    for (i = 0; i < ib_res.num_sync_sockfds; i++)
+        close(ib_res.sync_sockfds[i]);
+    ib_res.num_sync_sockfds = 0;
+}
+
+int ib_workers_ready(bool ok) {
+    int ret = 0;
+
+    if (ok == false)
+        workers_ok = false;
+
+    /* the barrier orders workers_ok before the serial thread reads it */
+    ret = pthread_barrier_wait(&workers_barrier);
+    if (ret == PTHREAD_BARRIER_SERIAL_THREAD) {
+        workers_sync = workers_ok ? __sync_peers() : -1;
+        /* a peer still waiting for the sync fails on the closed socket */
+        __close_sync_sockfds();
+    }
+    pthread_barrier_wait(&workers_barrier);
+
+    return workers_sync;
+}
+
 static struct ibv_context *__ctx_open_device(const char *ib_devname) {
-    int num_of_devices;
+    int i = 0, num_of_devices;
     struct ibv_device **list;
     struct ibv_device *dev = NULL;
     struct ibv_context *ctx = NULL;
@@ -193,7 +392,8 @@ static struct ibv_context *__ctx_open_device(const char *ib_devname) {
         // return the first available device
         dev = list[0];
     } else {
-        for (; (dev = *list); ++list)
+        // walk with an index, list must be freed from its head
+        for (i = 0; (dev = list[i]) != NULL; i++)
             if (!strcmp(ibv_get_device_name(dev), ib_devname))
                 break;
         check(dev != NULL, "IB device %s not found\n", ib_devname);
@@ -218,20 +418,180 @@ error:
     return ctx;
 }
 
+/*
+ * Pinning the buffer is the slowest part of the setup and nothing but the
+ * first post needs the MR, so it runs on its own thread while the queues
+ * are created and the TCP handshake waits for the peer.
+ */
+#define MR_ACCESS (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | \
+                   IBV_ACCESS_REMOTE_WRITE)
+
+static int reg_next_chunk = 0;
+
+/* take chunks until none are left */
+static void *__reg_chunk_worker(void *arg) {
+    int i = 0;
+    size_t offset = 0, len = 0;
+
+    while ((i = __atomic_fetch_add(&reg_next_chunk, 1, __ATOMIC_RELAXED)) <
+           ib_res.num_mrs) {
+        offset = (size_t)i * ib_res.mr_chunk_size;
+        len    = ib_res.ib_buf_size - offset;
+        if (len > ib_res.mr_chunk_size)
+            len = ib_res.mr_chunk_size;
+
+        ib_res.mrs[i] = ibv_reg_mr(ib_res.pd, ib_res.ib_buf + offset, len,
+                                   MR_ACCESS);
+        if (ib_res.mrs[i] == NULL) {
+            /* no point in pinning the rest */
+            __atomic_store_n(&reg_next_chunk, ib_res.num_mrs, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* the CPUs of the NUMA node the NIC sits on that we may run on */
+static int __nic_cpus(cpu_set_t *cpus) {
+    char path[256], list[1024];
+    FILE *fp = NULL;
+    int node = -1, lo = 0, hi = 0, cpu = 0;
+    char *p = NULL;
+    cpu_set_t allowed, node_cpus;
+
+    sched_getaffinity(0, sizeof(cpu_set_t), &allowed);
+    *cpus = allowed;
+
+    snprintf(path, sizeof(path), "/sys/class/infiniband/%s/device/numa_node",
+             ibv_get_device_name(ib_res.ctx->device));
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    if (fscanf(fp, "%d", &node) != 1)
+        node = -1;
+    fclose(fp);
+    if (node < 0)
+        return -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    p = fgets(list, sizeof(list), fp);
+    fclose(fp);
+    if (p == NULL)
+        return -1;
+
+    /* "0-7,16-23" */
+    CPU_ZERO(&node_cpus);
+    while (sscanf(p, "%d", &lo) == 1) {
+        hi = lo;
+        p += strspn(p, "0123456789");
+        if (*p == '-' && sscanf(++p, "%d", &hi) == 1)
+            p += strspn(p, "0123456789");
+        for (cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &node_cpus);
+        if (*p != ',')
+            break;
+        p++;
+    }
+
+    CPU_AND(&node_cpus, &node_cpus, &allowed);
+    if (CPU_COUNT(&node_cpus) == 0)
+        return -1;
+
+    *cpus = node_cpus;
+    return node;
+}
+
+/*
+ * The kernel pins the pages of one registration serially, so a large pool
+ * is registered as chunks by a pool of threads. They run on the NIC's NUMA
+ * node: pinning faults the pages in, and first touch places them there.
+ */
+static void __reg_chunks() {
+    int i = 0, num_threads = config_info.reg_threads;
+    pthread_t *threads = NULL;
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+
+    ib_res.nic_numa_node = __nic_cpus(&cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+
+    if (num_threads <= 0)
+        num_threads = CPU_COUNT(&cpus) < 16 ? CPU_COUNT(&cpus) : 16;
+    if (num_threads > ib_res.num_mrs)
+        num_threads = ib_res.num_mrs;
+
+    reg_next_chunk = 0;
+    ib_res.num_reg_threads = 1;
+
+    /* this thread is one of the pool */
+    threads = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
+    if (threads != NULL) {
+        pthread_attr_init(&attr);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+        for (i = 1; i < num_threads; i++) {
+            if (pthread_create(&threads[i], &attr, __reg_chunk_worker,
+                               NULL) != 0)
+                break;
+            ib_res.num_reg_threads++;
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    __reg_chunk_worker(NULL);
+
+    for (i = 1; i < ib_res.num_reg_threads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+static void *__reg_mr_thread(void *arg) {
+    uint64_t start = __monotonic_ns();
+
+    if (ib_res.num_mrs == 1) {
+        ib_res.mrs[0] = ibv_reg_mr(ib_res.pd, (void *)ib_res.ib_buf,
+                                   ib_res.ib_buf_size, MR_ACCESS);
+        ib_res.num_reg_threads = 1;
+        ib_res.nic_numa_node = -1;
+    } else {
+        __reg_chunks();
+    }
+
+    __phase_done(SETUP_REG_MR, start);
+    return NULL;
+}
+
 int setup_ib(const char *ib_devname) {
-    int ret = 0;
+    int ret = 0, i = 0;
+    uint64_t start = __monotonic_ns(), t = start;
+    pthread_t mr_thread;
+    bool mr_thread_running = false;
+    int max_send_wr = 0, max_recv_wr = 0, cqe = 0;
+    size_t chunk_slots = 0, rss_vec_size = 0;
+    unsigned char *rss_vec = NULL;
+    long rss_pages = -1;
 
     memset(&ib_res, 0, sizeof(struct IBRes));
 
     // refer to https://www.rdmamojo.com/2012/05/24/ibv_fork_init/
     // ibv_fork_init() should be called before calling any other
-    // function in libibverbs.
-    ret = ibv_fork_init();
-    check(ret == 0, "Failed to ibv_fork_init.");
+    // function in libibverbs. It is only needed when the process forks
+    // with registered memory, which this one never does, and it makes
+    // every registration madvise() its pages: --no-fork-init skips it.
+    if (config_info.fork_init) {
+        ret = ibv_fork_init();
+        check(ret == 0, "Failed to ibv_fork_init.");
+    }
+    t = __phase_done(SETUP_FORK_INIT, t);
 
     /* create IB context */
     ib_res.ctx = __ctx_open_device(ib_devname);
     check(ib_res.ctx != NULL, "Failed to open ib device.");
+    t = __phase_done(SETUP_OPEN_DEVICE, t);
 
     /* allocate protection domain */
     /*
@@ -281,6 +641,7 @@ int setup_ib(const char *ib_devname) {
      */
     ib_res.pd = ibv_alloc_pd(ib_res.ctx);
     check(ib_res.pd != NULL, "Failed to allocate protection domain.");
+    t = __phase_done(SETUP_ALLOC_PD, t);
 
     /*
      * ibv_query_port() returns the attributes of a port of an RDMA
@@ -317,7 +678,7 @@ int setup_ib(const char *ib_devname) {
      *    - IBoE (or RoCE) can be used
      *
      */
-    ret = ibv_query_port(ib_res.ctx, IB_PORT, &ib_res.port_attr);
+    ret = ibv_query_port(ib_res.ctx, config_info.ib_port, &ib_res.port_attr);
     check(ret == 0, "Failed to query IB port information.");
 
     if (ib_res.port_attr.link_layer == IBV_LINK_LAYER_INFINIBAND) {
@@ -338,17 +699,66 @@ int setup_ib(const char *ib_devname) {
          * SM (Subnet Manager).
          *
          */
-        ret = ibv_query_gid(ib_res.ctx, IB_PORT, IB_GID_INDEX,
+        ret = ibv_query_gid(ib_res.ctx, config_info.ib_port, config_info.gid_index,
                             &ib_res.local_gid);
         check(ret == 0, "Failed to query GID information.");
     } else { // IBV_LINK_LAYER_UNSPECIFIED
         // do nothing
     }
 
+    /* a UD message is a single packet */
+    if (config_info.ud) {
+        ib_res.ud_mtu = 128u << ib_res.port_attr.active_mtu;
+        check(workload.max_size <= ib_res.ud_mtu, "ud messages of %"PRIu32
+              " bytes exceed the path MTU of %"PRIu32, workload.max_size,
+              ib_res.ud_mtu);
+    }
+    t = __phase_done(SETUP_QUERY_PORT, t);
+
     /* register mr (memory region) */
-    ib_res.ib_buf_size = config_info.msg_size * config_info.num_concurr_msgs;
+    /*
+     * Receives can't know the size of the next message, so every slot holds
+     * the largest message of the workload; for a workload of mostly small
+     * messages, --rndv keeps the receives small instead. Slots are
+     * cache-line rounded so that neighbouring messages never share a line.
+     * The client keeps a second set of slots to send from, so that an
+     * incoming echo never lands in a buffer which is still being sent; the
+     * server keeps a response slot per client slot for RPC handlers which
+     * do not answer in place.
+     */
+    /*
+     * With a rendezvous threshold the receives and the read pool belong to
+     * the rndv layer; the client only sends from here, the server keeps a
+     * slot for its control messages in front of the response slots.
+     * Credits take receives of their own. A coalescing server keeps a
+     * batch buffer per client slot behind the response slots.
+     *
+     * A UD receive starts with the GRH, so its slot holds that in front of
+     * the message; the rndv layer hands out the message past it.
+     */
+    ib_res.buf_slot_size = ((size_t)workload.max_size + ib_recv_offset() +
+                            63) & ~(size_t)63;
+    ib_res.num_buf_slots = config_info.num_concurr_msgs;
+    if (config_info.rndv_threshold != 0) {
+        if (config_info.is_server)
+            ib_res.num_buf_slots += 1;
+    } else {
+        ib_res.num_buf_slots += rndv_eager_recvs();
+    }
+    if (config_info.is_server && config_info.coalesce > 1)
+        ib_res.num_buf_slots += config_info.num_concurr_msgs;
+
+    /*
+     * every worker thread owns a contiguous run of slots, one set for each
+     * client QP it serves
+     */
+    ib_res.num_qps         = config_info.num_threads;
+    ib_res.peer_buf_size   = ib_res.buf_slot_size * ib_res.num_buf_slots;
+    ib_res.thread_buf_size = ib_res.peer_buf_size * ib_max_qp_peers();
+    ib_res.ib_buf_size     = ib_res.thread_buf_size * ib_res.num_qps;
     ib_res.ib_buf      = (char *)memalign(4096, ib_res.ib_buf_size);
     check(ib_res.ib_buf != NULL, "Failed to allocate ib_buf");
+    t = __phase_done(SETUP_ALLOC_BUF, t);
 
     /*
      * struct ibv_mr *, Pointer to the newly allocated Memory Region.
@@ -385,10 +795,29 @@ int setup_ib(const char *ib_devname) {
      * The registered memory buffer doesn't have to be page-aligned.
      *
      */
-    ib_res.mr = ibv_reg_mr(ib_res.pd, (void *)ib_res.ib_buf, ib_res.ib_buf_size,
-                           IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
-                           IBV_ACCESS_REMOTE_WRITE);
-    check(ib_res.mr != NULL, "Failed to register mr");
+    /*
+     * A pool larger than --reg-chunk-mb is registered as several MRs. Chunks
+     * are whole slots, so that a message never straddles two of them, and
+     * ib_lkey() finds the one holding a buffer.
+     */
+    ib_res.mr_chunk_size = ib_res.ib_buf_size;
+    if (config_info.reg_chunk_mb > 0) {
+        chunk_slots = ((size_t)config_info.reg_chunk_mb << 20) /
+            ib_res.buf_slot_size;
+        if (chunk_slots == 0)
+            chunk_slots = 1;
+        if (chunk_slots * ib_res.buf_slot_size < ib_res.ib_buf_size)
+            ib_res.mr_chunk_size = chunk_slots * ib_res.buf_slot_size;
+    }
+    ib_res.num_mrs = (ib_res.ib_buf_size + ib_res.mr_chunk_size - 1) /
+        ib_res.mr_chunk_size;
+    ib_res.mrs = (struct ibv_mr **)calloc(ib_res.num_mrs,
+                                          sizeof(struct ibv_mr *));
+    check(ib_res.mrs != NULL, "Failed to allocate mrs");
+
+    ret = pthread_create(&mr_thread, NULL, __reg_mr_thread, NULL);
+    check(ret == 0, "Failed to start mr registration");
+    mr_thread_running = true;
 
     /* query IB device attr */
     /*
@@ -409,6 +838,7 @@ int setup_ib(const char *ib_devname) {
      */
     ret = ibv_query_device(ib_res.ctx, &ib_res.dev_attr);
     check(ret == 0, "Failed to query device");
+    t = __phase_done(SETUP_QUERY_DEVICE, t);
 
     /* create cq (complete queue)
      *
@@ -428,9 +858,66 @@ int setup_ib(const char *ib_devname) {
      *  can be equal or higher than this value.
      *
      */
-    ib_res.cq = ibv_create_cq(ib_res.ctx, ib_res.dev_attr.max_cqe,
-                              NULL, NULL, 0);
-    check(ib_res.cq != NULL, "Failed to create cq");
+    /*
+     * Every worker keeps num_concurr_msgs data messages in flight plus a
+     * control message. Unsignaled sends hold their send queue entry until a
+     * later signaled send completes, so the send queue also covers one
+     * signal interval.
+     *
+     * A worker's QP is the only one on its CQ, so the CQ never holds more
+     * completions than both queues have entries. max_cqe would cost pinned
+     * memory and creation time for nothing.
+     */
+    max_send_wr = config_info.num_concurr_msgs + config_info.signal_interval + 2;
+    max_recv_wr = config_info.num_concurr_msgs + 1;
+    if (config_info.rndv_threshold != 0) {
+        /* a READ and a FIN per pool buffer, FINs take receives */
+        max_send_wr += 2 * rndv_pool_bufs();
+        max_recv_wr += rndv_pool_bufs() + 1;
+    }
+    if (config_info.credits) {
+        /* credit messages, into the reserve */
+        max_send_wr += RNDV_CREDIT_RECVS;
+        max_recv_wr += RNDV_CREDIT_RECVS;
+    }
+    /* a server UD QP takes the messages of all of its peers */
+    max_send_wr *= ib_max_qp_peers();
+    max_recv_wr *= ib_max_qp_peers();
+    cqe         = max_send_wr + max_recv_wr;
+    check(cqe <= ib_res.dev_attr.max_cqe, "%d cq entries exceed the device "
+          "limit %d", cqe, ib_res.dev_attr.max_cqe);
+
+    ib_res.cq = (struct ibv_cq **)calloc(ib_res.num_qps, sizeof(struct ibv_cq *));
+    ib_res.qp = (struct ibv_qp **)calloc(ib_res.num_qps, sizeof(struct ibv_qp *));
+    check(ib_res.cq != NULL && ib_res.qp != NULL, "Failed to allocate qps");
+    if (config_info.ud) {
+        /* the server addresses every reply itself */
+        if (config_info.is_server == false)
+            ib_res.ud_dest = (struct UdDest *)calloc(ib_res.num_qps,
+                                                     sizeof(struct UdDest));
+        ib_res.ah_cache = ah_cache_create(ib_res.pd, config_info.ib_port,
+                                          config_info.gid_index,
+                                          ib_res.port_attr.link_layer ==
+                                          IBV_LINK_LAYER_ETHERNET);
+        check((config_info.is_server || ib_res.ud_dest != NULL) &&
+              ib_res.ah_cache != NULL,
+              "Failed to allocate ud destinations");
+    }
+
+    /* what the queues cost in memory; vec is resident before it counts */
+    rss_vec_size = (ib_res.ib_buf_size + sysconf(_SC_PAGESIZE) - 1) /
+        sysconf(_SC_PAGESIZE);
+    rss_vec = (unsigned char *)malloc(rss_vec_size);
+    if (rss_vec != NULL) {
+        memset(rss_vec, 0, rss_vec_size);
+        rss_pages = __rss_pages(rss_vec);
+    }
+
+    for (i = 0; i < ib_res.num_qps; i++) {
+        ib_res.cq[i] = ibv_create_cq(ib_res.ctx, cqe, NULL, NULL, 0);
+        check(ib_res.cq[i] != NULL, "Failed to create cq[%d]", i);
+    }
+    t = __phase_done(SETUP_CREATE_CQ, t);
 
     /* create qp (queue pair) */
     /*
@@ -446,11 +933,9 @@ int setup_ib(const char *ib_devname) {
      *
      */
     struct ibv_qp_init_attr qp_init_attr = {
-        .send_cq = ib_res.cq,
-        .recv_cq = ib_res.cq,
         .cap = {
-            .max_send_wr = 2, // [0..ib_res.dev_attr.max_qp_wr]
-            .max_recv_wr = 2, // [0..ib_res.dev_attr.max_qp_wr]
+            .max_send_wr = max_send_wr, // [0..ib_res.dev_attr.max_qp_wr]
+            .max_recv_wr = max_recv_wr, // [0..ib_res.dev_attr.max_qp_wr]
             /*
              * The maximum number of scatter/gather elements in any Work Request
              * that can be posted to the Send Queue in that Queue Pair. Value can
@@ -459,7 +944,7 @@ int setup_ib(const char *ib_devname) {
              * elements than the maximum reported value.
              *
              */
-            .max_send_sge = 1,
+            .max_send_sge = config_info.num_sge,
             /*
              * The maximum number of scatter/gather elements in any Work Request
              * that can be posted to the Receive Queue in that Queue Pair.
@@ -469,7 +954,7 @@ int setup_ib(const char *ib_devname) {
              * if the Queue Pair is associated with an SRQ (Shared Receive Queue)
              *
              */
-            .max_recv_sge = 1,
+            .max_recv_sge = config_info.num_sge,
             /*
              * The maximum message size (in bytes) that can be posted inline to
              * the Send Queue. 0, if no inline message is requested
@@ -489,10 +974,11 @@ int setup_ib(const char *ib_devname) {
              * create the QP with the required message size and continue
              * decreasing it if the QP creation fails.
              */
-            .max_inline_data = 0,
+            .max_inline_data = config_info.inline_size,
         },
-        .qp_type = IBV_QPT_RC,
+        .qp_type = config_info.ud ? IBV_QPT_UD : IBV_QPT_RC,
     };
+    struct ibv_qp_cap qp_cap = qp_init_attr.cap;
 
     /*
      * ibv_create_qp() creates a Queue Pair (QP) associated with a Protection
@@ -503,8 +989,49 @@ int setup_ib(const char *ib_devname) {
      * and Receive queues. The actual attributes can be equal or higher than
      * those values.
      */
-    ib_res.qp = ibv_create_qp(ib_res.pd, &qp_init_attr);
-    check(ib_res.qp != NULL, "Failed to create qp");
+    check(qp_cap.max_send_wr <= (uint32_t)ib_res.dev_attr.max_qp_wr,
+          "max_send_wr %"PRIu32" exceeds the device limit %d",
+          qp_cap.max_send_wr, ib_res.dev_attr.max_qp_wr);
+    check(qp_cap.max_recv_wr <= (uint32_t)ib_res.dev_attr.max_qp_wr,
+          "max_recv_wr %"PRIu32" exceeds the device limit %d",
+          qp_cap.max_recv_wr, ib_res.dev_attr.max_qp_wr);
+    check(config_info.num_sge <= ib_res.dev_attr.max_sge,
+          "%d sges exceed the device limit %d", config_info.num_sge,
+          ib_res.dev_attr.max_sge);
+
+    for (i = 0; i < ib_res.num_qps; i++) {
+        qp_init_attr.send_cq = ib_res.cq[i];
+        qp_init_attr.recv_cq = ib_res.cq[i];
+        if (ib_res.ud_dest != NULL)
+            qp_init_attr.qp_context = &ib_res.ud_dest[i];
+
+        /* halve the inline size until the provider accepts it */
+        while ((ib_res.qp[i] = ibv_create_qp(ib_res.pd, &qp_init_attr)) == NULL &&
+               qp_init_attr.cap.max_inline_data > 0) {
+            qp_cap.max_inline_data /= 2;
+            qp_init_attr.cap = qp_cap;
+        }
+        check(ib_res.qp[i] != NULL, "Failed to create qp[%d]", i);
+        PROBE(qp_created, i, ib_res.qp[i]->qp_num,
+              qp_init_attr.cap.max_send_wr, qp_init_attr.cap.max_recv_wr,
+              qp_init_attr.cap.max_inline_data);
+
+        /* later QPs ask for what the first one was granted */
+        qp_cap = qp_init_attr.cap;
+    }
+
+    /*
+     * the provider writes back what it actually granted. Some providers
+     * grant inline space nobody asked for; inline sends stay off then.
+     */
+    ib_res.qp_cap = qp_init_attr.cap;
+    if (config_info.inline_size == 0)
+        ib_res.qp_cap.max_inline_data = 0;
+    else if (ib_res.qp_cap.max_inline_data < (uint32_t)config_info.inline_size)
+        log("max_inline_data: asked for %d, granted %"PRIu32,
+            config_info.inline_size, ib_res.qp_cap.max_inline_data);
+
+    t = __phase_done(SETUP_CREATE_QP, t);
 
     /* connect QP */
     if (config_info.is_server) {
@@ -513,22 +1040,78 @@ int setup_ib(const char *ib_devname) {
         ret = connect_qp_client();
     }
     check(ret == 0, "Failed to connect qp");
+    t = __phase_done(SETUP_CONNECT, t);
+
+    ib_res.queue_rss = -1;
+    if (rss_pages >= 0 && (ib_res.queue_rss = __rss_pages(rss_vec)) >= 0)
+        ib_res.queue_rss = (ib_res.queue_rss - rss_pages) *
+            sysconf(_SC_PAGESIZE);
+    free(rss_vec);
+    rss_vec = NULL;
+
+    ret = pthread_barrier_init(&workers_barrier, NULL, ib_res.num_qps);
+    check(ret == 0, "Failed to init the workers barrier");
+    workers_barrier_inited = true;
+
+    pthread_join(mr_thread, NULL);
+    mr_thread_running = false;
+    for (i = 0; i < ib_res.num_mrs; i++) {
+        check(ib_res.mrs[i] != NULL, "Failed to register mr[%d]", i);
+        PROBE(mr_registered, ib_res.mrs[i]->addr, ib_res.mrs[i]->length,
+              ib_res.mrs[i]->lkey);
+    }
+    t = __phase_done(SETUP_MR_WAIT, t);
+
+    ib_res.setup_total_ns = t - start;
+    __log_setup_timing();
 
     return 0;
 
 error:
+    /* close_ib_connection() must not race with the registration */
+    if (mr_thread_running)
+        pthread_join(mr_thread, NULL);
+    if (rss_vec != NULL)
+        free(rss_vec);
     return -1;
 }
 
 void close_ib_connection() {
+    int i = 0;
+
+    __close_sync_sockfds();
+    if (ib_res.sync_sockfds != NULL)
+        free(ib_res.sync_sockfds);
+    if (ib_res.qp_peers != NULL)
+        free(ib_res.qp_peers);
+    if (workers_barrier_inited)
+        pthread_barrier_destroy(&workers_barrier);
+
+    for (i = 0; i < ib_res.num_qps; i++) {
+        if (ib_res.qp != NULL && ib_res.qp[i] != NULL)
+            ibv_destroy_qp(ib_res.qp[i]);
+
+        if (ib_res.cq != NULL && ib_res.cq[i] != NULL)
+            ibv_destroy_cq(ib_res.cq[i]);
+    }
+
     if (ib_res.qp != NULL)
-        ibv_destroy_qp(ib_res.qp);
+        free(ib_res.qp);
+
+    /* after the QPs, whose sends may have named the AHs */
+    ah_cache_destroy(ib_res.ah_cache);
+    if (ib_res.ud_dest != NULL)
+        free(ib_res.ud_dest);
 
     if (ib_res.cq != NULL)
-        ibv_destroy_cq(ib_res.cq);
+        free(ib_res.cq);
+
+    for (i = 0; i < ib_res.num_mrs; i++)
+        if (ib_res.mrs != NULL && ib_res.mrs[i] != NULL)
+            ibv_dereg_mr(ib_res.mrs[i]);
 
-    if (ib_res.mr != NULL)
-        ibv_dereg_mr(ib_res.mr);
+    if (ib_res.mrs != NULL)
+        free(ib_res.mrs);
 
     if (ib_res.pd != NULL)
         ibv_dealloc_pd(ib_res.pd);
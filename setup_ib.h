@@ -3,27 +3,146 @@
 
 #include <infiniband/verbs.h>
 
+#include "ib.h"
+#include "config.h"
+#include "ah_cache.h"
+
+/* setup_ib() phases, timed into ib_res.setup_ns */
+enum SetupPhase {
+    SETUP_FORK_INIT = 0,
+    SETUP_OPEN_DEVICE,
+    SETUP_ALLOC_PD,
+    SETUP_QUERY_PORT,
+    SETUP_ALLOC_BUF,
+    SETUP_REG_MR,       /* on a helper thread, overlaps the phases below */
+    SETUP_QUERY_DEVICE,
+    SETUP_CREATE_CQ,
+    SETUP_CREATE_QP,
+    SETUP_CONNECT,      /* TCP handshake and QP transitions */
+    SETUP_MR_WAIT,      /* registration still running after connect */
+    SETUP_NUM_PHASES,
+};
+
+extern const char *setup_phase_names[SETUP_NUM_PHASES];
+
 struct IBRes {
     struct ibv_context      *ctx;
     struct ibv_pd           *pd;
-    struct ibv_mr           *mr;
-    struct ibv_cq           *cq;
-    struct ibv_qp           *qp;
+    struct ibv_mr           **mrs;   /* the buffer pool, in chunks */
+    int                     num_mrs;
+    size_t                  mr_chunk_size;
+    struct ibv_cq           **cq;    /* one per worker thread */
+    struct ibv_qp           **qp;    /* one per worker thread */
+    int                     num_qps;
     struct ibv_port_attr    port_attr;
     struct ibv_device_attr  dev_attr;
+    struct ibv_qp_cap       qp_cap;
     union  ibv_gid          local_gid;
+    int                     *sync_sockfds; /* to the clients, or the
+                                            * server, until the workers
+                                            * are ready */
+    int                     num_sync_sockfds;
+    int                     *qp_peers; /* client QPs each qp serves */
+    struct UdDest           *ud_dest; /* peer of each qp, --ud client */
+    struct AhCache          *ah_cache;
+    uint32_t                ud_mtu;  /* largest UD message, 0 for RC */
 
 
     char    *ib_buf;
     size_t  ib_buf_size;
+    size_t  thread_buf_size; /* slots of one worker thread */
+    size_t  peer_buf_size;   /* slots of one peer of a worker thread */
+    size_t  buf_slot_size;   /* one message slot, cache-line rounded */
+    int     num_buf_slots;   /* per peer of a worker thread */
+
+    uint64_t setup_ns[SETUP_NUM_PHASES];
+    uint64_t setup_total_ns; /* wall clock of setup_ib() */
+    int      num_reg_threads;
+    int      nic_numa_node;  /* -1 if unknown or not looked up */
+    long     queue_rss;      /* bytes the CQs, QPs and AHs grew RSS by */
 };
 
 extern struct IBRes ib_res;
 
+/* bytes in front of a message in its receive, the GRH of a UD QP */
+static inline uint32_t ib_recv_offset() {
+    return config_info.ud ? IB_GRH_SIZE : 0;
+}
+
+/*
+ * Client QPs a QP of ours serves at most: a server spreads --peers over its
+ * threads, round robin. Each gets the receives and slots one peer takes.
+ */
+static inline int ib_max_qp_peers() {
+    if (config_info.is_server == false)
+        return 1;
+    return (config_info.num_peers + config_info.num_threads - 1) /
+        config_info.num_threads;
+}
+
+/* buffer region owned by worker thread_id */
+static inline char *ib_thread_buf(long thread_id) {
+    return ib_res.ib_buf + thread_id * ib_res.thread_buf_size;
+}
+
+/* the part of it for the peer-th client QP the worker serves */
+static inline char *ib_peer_buf(long thread_id, int peer) {
+    return ib_thread_buf(thread_id) + peer * ib_res.peer_buf_size;
+}
+
+/* the MR of the chunk holding addr, which must be inside ib_buf */
+static inline struct ibv_mr *ib_mr_of(const void *addr) {
+    if (ib_res.num_mrs == 1)
+        return ib_res.mrs[0];
+    return ib_res.mrs[((const char *)addr - ib_res.ib_buf) /
+                      ib_res.mr_chunk_size];
+}
+
+static inline uint32_t ib_lkey(const void *addr) {
+    return ib_mr_of(addr)->lkey;
+}
+
+static inline uint32_t ib_rkey(const void *addr) {
+    return ib_mr_of(addr)->rkey;
+}
+
+/* registration throughput of the buffer pool, GB/s */
+static inline double setup_reg_gbps() {
+    return ib_res.setup_ns[SETUP_REG_MR] ?
+        (double)ib_res.ib_buf_size / ib_res.setup_ns[SETUP_REG_MR] : 0.0;
+}
+
+/*
+ * Send flags for the next data message. Only one send in every
+ * signal_interval asks for a completion; a signaled completion retires the
+ * unsignaled sends posted before it, so the send queue is sized for it in
+ * setup_ib(). Messages which fit in the granted max_inline_data are copied
+ * into the WQE instead of being fetched by the NIC.
+ */
+static inline int data_send_flags(uint32_t size, uint64_t *num_sends) {
+    int flags = 0;
+
+    if (++(*num_sends) % config_info.signal_interval == 0)
+        flags |= IBV_SEND_SIGNALED;
+    if (size > 0 && size <= ib_res.qp_cap.max_inline_data)
+        flags |= IBV_SEND_INLINE;
+
+    return flags;
+}
+
 int setup_ib(const char *ib_devname);
 void close_ib_connection();
 
 int connect_qp_server();
 int connect_qp_client();
 
+/*
+ * Every worker calls this once its receives are posted, ok false if it
+ * failed before. The last one to arrive exchanges the sync message with the
+ * server, or with every client, so no message of either side can find a
+ * receive queue of the other empty. Returns -1 if a worker of either side
+ * failed.
+ */
+int ib_workers_ready(bool ok);
+
 #endif /* __SETUP_IB_H__ */
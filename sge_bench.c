@@ -0,0 +1,426 @@
+/*
+ * rdma-sge-bench: gather/scatter against copy-then-send
+ *
+ * Sends messages made of a header and a payload kept in separate registered
+ * buffers between two RC QPs of one port, connected to each other. With
+ * copy, the sender memcpy()s both into a staging buffer and posts one SGE,
+ * and the receiver takes the message in one buffer. With gather, the sender
+ * posts two SGEs and the receiver scatters the header and the payload into
+ * their own buffers. Reports message rate, bandwidth and the sender's CPU
+ * cost per message (copies and post) for every payload size.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <malloc.h>
+#include <infiniband/verbs.h>
+
+#include "debug.h"
+#include "ib.h"
+#include "config.h"
+#include "setup_ib.h"
+#include "tsc.h"
+
+FILE *log_fp = NULL;
+struct IBRes ib_res;
+
+#define SGE_BENCH_DEPTH     64
+#define SGE_BENCH_OPS       1000000
+#define SGE_BENCH_HEADER    64
+#define SGE_BENCH_MAX_SIZES 16
+
+struct Peer {
+    struct ibv_cq *cq;
+    struct ibv_qp *qp;
+};
+
+/* all buffers of both sides, depth slots each, in one MR */
+struct Bufs {
+    char          *region;
+    struct ibv_mr *mr;
+    uint32_t      hdr_size;
+    uint32_t      max_size;
+    int           depth;
+    char          *hdr, *payload, *stage;       /* sender */
+    char          *rhdr, *rpayload, *rstage;    /* receiver */
+};
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-d ib_dev] [-P ib_port] [-g gid_idx] [-H header] "
+           "[-s size,...] [-n ops] [-q depth]\n", prog);
+    printf("  defaults: first device, port %d, gid %d, %d byte header, sizes "
+           "64..64K, %d ops, depth %d\n", IB_PORT, IB_GID_INDEX,
+           SGE_BENCH_HEADER, SGE_BENCH_OPS, SGE_BENCH_DEPTH);
+}
+
+static inline size_t __round64(size_t n) {
+    return (n + 63) & ~(size_t)63;
+}
+
+static int __open(const char *name) {
+    int i = 0, num = 0;
+    struct ibv_device **list = NULL;
+
+    list = ibv_get_device_list(&num);
+    check(list != NULL && num > 0, "No IB devices found");
+    for (i = 0; i < num; i++)
+        if (name == NULL || !strcmp(ibv_get_device_name(list[i]), name))
+            break;
+    check(i < num, "IB device %s not found", name);
+
+    ib_res.ctx = ibv_open_device(list[i]);
+    check(ib_res.ctx != NULL, "Failed to open %s",
+          ibv_get_device_name(list[i]));
+    ibv_free_device_list(list);
+    list = NULL;
+
+    ib_res.pd = ibv_alloc_pd(ib_res.ctx);
+    check(ib_res.pd != NULL, "Failed to allocate pd");
+    check(ibv_query_port(ib_res.ctx, config_info.ib_port,
+                         &ib_res.port_attr) == 0, "Failed to query port");
+    check(ibv_query_device(ib_res.ctx, &ib_res.dev_attr) == 0,
+          "Failed to query device");
+    if (ib_res.port_attr.link_layer == IBV_LINK_LAYER_ETHERNET)
+        check(ibv_query_gid(ib_res.ctx, config_info.ib_port,
+                            config_info.gid_index, &ib_res.local_gid) == 0,
+              "Failed to query GID");
+    check(ib_res.dev_attr.max_sge >= 2, "%s supports %d sge only",
+          ibv_get_device_name(ib_res.ctx->device), ib_res.dev_attr.max_sge);
+
+    return 0;
+error:
+    if (list != NULL)
+        ibv_free_device_list(list);
+    return -1;
+}
+
+static int __create_peer(struct Peer *p, int depth) {
+    struct ibv_qp_init_attr attr = {
+        .cap = {
+            .max_send_wr  = 2 * depth,
+            .max_recv_wr  = depth,
+            .max_send_sge = 2,
+            .max_recv_sge = 2,
+        },
+        .qp_type = IBV_QPT_RC,
+    };
+
+    p->cq = ibv_create_cq(ib_res.ctx, 3 * depth, NULL, NULL, 0);
+    check(p->cq != NULL, "Failed to create cq");
+
+    attr.send_cq = p->cq;
+    attr.recv_cq = p->cq;
+    p->qp = ibv_create_qp(ib_res.pd, &attr);
+    check(p->qp != NULL, "Failed to create qp");
+
+    return 0;
+error:
+    return -1;
+}
+
+static void __destroy_peer(struct Peer *p) {
+    if (p->qp != NULL)
+        ibv_destroy_qp(p->qp);
+    if (p->cq != NULL)
+        ibv_destroy_cq(p->cq);
+}
+
+/* connect the two QPs to each other through the port */
+static int __connect(struct Peer *a, struct Peer *b) {
+    struct QPInfo info_a, info_b;
+
+    info_a.lid    = ib_res.port_attr.lid;
+    info_a.qp_num = a->qp->qp_num;
+    info_a.gid    = ib_res.local_gid;
+    info_b        = info_a;
+    info_b.qp_num = b->qp->qp_num;
+
+    check(modify_qp_to_rts(a->qp, &info_b) == 0, "Failed to connect qp a");
+    check(modify_qp_to_rts(b->qp, &info_a) == 0, "Failed to connect qp b");
+    return 0;
+error:
+    return -1;
+}
+
+/* a run leaves its receives posted in its own layout: start on fresh QPs */
+static int __reset(struct Peer *tx, struct Peer *rx, int depth) {
+    __destroy_peer(tx);
+    __destroy_peer(rx);
+    memset(tx, 0, sizeof(struct Peer));
+    memset(rx, 0, sizeof(struct Peer));
+
+    check(__create_peer(tx, depth) == 0 && __create_peer(rx, depth) == 0,
+          "Failed to create qps");
+    return __connect(tx, rx);
+error:
+    return -1;
+}
+
+static int __alloc_bufs(struct Bufs *b, uint32_t hdr_size, uint32_t max_size,
+                        int depth) {
+    size_t hdr = __round64(hdr_size), payload = __round64(max_size);
+    size_t stage = __round64(hdr_size + max_size);
+    size_t size = 2 * depth * (hdr + payload + stage);
+
+    b->hdr_size = hdr_size;
+    b->max_size = max_size;
+    b->depth    = depth;
+
+    b->region = (char *)memalign(4096, size);
+    check(b->region != NULL, "Failed to allocate %zu bytes", size);
+    memset(b->region, 0, size);
+
+    b->mr = ibv_reg_mr(ib_res.pd, b->region, size, IBV_ACCESS_LOCAL_WRITE);
+    check(b->mr != NULL, "Failed to register buffers");
+
+    b->hdr      = b->region;
+    b->payload  = b->hdr + depth * hdr;
+    b->stage    = b->payload + depth * payload;
+    b->rhdr     = b->stage + depth * stage;
+    b->rpayload = b->rhdr + depth * hdr;
+    b->rstage   = b->rpayload + depth * payload;
+
+    return 0;
+error:
+    return -1;
+}
+
+#define HDR(b, base, i)     ((base) + (i) * __round64((b)->hdr_size))
+#define PAYLOAD(b, base, i) ((base) + (i) * __round64((b)->max_size))
+#define STAGE(b, base, i)   ((base) + (i) * \
+                             __round64((b)->hdr_size + (b)->max_size))
+
+static int __post_recv(struct Bufs *b, struct Peer *rx, int slot, uint32_t size,
+                       bool gather) {
+    struct ibv_sge sgl[2];
+
+    if (gather) {
+        sgl[0].addr   = (uintptr_t)HDR(b, b->rhdr, slot);
+        sgl[0].length = b->hdr_size;
+        sgl[0].lkey   = b->mr->lkey;
+        sgl[1].addr   = (uintptr_t)PAYLOAD(b, b->rpayload, slot);
+        sgl[1].length = size;
+        sgl[1].lkey   = b->mr->lkey;
+        return post_recv_sgl(sgl, 2, slot, rx->qp);
+    }
+
+    return post_recv(b->hdr_size + size, b->mr->lkey, slot, rx->qp,
+                     STAGE(b, b->rstage, slot));
+}
+
+/* header and payload of a received message are where the mode puts them */
+static bool __check_recv(struct Bufs *b, int slot, uint32_t size, bool gather,
+                         uint32_t byte_len) {
+    char *hdr = gather ? HDR(b, b->rhdr, slot) : STAGE(b, b->rstage, slot);
+    char *payload = gather ? PAYLOAD(b, b->rpayload, slot) :
+        hdr + b->hdr_size;
+
+    return byte_len == b->hdr_size + size &&
+        (uint8_t)hdr[0] == (uint8_t)(0xA0 + slot) &&
+        (size == 0 || (uint8_t)payload[size - 1] == (uint8_t)(0x50 + slot));
+}
+
+struct RunResult {
+    double   mops;
+    double   gbps;
+    double   post_ns;
+};
+
+static int __run(struct Bufs *b, struct Peer *tx, struct Peer *rx,
+                 uint32_t size, long ops, bool gather, struct RunResult *r) {
+    int i = 0, n = 0, slot = 0, depth = b->depth;
+    long sent = 0, received = 0, sq_out = 0;
+    uint64_t start = 0, post_cycles = 0, t = 0;
+    struct ibv_sge sgl[2];
+    struct ibv_wc wc[32];
+
+    for (i = 0; i < depth; i++) {
+        memset(HDR(b, b->hdr, i), 0xA0 + i, b->hdr_size);
+        memset(PAYLOAD(b, b->payload, i), 0x50 + i, size);
+        check(__post_recv(b, rx, i, size, gather) == 0, "Failed to post recv");
+    }
+
+    start = rdtsc();
+    while (received < ops) {
+        /* every send has a receive waiting: at most depth in flight */
+        while (sent < ops && sent - received < depth && sq_out < 2 * depth) {
+            slot = sent % depth;
+            t = rdtsc();
+            if (gather) {
+                sgl[0].addr   = (uintptr_t)HDR(b, b->hdr, slot);
+                sgl[0].length = b->hdr_size;
+                sgl[0].lkey   = b->mr->lkey;
+                sgl[1].addr   = (uintptr_t)PAYLOAD(b, b->payload, slot);
+                sgl[1].length = size;
+                sgl[1].lkey   = b->mr->lkey;
+                n = post_send_sgl(sgl, 2, slot, MSG_REGULAR,
+                                  IBV_SEND_SIGNALED, tx->qp);
+            } else {
+                memcpy(STAGE(b, b->stage, slot), HDR(b, b->hdr, slot),
+                       b->hdr_size);
+                memcpy(STAGE(b, b->stage, slot) + b->hdr_size,
+                       PAYLOAD(b, b->payload, slot), size);
+                n = post_send(b->hdr_size + size, b->mr->lkey, slot,
+                              MSG_REGULAR, IBV_SEND_SIGNALED, tx->qp,
+                              STAGE(b, b->stage, slot));
+            }
+            post_cycles += rdtsc() - t;
+            check(n == 0, "Failed to post send");
+            sent++;
+            sq_out++;
+        }
+
+        n = ibv_poll_cq(rx->cq, 32, wc);
+        check(n >= 0, "Failed to poll cq");
+        for (i = 0; i < n; i++) {
+            check(wc[i].status == IBV_WC_SUCCESS, "wc failed status: %d, %s",
+                  wc[i].status, ibv_wc_status_str(wc[i].status));
+            slot = (int)wc[i].wr_id;
+            check(__check_recv(b, slot, size, gather, wc[i].byte_len),
+                  "Message %ld landed in the wrong place", received);
+            received++;
+            check(__post_recv(b, rx, slot, size, gather) == 0,
+                  "Failed to post recv");
+        }
+
+        n = ibv_poll_cq(tx->cq, 32, wc);
+        check(n >= 0, "Failed to poll cq");
+        for (i = 0; i < n; i++) {
+            check(wc[i].status == IBV_WC_SUCCESS, "send failed status: %d, %s",
+                  wc[i].status, ibv_wc_status_str(wc[i].status));
+            sq_out--;
+        }
+    }
+    t = rdtsc() - start;
+
+    while (sq_out > 0) {
+        n = ibv_poll_cq(tx->cq, 32, wc);
+        check(n >= 0, "Failed to poll cq");
+        sq_out -= n;
+    }
+
+    r->mops    = ops / (double)tsc_to_ns(t) * 1e3;
+    r->gbps    = ops * (double)(b->hdr_size + size) * 8 / tsc_to_ns(t);
+    r->post_ns = (double)tsc_to_ns(post_cycles) / ops;
+    return 0;
+error:
+    return -1;
+}
+
+static int __parse_sizes(char *arg, uint32_t *sizes) {
+    int n = 0;
+    char *tok = NULL;
+
+    for (tok = strtok(arg, ","); tok != NULL && n < SGE_BENCH_MAX_SIZES;
+         tok = strtok(NULL, ","))
+        sizes[n++] = (uint32_t)atol(tok);
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    int opt = 0, i = 0, num_sizes = 0, depth = SGE_BENCH_DEPTH;
+    long ops = SGE_BENCH_OPS;
+    uint32_t hdr_size = SGE_BENCH_HEADER, max_size = 0;
+    uint32_t sizes[SGE_BENCH_MAX_SIZES] = {64, 256, 1024, 4096, 16384, 65536};
+    char *dev = NULL;
+    struct Peer tx, rx;
+    struct Bufs bufs;
+    struct RunResult copy, gather;
+
+    log_fp = stdout;
+    num_sizes = 6;
+    memset(&tx, 0, sizeof(tx));
+    memset(&rx, 0, sizeof(rx));
+    memset(&bufs, 0, sizeof(bufs));
+    config_info.ib_port   = IB_PORT;
+    config_info.gid_index = IB_GID_INDEX;
+
+    while ((opt = getopt(argc, argv, "d:P:g:H:s:n:q:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            dev = optarg;
+            break;
+        case 'P':
+            config_info.ib_port = atoi(optarg);
+            break;
+        case 'g':
+            config_info.gid_index = atoi(optarg);
+            break;
+        case 'H':
+            hdr_size = atoi(optarg);
+            break;
+        case 's':
+            num_sizes = __parse_sizes(optarg, sizes);
+            break;
+        case 'n':
+            ops = atol(optarg);
+            break;
+        case 'q':
+            depth = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 0;
+        }
+    }
+    check(hdr_size > 0 && num_sizes > 0 && ops > 0 && depth > 0 &&
+          depth < 256, "header, sizes and ops must be positive, depth "
+          "1..255");
+
+    for (i = 0; i < num_sizes; i++)
+        if (sizes[i] > max_size)
+            max_size = sizes[i];
+
+    check(tsc_init() == 0, "Failed to calibrate TSC");
+    check(__open(dev) == 0, "Failed to open device");
+    check(__create_peer(&tx, depth) == 0 && __create_peer(&rx, depth) == 0,
+          "Failed to create qps");
+    check(__connect(&tx, &rx) == 0, "Failed to connect qps");
+    check(__alloc_bufs(&bufs, hdr_size, max_size, depth) == 0,
+          "Failed to allocate buffers");
+
+    printf("%s port %d: %u byte header, %ld ops, depth %d\n\n",
+           ibv_get_device_name(ib_res.ctx->device), config_info.ib_port,
+           hdr_size, ops, depth);
+    printf("%10s | %10s %8s %10s | %10s %8s %10s\n", "", "copy", "", "",
+           "gather", "", "");
+    printf("%10s | %10s %8s %10s | %10s %8s %10s\n", "payload", "Mmsg/s",
+           "Gb/s", "cpu(ns)", "Mmsg/s", "Gb/s", "cpu(ns)");
+
+    for (i = 0; i < num_sizes; i++) {
+        check(__run(&bufs, &tx, &rx, sizes[i], ops, false, &copy) == 0,
+              "Copy run of %u bytes failed", sizes[i]);
+        check(__reset(&tx, &rx, depth) == 0, "Failed to recreate qps");
+
+        check(__run(&bufs, &tx, &rx, sizes[i], ops, true, &gather) == 0,
+              "Gather run of %u bytes failed", sizes[i]);
+        check(__reset(&tx, &rx, depth) == 0, "Failed to recreate qps");
+
+        printf("%10u | %10.3f %8.2f %10.1f | %10.3f %8.2f %10.1f\n", sizes[i],
+               copy.mops, copy.gbps, copy.post_ns, gather.mops, gather.gbps,
+               gather.post_ns);
+    }
+
+    __destroy_peer(&tx);
+    __destroy_peer(&rx);
+    ibv_dereg_mr(bufs.mr);
+    free(bufs.region);
+    ibv_dealloc_pd(ib_res.pd);
+    ibv_close_device(ib_res.ctx);
+    return 0;
+
+error:
+    __destroy_peer(&tx);
+    __destroy_peer(&rx);
+    if (bufs.mr != NULL)
+        ibv_dereg_mr(bufs.mr);
+    if (bufs.region != NULL)
+        free(bufs.region);
+    if (ib_res.pd != NULL)
+        ibv_dealloc_pd(ib_res.pd);
+    if (ib_res.ctx != NULL)
+        ibv_close_device(ib_res.ctx);
+    return -1;
+}
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "config.h"
+#include "shm_stats.h"
+
+static struct ShmStatsHeader *shm_hdr = NULL;
+static size_t shm_size = 0;
+static char shm_name[64] = {'\0'};
+
+struct ThreadStats *shm_stats_create(int num_threads) {
+    int fd = -1;
+    struct timespec now;
+
+    snprintf(shm_name, sizeof(shm_name), "/" SHM_STATS_PREFIX "%d",
+             (int)getpid());
+    shm_size = sizeof(struct ShmStatsHeader) +
+        (size_t)num_threads * sizeof(struct ThreadStats);
+
+    fd = shm_open(shm_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    check(fd >= 0, "Failed to create shm segment %s", shm_name);
+
+    check(ftruncate(fd, shm_size) == 0, "Failed to size shm segment %s",
+          shm_name);
+
+    shm_hdr = (struct ShmStatsHeader *)mmap(NULL, shm_size,
+                                            PROT_READ | PROT_WRITE,
+                                            MAP_SHARED, fd, 0);
+    check(shm_hdr != MAP_FAILED, "Failed to map shm segment %s", shm_name);
+    close(fd);
+    fd = -1;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    shm_hdr->header_size      = sizeof(struct ShmStatsHeader);
+    shm_hdr->stats_size       = sizeof(struct ThreadStats);
+    shm_hdr->version          = SHM_STATS_VERSION;
+    shm_hdr->pid              = getpid();
+    shm_hdr->num_threads      = num_threads;
+    shm_hdr->is_server        = config_info.is_server;
+    shm_hdr->msg_size         = config_info.msg_size;
+    shm_hdr->num_concurr_msgs = config_info.num_concurr_msgs;
+    shm_hdr->state            = SHM_STATS_RUNNING;
+    shm_hdr->start_time_ns    = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+    /* publish the header last, readers spin until the magic shows up */
+    __atomic_store_n(&shm_hdr->magic, SHM_STATS_MAGIC, __ATOMIC_RELEASE);
+
+    log("shm stats segment  = /dev/shm%s", shm_name);
+    return shm_stats_thread(shm_hdr, 0);
+
+error:
+    if (fd >= 0)
+        close(fd);
+    if (shm_name[0] != '\0')
+        shm_unlink(shm_name);
+    shm_hdr = NULL;
+    return NULL;
+}
+
+void shm_stats_destroy() {
+    if (shm_hdr == NULL)
+        return;
+
+    __atomic_store_n(&shm_hdr->state, SHM_STATS_FINISHED, __ATOMIC_RELEASE);
+    munmap(shm_hdr, shm_size);
+    shm_unlink(shm_name);
+
+    shm_hdr = NULL;
+}
+
+struct ShmStatsHeader *shm_stats_attach(pid_t pid, size_t *size) {
+    int fd = -1;
+    char name[64];
+    struct stat st;
+    struct ShmStatsHeader *hdr = MAP_FAILED;
+
+    snprintf(name, sizeof(name), "/" SHM_STATS_PREFIX "%d", (int)pid);
+
+    fd = shm_open(name, O_RDONLY, 0);
+    check(fd >= 0, "Failed to open shm segment %s", name);
+
+    check(fstat(fd, &st) == 0, "Failed to stat shm segment %s", name);
+    check(st.st_size >= (off_t)sizeof(struct ShmStatsHeader),
+          "shm segment %s is too small", name);
+
+    hdr = (struct ShmStatsHeader *)mmap(NULL, st.st_size, PROT_READ,
+                                        MAP_SHARED, fd, 0);
+    check(hdr != MAP_FAILED, "Failed to map shm segment %s", name);
+    close(fd);
+    fd = -1;
+
+    check(__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == SHM_STATS_MAGIC,
+          "%s is not an rdma-tutorial stats segment", name);
+    check(hdr->version == SHM_STATS_VERSION,
+          "%s has version %u, expected %u", name, hdr->version,
+          SHM_STATS_VERSION);
+    check(hdr->stats_size >= sizeof(struct ThreadStats) &&
+          hdr->header_size + (size_t)hdr->num_threads * hdr->stats_size <=
+          (size_t)st.st_size, "%s has an inconsistent layout", name);
+
+    *size = st.st_size;
+    return hdr;
+
+error:
+    if (fd >= 0)
+        close(fd);
+    if (hdr != MAP_FAILED)
+        munmap(hdr, st.st_size);
+    return NULL;
+}
+
+void shm_stats_detach(struct ShmStatsHeader *hdr, size_t size) {
+    if (hdr != NULL)
+        munmap(hdr, size);
+}
@@ -0,0 +1,56 @@
+#ifndef __SHM_STATS_H__
+#define __SHM_STATS_H__
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+#include "stats.h"
+
+/*
+ * Shared-memory stats segment
+ *
+ * With --shm-stats the per-thread ThreadStats live in a POSIX shared-memory
+ * segment, /dev/shm/rdma-tutorial.<pid>, instead of the heap. Workers keep
+ * updating them in place, so publishing costs nothing beyond the seqlock
+ * they already maintain, and rdma-stat can attach to any running process.
+ *
+ * Layout: one ShmStatsHeader, followed by num_threads ThreadStats. Readers
+ * must check magic and version, and use header_size and stats_size to
+ * locate the per-thread slots.
+ */
+#define SHM_STATS_MAGIC     0x54534452  /* "RDST" */
+#define SHM_STATS_VERSION   4
+#define SHM_STATS_PREFIX    "rdma-tutorial."
+
+enum ShmStatsState {
+    SHM_STATS_RUNNING = 0,
+    SHM_STATS_FINISHED,
+};
+
+struct ShmStatsHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t stats_size;
+    int32_t  pid;
+    int32_t  num_threads;
+    int32_t  is_server;
+    int32_t  msg_size;
+    int32_t  num_concurr_msgs;
+    int32_t  state;             /* enum ShmStatsState */
+    uint64_t start_time_ns;     /* CLOCK_REALTIME */
+}__attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct ThreadStats *shm_stats_create(int num_threads);
+void shm_stats_destroy();
+
+struct ShmStatsHeader *shm_stats_attach(pid_t pid, size_t *size);
+void shm_stats_detach(struct ShmStatsHeader *hdr, size_t size);
+
+static inline struct ThreadStats *shm_stats_thread(struct ShmStatsHeader *hdr,
+                                                   int thread_id) {
+    return (struct ThreadStats *)((char *)hdr + hdr->header_size +
+                                  (size_t)thread_id * hdr->stats_size);
+}
+
+#endif /* __SHM_STATS_H__ */
@@ -59,7 +59,7 @@ ssize_t sock_write(int sock_fd, void *buffer, size_t len) {
 int sock_create_bind(char *port) {
     struct addrinfo hints;
     struct addrinfo *result, *rp;
-    int sock_fd = -1, ret = 0;
+    int sock_fd = -1, ret = 0, on = 1;
 
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_socktype = SOCK_STREAM;
@@ -74,6 +74,9 @@ int sock_create_bind(char *port) {
         if (sock_fd < 0)
             continue;
 
+        /* back-to-back runs reuse the port while it is in TIME_WAIT */
+        setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
         ret = bind(sock_fd, rp->ai_addr, rp->ai_addrlen);
         if (ret == 0)
             /* bind success */
@@ -0,0 +1,28 @@
+#include <stdlib.h>
+#include <malloc.h>
+
+#include "debug.h"
+#include "spsc.h"
+
+int spsc_init(struct SpscRing *r, uint32_t size, uint32_t entry_size) {
+    memset(r, 0, sizeof(struct SpscRing));
+    check(size >= 2 && (size & (size - 1)) == 0,
+          "SPSC ring of %"PRIu32" entries is not a power of two", size);
+
+    r->entry_size = entry_size;
+    r->mask       = size - 1;
+    r->entries    = (char *)memalign(SPSC_LINE, (size_t)size * entry_size);
+    check(r->entries != NULL, "Failed to allocate an SPSC ring");
+
+    return 0;
+error:
+    spsc_destroy(r);
+    return -1;
+}
+
+void spsc_destroy(struct SpscRing *r) {
+    if (r->entries != NULL)
+        free(r->entries);
+
+    r->entries = NULL;
+}
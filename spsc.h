@@ -0,0 +1,70 @@
+#ifndef __SPSC_H__
+#define __SPSC_H__
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+
+/*
+ * Single-producer single-consumer ring
+ *
+ * A bounded queue of fixed-size entries between exactly two threads, with
+ * no locks and no atomic read-modify-write: the producer only stores head,
+ * the consumer only stores tail, each with release order, and each reads
+ * the other's index with acquire order. The two indices live on cache
+ * lines of their own, next to a private copy of the other side's index,
+ * so that a push or pop only touches the shared line when the copy says
+ * the ring looks full or empty.
+ */
+#define SPSC_LINE       64
+
+struct SpscRing {
+    char        *entries;
+    uint32_t    entry_size;
+    uint32_t    mask;           /* size - 1, size a power of two */
+
+    /* producer */
+    uint64_t    head __attribute__((aligned(SPSC_LINE)));
+    uint64_t    tail_cache;
+
+    /* consumer */
+    uint64_t    tail __attribute__((aligned(SPSC_LINE)));
+    uint64_t    head_cache;
+}__attribute__((aligned(SPSC_LINE)));
+
+int  spsc_init(struct SpscRing *r, uint32_t size, uint32_t entry_size);
+void spsc_destroy(struct SpscRing *r);
+
+/* copy entry in, false while the ring is full */
+static inline bool spsc_push(struct SpscRing *r, const void *entry) {
+    uint64_t head = r->head;
+
+    if (head - r->tail_cache > r->mask) {
+        r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (head - r->tail_cache > r->mask)
+            return false;
+    }
+
+    memcpy(r->entries + (head & r->mask) * r->entry_size, entry,
+           r->entry_size);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* copy the oldest entry out, false while the ring is empty */
+static inline bool spsc_pop(struct SpscRing *r, void *entry) {
+    uint64_t tail = r->tail;
+
+    if (tail == r->head_cache) {
+        r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (tail == r->head_cache)
+            return false;
+    }
+
+    memcpy(entry, r->entries + (tail & r->mask) * r->entry_size,
+           r->entry_size);
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#endif /* __SPSC_H__ */
@@ -0,0 +1,308 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <malloc.h>
+
+#include "debug.h"
+#include "stats.h"
+#include "shm_stats.h"
+
+/* snapshot retries: spins, doubling each time, then yields */
+#define STATS_SNAPSHOT_SPINS    10
+#define STATS_SNAPSHOT_TRIES    1000
+
+struct ThreadStats *thread_stats = NULL;
+int num_stats_threads = 0;
+static bool stats_shared = false;
+
+static pthread_t        reporter_thread;
+static pthread_mutex_t  reporter_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   reporter_cond;
+static bool             reporter_running = false;
+static bool             reporter_stop = false;
+static int              reporter_interval_ms = 0;
+
+int stats_init(int num_threads, bool shared) {
+    if (shared) {
+        thread_stats = shm_stats_create(num_threads);
+        check(thread_stats != NULL, "Failed to create shm stats segment");
+    } else {
+        thread_stats = (struct ThreadStats *)memalign(CACHE_LINE_SIZE,
+            num_threads * sizeof(struct ThreadStats));
+        check(thread_stats != NULL, "Failed to allocate thread stats");
+
+        memset(thread_stats, 0, num_threads * sizeof(struct ThreadStats));
+    }
+
+    stats_shared = shared;
+    num_stats_threads = num_threads;
+
+    return 0;
+error:
+    return -1;
+}
+
+void stats_destroy() {
+    if (stats_shared)
+        shm_stats_destroy();
+    else if (thread_stats != NULL)
+        free(thread_stats);
+
+    thread_stats = NULL;
+    num_stats_threads = 0;
+    stats_shared = false;
+}
+
+void stats_record_wc_error(struct ThreadStats *stats, struct ibv_wc *wc) {
+    stats_write_begin(stats);
+    if (wc->status == IBV_WC_RNR_RETRY_EXC_ERR)
+        stats_inc(stats, rnr_errors);
+    else if (wc->status == IBV_WC_RETRY_EXC_ERR)
+        stats_inc(stats, retry_errors);
+    stats_write_end(stats);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define __cpu_relax() _mm_pause()
+#else
+#define __cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/*
+ * wait before the next try, longer every time, and give up the cpu once a
+ * short spin was not enough, e.g. because the owner was preempted
+ */
+static void __backoff(int tries) {
+    int i = 0;
+
+    if (tries >= STATS_SNAPSHOT_SPINS) {
+        sched_yield();
+        return;
+    }
+
+    for (i = 0; i < (1 << tries); i++)
+        __cpu_relax();
+}
+
+/*
+ * Copy a consistent view of stats, retrying while its owner is in the middle
+ * of an update. Returns -1 if the owner never got out of the way, e.g.
+ * because it died inside an update.
+ */
+int stats_snapshot(struct ThreadStats *stats, struct ThreadStats *snapshot) {
+    int i = 0, tries = 0;
+    uint64_t seq = 0;
+
+    for (tries = 0; tries < STATS_SNAPSHOT_TRIES; __backoff(tries++)) {
+        seq = __atomic_load_n(&stats->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+
+        snapshot->ops           = stats_read(stats, ops);
+        snapshot->bytes         = stats_read(stats, bytes);
+        snapshot->cq_polls      = stats_read(stats, cq_polls);
+        snapshot->empty_polls   = stats_read(stats, empty_polls);
+        snapshot->post_failures = stats_read(stats, post_failures);
+        snapshot->rnr_errors    = stats_read(stats, rnr_errors);
+        snapshot->retry_errors  = stats_read(stats, retry_errors);
+        snapshot->credit_waits  = stats_read(stats, credit_waits);
+        snapshot->credit_msgs   = stats_read(stats, credit_msgs);
+        snapshot->steals        = stats_read(stats, steals);
+        snapshot->stolen        = stats_read(stats, stolen);
+        snapshot->batches       = stats_read(stats, batches);
+        snapshot->coalesced     = stats_read(stats, coalesced);
+        snapshot->outstanding   = stats_read(stats, outstanding);
+        for (i = 0; i < STATS_LAT_BUCKETS; i++)
+            snapshot->lat_hist[i] = stats_read(stats, lat_hist[i]);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&stats->seq, __ATOMIC_RELAXED) == seq) {
+            snapshot->seq = seq;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+uint64_t stats_lat_bucket_lower(int bucket) {
+    int msb = 0;
+
+    if (bucket < (1 << STATS_LAT_SUB_BITS))
+        return bucket;
+
+    msb = (bucket >> STATS_LAT_SUB_BITS) + STATS_LAT_SUB_BITS - 1;
+    return (1ULL << msb) + ((uint64_t)(bucket & ((1 << STATS_LAT_SUB_BITS) - 1))
+                            << (msb - STATS_LAT_SUB_BITS));
+}
+
+/* the midpoint of the bucket holding the p-th percentile, p in [0, 100] */
+uint64_t stats_lat_percentile(const uint64_t *hist, double p) {
+    int i = 0;
+    uint64_t total = 0, rank = 0, seen = 0;
+
+    for (i = 0; i < STATS_LAT_BUCKETS; i++)
+        total += hist[i];
+    if (total == 0)
+        return 0;
+
+    rank = (uint64_t)(p / 100.0 * total);
+    if (rank >= total)
+        rank = total - 1;
+
+    for (i = 0; i < STATS_LAT_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > rank)
+            break;
+    }
+
+    if (i >= STATS_LAT_BUCKETS - 1)
+        return stats_lat_bucket_lower(STATS_LAT_BUCKETS - 1);
+
+    return (stats_lat_bucket_lower(i) + stats_lat_bucket_lower(i + 1)) / 2;
+}
+
+static double __elapsed_sec(struct timespec *from, struct timespec *to) {
+    return (double)(to->tv_sec - from->tv_sec) +
+        (double)(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void __report_interval(struct ThreadStats *prev, double elapsed,
+                              double interval) {
+    int i = 0, j = 0;
+    struct ThreadStats cur, total;
+    uint64_t polls = 0;
+
+    memset(&total, 0, sizeof(struct ThreadStats));
+
+    for (i = 0; i < num_stats_threads; i++) {
+        if (stats_snapshot(&thread_stats[i], &cur) != 0) {
+            log("[%8.1fs] thread[%d]: stats unavailable", elapsed, i);
+            continue;
+        }
+
+        /* interval histogram, reuse prev to hold it */
+        for (j = 0; j < STATS_LAT_BUCKETS; j++) {
+            total.lat_hist[j]   += cur.lat_hist[j] - prev[i].lat_hist[j];
+            prev[i].lat_hist[j]  = cur.lat_hist[j] - prev[i].lat_hist[j];
+        }
+
+        polls = cur.cq_polls - prev[i].cq_polls;
+        log("[%8.1fs] thread[%d]: %.3f Mops/s, %.3f Gb/s, empty polls %.1f%%, "
+            "outstanding %"PRIu64", p50 %"PRIu64" ns, p99 %"PRIu64" ns, "
+            "post failures %"PRIu64", rnr %"PRIu64", retry %"PRIu64,
+            elapsed, i,
+            (double)(cur.ops - prev[i].ops) / interval / 1e6,
+            (double)(cur.bytes - prev[i].bytes) * 8 / interval / 1e9,
+            polls ? 100.0 * (cur.empty_polls - prev[i].empty_polls) / polls : 0.0,
+            cur.outstanding,
+            stats_lat_percentile(prev[i].lat_hist, 50),
+            stats_lat_percentile(prev[i].lat_hist, 99),
+            cur.post_failures, cur.rnr_errors, cur.retry_errors);
+
+        total.ops   += cur.ops - prev[i].ops;
+        total.bytes += cur.bytes - prev[i].bytes;
+        prev[i] = cur;
+    }
+
+    if (num_stats_threads > 1)
+        log("[%8.1fs] total: %.3f Mops/s, %.3f Gb/s, p50 %"PRIu64" ns, "
+            "p99 %"PRIu64" ns", elapsed,
+            (double)total.ops / interval / 1e6,
+            (double)total.bytes * 8 / interval / 1e9,
+            stats_lat_percentile(total.lat_hist, 50),
+            stats_lat_percentile(total.lat_hist, 99));
+}
+
+static void *__reporter_func(void *arg) {
+    struct sched_param  param = { .sched_priority = 0 };
+    struct ThreadStats *prev = NULL;
+    struct timespec     start, last, now, deadline;
+    int                 i = 0;
+
+    /* stay out of the workers' way, only run when a core would idle */
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0)
+        log("stats reporter: failed to switch to SCHED_IDLE");
+
+    prev = (struct ThreadStats *)memalign(CACHE_LINE_SIZE,
+        num_stats_threads * sizeof(struct ThreadStats));
+    check(prev != NULL, "Failed to allocate stats snapshots");
+
+    memset(prev, 0, num_stats_threads * sizeof(struct ThreadStats));
+    for (i = 0; i < num_stats_threads; i++)
+        stats_snapshot(&thread_stats[i], &prev[i]);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    last = deadline = start;
+
+    pthread_mutex_lock(&reporter_lock);
+    while (reporter_stop != true) {
+        deadline.tv_sec  += reporter_interval_ms / 1000;
+        deadline.tv_nsec += (long)(reporter_interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec  += 1;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        while (reporter_stop != true &&
+               pthread_cond_timedwait(&reporter_cond, &reporter_lock,
+                                      &deadline) == 0)
+            ;
+        if (reporter_stop == true)
+            break;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        __report_interval(prev, __elapsed_sec(&start, &now),
+                          __elapsed_sec(&last, &now));
+        last = now;
+    }
+    pthread_mutex_unlock(&reporter_lock);
+
+    free(prev);
+    return NULL;
+
+error:
+    return NULL;
+}
+
+int stats_reporter_start(int interval_ms) {
+    int ret = 0;
+    pthread_condattr_t attr;
+
+    if (interval_ms <= 0)
+        return 0;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&reporter_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    reporter_interval_ms = interval_ms;
+    reporter_stop = false;
+
+    ret = pthread_create(&reporter_thread, NULL, __reporter_func, NULL);
+    check(ret == 0, "Failed to create stats reporter");
+
+    reporter_running = true;
+    return 0;
+error:
+    pthread_cond_destroy(&reporter_cond);
+    return -1;
+}
+
+void stats_reporter_stop() {
+    if (reporter_running != true)
+        return;
+
+    pthread_mutex_lock(&reporter_lock);
+    reporter_stop = true;
+    pthread_cond_signal(&reporter_cond);
+    pthread_mutex_unlock(&reporter_lock);
+
+    pthread_join(reporter_thread, NULL);
+    pthread_cond_destroy(&reporter_cond);
+    reporter_running = false;
+}
@@ -0,0 +1,129 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <infiniband/verbs.h>
+
+#include "tsc.h"
+
+#define CACHE_LINE_SIZE 64
+
+/*
+ * Latency histogram
+ *
+ * Log-linear buckets: every power of two of nanoseconds is split into
+ * 2^STATS_LAT_SUB_BITS sub-buckets, which keeps the relative error of a
+ * percentile under 25% across the whole 64-bit range in 2KB per thread.
+ */
+#define STATS_LAT_SUB_BITS  2
+#define STATS_LAT_BUCKETS   (64 << STATS_LAT_SUB_BITS)
+
+/*
+ * Per-thread counters
+ *
+ * Every worker owns one cache-line-aligned ThreadStats and is its only
+ * writer, so the hot path never bounces a line with another worker. A
+ * worker brackets each group of updates which belong together, e.g. the
+ * ops and bytes of one message, with stats_write_begin() and
+ * stats_write_end(); readers (the reporter thread, or rdma-stat through the
+ * shared-memory segment) retry while seq is odd or has moved, so they
+ * always see consistent counters without the worker ever taking a lock.
+ * Handlers and posts run outside the brackets, which leaves the readers
+ * all of the time but a few stores.
+ */
+struct ThreadStats {
+    uint64_t seq;               /* seqlock, odd while the owner updates */
+
+    uint64_t ops;               /* messages received, client: responses */
+    uint64_t bytes;             /* payload bytes received */
+    uint64_t cq_polls;          /* calls to ibv_poll_cq */
+    uint64_t empty_polls;       /* calls to ibv_poll_cq which returned 0 */
+    uint64_t post_failures;     /* failed ibv_post_send/ibv_post_recv */
+    uint64_t rnr_errors;        /* IBV_WC_RNR_RETRY_EXC_ERR completions */
+    uint64_t retry_errors;      /* IBV_WC_RETRY_EXC_ERR completions */
+    uint64_t credit_waits;      /* sends queued for lack of credits */
+    uint64_t credit_msgs;       /* credits returned without a message */
+    uint64_t steals;            /* server: requests of other threads run */
+    uint64_t stolen;            /* server: own requests run elsewhere */
+    uint64_t batches;           /* coalesced responses, sent or received */
+    uint64_t coalesced;         /* responses in those */
+
+    uint64_t poll_cycles;       /* TSC cycles inside ibv_poll_cq */
+    uint64_t empty_poll_cycles; /* of which in polls which returned 0 */
+    uint64_t post_cycles;       /* TSC cycles inside ibv_post_send/recv */
+
+    uint64_t outstanding;       /* client: requests in flight,
+                                 * server: receives posted */
+
+    uint64_t lat_hist[STATS_LAT_BUCKETS];   /* client: round trip,
+                                             * server: service time, in ns */
+}__attribute__((aligned(CACHE_LINE_SIZE)));
+
+#define stats_add(s, field, n)                                          \
+    __atomic_store_n(&(s)->field, (s)->field + (n), __ATOMIC_RELAXED)
+
+#define stats_inc(s, field) stats_add(s, field, 1)
+
+#define stats_set(s, field, v)                                          \
+    __atomic_store_n(&(s)->field, (v), __ATOMIC_RELAXED)
+
+#define stats_read(s, field) __atomic_load_n(&(s)->field, __ATOMIC_RELAXED)
+
+static inline void stats_write_begin(struct ThreadStats *s) {
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void stats_write_end(struct ThreadStats *s) {
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * evaluate expr, a post, and account the TSC cycles it took and whether it
+ * failed; only the accounting is bracketed, not the post
+ */
+#define stats_post(s, expr) ({                                          \
+    uint64_t __t0 = rdtsc();                                            \
+    __typeof__(expr) __r = (expr);                                      \
+    uint64_t __t1 = rdtsc();                                            \
+    stats_write_begin(s);                                               \
+    stats_add(s, post_cycles, __t1 - __t0);                             \
+    if (__r != 0)                                                       \
+        stats_inc(s, post_failures);                                    \
+    stats_write_end(s);                                                 \
+    __r;                                                                \
+})
+
+static inline int stats_lat_bucket(uint64_t ns) {
+    int msb = 0;
+
+    if (ns < (1 << STATS_LAT_SUB_BITS))
+        return (int)ns;
+
+    msb = 63 - __builtin_clzll(ns);
+    return ((msb - STATS_LAT_SUB_BITS + 1) << STATS_LAT_SUB_BITS) +
+        (int)((ns >> (msb - STATS_LAT_SUB_BITS)) &
+              ((1 << STATS_LAT_SUB_BITS) - 1));
+}
+
+static inline void stats_record_latency(struct ThreadStats *s, uint64_t ns) {
+    stats_inc(s, lat_hist[stats_lat_bucket(ns)]);
+}
+
+extern struct ThreadStats *thread_stats;
+extern int num_stats_threads;
+
+int  stats_init(int num_threads, bool shared);
+void stats_destroy();
+
+void stats_record_wc_error(struct ThreadStats *stats, struct ibv_wc *wc);
+int  stats_snapshot(struct ThreadStats *stats, struct ThreadStats *snapshot);
+
+uint64_t stats_lat_bucket_lower(int bucket);
+uint64_t stats_lat_percentile(const uint64_t *hist, double p);
+
+int  stats_reporter_start(int interval_ms);
+void stats_reporter_stop();
+
+#endif /* __STATS_H__ */
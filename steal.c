@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "debug.h"
+#include "steal.h"
+
+struct StealQueue *steal_queues     = NULL;
+int               num_steal_queues = 0;
+
+static int __deque_init(struct StealDeque *d, int64_t size) {
+    d->jobs = (struct PipeJob *)memalign(64, size * sizeof(struct PipeJob));
+    check(d->jobs != NULL, "Failed to allocate a steal deque");
+    d->mask = size - 1;
+    return 0;
+error:
+    return -1;
+}
+
+static bool __deque_push(struct StealDeque *d, struct PipeJob *job) {
+    int64_t b = d->bottom;
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+
+    if (b - t > d->mask)
+        return false;
+
+    d->jobs[b & d->mask] = *job;
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static bool __deque_steal(struct StealDeque *d, struct PipeJob *job) {
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE), b = 0;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return false;
+
+    /* the owner can't reuse slot t before top moves past it */
+    *job = d->jobs[t & d->mask];
+    return __atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+int steal_init(int num_threads) {
+    int i = 0, k = 0, ret = 0;
+    struct StealQueue *q = NULL;
+
+    steal_queues = (struct StealQueue *)memalign(64, num_threads *
+                                                 sizeof(struct StealQueue));
+    check(steal_queues != NULL, "Failed to allocate steal queues");
+    memset(steal_queues, 0, num_threads * sizeof(struct StealQueue));
+    num_steal_queues = num_threads;
+
+    for (i = 0; i < num_threads; i++) {
+        q = &steal_queues[i];
+        q->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+
+        ret = __deque_init(&q->deque, STEAL_DEQUE_SIZE);
+        check(ret == 0, "Failed to init deque %d", i);
+
+        q->returns = (struct SpscRing *)memalign(64, num_threads *
+                                                 sizeof(struct SpscRing));
+        check(q->returns != NULL, "Failed to allocate return rings");
+        memset(q->returns, 0, num_threads * sizeof(struct SpscRing));
+        for (k = 0; k < num_threads; k++) {
+            if (k == i)
+                continue;
+            ret = spsc_init(&q->returns[k], STEAL_RETURN_SIZE,
+                            sizeof(struct PipeJob));
+            check(ret == 0, "Failed to init return ring %d to %d", k, i);
+        }
+    }
+
+    return 0;
+error:
+    steal_destroy();
+    return -1;
+}
+
+void steal_destroy() {
+    int i = 0, k = 0;
+    struct StealQueue *q = NULL;
+
+    if (steal_queues == NULL)
+        return;
+
+    for (i = 0; i < num_steal_queues; i++) {
+        q = &steal_queues[i];
+        if (q->deque.jobs != NULL)
+            free(q->deque.jobs);
+        if (q->returns == NULL)
+            continue;
+        for (k = 0; k < num_steal_queues; k++)
+            spsc_destroy(&q->returns[k]);
+        free(q->returns);
+    }
+
+    free(steal_queues);
+    steal_queues     = NULL;
+    num_steal_queues = 0;
+}
+
+bool steal_push(int me, struct PipeJob *job) {
+    struct StealQueue *q = &steal_queues[me];
+
+    if (__deque_push(&q->deque, job) == false)
+        return false;
+
+    q->in_flight++;
+    return true;
+}
+
+bool steal_pop(int me, struct PipeJob *job) {
+    struct StealQueue *q = &steal_queues[me];
+    struct StealDeque *d = &q->deque;
+
+    /* from the top, oldest first; a lost CAS means a thief took that one */
+    while (__atomic_load_n(&d->top, __ATOMIC_ACQUIRE) < d->bottom) {
+        if (__deque_steal(d, job)) {
+            q->in_flight--;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool steal_returned(int me, struct PipeJob *job) {
+    struct StealQueue *q = &steal_queues[me];
+    int k = 0;
+
+    if (q->in_flight == 0)
+        return false;
+
+    for (k = 0; k < num_steal_queues; k++) {
+        if (k != me && spsc_pop(&q->returns[k], job)) {
+            q->in_flight--;
+            q->stolen++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool steal_take(int me, struct PipeJob *job, int *victim) {
+    struct StealQueue *q = &steal_queues[me];
+    int i = 0, k = 0, start = 0;
+
+    if (num_steal_queues < 2)
+        return false;
+
+    /* xorshift64, start at a random victim so thieves spread out */
+    q->rng ^= q->rng << 13;
+    q->rng ^= q->rng >> 7;
+    q->rng ^= q->rng << 17;
+    start = (int)(q->rng % num_steal_queues);
+
+    for (i = 0; i < num_steal_queues; i++) {
+        k = (start + i) % num_steal_queues;
+        if (k == me)
+            continue;
+        if (__deque_steal(&steal_queues[k].deque, job)) {
+            *victim = k;
+            q->steals++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool steal_return(int me, int victim, struct PipeJob *job) {
+    return spsc_push(&steal_queues[victim].returns[me], job);
+}
@@ -0,0 +1,66 @@
+#ifndef __STEAL_H__
+#define __STEAL_H__
+
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include "spsc.h"
+#include "rpc.h"
+#include "pipeline.h"
+
+/*
+ * Work stealing between server threads
+ *
+ * With --steal a server thread does not run the handler of a message when
+ * it is delivered: it pushes the job onto the bottom of its own deque and
+ * goes back to its CQ. After each poll it runs its jobs until the deque is
+ * empty, oldest first, so no request waits behind newer ones. A server
+ * thread whose CQ and deque are empty steals from the top of the deque of
+ * another thread, so a hot connection gets the spare cycles of the idle
+ * ones. The deques are Chase-Lev: the owner pushes with plain stores, and
+ * takes from the top like a thief would, racing the thieves with a CAS.
+ *
+ * Only the owner of a connection ever touches its QP, CQ and rndv state.
+ * A thief runs rpc_handle() against the job's RpcConn, which only reads
+ * the message and writes its response slot, and hands the job back over an
+ * SPSC ring from thief to owner; the owner posts the response and the
+ * receive. An owner stops only once none of its jobs are left anywhere.
+ */
+#define STEAL_DEQUE_SIZE    256     /* jobs, a power of two */
+#define STEAL_RETURN_SIZE   64      /* returned jobs per thief */
+
+struct StealDeque {
+    struct PipeJob  *jobs;
+    int64_t         mask;
+    int64_t         top __attribute__((aligned(64)));     /* thieves */
+    int64_t         bottom __attribute__((aligned(64)));  /* owner */
+};
+
+struct StealQueue {
+    struct StealDeque   deque;
+    struct SpscRing     *returns;       /* one per thief, to us */
+    uint64_t            in_flight;      /* pushed, not responded yet */
+    uint64_t            steals;         /* jobs of others we ran */
+    uint64_t            stolen;         /* ours others ran */
+    uint64_t            rng;
+}__attribute__((aligned(64)));
+
+extern struct StealQueue *steal_queues;
+extern int               num_steal_queues;
+
+int  steal_init(int num_threads);
+void steal_destroy();
+
+/* owner side: false when the deque is full, run the job inline then */
+bool steal_push(int me, struct PipeJob *job);
+/* our oldest job, false once the deque is empty */
+bool steal_pop(int me, struct PipeJob *job);
+/* a job of ours a thief has handled */
+bool steal_returned(int me, struct PipeJob *job);
+
+/* thief side: a job of another thread, and whose it is */
+bool steal_take(int me, struct PipeJob *job, int *victim);
+/* hand the handled job back, false while our ring to the victim is full */
+bool steal_return(int me, int victim, struct PipeJob *job);
+
+#endif /* __STEAL_H__ */
@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# Verbs latency tracing for any libibverbs application
+#
+#   sudo tracing/trace_verbs.sh [-p PID] [-P provider] [-o file.bt]
+#
+# Traces the control path (reg_mr, create_qp/cq) from libibverbs and, when
+# the provider's symbols are available, the data path (post_send/recv,
+# poll_cq) from the provider library. With -p the provider is read from the
+# process's mappings; otherwise it is given with -P (mlx5 by default).
+# Histograms print on Ctrl-C. -o only writes the combined script.
+#
+set -e
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+PID=
+PROVIDER=
+OUT=
+
+while getopts "p:P:o:h" opt; do
+    case $opt in
+    p) PID=$OPTARG ;;
+    P) PROVIDER=$OPTARG ;;
+    o) OUT=$OPTARG ;;
+    *) sed -n '3,12p' "$0"; exit 0 ;;
+    esac
+done
+
+# provider library: mapped into PID, or from the ld cache and rdma-core's
+# provider directory
+provider_lib() {
+    if [ -n "$PID" ]; then
+        grep -oE "/[^ ]*/lib${1}(-rdmav[0-9]+)?\.so[.0-9]*" "/proc/$PID/maps" | head -n 1
+        return
+    fi
+    lib=$(ldconfig -p | awk -v n="lib${1}.so.1" '$1 == n { print $NF; exit }')
+    [ -n "$lib" ] || lib=$(ls /usr/lib*/libibverbs/lib"${1}"-rdmav*.so \
+        /usr/lib/*/libibverbs/lib"${1}"-rdmav*.so 2>/dev/null | head -n 1)
+    echo "$lib"
+}
+
+# true when the library or its build-id debuginfo defines sym
+has_symbol() {
+    nm "$1" 2>/dev/null | grep -q " [tT] $2\$" && return 0
+    id=$(readelf -n "$1" 2>/dev/null | awk '/Build ID/ { print $3 }')
+    [ -n "$id" ] || return 1
+    dbg=/usr/lib/debug/.build-id/$(echo "$id" | cut -c1-2)/$(echo "$id" | cut -c3-).debug
+    nm "$dbg" 2>/dev/null | grep -q " [tT] $2\$"
+}
+
+if [ -z "$PROVIDER" ] && [ -n "$PID" ]; then
+    PROVIDER=$(grep -oE "/lib[a-z0-9_]+-rdmav[0-9]+\.so" "/proc/$PID/maps" |
+               head -n 1 | sed 's|/lib\(.*\)-rdmav.*|\1|')
+fi
+PROVIDER=${PROVIDER:-mlx5}
+
+SCRIPT=${OUT:-$(mktemp /tmp/trace_verbs.XXXXXX.bt)}
+cat "$DIR/verbs_ctrl.bt" > "$SCRIPT"
+
+LIB=$(provider_lib "$PROVIDER")
+if [ -n "$LIB" ] && has_symbol "$LIB" "${PROVIDER}_post_send"; then
+    sed -e "s|@PROVIDER_LIB@|$LIB|g" -e "s|@PREFIX@|$PROVIDER|g" \
+        "$DIR/verbs_data.bt.in" >> "$SCRIPT"
+    echo "data path: ${PROVIDER}_post_send/post_recv/poll_cq in $LIB" >&2
+else
+    echo "data path: no symbols for ${PROVIDER}_post_send in ${LIB:-lib$PROVIDER}," \
+         "install the provider's debuginfo; tracing the control path only" >&2
+fi
+
+[ -n "$OUT" ] && exit 0
+
+if [ -n "$PID" ]; then
+    exec bpftrace -p "$PID" "$SCRIPT"
+fi
+exec bpftrace "$SCRIPT"
@@ -0,0 +1,32 @@
+#include "debug.h"
+#include "tsc.h"
+
+double tsc_ns_per_cycle = 1.0;
+
+static uint64_t __monotonic_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int tsc_init() {
+    uint64_t ns_start = 0, ns_end = 0;
+    uint64_t tsc_start = 0, tsc_end = 0;
+    struct timespec delay = { .tv_sec = 0, .tv_nsec = 20000000 };
+
+    ns_start  = __monotonic_ns();
+    tsc_start = rdtsc();
+
+    nanosleep(&delay, NULL);
+
+    ns_end  = __monotonic_ns();
+    tsc_end = rdtsc();
+
+    check(tsc_end > tsc_start && ns_end > ns_start, "TSC is not monotonic");
+
+    tsc_ns_per_cycle = (double)(ns_end - ns_start) / (tsc_end - tsc_start);
+    return 0;
+error:
+    return -1;
+}
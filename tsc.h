@@ -0,0 +1,44 @@
+#ifndef __TSC_H__
+#define __TSC_H__
+
+#include <inttypes.h>
+#include <time.h>
+
+/*
+ * Time stamp counter
+ *
+ * rdtsc() is what the data path uses to take timestamps: it costs a couple
+ * of dozen cycles and never enters the kernel. tsc_init() calibrates it
+ * against CLOCK_MONOTONIC once at startup so that cycle deltas can be turned
+ * into nanoseconds. Architectures without an invariant TSC fall back to
+ * CLOCK_MONOTONIC, in which case one "cycle" is one nanosecond.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+static inline uint64_t rdtsc() {
+    return __rdtsc();
+}
+#else
+static inline uint64_t rdtsc() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+extern double tsc_ns_per_cycle;
+
+int tsc_init();
+
+static inline uint64_t tsc_to_ns(uint64_t cycles) {
+    return (uint64_t)((double)cycles * tsc_ns_per_cycle);
+}
+
+static inline uint64_t tsc_from_ns(uint64_t ns) {
+    return (uint64_t)((double)ns / tsc_ns_per_cycle);
+}
+
+#endif /* __TSC_H__ */
@@ -0,0 +1,357 @@
+#include <stdlib.h>
+#include <math.h>
+
+#include "debug.h"
+#include "workload.h"
+
+struct Workload workload;
+
+static const char *workload_names[] = {
+    [WL_FIXED]   = "fixed",
+    [WL_UNIFORM] = "uniform",
+    [WL_ZIPF]    = "zipf",
+    [WL_BIMODAL] = "bimodal",
+    [WL_CDF]     = "cdf",
+    [WL_TRACE]   = "trace",
+};
+
+/* parse a size with an optional K/M/G suffix */
+static int __parse_size(const char *str, uint32_t *size) {
+    char *end = NULL;
+    unsigned long long val = 0;
+    int shift = 0;
+
+    errno = 0;
+    val = strtoull(str, &end, 10);
+    check(errno == 0 && end != str, "Invalid size '%s'", str);
+
+    switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    default: break;
+    }
+    check(*end == '\0' || *end == ':', "Invalid size '%s'", str);
+    /* before the shift, which could wrap */
+    check(val > 0 && val <= UINT32_MAX >> shift, "Size '%s' out of range",
+          str);
+
+    *size = (uint32_t)(val << shift);
+    return 0;
+error:
+    return -1;
+}
+
+/* split spec into at most max_fields ':'-separated fields, in place */
+static int __split_spec(char *spec, char **fields, int max_fields) {
+    int n = 0;
+    char *p = spec;
+
+    while (p != NULL && n < max_fields) {
+        fields[n++] = p;
+        p = strchr(p, ':');
+        if (p != NULL)
+            *p++ = '\0';
+    }
+
+    return p == NULL ? n : -1;
+}
+
+static int __init_zipf(double s) {
+    int i = 0;
+    uint32_t size = 0;
+    double sum = 0.0;
+
+    for (size = workload.min_size; size <= workload.max_size &&
+             size >= workload.min_size; size <<= 1)
+        workload.num_entries++;
+
+    workload.sizes = (uint32_t *)calloc(workload.num_entries, sizeof(uint32_t));
+    workload.cdf   = (double *)calloc(workload.num_entries, sizeof(double));
+    check(workload.sizes != NULL && workload.cdf != NULL,
+          "Failed to allocate zipf table");
+
+    for (i = 0, size = workload.min_size; i < workload.num_entries;
+         i++, size <<= 1) {
+        workload.sizes[i] = size;
+        sum += 1.0 / pow(i + 1, s);
+        workload.cdf[i] = sum;
+    }
+
+    for (i = 0; i < workload.num_entries; i++)
+        workload.cdf[i] /= sum;
+    workload.cdf[workload.num_entries - 1] = 1.0;
+
+    workload.max_size = workload.sizes[workload.num_entries - 1];
+    return 0;
+error:
+    return -1;
+}
+
+static int __init_cdf(const char *path) {
+    FILE *fp = NULL;
+    int cap = 0;
+    unsigned int size = 0;
+    double prob = 0.0, prev = 0.0;
+    uint32_t *sizes = NULL;
+    double *cdf = NULL;
+
+    fp = fopen(path, "r");
+    check(fp != NULL, "Failed to open cdf file %s", path);
+
+    while (fscanf(fp, "%u %lf", &size, &prob) == 2) {
+        check(size > 0 && prob >= prev && prob <= 1.0,
+              "Invalid cdf entry %u %f in %s", size, prob, path);
+
+        if (workload.num_entries == cap) {
+            /* the old tables stay for workload_destroy() on failure */
+            cap = cap ? cap * 2 : 64;
+            sizes = (uint32_t *)realloc(workload.sizes,
+                                        cap * sizeof(uint32_t));
+            if (sizes != NULL)
+                workload.sizes = sizes;
+            cdf = (double *)realloc(workload.cdf, cap * sizeof(double));
+            if (cdf != NULL)
+                workload.cdf = cdf;
+            check(sizes != NULL && cdf != NULL,
+                  "Failed to allocate cdf table");
+        }
+
+        workload.sizes[workload.num_entries] = size;
+        workload.cdf[workload.num_entries]   = prob;
+        workload.num_entries++;
+
+        if (size > workload.max_size)
+            workload.max_size = size;
+        if (workload.min_size == 0 || size < workload.min_size)
+            workload.min_size = size;
+        prev = prob;
+    }
+    check(workload.num_entries > 0, "Empty cdf file %s", path);
+    check(prev > 0.999999, "cdf in %s does not reach 1", path);
+
+    workload.cdf[workload.num_entries - 1] = 1.0;
+    fclose(fp);
+    return 0;
+error:
+    if (fp != NULL)
+        fclose(fp);
+    return -1;
+}
+
+static int __init_trace(const char *path) {
+    FILE *fp = NULL;
+    int cap = 0;
+    unsigned long long ts = 0, prev_ts = 0;
+    unsigned int size = 0;
+    char op[16] = {'\0'};
+    struct WorkloadRecord *rec = NULL, *records = NULL;
+
+    fp = fopen(path, "r");
+    check(fp != NULL, "Failed to open trace file %s", path);
+
+    while (fscanf(fp, "%llu %u %15s", &ts, &size, op) == 3) {
+        check(size > 0 && ts >= prev_ts,
+              "Invalid trace record %llu %u %s in %s", ts, size, op, path);
+        check(strcmp(op, "send") == 0,
+              "Unsupported trace op '%s' in %s", op, path);
+
+        if (workload.num_records == cap) {
+            cap = cap ? cap * 2 : 1024;
+            records = (struct WorkloadRecord *)realloc(
+                workload.records, cap * sizeof(struct WorkloadRecord));
+            check(records != NULL, "Failed to allocate trace");
+            workload.records = records;
+        }
+
+        rec = &workload.records[workload.num_records++];
+        rec->timestamp_us = ts;
+        rec->size         = size;
+        rec->op           = WL_OP_SEND;
+
+        if (size > workload.max_size)
+            workload.max_size = size;
+        if (workload.min_size == 0 || size < workload.min_size)
+            workload.min_size = size;
+        prev_ts = ts;
+    }
+    check(workload.num_records > 0, "Empty trace file %s", path);
+
+    /* keep the gap between the last and the first record on wrap-around */
+    workload.trace_duration_us = prev_ts + 1;
+
+    fclose(fp);
+    return 0;
+error:
+    if (fp != NULL)
+        fclose(fp);
+    return -1;
+}
+
+int workload_init(const char *spec, int msg_size) {
+    int n = 0;
+    char *buf = NULL;
+    char *fields[5];
+
+    memset(&workload, 0, sizeof(struct Workload));
+    workload.type     = WL_FIXED;
+    workload.min_size = msg_size;
+    workload.max_size = msg_size;
+
+    if (spec == NULL || strcmp(spec, "fixed") == 0)
+        return 0;
+
+    buf = strdup(spec);
+    check(buf != NULL, "Failed to copy workload spec");
+
+    n = __split_spec(buf, fields, 5);
+    check(n > 0, "Invalid workload spec '%s'", spec);
+
+    workload.min_size = 0;
+    workload.max_size = 0;
+
+    if (strcmp(fields[0], "uniform") == 0) {
+        check(n == 3, "Usage: uniform:MIN:MAX");
+        workload.type = WL_UNIFORM;
+        check(__parse_size(fields[1], &workload.min_size) == 0 &&
+              __parse_size(fields[2], &workload.max_size) == 0,
+              "Invalid uniform spec '%s'", spec);
+    } else if (strcmp(fields[0], "zipf") == 0) {
+        check(n == 4, "Usage: zipf:MIN:MAX:S");
+        workload.type = WL_ZIPF;
+        check(__parse_size(fields[1], &workload.min_size) == 0 &&
+              __parse_size(fields[2], &workload.max_size) == 0,
+              "Invalid zipf spec '%s'", spec);
+        check(workload.min_size <= workload.max_size,
+              "zipf MIN is larger than MAX");
+        check(__init_zipf(atof(fields[3])) == 0, "Failed to init zipf");
+    } else if (strcmp(fields[0], "bimodal") == 0) {
+        check(n == 4, "Usage: bimodal:SMALL:LARGE:P");
+        workload.type = WL_BIMODAL;
+        check(__parse_size(fields[1], &workload.small_size) == 0 &&
+              __parse_size(fields[2], &workload.large_size) == 0,
+              "Invalid bimodal spec '%s'", spec);
+        workload.p_large  = atof(fields[3]);
+        check(workload.p_large >= 0.0 && workload.p_large <= 1.0,
+              "bimodal P must be in [0, 1]");
+        workload.min_size = workload.small_size < workload.large_size ?
+            workload.small_size : workload.large_size;
+        workload.max_size = workload.small_size > workload.large_size ?
+            workload.small_size : workload.large_size;
+    } else if (strcmp(fields[0], "cdf") == 0) {
+        check(n == 2, "Usage: cdf:FILE");
+        workload.type = WL_CDF;
+        check(__init_cdf(fields[1]) == 0, "Failed to load cdf");
+    } else if (strcmp(fields[0], "trace") == 0) {
+        check(n == 2, "Usage: trace:FILE");
+        workload.type = WL_TRACE;
+        check(__init_trace(fields[1]) == 0, "Failed to load trace");
+    } else {
+        check(0, "Unknown workload '%s'", fields[0]);
+    }
+
+    check(workload.min_size <= workload.max_size,
+          "Invalid size range in workload spec '%s'", spec);
+
+    free(buf);
+    return 0;
+error:
+    if (buf != NULL)
+        free(buf);
+    workload_destroy();
+    return -1;
+}
+
+void workload_destroy() {
+    if (workload.sizes != NULL)
+        free(workload.sizes);
+    if (workload.cdf != NULL)
+        free(workload.cdf);
+    if (workload.records != NULL)
+        free(workload.records);
+
+    workload.sizes   = NULL;
+    workload.cdf     = NULL;
+    workload.records = NULL;
+}
+
+void print_workload_info() {
+    log("workload           = %s", workload_names[workload.type]);
+    log("min_size           = %"PRIu32, workload.min_size);
+    log("max_size           = %"PRIu32, workload.max_size);
+
+    if (workload.type == WL_BIMODAL)
+        log("p_large            = %f", workload.p_large);
+    if (workload.type == WL_ZIPF || workload.type == WL_CDF)
+        log("num_sizes          = %d", workload.num_entries);
+    if (workload.type == WL_TRACE)
+        log("num_records        = %d", workload.num_records);
+}
+
+/* xorshift64*, good enough for size sampling and cheap on the hot path */
+static inline uint64_t __rand64(struct WorkloadGen *gen) {
+    gen->rng ^= gen->rng >> 12;
+    gen->rng ^= gen->rng << 25;
+    gen->rng ^= gen->rng >> 27;
+    return gen->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static inline double __rand_unit(struct WorkloadGen *gen) {
+    return (double)(__rand64(gen) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void workload_gen_init(struct WorkloadGen *gen, uint64_t seed) {
+    gen->wl           = &workload;
+    gen->rng          = seed ? seed : 0x9E3779B97F4A7C15ULL;
+    gen->cursor       = 0;
+    gen->time_base_us = 0;
+}
+
+void workload_next(struct WorkloadGen *gen, struct WorkloadOp *op) {
+    const struct Workload *wl = gen->wl;
+    const struct WorkloadRecord *rec = NULL;
+    int lo = 0, hi = 0, mid = 0;
+    double u = 0.0;
+
+    op->op     = WL_OP_SEND;
+    op->due_us = 0;
+
+    switch (wl->type) {
+    case WL_FIXED:
+        op->size = wl->max_size;
+        break;
+    case WL_UNIFORM:
+        op->size = wl->min_size +
+            (uint32_t)(__rand64(gen) % (wl->max_size - wl->min_size + 1));
+        break;
+    case WL_BIMODAL:
+        op->size = __rand_unit(gen) < wl->p_large ?
+            wl->large_size : wl->small_size;
+        break;
+    case WL_ZIPF:
+    case WL_CDF:
+        /* first entry whose cumulative probability exceeds u */
+        u  = __rand_unit(gen);
+        lo = 0;
+        hi = wl->num_entries - 1;
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            if (u < wl->cdf[mid])
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        op->size = wl->sizes[lo];
+        break;
+    case WL_TRACE:
+        rec        = &wl->records[gen->cursor];
+        op->size   = rec->size;
+        op->op     = rec->op;
+        op->due_us = gen->time_base_us + rec->timestamp_us;
+        if (++gen->cursor == wl->num_records) {
+            gen->cursor = 0;
+            gen->time_base_us += wl->trace_duration_us;
+        }
+        break;
+    }
+}
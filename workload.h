@@ -0,0 +1,96 @@
+#ifndef __WORKLOAD_H__
+#define __WORKLOAD_H__
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/*
+ * Workload generator
+ *
+ * The client draws the size of every message it sends from a workload spec
+ * given with `-w SPEC`:
+ *
+ *   fixed                      every message is msg_size bytes (default)
+ *   uniform:MIN:MAX            uniform over [MIN, MAX]
+ *   zipf:MIN:MAX:S             Zipf(S) over the power-of-two sizes in
+ *                              [MIN, MAX], the smallest size is the most
+ *                              popular one
+ *   bimodal:SMALL:LARGE:P      LARGE with probability P, SMALL otherwise
+ *   cdf:FILE                   empirical CDF, one "size cum_prob" per line,
+ *                              both columns ascending, last cum_prob is 1
+ *   trace:FILE                 replay "timestamp_us size op" records in
+ *                              order, pacing sends by the timestamps; the
+ *                              trace wraps around when it is exhausted
+ *
+ * Sizes accept K/M/G suffixes. The server only uses the spec to size its
+ * receive buffers, so both sides must be given the same spec. Every receive
+ * and send slot holds the largest size of the spec; with --rndv receives
+ * only hold the threshold and larger messages are read into a small pool.
+ */
+
+enum WorkloadType {
+    WL_FIXED = 0,
+    WL_UNIFORM,
+    WL_ZIPF,
+    WL_BIMODAL,
+    WL_CDF,
+    WL_TRACE,
+};
+
+enum WorkloadOpType {
+    WL_OP_SEND = 0,
+};
+
+struct WorkloadRecord {
+    uint64_t timestamp_us;      /* offset from the start of the trace */
+    uint32_t size;
+    uint32_t op;                /* enum WorkloadOpType */
+};
+
+struct Workload {
+    enum WorkloadType type;
+
+    uint32_t min_size;
+    uint32_t max_size;
+
+    /* bimodal */
+    uint32_t small_size;
+    uint32_t large_size;
+    double   p_large;
+
+    /* zipf and cdf: sizes[i] is drawn when u < cdf[i] */
+    int       num_entries;
+    uint32_t *sizes;
+    double   *cdf;
+
+    /* trace */
+    int                     num_records;
+    struct WorkloadRecord  *records;
+    uint64_t                trace_duration_us;
+};
+
+/* per-thread generator state, the hot path never shares it */
+struct WorkloadGen {
+    const struct Workload *wl;
+    uint64_t rng;
+    int      cursor;            /* next trace record */
+    uint64_t time_base_us;      /* trace time offset after wrap-arounds */
+};
+
+struct WorkloadOp {
+    uint32_t size;
+    uint32_t op;
+    uint64_t due_us;            /* trace only: send no earlier than this,
+                                 * relative to the start of the run */
+};
+
+extern struct Workload workload;
+
+int  workload_init(const char *spec, int msg_size);
+void workload_destroy();
+void print_workload_info();
+
+void workload_gen_init(struct WorkloadGen *gen, uint64_t seed);
+void workload_next(struct WorkloadGen *gen, struct WorkloadOp *op);
+
+#endif /* __WORKLOAD_H__ */
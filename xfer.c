@@ -0,0 +1,121 @@
+#include <string.h>
+
+#include "debug.h"
+#include "ib.h"
+#include "xfer.h"
+
+/* the immediate of a lane's last chunk: transfer id and lanes carrying it */
+#define XFER_IMM(id, lanes) \
+    MSG_IMM(MSG_XFER_END, ((id) & 0xfffff) << 4 | ((lanes) - 1))
+#define XFER_IMM_ID(imm)    (MSG_IMM_ARG(imm) >> 4)
+#define XFER_IMM_LANES(imm) ((int)(MSG_IMM_ARG(imm) & 0xf) + 1)
+
+int xfer_init(struct XferConn *x, struct ibv_qp **qps, int num_lanes,
+              uint32_t chunk_size, int window) {
+    int i = 0, j = 0;
+
+    memset(x, 0, sizeof(struct XferConn));
+    check(num_lanes > 0 && num_lanes <= XFER_MAX_LANES && window > 0,
+          "Bad transfer engine setup: %d lanes, window %d", num_lanes, window);
+
+    x->num_lanes  = num_lanes;
+    x->chunk_size = chunk_size;
+    x->window     = window;
+    for (i = 0; i < num_lanes; i++) {
+        x->qps[i] = qps[i];
+        for (j = 0; j < XFER_RECVS; j++)
+            check(xfer_post_recv(x, i) == 0, "Failed to post recv");
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+int xfer_post_recv(struct XferConn *x, int lane) {
+    return post_recv_sgl(NULL, 0, lane, x->qps[lane]);
+}
+
+void xfer_start(struct XferConn *x, char *buf, uint32_t lkey, uint64_t len,
+                uint64_t remote_addr, uint32_t rkey, uint32_t id) {
+    x->buf         = buf;
+    x->lkey        = lkey;
+    x->len         = len;
+    x->remote_addr = remote_addr;
+    x->rkey        = rkey;
+    x->id          = id;
+    x->next_chunk  = 0;
+
+    if (x->chunk_size == 0 || len == 0) {
+        x->num_chunks = 1;
+        x->lanes_used = 1;
+    } else {
+        x->num_chunks = (len + x->chunk_size - 1) / x->chunk_size;
+        x->lanes_used = x->num_chunks < (uint64_t)x->num_lanes ?
+            (int)x->num_chunks : x->num_lanes;
+    }
+}
+
+/*
+ * Post chunks until the window is full or the transfer is out. Chunk i goes
+ * to lane i % lanes_used, so a lane's last chunk is one of the final
+ * lanes_used chunks. Every chunk is signaled: at a megabyte a chunk, a
+ * completion costs nothing next to the wire time, and it opens the window.
+ */
+int xfer_post(struct XferConn *x) {
+    int ret = 0, lane = 0;
+    uint64_t off = 0, size = 0;
+
+    while (x->next_chunk < x->num_chunks) {
+        if (x->inflight >= x->window) {
+            x->window_full++;
+            break;
+        }
+
+        lane = (int)(x->next_chunk % x->lanes_used);
+        off  = x->chunk_size ? x->next_chunk * x->chunk_size : 0;
+        size = x->chunk_size && x->len - off > x->chunk_size ?
+            x->chunk_size : x->len - off;
+
+        if (x->next_chunk >= x->num_chunks - x->lanes_used)
+            ret = post_write_imm(size, x->lkey, XFER_WR_ID | lane,
+                                 XFER_IMM(x->id, x->lanes_used),
+                                 IBV_SEND_SIGNALED, x->remote_addr + off,
+                                 x->rkey, x->qps[lane], x->buf + off);
+        else
+            ret = post_write(size, x->lkey, XFER_WR_ID | lane,
+                             IBV_SEND_SIGNALED, x->remote_addr + off,
+                             x->rkey, x->qps[lane], x->buf + off);
+        check(ret == 0, "Failed to post chunk %"PRIu64" of transfer %"PRIu32,
+              x->next_chunk, x->id);
+
+        x->next_chunk++;
+        x->inflight++;
+        x->chunks++;
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+int xfer_recv_done(struct XferConn *x, struct ibv_wc *wc, uint32_t *id) {
+    int ret = 0, slot = 0;
+    uint32_t imm = ntohl(wc->imm_data);
+
+    check(MSG_IMM_TYPE(imm) == MSG_XFER_END, "Unexpected immediate %#x", imm);
+
+    ret = xfer_post_recv(x, (int)wc->wr_id);
+    check(ret == 0, "Failed to post recv");
+
+    slot = XFER_IMM_ID(imm) % XFER_MAX_PENDING;
+    if (x->lanes_left[slot] == 0)
+        x->lanes_left[slot] = XFER_IMM_LANES(imm);
+    if (--x->lanes_left[slot] > 0)
+        return 0;
+
+    *id = XFER_IMM_ID(imm);
+    return 1;
+error:
+    return -1;
+}
@@ -0,0 +1,100 @@
+#ifndef __XFER_H__
+#define __XFER_H__
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <infiniband/verbs.h>
+
+#include "ib.h"
+
+/*
+ * Pipelined large transfers
+ *
+ * One multi-megabyte work request occupies a single QP until its last byte
+ * is acknowledged. The engine cuts a transfer into chunks, RDMA WRITEs them
+ * round-robin over one or more QPs ("lanes") connected to the same peer and
+ * keeps up to a window of chunks in flight, so that the NIC always has the
+ * next chunk while earlier ones are on the wire.
+ *
+ * Writes on different QPs are not ordered against each other, so the last
+ * chunk of every lane goes out as WRITE_WITH_IMM. The immediate names the
+ * transfer and how many lanes carry it; the receiver has the whole payload
+ * once each of those lanes has completed a receive for it. Receives are
+ * empty, the payload lands where the sender wrote it.
+ *
+ * An XferConn is used by one thread. Its lanes may share a CQ; the caller
+ * polls it and feeds the completions back with xfer_send_done() and
+ * xfer_recv_done().
+ */
+#define XFER_CHUNK          (1 << 20)   /* default chunk size */
+#define XFER_WINDOW         16          /* default chunks in flight */
+#define XFER_MAX_LANES      16
+#define XFER_RECVS          16          /* empty receives per lane */
+#define XFER_MAX_PENDING    64          /* transfers being received */
+
+/* chunk writes carry XFER_WR_ID | lane */
+#define XFER_WR_ID          0xD000000000000000
+#define XFER_WR_ID_MASK     0xF000000000000000
+
+/* where the peer may write: sent over the socket, network order */
+struct XferRemote {
+    uint64_t addr;
+    uint64_t size;
+    uint32_t rkey;
+}__attribute__((packed));
+
+struct XferConn {
+    struct ibv_qp   *qps[XFER_MAX_LANES];
+    int             num_lanes;
+    uint32_t        chunk_size;     /* 0: one write on lane 0 */
+    int             window;
+
+    /* the transfer being sent */
+    char            *buf;
+    uint32_t        lkey;
+    uint64_t        len;
+    uint64_t        remote_addr;
+    uint32_t        rkey;
+    uint32_t        id;
+    uint64_t        num_chunks;
+    uint64_t        next_chunk;
+    int             lanes_used;
+    int             inflight;       /* chunks posted, not completed */
+
+    /* lanes still to report, by id % XFER_MAX_PENDING */
+    int             lanes_left[XFER_MAX_PENDING];
+
+    uint64_t        chunks;         /* written */
+    uint64_t        window_full;    /* xfer_post() stopped at the window */
+};
+
+int  xfer_init(struct XferConn *x, struct ibv_qp **qps, int num_lanes,
+               uint32_t chunk_size, int window);
+int  xfer_post_recv(struct XferConn *x, int lane);
+
+/* begin sending len bytes at buf to remote_addr, chunks go out in xfer_post() */
+void xfer_start(struct XferConn *x, char *buf, uint32_t lkey, uint64_t len,
+                uint64_t remote_addr, uint32_t rkey, uint32_t id);
+int  xfer_post(struct XferConn *x);
+
+static inline bool xfer_owns(struct ibv_wc *wc) {
+    return (wc->wr_id & XFER_WR_ID_MASK) == XFER_WR_ID;
+}
+
+/* all chunks of the current transfer are posted and completed */
+static inline bool xfer_sent(struct XferConn *x) {
+    return x->next_chunk == x->num_chunks && x->inflight == 0;
+}
+
+/* a completion of a chunk write */
+static inline void xfer_send_done(struct XferConn *x) {
+    x->inflight--;
+}
+
+/*
+ * A RECV_RDMA_WITH_IMM completion: reposts the receive and returns 1 with
+ * *id when it was the last lane of a transfer, 0 otherwise, -1 on error.
+ */
+int  xfer_recv_done(struct XferConn *x, struct ibv_wc *wc, uint32_t *id);
+
+#endif /* __XFER_H__ */
@@ -0,0 +1,556 @@
+/*
+ * rdma-xfer: large transfers, one write against pipelined chunks
+ *
+ * The client writes transfers of 1MB and up into a buffer of the server,
+ * first as a single WRITE_WITH_IMM on one QP, then cut into chunks by the
+ * transfer engine (xfer.h) over all lanes. The server answers every
+ * complete transfer with an empty send, the client reports the time from
+ * the first post to that answer and the bandwidth it amounts to.
+ *
+ *   server: rdma-xfer [options] sock_port
+ *   client: rdma-xfer [options] server_name sock_port
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <malloc.h>
+#include <infiniband/verbs.h>
+
+#include "debug.h"
+#include "ib.h"
+#include "config.h"
+#include "setup_ib.h"
+#include "sock.h"
+#include "tsc.h"
+#include "xfer.h"
+
+FILE *log_fp = NULL;
+struct IBRes ib_res;
+
+#define XFER_BENCH_ITERS        20
+#define XFER_BENCH_MAX_SIZES    16
+
+/* sent by the client before the QPs are connected, network order */
+struct XferHello {
+    uint32_t num_lanes;
+    uint64_t max_size;
+}__attribute__((packed));
+
+struct Bench {
+    struct ibv_cq       *cq;
+    struct ibv_qp       *qps[XFER_MAX_LANES];
+    int                 num_lanes;
+    int                 window;
+    char                *buf;
+    uint64_t            buf_size;
+    struct ibv_mr       *mr;
+    struct XferRemote   remote;     /* host order, client side */
+    struct XferConn     x;
+};
+
+static void usage(const char *prog) {
+    printf("Server: %s [options] sock_port\n", prog);
+    printf("Client: %s [options] server_name sock_port\n", prog);
+    printf("Options:\n");
+    printf("  -d ib_dev     IB device (default: the first one)\n");
+    printf("  -P ib_port    IB port (default %d)\n", IB_PORT);
+    printf("  -g gid_idx    GID index for RoCE (default %d)\n", IB_GID_INDEX);
+    printf("  -q lanes      QPs a transfer is spread over (default 1, up to %d,\n"
+           "                same on both sides)\n", XFER_MAX_LANES);
+    printf("  -c chunk      chunk size, K/M suffixes (default 1M)\n");
+    printf("  -w window     chunks in flight over all lanes (default %d)\n",
+           XFER_WINDOW);
+    printf("  -s size,...   transfer sizes, K/M/G suffixes (default 1M..1G)\n");
+    printf("  -n iters      transfers per size and mode (default %d)\n",
+           XFER_BENCH_ITERS);
+}
+
+static uint64_t __parse_size(const char *s) {
+    char *end = NULL;
+    uint64_t n = strtoull(s, &end, 10);
+
+    switch (*end) {
+    case 'G': case 'g':
+        n <<= 10;
+        /* fall through */
+    case 'M': case 'm':
+        n <<= 10;
+        /* fall through */
+    case 'K': case 'k':
+        n <<= 10;
+        break;
+    }
+    return n;
+}
+
+static int __parse_sizes(char *arg, uint64_t *sizes) {
+    int n = 0;
+    char *tok = NULL;
+
+    for (tok = strtok(arg, ","); tok != NULL && n < XFER_BENCH_MAX_SIZES;
+         tok = strtok(NULL, ","))
+        sizes[n++] = __parse_size(tok);
+    return n;
+}
+
+static int __open(const char *name) {
+    int i = 0, num = 0;
+    struct ibv_device **list = NULL;
+
+    list = ibv_get_device_list(&num);
+    check(list != NULL && num > 0, "No IB devices found");
+    for (i = 0; i < num; i++)
+        if (name == NULL || !strcmp(ibv_get_device_name(list[i]), name))
+            break;
+    check(i < num, "IB device %s not found", name);
+
+    ib_res.ctx = ibv_open_device(list[i]);
+    check(ib_res.ctx != NULL, "Failed to open %s",
+          ibv_get_device_name(list[i]));
+    ibv_free_device_list(list);
+    list = NULL;
+
+    ib_res.pd = ibv_alloc_pd(ib_res.ctx);
+    check(ib_res.pd != NULL, "Failed to allocate pd");
+    check(ibv_query_port(ib_res.ctx, config_info.ib_port,
+                         &ib_res.port_attr) == 0, "Failed to query port");
+    check(ibv_query_device(ib_res.ctx, &ib_res.dev_attr) == 0,
+          "Failed to query device");
+    if (ib_res.port_attr.link_layer == IBV_LINK_LAYER_ETHERNET)
+        check(ibv_query_gid(ib_res.ctx, config_info.ib_port,
+                            config_info.gid_index, &ib_res.local_gid) == 0,
+              "Failed to query GID");
+
+    return 0;
+error:
+    if (list != NULL)
+        ibv_free_device_list(list);
+    return -1;
+}
+
+static int __create_qps(struct Bench *b) {
+    int i = 0;
+    struct ibv_qp_init_attr attr = {
+        .cap = {
+            /* the window may sit on one lane, plus an answer or a stop */
+            .max_send_wr  = b->window + 2,
+            .max_recv_wr  = XFER_RECVS,
+            .max_send_sge = 1,
+            .max_recv_sge = 1,
+        },
+        .qp_type = IBV_QPT_RC,
+    };
+
+    b->cq = ibv_create_cq(ib_res.ctx, b->num_lanes *
+                          (b->window + 2 + XFER_RECVS), NULL, NULL, 0);
+    check(b->cq != NULL, "Failed to create cq");
+
+    attr.send_cq = b->cq;
+    attr.recv_cq = b->cq;
+    for (i = 0; i < b->num_lanes; i++) {
+        b->qps[i] = ibv_create_qp(ib_res.pd, &attr);
+        check(b->qps[i] != NULL, "Failed to create qp[%d]", i);
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+static int __alloc_buf(struct Bench *b, uint64_t size, int access) {
+    b->buf_size = size;
+    b->buf = (char *)memalign(4096, size);
+    check(b->buf != NULL, "Failed to allocate %"PRIu64" bytes", size);
+    memset(b->buf, 0, size);
+
+    b->mr = ibv_reg_mr(ib_res.pd, b->buf, size, access);
+    check(b->mr != NULL, "Failed to register %"PRIu64" bytes", size);
+
+    return 0;
+error:
+    return -1;
+}
+
+/* QP i of the client to QP i of the server, the client speaks first */
+static int __connect_lanes(struct Bench *b, int sockfd, bool is_server) {
+    int i = 0, ret = 0;
+    struct QPInfo local, remote;
+
+    for (i = 0; i < b->num_lanes; i++) {
+        local.lid    = ib_res.port_attr.lid;
+        local.qp_num = b->qps[i]->qp_num;
+        local.gid    = ib_res.local_gid;
+
+        if (is_server) {
+            ret = sock_get_qp_info(sockfd, &remote);
+            check(ret == 0, "Failed to get qp_info");
+            ret = sock_set_qp_info(sockfd, &local);
+            check(ret == 0, "Failed to send qp_info");
+        } else {
+            ret = sock_set_qp_info(sockfd, &local);
+            check(ret == 0, "Failed to send qp_info");
+            ret = sock_get_qp_info(sockfd, &remote);
+            check(ret == 0, "Failed to get qp_info");
+        }
+
+        ret = modify_qp_to_rts(b->qps[i], &remote);
+        check(ret == 0, "Failed to connect qp[%d]", i);
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+/* receives are posted before the sync, so no write ever finds none */
+static int __sync(int sockfd, bool is_server) {
+    char sock_buf[64] = {'\0'};
+    int n = 0;
+
+    if (is_server == false) {
+        n = sock_write(sockfd, sock_buf, sizeof(SOCK_SYNC_MSG));
+        check(n == sizeof(SOCK_SYNC_MSG), "Failed to write sync");
+    }
+    n = sock_read(sockfd, sock_buf, sizeof(SOCK_SYNC_MSG));
+    check(n == sizeof(SOCK_SYNC_MSG), "Failed to read sync");
+    if (is_server) {
+        n = sock_write(sockfd, sock_buf, sizeof(SOCK_SYNC_MSG));
+        check(n == sizeof(SOCK_SYNC_MSG), "Failed to write sync");
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+static int __send_empty(struct Bench *b, uint32_t imm) {
+    return post_send_sgl(NULL, 0, 0, imm, IBV_SEND_SIGNALED, b->qps[0]);
+}
+
+static int __run_server(struct Bench *b, uint32_t chunk_size) {
+    int i = 0, n = 0, ret = 0, sockfd = 0, peer_sockfd = 0;
+    bool stop = false;
+    uint32_t id = 0, imm = 0;
+    uint64_t transfers = 0;
+    struct XferHello hello;
+    struct XferRemote remote;
+    struct ibv_wc wc[32];
+
+    sockfd = sock_create_bind(config_info.sock_port);
+    check(sockfd > 0, "Failed to create server socket");
+    listen(sockfd, 5);
+    peer_sockfd = accept(sockfd, NULL, NULL);
+    check(peer_sockfd > 0, "Failed to accept the client");
+
+    n = sock_read(peer_sockfd, &hello, sizeof(hello));
+    check(n == sizeof(hello), "Failed to read the client's hello");
+    check(ntohl(hello.num_lanes) == (uint32_t)b->num_lanes,
+          "Client runs %"PRIu32" lanes, server runs %d",
+          ntohl(hello.num_lanes), b->num_lanes);
+
+    ret = __alloc_buf(b, ntohll(hello.max_size),
+                      IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    check(ret == 0, "Failed to set up the target buffer");
+    remote.addr = htonll((uintptr_t)b->buf);
+    remote.size = htonll(b->buf_size);
+    remote.rkey = htonl(b->mr->rkey);
+    n = sock_write(peer_sockfd, &remote, sizeof(remote));
+    check(n == sizeof(remote), "Failed to send the target buffer");
+
+    check(__connect_lanes(b, peer_sockfd, true) == 0, "Failed to connect");
+    check(xfer_init(&b->x, b->qps, b->num_lanes, chunk_size, b->window) == 0,
+          "Failed to init the transfer engine");
+    check(__sync(peer_sockfd, true) == 0, "Failed to sync with the client");
+
+    log("server: %d lane(s), %"PRIu64" byte target", b->num_lanes,
+        b->buf_size);
+
+    while (stop == false) {
+        n = ibv_poll_cq(b->cq, 32, wc);
+        check(n >= 0, "Failed to poll cq");
+
+        for (i = 0; i < n; i++) {
+            check(wc[i].status == IBV_WC_SUCCESS, "wc failed status: %d, %s",
+                  wc[i].status, ibv_wc_status_str(wc[i].status));
+
+            if (wc[i].opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+                ret = xfer_recv_done(&b->x, &wc[i], &id);
+                check(ret >= 0, "Failed to complete a transfer");
+                if (ret == 0)
+                    continue;
+
+                check(b->buf[0] == (char)id, "Transfer %"PRIu32" is not "
+                      "complete", id);
+                ret = __send_empty(b, MSG_IMM(MSG_REGULAR, id));
+                check(ret == 0, "Failed to answer transfer %"PRIu32, id);
+                transfers++;
+            } else if (wc[i].opcode == IBV_WC_RECV) {
+                imm = ntohl(wc[i].imm_data);
+                stop = MSG_IMM_TYPE(imm) == MSG_CTL_STOP;
+                ret = xfer_post_recv(&b->x, (int)wc[i].wr_id);
+                check(ret == 0, "Failed to post recv");
+            }
+        }
+    }
+
+    log("server: %"PRIu64" transfers", transfers);
+    close(peer_sockfd);
+    close(sockfd);
+    return 0;
+error:
+    if (peer_sockfd > 0)
+        close(peer_sockfd);
+    if (sockfd > 0)
+        close(sockfd);
+    return -1;
+}
+
+/* one transfer, from the first post to the server's answer, in ns */
+static uint64_t __transfer(struct Bench *b, uint64_t len, uint32_t id) {
+    int i = 0, n = 0, ret = 0;
+    bool answered = false;
+    uint32_t imm = 0;
+    uint64_t start = 0;
+    struct ibv_wc wc[32];
+
+    b->buf[0] = (char)id;
+    start = rdtsc();
+    xfer_start(&b->x, b->buf, b->mr->lkey, len, b->remote.addr,
+               b->remote.rkey, id);
+
+    while (answered == false || xfer_sent(&b->x) == false) {
+        ret = xfer_post(&b->x);
+        check(ret == 0, "Failed to post transfer %"PRIu32, id);
+
+        n = ibv_poll_cq(b->cq, 32, wc);
+        check(n >= 0, "Failed to poll cq");
+
+        for (i = 0; i < n; i++) {
+            check(wc[i].status == IBV_WC_SUCCESS, "wc failed status: %d, %s",
+                  wc[i].status, ibv_wc_status_str(wc[i].status));
+
+            if (xfer_owns(&wc[i])) {
+                xfer_send_done(&b->x);
+            } else if (wc[i].opcode == IBV_WC_RECV) {
+                imm = ntohl(wc[i].imm_data);
+                check(MSG_IMM_ARG(imm) == (id & 0xfffff), "Answer to "
+                      "transfer %"PRIu32" while waiting for %"PRIu32,
+                      MSG_IMM_ARG(imm), id);
+                answered = true;
+                ret = xfer_post_recv(&b->x, (int)wc[i].wr_id);
+                check(ret == 0, "Failed to post recv");
+            }
+        }
+    }
+
+    return tsc_to_ns(rdtsc() - start);
+error:
+    return 0;
+}
+
+/* mean ns per transfer of len bytes, one write or chunked, 0 on error */
+static uint64_t __measure(struct Bench *b, uint64_t len, uint32_t chunk_size,
+                          long iters, uint32_t *id) {
+    long i = 0;
+    uint64_t ns = 0, total = 0;
+
+    b->x.chunk_size = chunk_size;
+    for (i = 0; i <= iters; i++) {
+        ns = __transfer(b, len, (*id)++);
+        check(ns > 0, "Transfer of %"PRIu64" bytes failed", len);
+        /* the first one warms up */
+        if (i > 0)
+            total += ns;
+    }
+
+    return total / iters;
+error:
+    return 0;
+}
+
+static int __run_client(struct Bench *b, uint32_t chunk_size, uint64_t *sizes,
+                        int num_sizes, long iters) {
+    int i = 0, n = 0, sockfd = 0;
+    uint32_t id = 0;
+    uint64_t max_size = 0, single_ns = 0, chunked_ns = 0;
+    struct XferHello hello;
+    struct XferRemote remote;
+    struct ibv_wc wc;
+
+    for (i = 0; i < num_sizes; i++)
+        if (sizes[i] > max_size)
+            max_size = sizes[i];
+
+    sockfd = sock_create_connect(config_info.server_name,
+                                 config_info.sock_port);
+    check(sockfd > 0, "Failed to connect to the server");
+
+    hello.num_lanes = htonl((uint32_t)b->num_lanes);
+    hello.max_size  = htonll(max_size);
+    n = sock_write(sockfd, &hello, sizeof(hello));
+    check(n == sizeof(hello), "Failed to send hello");
+    n = sock_read(sockfd, &remote, sizeof(remote));
+    check(n == sizeof(remote), "Server refused %d lanes", b->num_lanes);
+    b->remote.addr = ntohll(remote.addr);
+    b->remote.size = ntohll(remote.size);
+    b->remote.rkey = ntohl(remote.rkey);
+
+    check(__alloc_buf(b, max_size, IBV_ACCESS_LOCAL_WRITE) == 0,
+          "Failed to set up the source buffer");
+    memset(b->buf, 0x5A, b->buf_size);
+
+    check(__connect_lanes(b, sockfd, false) == 0, "Failed to connect");
+    check(xfer_init(&b->x, b->qps, b->num_lanes, chunk_size, b->window) == 0,
+          "Failed to init the transfer engine");
+    check(__sync(sockfd, false) == 0, "Failed to sync with the server");
+    close(sockfd);
+    sockfd = 0;
+
+    printf("%s port %d: %d lane(s), %"PRIu32" byte chunks, window %d, "
+           "%ld transfers per size\n\n", ibv_get_device_name(ib_res.ctx->device),
+           config_info.ib_port, b->num_lanes, chunk_size, b->window, iters);
+    printf("%12s | %10s %8s | %10s %8s\n", "", "one write", "", "chunked", "");
+    printf("%12s | %10s %8s | %10s %8s\n", "size", "ms", "Gb/s", "ms", "Gb/s");
+
+    for (i = 0; i < num_sizes; i++) {
+        /* one write is bounded by the port's largest message */
+        single_ns = 0;
+        if (sizes[i] <= ib_res.port_attr.max_msg_sz) {
+            single_ns = __measure(b, sizes[i], 0, iters, &id);
+            check(single_ns > 0, "One-write run of %"PRIu64" bytes failed",
+                  sizes[i]);
+        }
+        chunked_ns = __measure(b, sizes[i], chunk_size, iters, &id);
+        check(chunked_ns > 0, "Chunked run of %"PRIu64" bytes failed",
+              sizes[i]);
+
+        if (single_ns > 0)
+            printf("%12"PRIu64" | %10.3f %8.2f |", sizes[i], single_ns / 1e6,
+                   sizes[i] * 8.0 / single_ns);
+        else
+            printf("%12"PRIu64" | %10s %8s |", sizes[i], "-", "-");
+        printf(" %10.3f %8.2f\n", chunked_ns / 1e6,
+               sizes[i] * 8.0 / chunked_ns);
+    }
+
+    printf("\n%"PRIu64" chunks, window full %"PRIu64" times\n", b->x.chunks,
+           b->x.window_full);
+
+    /* let the server go */
+    check(__send_empty(b, MSG_IMM(MSG_CTL_STOP, 0)) == 0,
+          "Failed to stop the server");
+    do {
+        n = ibv_poll_cq(b->cq, 1, &wc);
+        check(n >= 0, "Failed to poll cq");
+    } while (n == 0 || wc.opcode != IBV_WC_SEND);
+
+    return 0;
+error:
+    if (sockfd > 0)
+        close(sockfd);
+    return -1;
+}
+
+static void __destroy(struct Bench *b) {
+    int i = 0;
+
+    for (i = 0; i < b->num_lanes; i++)
+        if (b->qps[i] != NULL)
+            ibv_destroy_qp(b->qps[i]);
+    if (b->cq != NULL)
+        ibv_destroy_cq(b->cq);
+    if (b->mr != NULL)
+        ibv_dereg_mr(b->mr);
+    if (b->buf != NULL)
+        free(b->buf);
+    if (ib_res.pd != NULL)
+        ibv_dealloc_pd(ib_res.pd);
+    if (ib_res.ctx != NULL)
+        ibv_close_device(ib_res.ctx);
+}
+
+int main(int argc, char *argv[]) {
+    int ret = 0, opt = 0, num_sizes = 6;
+    long iters = XFER_BENCH_ITERS;
+    uint64_t chunk_size = XFER_CHUNK;
+    uint64_t sizes[XFER_BENCH_MAX_SIZES] = {1 << 20, 4 << 20, 16 << 20,
+                                            64 << 20, 256 << 20, 1 << 30};
+    char *dev = NULL;
+    struct Bench b;
+
+    log_fp = stdout;
+    memset(&b, 0, sizeof(b));
+    b.num_lanes           = 1;
+    b.window              = XFER_WINDOW;
+    config_info.ib_port   = IB_PORT;
+    config_info.gid_index = IB_GID_INDEX;
+
+    while ((opt = getopt(argc, argv, "d:P:g:q:c:w:s:n:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            dev = optarg;
+            break;
+        case 'P':
+            config_info.ib_port = atoi(optarg);
+            break;
+        case 'g':
+            config_info.gid_index = atoi(optarg);
+            break;
+        case 'q':
+            b.num_lanes = atoi(optarg);
+            break;
+        case 'c':
+            chunk_size = __parse_size(optarg);
+            break;
+        case 'w':
+            b.window = atoi(optarg);
+            break;
+        case 's':
+            num_sizes = __parse_sizes(optarg, sizes);
+            break;
+        case 'n':
+            iters = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 0;
+        }
+    }
+
+    if (argc - optind == 2) {
+        config_info.is_server   = false;
+        config_info.server_name = argv[optind];
+        config_info.sock_port   = argv[optind + 1];
+    } else if (argc - optind == 1) {
+        config_info.is_server   = true;
+        config_info.sock_port   = argv[optind];
+    } else {
+        usage(argv[0]);
+        return 0;
+    }
+
+    check(b.num_lanes > 0 && b.num_lanes <= XFER_MAX_LANES,
+          "lanes must be 1..%d", XFER_MAX_LANES);
+    check(chunk_size > 0 && chunk_size <= UINT32_MAX && b.window > 0 &&
+          iters > 0 && num_sizes > 0, "chunk, window, sizes and iters must "
+          "be positive, chunk below 4G");
+
+    check(tsc_init() == 0, "Failed to calibrate TSC");
+    check(__open(dev) == 0, "Failed to open device");
+    check(__create_qps(&b) == 0, "Failed to create qps");
+
+    if (config_info.is_server)
+        ret = __run_server(&b, chunk_size);
+    else
+        ret = __run_client(&b, chunk_size, sizes, num_sizes, iters);
+    check(ret == 0, "Failed to run");
+
+    __destroy(&b);
+    return 0;
+error:
+    __destroy(&b);
+    return -1;
+}